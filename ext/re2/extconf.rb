@@ -205,6 +205,68 @@ module RE2
           $defs.push("-DHAVE_SET_SIZE")
         end
       end
+
+      checking_for("RE2::FilteredRE2 with min_atom_len") do
+        test_filtered_re2_min_atom_len = <<~SRC
+          #include <re2/filtered_re2.h>
+
+          int main() {
+            re2::FilteredRE2 f(3);
+
+            return 0;
+          }
+        SRC
+
+        if try_compile(test_filtered_re2_min_atom_len, compile_options)
+          $defs.push("-DHAVE_FILTERED_RE2_MIN_ATOM_LEN")
+        end
+      end
+
+      # RE2::Regexp#search_file and RE2::Set#search_file read partitions of
+      # files in parallel with pread() where possible, otherwise falling back
+      # to reading them in order.
+      checking_for("pread()") do
+        test_pread = <<~SRC
+          #include <fcntl.h>
+          #include <sys/stat.h>
+          #include <unistd.h>
+
+          int main() {
+            char buffer[1];
+            int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            pread(fd, buffer, sizeof(buffer), 0);
+            close(fd);
+
+            return 0;
+          }
+        SRC
+
+        if try_compile(test_pread, compile_options)
+          $defs.push("-DHAVE_PARTITIONED_READS")
+        end
+      end
+
+      # Pinning worker threads to specific CPUs is only supported on
+      # platforms with the GNU pthread_setaffinity_np() extension.
+      checking_for("pthread_setaffinity_np()") do
+        test_pthread_setaffinity_np = <<~SRC
+          #include <pthread.h>
+          #include <sched.h>
+
+          int main() {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(0, &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+            return 0;
+          }
+        SRC
+
+        if try_compile(test_pthread_setaffinity_np, compile_options)
+          $defs.push("-DHAVE_PTHREAD_SETAFFINITY_NP")
+        end
+      end
     end
 
     def static_pkg_config(pc_file, pkg_config_paths)
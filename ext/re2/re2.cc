@@ -9,2404 +9,9046 @@
  */
 
 #include <cstdint>
+#include <cstring>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+#ifdef HAVE_PARTITIONED_READS
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <pthread.h>
+#include <sched.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define RE2_LITERAL_AVX2
+#endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <re2/filtered_re2.h>
 #include <re2/re2.h>
 #include <re2/set.h>
 #include <ruby.h>
 #include <ruby/encoding.h>
+#include <ruby/ractor.h>
 #include <ruby/thread.h>
 
 #define BOOL2RUBY(v) (v ? Qtrue : Qfalse)
 
-typedef struct {
-  RE2 *pattern;
-} re2_pattern;
+/* Opt-in counters for an instrumented regexp or set. They are updated with
+ * relaxed atomics by whichever thread did the matching (usually without the
+ * GVL) so may be read while other threads are still matching.
+ */
+struct re2_stats {
+  static const int buckets = 32;
 
-typedef struct {
-  re2::StringPiece *matches;
-  int number_of_matches;
-  VALUE regexp, text;
-} re2_matchdata;
+  std::atomic<uint64_t> calls;
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+  std::atomic<uint64_t> nanoseconds;
 
-typedef struct {
-  re2::StringPiece *input;
-  int number_of_capturing_groups;
-  bool eof;
-  VALUE regexp, text;
-} re2_scanner;
+  /* The number of calls that took [2^i, 2^(i+1)) nanoseconds (with the last
+   * bucket also counting any that took longer).
+   */
+  std::atomic<uint64_t> histogram[buckets];
 
-typedef struct {
-  RE2::Set *set;
-} re2_set;
+  re2_stats() : calls(0), bytes(0), hits(0), misses(0), nanoseconds(0) {
+    for (int i = 0; i < buckets; ++i) {
+      histogram[i].store(0, std::memory_order_relaxed);
+    }
+  }
 
-struct nogvl_match_arg {
-  const RE2 *pattern;
-  re2::StringPiece text;
-  size_t startpos;
-  size_t endpos;
-  RE2::Anchor anchor;
-  re2::StringPiece *matches;
-  int n;
-  bool matched;
-};
+  void record(size_t scanned, bool matched, uint64_t elapsed) {
+    calls.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(scanned, std::memory_order_relaxed);
+    (matched ? hits : misses).fetch_add(1, std::memory_order_relaxed);
+    nanoseconds.fetch_add(elapsed, std::memory_order_relaxed);
 
-static void *nogvl_match(void *ptr) {
-  auto *arg = static_cast<nogvl_match_arg *>(ptr);
-#ifdef HAVE_ENDPOS_ARGUMENT
-  arg->matched = arg->pattern->Match(
-      arg->text, arg->startpos, arg->endpos,
-      arg->anchor, arg->matches, arg->n);
-#else
-  arg->matched = arg->pattern->Match(
-      arg->text, arg->startpos,
-      arg->anchor, arg->matches, arg->n);
-#endif
-  return nullptr;
-}
+    int bucket = 0;
+    while (elapsed > 1 && bucket < buckets - 1) {
+      elapsed >>= 1;
+      ++bucket;
+    }
+    histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+  }
+};
 
-static bool re2_match_without_gvl(
-    const RE2 *pattern, VALUE text, size_t startpos, size_t endpos,
-    RE2::Anchor anchor, re2::StringPiece *matches, int n) {
-  nogvl_match_arg arg;
-  arg.pattern = pattern;
-  arg.text = re2::StringPiece(RSTRING_PTR(text), RSTRING_LEN(text));
-  arg.startpos = startpos;
-  arg.endpos = endpos;
-  arg.anchor = anchor;
-  arg.matches = matches;
-  arg.n = n;
-  arg.matched = false;
+/* Whether the CPU supports AVX2, checked once when the extension loads. */
+static bool re2_cpu_avx2 = false;
 
-  /* Abseil's synchronization primitives (SRWLOCK, SleepConditionVariableSRW)
-   * are incompatible with Ruby's Win32 Mutex-based GVL, causing
-   * WAIT_ABANDONED crashes when multiple threads match concurrently.
-   */
-#ifdef _WIN32
-  nogvl_match(&arg);
-#else
-  /* No unblocking function is needed: RE2 matching is CPU-bound computation,
-   * not a blocking system call, so a signal cannot safely interrupt it.
+/* A pattern that can only match one fixed, non-empty string: one created with
+ * `literal: true` or RE2.escape, optionally anchored with `^` or `$` or made
+ * case-insensitive for ASCII with `(?i)`. These are searched for directly
+ * (comparing the first and last bytes of 16 or 32 positions at a time where
+ * SSE2 or AVX2 is available) rather than with RE2's engines, with the same
+ * results.
+ */
+class re2_literal {
+ public:
+  /* Returns the literal the given pattern matches, or null if it may match
+   * anything else (or there was not enough memory).
    */
-  rb_thread_call_without_gvl(nogvl_match, &arg, NULL, NULL);
-#endif
+  static re2_literal *parse(const RE2 &pattern) {
+    const RE2::Options &options = pattern.options();
 
-  return arg.matched;
-}
+    /* never_nl changes how text containing newlines is searched. */
+    if (!pattern.ok() || options.never_nl()) {
+      return nullptr;
+    }
 
-struct nogvl_set_match_arg {
-  const RE2::Set *set;
-  re2::StringPiece text;
-  std::vector<int> *v;
-#ifdef HAVE_ERROR_INFO_ARGUMENT
-  RE2::Set::ErrorInfo *error_info;
-#endif
-  bool matched;
-};
+    const std::string &source = pattern.pattern();
+    std::string literal;
+    bool fold = !options.case_sensitive();
+    bool anchor_start = false;
+    bool anchor_end = false;
 
-static void *nogvl_set_match(void *ptr) {
-  auto *arg = static_cast<nogvl_set_match_arg *>(ptr);
-#ifdef HAVE_ERROR_INFO_ARGUMENT
-  if (arg->error_info) {
-    arg->matched = arg->set->Match(arg->text, arg->v, arg->error_info);
-  } else {
-    arg->matched = arg->set->Match(arg->text, arg->v);
-  }
-#else
-  arg->matched = arg->set->Match(arg->text, arg->v);
-#endif
-  return nullptr;
-}
+    if (options.literal()) {
+      literal = source;
+    } else {
+      /* ^ and $ match at every line with posix_syntax unless one_line is
+       * set.
+       */
+      bool anchors = !options.posix_syntax() || options.one_line();
+      size_t size = source.size();
+      size_t i = 0;
+
+      if (source.compare(0, 4, "(?i)") == 0) {
+        fold = true;
+        i = 4;
+      }
 
-struct nogvl_replace_arg {
-  std::string *str;
-  const RE2 *pattern;
-  re2::StringPiece string_pattern;
-  re2::StringPiece rewrite;
-};
+      if (i < size && source[i] == '^') {
+        if (!anchors) {
+          return nullptr;
+        }
+        anchor_start = true;
+        ++i;
+      }
 
-static void *nogvl_replace(void *ptr) {
-  auto *arg = static_cast<nogvl_replace_arg *>(ptr);
-  if (arg->pattern) {
-    RE2::Replace(arg->str, *arg->pattern, arg->rewrite);
-  } else {
-    RE2::Replace(arg->str, arg->string_pattern, arg->rewrite);
-  }
-  return nullptr;
-}
+      for (; i < size; ++i) {
+        unsigned char c = source[i];
+
+        switch (c) {
+          case '\\':
+            /* Only the escapes written by RE2.escape: punctuation and NUL. */
+            if (source.compare(i + 1, 3, "x00") == 0) {
+              literal.push_back('\0');
+              i += 3;
+              break;
+            }
+            if (++i == size) {
+              return nullptr;
+            }
+            c = source[i];
+            if (c >= 0x80 || isalnum(c)) {
+              return nullptr;
+            }
+            literal.push_back(c);
+            break;
+          case '$':
+            if (i + 1 != size || !anchors) {
+              return nullptr;
+            }
+            anchor_end = true;
+            break;
+          case '^': case '.': case '|': case '?': case '*': case '+':
+          case '(': case ')': case '[': case ']': case '{': case '}':
+            return nullptr;
+          default:
+            literal.push_back(c);
+        }
+      }
+    }
 
-static void *nogvl_global_replace(void *ptr) {
-  auto *arg = static_cast<nogvl_replace_arg *>(ptr);
-  if (arg->pattern) {
-    RE2::GlobalReplace(arg->str, *arg->pattern, arg->rewrite);
-  } else {
-    RE2::GlobalReplace(arg->str, arg->string_pattern, arg->rewrite);
-  }
-  return nullptr;
-}
+    if (literal.empty()) {
+      return nullptr;
+    }
 
-struct nogvl_extract_arg {
-  re2::StringPiece text;
-  const RE2 *pattern;
-  re2::StringPiece string_pattern;
-  re2::StringPiece rewrite;
-  std::string *out;
-  bool extracted;
-};
+    if (fold) {
+      bool utf8 = options.encoding() == RE2::Options::EncodingUTF8;
 
-static void *nogvl_extract(void *ptr) {
-  auto *arg = static_cast<nogvl_extract_arg *>(ptr);
-  if (arg->pattern) {
-    arg->extracted = RE2::Extract(arg->text, *arg->pattern,
-        arg->rewrite, arg->out);
-  } else {
-    arg->extracted = RE2::Extract(arg->text, RE2(arg->string_pattern),
-        arg->rewrite, arg->out);
-  }
-  return nullptr;
-}
+      for (char &c : literal) {
+        unsigned char lower = re2_literal::lower(c);
 
-VALUE re2_mRE2, re2_cRegexp, re2_cMatchData, re2_cScanner, re2_cSet,
-      re2_eSetMatchError, re2_eSetUnsupportedError, re2_eRegexpUnsupportedError;
+        /* Non-ASCII letters fold in ways that depend on the encoding and in
+         * UTF-8 so do k and s (to the Kelvin sign and long s).
+         */
+        if (lower >= 0x80 || (utf8 && (lower == 'k' || lower == 's'))) {
+          return nullptr;
+        }
+        c = lower;
+      }
+    }
 
-/* Symbols used in RE2 options. */
-static ID id_utf8, id_posix_syntax, id_longest_match, id_log_errors,
-          id_max_mem, id_literal, id_never_nl, id_case_sensitive,
-          id_perl_classes, id_word_boundary, id_one_line, id_unanchored,
-          id_anchor, id_anchor_start, id_anchor_both, id_exception,
-          id_submatches, id_startpos, id_endpos, id_symbolize_names;
+    re2_literal *result = new(std::nothrow) re2_literal;
+    if (result == nullptr) {
+      return nullptr;
+    }
 
-inline VALUE encoded_str_new(const char *str, long length, RE2::Options::Encoding encoding) {
-  if (encoding == RE2::Options::EncodingUTF8) {
-    return rb_utf8_str_new(str, length);
+    result->literal_.swap(literal);
+    result->fold_ = fold;
+    result->anchor_start_ = anchor_start;
+    result->anchor_end_ = anchor_end;
+
+    return result;
   }
 
-  VALUE string = rb_str_new(str, length);
-  rb_enc_associate_index(string, rb_enc_find_index("ISO-8859-1"));
+  /* Matches the text in the same way as RE2::Match, setting the overall
+   * match (the pattern has no capturing groups).
+   */
+  bool match(const re2::StringPiece &text, size_t startpos, size_t endpos,
+      RE2::Anchor anchor, re2::StringPiece *match) const {
+    if (startpos > endpos || endpos > text.size() ||
+        (anchor_start_ && startpos != 0) ||
+        (anchor_end_ && endpos != text.size())) {
+      return false;
+    }
 
-  return string;
-}
+    size_t size = literal_.size();
+    const char *begin = text.data() + startpos;
+    const char *end = text.data() + endpos;
+    if (static_cast<size_t>(end - begin) < size) {
+      return false;
+    }
 
-static void parse_re2_options(RE2::Options* re2_options, const VALUE options) {
-  if (TYPE(options) != T_HASH) {
-    rb_raise(rb_eArgError, "options should be a hash");
-  }
+    const char *found;
+    if (anchor_start_ || anchor != RE2::UNANCHORED) {
+      if ((anchor_end_ || anchor == RE2::ANCHOR_BOTH) &&
+          static_cast<size_t>(end - begin) != size) {
+        return false;
+      }
+      found = equal_at(begin) ? begin : nullptr;
+    } else if (anchor_end_) {
+      found = equal_at(end - size) ? end - size : nullptr;
+    } else {
+      found = find(begin, end);
+    }
 
-  VALUE utf8 = rb_hash_aref(options, ID2SYM(id_utf8));
-  if (!NIL_P(utf8)) {
-    re2_options->set_encoding(RTEST(utf8) ? RE2::Options::EncodingUTF8 : RE2::Options::EncodingLatin1);
-  }
+    if (found == nullptr) {
+      return false;
+    }
 
-  VALUE posix_syntax = rb_hash_aref(options, ID2SYM(id_posix_syntax));
-  if (!NIL_P(posix_syntax)) {
-    re2_options->set_posix_syntax(RTEST(posix_syntax));
-  }
+    if (match) {
+      *match = re2::StringPiece(found, size);
+    }
 
-  VALUE longest_match = rb_hash_aref(options, ID2SYM(id_longest_match));
-  if (!NIL_P(longest_match)) {
-    re2_options->set_longest_match(RTEST(longest_match));
+    return true;
   }
 
-  VALUE log_errors = rb_hash_aref(options, ID2SYM(id_log_errors));
-  if (!NIL_P(log_errors)) {
-    re2_options->set_log_errors(RTEST(log_errors));
+  size_t memsize() const {
+    return sizeof(*this) + literal_.capacity();
   }
 
-  VALUE max_mem = rb_hash_aref(options, ID2SYM(id_max_mem));
-  if (!NIL_P(max_mem)) {
-    re2_options->set_max_mem(NUM2INT(max_mem));
-  }
+ private:
+  std::string literal_;
+  bool fold_ = false;
+  bool anchor_start_ = false;
+  bool anchor_end_ = false;
 
-  VALUE literal = rb_hash_aref(options, ID2SYM(id_literal));
-  if (!NIL_P(literal)) {
-    re2_options->set_literal(RTEST(literal));
+  static unsigned char lower(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
   }
 
-  VALUE never_nl = rb_hash_aref(options, ID2SYM(id_never_nl));
-  if (!NIL_P(never_nl)) {
-    re2_options->set_never_nl(RTEST(never_nl));
+  static unsigned char upper(unsigned char c) {
+    return c >= 'a' && c <= 'z' ? c - ('a' - 'A') : c;
   }
 
-  VALUE case_sensitive = rb_hash_aref(options, ID2SYM(id_case_sensitive));
-  if (!NIL_P(case_sensitive)) {
-    re2_options->set_case_sensitive(RTEST(case_sensitive));
-  }
+  bool equal_at(const char *p) const {
+    if (!fold_) {
+      return memcmp(p, literal_.data(), literal_.size()) == 0;
+    }
 
-  VALUE perl_classes = rb_hash_aref(options, ID2SYM(id_perl_classes));
-  if (!NIL_P(perl_classes)) {
-    re2_options->set_perl_classes(RTEST(perl_classes));
-  }
+    for (size_t i = 0; i < literal_.size(); ++i) {
+      if (lower(p[i]) != static_cast<unsigned char>(literal_[i])) {
+        return false;
+      }
+    }
 
-  VALUE word_boundary = rb_hash_aref(options, ID2SYM(id_word_boundary));
-  if (!NIL_P(word_boundary)) {
-    re2_options->set_word_boundary(RTEST(word_boundary));
+    return true;
   }
 
-  VALUE one_line = rb_hash_aref(options, ID2SYM(id_one_line));
-  if (!NIL_P(one_line)) {
-    re2_options->set_one_line(RTEST(one_line));
-  }
-}
+  /* Advances `*p` to the next position holding the literal's first byte (or
+   * past `last` if there is none) when searching case-sensitively. memchr is
+   * faster than comparing two bytes at every position when the first byte
+   * is rare.
+   */
+  void skip(const char **p, const char *last) const {
+    if (fold_ || *p > last) {
+      return;
+    }
 
-static void re2_matchdata_mark(void *ptr) {
-  re2_matchdata *m = static_cast<re2_matchdata *>(ptr);
-  rb_gc_mark_movable(m->regexp);
+    const void *next = memchr(*p, literal_[0], last - *p + 1);
+    *p = next ? static_cast<const char *>(next) : last + 1;
+  }
 
-  /* Text must not be movable because StringPiece matches hold pointers into
-   * its underlying buffer; moving the string would invalidate them.
+  /* Returns the first occurrence of the literal in [begin, end), which must
+   * be at least as long as the literal.
    */
-  rb_gc_mark(m->text);
-}
+  const char *find(const char *begin, const char *end) const {
+    const char *p = begin;
+    const char *last = end - literal_.size();
+    const char *found = nullptr;
+
+#ifdef RE2_LITERAL_AVX2
+    if (re2_cpu_avx2 && find_avx2(&p, last, &found)) {
+      return found;
+    }
+#endif
+#ifdef __SSE2__
+    if (find_sse2(&p, last, &found)) {
+      return found;
+    }
+#endif
 
-static void re2_matchdata_compact(void *ptr) {
-  re2_matchdata *m = static_cast<re2_matchdata *>(ptr);
-  m->regexp = rb_gc_location(m->regexp);
-}
+    unsigned char first = literal_[0];
+    for (; p <= last; ++p) {
+      if (!fold_) {
+        p = static_cast<const char *>(memchr(p, first, last - p + 1));
+        if (p == nullptr) {
+          return nullptr;
+        }
+      }
+      if (equal_at(p)) {
+        return p;
+      }
+    }
 
-static void re2_matchdata_free(void *ptr) {
-  re2_matchdata *m = static_cast<re2_matchdata *>(ptr);
-  if (m->matches) {
-    delete[] m->matches;
+    return nullptr;
   }
-  xfree(m);
-}
 
-static size_t re2_matchdata_memsize(const void *ptr) {
-  const re2_matchdata *m = static_cast<const re2_matchdata *>(ptr);
-  size_t size = sizeof(*m);
-  if (m->matches) {
-    size += sizeof(*m->matches) * m->number_of_matches;
+  /* Checks each block of candidate positions from `*p` whose first and last
+   * bytes both match the literal's, returning true and setting `found` at the
+   * first occurrence. Otherwise advances `*p` past the blocks checked,
+   * leaving any remaining positions to be checked one at a time.
+   */
+#ifdef __SSE2__
+  bool find_sse2(const char **p, const char *last, const char **found) const {
+    size_t size = literal_.size();
+    unsigned char first = literal_[0];
+    unsigned char final = literal_[size - 1];
+    const __m128i first_lower = _mm_set1_epi8(first);
+    const __m128i first_upper = _mm_set1_epi8(fold_ ? upper(first) : first);
+    const __m128i final_lower = _mm_set1_epi8(final);
+    const __m128i final_upper = _mm_set1_epi8(fold_ ? upper(final) : final);
+
+    while (last - *p >= 15) {
+      __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(*p));
+      __m128i b = _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(*p + size - 1));
+      __m128i firsts = _mm_or_si128(_mm_cmpeq_epi8(a, first_lower),
+          _mm_cmpeq_epi8(a, first_upper));
+      __m128i candidates = _mm_and_si128(firsts,
+          _mm_or_si128(_mm_cmpeq_epi8(b, final_lower),
+            _mm_cmpeq_epi8(b, final_upper)));
+
+      for (unsigned mask = _mm_movemask_epi8(candidates); mask;
+          mask &= mask - 1) {
+        const char *candidate = *p + __builtin_ctz(mask);
+        if (equal_at(candidate)) {
+          *found = candidate;
+          return true;
+        }
+      }
+
+      *p += 16;
+      if (_mm_movemask_epi8(firsts) == 0) {
+        skip(p, last);
+      }
+    }
+
+    return false;
   }
+#endif
 
-  return size;
-}
+#ifdef RE2_LITERAL_AVX2
+  __attribute__((target("avx2")))
+  bool find_avx2(const char **p, const char *last, const char **found) const {
+    size_t size = literal_.size();
+    unsigned char first = literal_[0];
+    unsigned char final = literal_[size - 1];
+    const __m256i first_lower = _mm256_set1_epi8(first);
+    const __m256i first_upper = _mm256_set1_epi8(fold_ ? upper(first) : first);
+    const __m256i final_lower = _mm256_set1_epi8(final);
+    const __m256i final_upper = _mm256_set1_epi8(fold_ ? upper(final) : final);
+
+    while (last - *p >= 31) {
+      __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(*p));
+      __m256i b = _mm256_loadu_si256(
+          reinterpret_cast<const __m256i *>(*p + size - 1));
+      __m256i firsts = _mm256_or_si256(_mm256_cmpeq_epi8(a, first_lower),
+          _mm256_cmpeq_epi8(a, first_upper));
+      __m256i candidates = _mm256_and_si256(firsts,
+          _mm256_or_si256(_mm256_cmpeq_epi8(b, final_lower),
+            _mm256_cmpeq_epi8(b, final_upper)));
+
+      for (unsigned mask = _mm256_movemask_epi8(candidates); mask;
+          mask &= mask - 1) {
+        const char *candidate = *p + __builtin_ctz(mask);
+        if (equal_at(candidate)) {
+          *found = candidate;
+          return true;
+        }
+      }
 
-static const rb_data_type_t re2_matchdata_data_type = {
-  "RE2::MatchData",
-  {
-    re2_matchdata_mark,
-    re2_matchdata_free,
-    re2_matchdata_memsize,
-    re2_matchdata_compact
-  },
-  0,
-  0,
-  // IMPORTANT: WB_PROTECTED objects must only use the RB_OBJ_WRITE()
-  // macro to update VALUE references, as to trigger write barriers.
-  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+      *p += 32;
+      if (_mm256_movemask_epi8(firsts) == 0) {
+        skip(p, last);
+      }
+    }
+
+    return false;
+  }
+#endif
 };
 
-static void re2_scanner_mark(void *ptr) {
-  re2_scanner *s = static_cast<re2_scanner *>(ptr);
-  rb_gc_mark_movable(s->regexp);
+typedef struct {
+  RE2 *pattern;
+  size_t memsize;
+  std::atomic<re2_stats *> stats;
+  std::string *source;
+  RE2::Options *options;
+  std::atomic<bool> compiled;
+  std::atomic<VALUE> groups;
+  re2_literal *literal;
+} re2_pattern;
 
-  /* Text must not be movable because the StringPiece input holds a pointer
-   * into its underlying buffer; moving the string would invalidate it.
+typedef struct {
+  re2::StringPiece *matches;
+  int number_of_matches;
+  int capacity;
+  bool matching;
+  VALUE regexp, text;
+} re2_matchdata;
+
+typedef struct {
+  re2::StringPiece *input;
+  int number_of_capturing_groups;
+  bool eof;
+  bool scanning;
+  RE2::Arg *argv;
+  RE2::Arg **args;
+  re2::StringPiece *matches;
+  int *groups;
+  int number_of_groups;
+  bool offsets;
+  VALUE regexp, text;
+} re2_scanner;
+
+typedef struct {
+  RE2::Set *set;
+  std::vector<RE2 *> *patterns;
+  std::vector<std::string> *rewrites;
+  RE2::Options::Encoding encoding;
+  size_t memsize;
+} re2_replacer;
+
+class re2_atom_matcher;
+
+typedef struct {
+  re2::FilteredRE2 *filter;
+  RE2::Options *options;
+  std::vector<std::string> *atoms;
+  re2_atom_matcher *matcher;
+  bool busy;
+  bool compiled;
+  size_t memsize;
+} re2_filtered_set;
+
+typedef struct {
+  RE2::Set *set;
+  RE2::Options *options;
+  RE2::Anchor anchor;
+  std::vector<std::string> *sources;
+  std::atomic<VALUE> *regexps;
+  bool busy;
+  bool compiled;
+  size_t patterns;
+  size_t pattern_bytes;
+  int64_t max_mem;
+  size_t memsize;
+  std::atomic<re2_stats *> stats;
+} re2_set;
+
+/* A batch of frozen strings pinned for the duration of a single call so that
+ * many of them can be matched without reacquiring the GVL in between, along
+ * with the results of matching them. Calls scanning a single text use an
+ * empty batch only to hold their matches.
+ */
+struct re2_batch {
+  std::vector<VALUE> texts;
+  std::vector<re2::StringPiece> pieces;
+  std::vector<re2::StringPiece> matches;
+  std::vector<char> matched;
+  std::vector<std::vector<int>> indices;
+  std::vector<int> counts;
+  std::vector<int> errors;
+  std::vector<std::string> messages;
+  std::vector<std::unique_ptr<RE2>> compiled;
+
+  /* Set by any worker thread that runs out of memory. */
+  std::atomic<bool> failed;
+};
+
+/* The matches found by searching a file, one entry per partition of its
+ * lines: the number of lines, the hits recorded for each matching line and,
+ * for a set, the indices of the patterns that matched.
+ */
+struct re2_file_matches {
+  std::vector<std::vector<int64_t>> hits;
+  std::vector<std::vector<int>> indices;
+  std::vector<int64_t> lines;
+
+  /* Set by any worker thread that runs out of memory. */
+  std::atomic<bool> failed;
+};
+
+/* A pool of native worker threads used to split batches of matches across
+ * cores once the GVL has been released.
+ *
+ * Workers are started lazily on first use and stopped (after finishing any
+ * queued work) whenever the pool is reconfigured. After a fork, the workers
+ * no longer exist in the child so they are abandoned rather than joined and a
+ * fresh set is started.
+ */
+class re2_thread_pool {
+ public:
+  /* A single call's worth of work: `chunks` calls to `fn` shared between the
+   * calling thread and any idle workers.
    */
-  rb_gc_mark(s->text);
-}
+  struct job {
+    const std::function<void(size_t)> *fn;
+    size_t chunks;
+    size_t next;
+    size_t pending;
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+
+  struct workers {
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<job *> queue;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+  };
+
+  re2_thread_pool() : size_(default_size()), pid_(0) {}
+
+  /* Idle workers may still be waiting for work when the process exits and
+   * there is no safe point to join them, so leave them running.
+   */
+  ~re2_thread_pool() {
+    if (current_) {
+      new std::shared_ptr<workers>(std::move(current_));
+    }
+  }
 
-static void re2_scanner_compact(void *ptr) {
-  re2_scanner *s = static_cast<re2_scanner *>(ptr);
-  s->regexp = rb_gc_location(s->regexp);
-}
+  size_t size() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return size_;
+  }
 
-static void re2_scanner_free(void *ptr) {
-  re2_scanner *s = static_cast<re2_scanner *>(ptr);
-  if (s->input) {
-    delete s->input;
+  void set_size(size_t size) {
+    std::shared_ptr<workers> old;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      size_ = size;
+      old = release_locked();
+    }
+    stop(old);
   }
-  xfree(s);
-}
 
-static size_t re2_scanner_memsize(const void *ptr) {
-  const re2_scanner *s = static_cast<const re2_scanner *>(ptr);
-  size_t size = sizeof(*s);
-  if (s->input) {
-    size += sizeof(*s->input);
+  std::vector<int> cpus() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cpus_;
   }
 
-  return size;
-}
+  void set_cpus(const std::vector<int> &cpus) {
+    std::shared_ptr<workers> old;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cpus_ = cpus;
+      old = release_locked();
+    }
+    stop(old);
+  }
 
-static const rb_data_type_t re2_scanner_data_type = {
-  "RE2::Scanner",
-  {
-    re2_scanner_mark,
-    re2_scanner_free,
-    re2_scanner_memsize,
-    re2_scanner_compact
-  },
-  0,
-  0,
-  // IMPORTANT: WB_PROTECTED objects must only use the RB_OBJ_WRITE()
-  // macro to update VALUE references, as to trigger write barriers.
-  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
-};
+  /* Returns the running workers, starting them if necessary. Must be called
+   * with the GVL held so that it cannot race with a fork.
+   */
+  std::shared_ptr<workers> acquire() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+#ifndef _WIN32
+    if (current_ && pid_ != getpid()) {
+      /* The threads were not copied into this process so they can be neither
+       * joined nor destroyed: deliberately leak them instead.
+       */
+      new std::shared_ptr<workers>(std::move(current_));
+    }
+#endif
 
-static void re2_regexp_free(void *ptr) {
-  re2_pattern *p = static_cast<re2_pattern *>(ptr);
-  if (p->pattern) {
-    delete p->pattern;
+    if (!current_) {
+      current_ = std::make_shared<workers>();
+#ifndef _WIN32
+      pid_ = getpid();
+#endif
+
+      workers *w = current_.get();
+      try {
+        for (size_t i = 0; i < size_; ++i) {
+          int cpu = cpus_.empty() ? -1 : cpus_[i % cpus_.size()];
+          w->threads.emplace_back([w, cpu] { work(w, cpu); });
+        }
+      } catch (const std::exception &) {
+        /* Carry on with however many workers could be started: run() falls
+         * back to the calling thread if there are none.
+         */
+      }
+    }
+
+    return current_;
   }
-  xfree(p);
-}
 
-static size_t re2_regexp_memsize(const void *ptr) {
-  const re2_pattern *p = static_cast<const re2_pattern *>(ptr);
-  size_t size = sizeof(*p);
-  if (p->pattern) {
-    size += sizeof(*p->pattern);
+  /* Calls `fn` with every chunk index from 0 to `chunks - 1`, spreading the
+   * calls across the workers and the calling thread and returning once they
+   * have all finished. Safe to call without the GVL.
+   */
+  static void run(workers *w, size_t chunks, const std::function<void(size_t)> &fn) {
+    job j;
+    j.fn = &fn;
+    j.chunks = chunks;
+    j.next = 0;
+    j.pending = chunks;
+
+    bool queued = false;
+    if (w && chunks > 1) {
+      std::lock_guard<std::mutex> lock(w->mutex);
+      if (!w->stopping && !w->threads.empty()) {
+        try {
+          w->queue.push_back(&j);
+          queued = true;
+        } catch (const std::exception &) {
+        }
+      }
+    }
+
+    if (!queued) {
+      for (size_t i = 0; i < chunks; ++i) {
+        fn(i);
+      }
+
+      return;
+    }
+
+    w->ready.notify_all();
+
+    /* Help out until every chunk has been claimed. */
+    for (;;) {
+      size_t i;
+      {
+        std::lock_guard<std::mutex> lock(w->mutex);
+        i = j.next < j.chunks ? j.next++ : j.chunks;
+      }
+
+      if (i == j.chunks) {
+        break;
+      }
+
+      fn(i);
+      finish(&j);
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(j.mutex);
+      j.done.wait(lock, [&j] { return j.pending == 0; });
+    }
+
+    /* Nobody can claim from a finished job but it may still be queued. */
+    std::lock_guard<std::mutex> lock(w->mutex);
+    auto it = std::find(w->queue.begin(), w->queue.end(), &j);
+    if (it != w->queue.end()) {
+      w->queue.erase(it);
+    }
   }
 
-  return size;
-}
+ private:
+  std::mutex mutex_;
+  std::shared_ptr<workers> current_;
+  size_t size_;
+  std::vector<int> cpus_;
+#ifndef _WIN32
+  pid_t pid_;
+#else
+  int pid_;
+#endif
 
-static const rb_data_type_t re2_regexp_data_type = {
-  "RE2::Regexp",
-  {
-    0,
-    re2_regexp_free,
-    re2_regexp_memsize,
-  },
-  0,
-  0,
-  // IMPORTANT: WB_PROTECTED objects must only use the RB_OBJ_WRITE()
-  // macro to update VALUE references, as to trigger write barriers.
-  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_FROZEN_SHAREABLE
-};
+  static size_t default_size() {
+    unsigned int cores = std::thread::hardware_concurrency();
 
-static re2_pattern *unwrap_re2_regexp(VALUE self) {
-  re2_pattern *p;
-  TypedData_Get_Struct(self, re2_pattern, &re2_regexp_data_type, p);
-  if (!p->pattern) {
-    rb_raise(rb_eTypeError, "uninitialized RE2::Regexp");
+    return cores > 0 ? cores : 1;
   }
-  return p;
-}
 
-static re2_matchdata *unwrap_re2_matchdata(VALUE self) {
-  re2_matchdata *m;
-  TypedData_Get_Struct(self, re2_matchdata, &re2_matchdata_data_type, m);
-  if (!RTEST(m->regexp)) {
-    rb_raise(rb_eTypeError, "uninitialized RE2::MatchData");
+  std::shared_ptr<workers> release_locked() {
+#ifndef _WIN32
+    if (current_ && pid_ != getpid()) {
+      new std::shared_ptr<workers>(std::move(current_));
+    }
+#endif
+
+    return std::move(current_);
   }
-  return m;
-}
 
-static re2_scanner *unwrap_re2_scanner(VALUE self) {
-  re2_scanner *c;
-  TypedData_Get_Struct(self, re2_scanner, &re2_scanner_data_type, c);
-  if (!RTEST(c->regexp)) {
-    rb_raise(rb_eTypeError, "uninitialized RE2::Scanner");
+  static void stop(const std::shared_ptr<workers> &w) {
+    if (!w) {
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(w->mutex);
+      w->stopping = true;
+    }
+    w->ready.notify_all();
+
+    for (std::thread &thread : w->threads) {
+      thread.join();
+    }
+    w->threads.clear();
   }
-  return c;
-}
 
-/*
- * Returns an array of names of all named capturing groups. Names are returned
- * in alphabetical order rather than definition order, as RE2 stores named
- * groups internally in a sorted map.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
- *
- * @return [Array<String>] an array of names of named capturing groups
- * @example
- *   RE2::Regexp.new('(?P<a>\d+) (?P<b>\w+)').names #=> ["a", "b"]
- */
-static VALUE re2_regexp_names(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+  static void finish(job *j) {
+    std::lock_guard<std::mutex> lock(j->mutex);
+    if (--j->pending == 0) {
+      j->done.notify_one();
+    }
+  }
+
+  static void work(workers *w, int cpu) {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(cpu, &cpus);
+      pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+#else
+    (void)cpu;
+#endif
+
+    std::unique_lock<std::mutex> lock(w->mutex);
+
+    for (;;) {
+      w->ready.wait(lock, [w] { return w->stopping || !w->queue.empty(); });
+
+      if (w->queue.empty()) {
+        return;
+      }
 
-  const auto& groups = p->pattern->NamedCapturingGroups();
-  VALUE names = rb_ary_new2(groups.size());
+      job *j = w->queue.front();
+      if (j->next >= j->chunks) {
+        w->queue.pop_front();
+        continue;
+      }
 
-  for (const auto& group : groups) {
-    rb_ary_push(names,
-        encoded_str_new(group.first.data(), group.first.size(),
-          p->pattern->options().encoding()));
+      size_t i = j->next++;
+      lock.unlock();
+      (*j->fn)(i);
+      finish(j);
+      lock.lock();
+    }
   }
+};
 
-  return names;
-}
+static re2_thread_pool thread_pool;
 
-static VALUE re2_matchdata_allocate(VALUE klass) {
-  re2_matchdata *m;
+/* Process-wide counters reported by RE2.stats. As the extension may be used
+ * from several Ractors (and threads without the GVL) at once, these are all
+ * relaxed atomics.
+ */
+enum re2_entry_point {
+  re2_entry_match,
+  re2_entry_match_p,
+  re2_entry_scan,
+  re2_entry_replace,
+  re2_entry_global_replace,
+  re2_entry_extract,
+  re2_entry_set_match,
+  re2_entry_points
+};
 
-  return TypedData_Make_Struct(klass, re2_matchdata, &re2_matchdata_data_type,
-      m);
+static struct {
+  std::atomic<uint64_t> regexps_compiled;
+  std::atomic<uint64_t> sets_compiled;
+  std::atomic<uint64_t> compile_nanoseconds;
+  std::atomic<int64_t> program_size;
+  std::atomic<uint64_t> calls[re2_entry_points];
+  std::atomic<uint64_t> nogvl_nanoseconds;
+  std::atomic<uint64_t> set_out_of_memory;
+  std::atomic<uint64_t> set_inconsistent;
+  std::atomic<uint64_t> set_not_compiled;
+  std::atomic<uint64_t> matchdata_allocations;
+  std::atomic<uint64_t> scanner_allocations;
+} global_stats;
+
+static void re2_count(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+  counter.fetch_add(n, std::memory_order_relaxed);
 }
 
-static VALUE re2_scanner_allocate(VALUE klass) {
-  re2_scanner *c;
+static void re2_count_call(re2_entry_point entry_point) {
+  re2_count(global_stats.calls[entry_point]);
+}
 
-  return TypedData_Make_Struct(klass, re2_scanner, &re2_scanner_data_type, c);
+static uint64_t re2_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
 }
 
-/*
- * Returns a frozen copy of the text supplied when matching.
- *
- * If the text was already a frozen string, returns the original.
- *
- * @return [String] a frozen string with the text supplied when matching
- * @example
- *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
- *   m.string #=> "bob 123"
+#ifndef _WIN32
+/* Calls `fn` with `arg` after releasing the GVL, recording how long the GVL
+ * was released for.
  */
-static VALUE re2_matchdata_string(const VALUE self) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
+static void re2_release_gvl(void *(*fn)(void *), void *arg) {
+  uint64_t start = re2_now_ns();
 
-  return m->text;
+  /* No unblocking function is needed: RE2 matching is CPU-bound computation,
+   * not a blocking system call, so a signal cannot safely interrupt it.
+   */
+  rb_thread_call_without_gvl(fn, arg, NULL, NULL);
+
+  re2_count(global_stats.nogvl_nanoseconds, re2_now_ns() - start);
 }
+#endif
 
-/*
- * Returns a frozen copy of the text supplied when incrementally matching with
- * {RE2::Regexp#scan}.
- *
- * If the text was already a frozen string, returns the original.
- *
- * @return [String] a frozen string with the text passed to {RE2::Regexp#scan}
- * @example
- *   c = RE2::Regexp.new('(\d+)').scan("foo")
- *   c.string #=> "foo"
+/* Inputs shorter than this many bytes are processed while holding the GVL, as
+ * handing it off costs more than the work itself. 0 always releases the GVL.
  */
-static VALUE re2_scanner_string(const VALUE self) {
-  re2_scanner *c = unwrap_re2_scanner(self);
-
-  return c->text;
-}
+static std::atomic<size_t> gvl_release_threshold(0);
 
-/*
- * Returns whether the {RE2::Scanner} has consumed all input or not.
- *
- * @return [Boolean] whether the {RE2::Scanner} has consumed all input or not
- * @example
- *   c = RE2::Regexp.new('(\d+)').scan("foo")
- *   c.eof? #=> true
+/* Calls `fn` with `arg`, releasing the GVL if processing `bytes` of input is
+ * expected to take longer than handing the GVL off to another thread.
  */
-static VALUE re2_scanner_eof(const VALUE self) {
-  re2_scanner *c = unwrap_re2_scanner(self);
-
-  return BOOL2RUBY(c->eof);
+static void re2_call_without_gvl(
+    void *(*fn)(void *), void *arg, size_t bytes) {
+  /* Abseil's synchronization primitives (SRWLOCK, SleepConditionVariableSRW)
+   * are incompatible with Ruby's Win32 Mutex-based GVL, causing
+   * WAIT_ABANDONED crashes when multiple threads match concurrently.
+   */
+#ifdef _WIN32
+  (void) bytes;
+  fn(arg);
+#else
+  if (bytes < gvl_release_threshold.load(std::memory_order_relaxed)) {
+    fn(arg);
+  } else {
+    re2_release_gvl(fn, arg);
+  }
+#endif
 }
 
-/*
- * Rewind the {RE2::Scanner} to the start of the string.
- *
- * @example
- *   s = RE2::Regexp.new('(\d+)').scan("1 2 3")
- *   e = s.to_enum
- *   e.scan #=> ["1"]
- *   e.scan #=> ["2"]
- *   s.rewind
- *   e.scan #=> ["1"]
+/* Whether every regexp and set is instrumented, see RE2.instrument=. */
+static std::atomic<bool> instrument_all(false);
+
+/* Returns the stats stored in `slot`, first creating them if `create` is set
+ * (or all objects are being instrumented). Returns null if not instrumented
+ * or there was not enough memory to create them. Objects may be shared
+ * between threads and Ractors so the stats are published with a
+ * compare-and-swap.
  */
-static VALUE re2_scanner_rewind(VALUE self) {
-  re2_scanner *c = unwrap_re2_scanner(self);
+static re2_stats *re2_stats_fetch(std::atomic<re2_stats *> *slot,
+    bool create) {
+  re2_stats *stats = slot->load(std::memory_order_acquire);
+  if (stats || !(create || instrument_all.load(std::memory_order_relaxed))) {
+    return stats;
+  }
 
-  delete c->input;
-  c->input = new(std::nothrow) re2::StringPiece(
-      RSTRING_PTR(c->text), RSTRING_LEN(c->text));
-  if (c->input == nullptr) {
-    rb_raise(rb_eNoMemError,
-             "not enough memory to allocate StringPiece for input");
+  re2_stats *created = new(std::nothrow) re2_stats();
+  if (created == nullptr) {
+    return nullptr;
   }
 
-  c->eof = false;
+  if (slot->compare_exchange_strong(stats, created,
+        std::memory_order_acq_rel, std::memory_order_acquire)) {
+    return created;
+  }
 
-  return self;
+  /* Another thread instrumented the object first. */
+  delete created;
+
+  return stats;
 }
 
-static VALUE re2_scanner_initialize_copy(VALUE self, VALUE other) {
-  if (self == other) return self;
+/* Returns the total number of bytes in a batch of texts. */
+static size_t re2_batch_bytes(const std::vector<re2::StringPiece> &pieces) {
+  size_t bytes = 0;
+  for (const re2::StringPiece &piece : pieces) {
+    bytes += piece.size();
+  }
 
-  re2_scanner *self_c;
-  re2_scanner *other_c = unwrap_re2_scanner(other);
+  return bytes;
+}
 
-  TypedData_Get_Struct(self, re2_scanner, &re2_scanner_data_type, self_c);
+struct nogvl_match_arg {
+  const RE2 *pattern;
+  const re2_literal *literal;
+  re2::StringPiece text;
+  size_t startpos;
+  size_t endpos;
+  RE2::Anchor anchor;
+  re2::StringPiece *matches;
+  int n;
+  re2_stats *stats;
+  bool matched;
+};
 
-  if (self_c->input) {
-    delete self_c->input;
-    self_c->input = nullptr;
+static void *nogvl_match(void *ptr) {
+  auto *arg = static_cast<nogvl_match_arg *>(ptr);
+  uint64_t start = arg->stats ? re2_now_ns() : 0;
+  if (arg->literal && arg->n <= 1) {
+    arg->matched = arg->literal->match(arg->text, arg->startpos, arg->endpos,
+        arg->anchor, arg->n == 1 ? arg->matches : nullptr);
+  } else {
+#ifdef HAVE_ENDPOS_ARGUMENT
+    arg->matched = arg->pattern->Match(
+        arg->text, arg->startpos, arg->endpos,
+        arg->anchor, arg->matches, arg->n);
+#else
+    arg->matched = arg->pattern->Match(
+        arg->text, arg->startpos,
+        arg->anchor, arg->matches, arg->n);
+#endif
   }
+  if (arg->stats) {
+    size_t end = std::min(arg->endpos, arg->text.size());
+    size_t scanned = end > arg->startpos ? end - arg->startpos : 0;
+    arg->stats->record(scanned, arg->matched, re2_now_ns() - start);
+  }
+  return nullptr;
+}
 
-  RB_OBJ_WRITE(self, &self_c->regexp, other_c->regexp);
-  RB_OBJ_WRITE(self, &self_c->text, other_c->text);
-  self_c->number_of_capturing_groups = other_c->number_of_capturing_groups;
-  self_c->eof = other_c->eof;
+static bool re2_match_without_gvl(
+    re2_pattern *p, VALUE text, size_t startpos, size_t endpos,
+    RE2::Anchor anchor, re2::StringPiece *matches, int n) {
+  nogvl_match_arg arg;
+  arg.pattern = p->pattern;
+  arg.literal = p->literal;
+  arg.text = re2::StringPiece(RSTRING_PTR(text), RSTRING_LEN(text));
+  arg.startpos = startpos;
+  arg.endpos = endpos;
+  arg.anchor = anchor;
+  arg.matches = matches;
+  arg.n = n;
+  arg.stats = re2_stats_fetch(&p->stats, false);
+  arg.matched = false;
 
-  if (other_c->input) {
-    self_c->input = new(std::nothrow) re2::StringPiece(*other_c->input);
-    if (self_c->input == nullptr) {
-      rb_raise(rb_eNoMemError,
-               "not enough memory to allocate StringPiece for input");
-    }
-  } else {
-    self_c->input = nullptr;
-  }
+  /* Only the bytes between startpos and endpos are searched. */
+  size_t end = std::min(endpos, arg.text.size());
+  size_t bytes = end > startpos ? end - startpos : 0;
 
-  return self;
+  re2_call_without_gvl(nogvl_match, &arg, bytes);
+
+  return arg.matched;
 }
 
-/*
- * Scan the given text incrementally for matches using
- * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L447-L463
- * `FindAndConsume`}, returning an array of submatches on each subsequent
- * call. Returns `nil` if no matches are found or an empty array for every
- * match if the pattern has no capturing groups.
+/* Returns the byte length of the character at the start of the (non-empty)
+ * input, treating every byte as a character unless the pattern is UTF-8.
  *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ * The lookup table approach is taken from RE2's own Python extension: the
+ * high 4 bits of a UTF-8 lead byte determine the character's byte length.
  *
- * @return [Array<String>] if the pattern has capturing groups
- * @return [[]] if the pattern does not have capturing groups
- * @return [nil] if no matches are found
- * @example
- *   s = RE2::Regexp.new('(\w+)').scan("Foo bar baz")
- *   s.scan #=> ["Foo"]
- *   s.scan #=> ["bar"]
+ * See https://github.com/google/re2/blob/972a15cedd008d846f1a39b2e88ce48d7f166cbd/python/_re2.cc#L46-L48
  */
-static VALUE re2_scanner_scan(VALUE self) {
-  re2_scanner *c = unwrap_re2_scanner(self);
-  re2_pattern *p = unwrap_re2_regexp(c->regexp);
+static size_t re2_char_size(const RE2 *pattern, const re2::StringPiece &input) {
+  if (pattern->options().encoding() != RE2::Options::EncodingUTF8) {
+    return 1;
+  }
 
-  std::vector<RE2::Arg> argv(c->number_of_capturing_groups);
-  std::vector<RE2::Arg*> args(c->number_of_capturing_groups);
-  std::vector<re2::StringPiece> matches(c->number_of_capturing_groups);
+  size_t char_size = "\1\1\1\1\1\1\1\1\1\1\1\1\2\2\3\4"
+      [(input[0] & 0xFF) >> 4];
 
-  if (c->eof) {
-    return Qnil;
+  return char_size > input.size() ? input.size() : char_size;
+}
+
+/* Finds the next match in `input` with `FindAndConsumeN` (or by searching for
+ * the literal, if given, when there are no submatches), storing submatches
+ * in `args` and consuming the input up to the end of the match. Returns
+ * whether a match was found and sets `eof` once the input is exhausted.
+ */
+static bool re2_scan_step(
+    const RE2 *pattern, const re2_literal *literal, re2::StringPiece *input,
+    RE2::Arg **args, int n, bool *eof) {
+  re2::StringPiece::size_type original_input_size = input->size();
+
+  if (literal && n == 0) {
+    re2::StringPiece match;
+    if (!literal->match(*input, 0, input->size(), RE2::UNANCHORED, &match)) {
+      return false;
+    }
+
+    input->remove_prefix(match.data() + match.size() - input->data());
+  } else if (!RE2::FindAndConsumeN(input, *pattern, args, n)) {
+    return false;
   }
 
-  re2::StringPiece::size_type original_input_size = c->input->size();
+  re2::StringPiece::size_type new_input_size = input->size();
+  bool input_advanced = new_input_size < original_input_size;
 
-  for (int i = 0; i < c->number_of_capturing_groups; ++i) {
-    argv[i] = &matches[i];
-    args[i] = &argv[i];
+  /* Check whether we've exhausted the input yet. */
+  *eof = new_input_size == 0;
+
+  /* If the match didn't advance the input, we need to do this ourselves,
+   * advancing by a whole character to avoid splitting multi-byte characters.
+   */
+  if (!input_advanced && new_input_size > 0) {
+    input->remove_prefix(re2_char_size(pattern, *input));
   }
 
-  if (RE2::FindAndConsumeN(c->input, *p->pattern, args.data(),
-        c->number_of_capturing_groups)) {
-    re2::StringPiece::size_type new_input_size = c->input->size();
-    bool input_advanced = new_input_size < original_input_size;
+  return true;
+}
 
-    VALUE result = rb_ary_new2(c->number_of_capturing_groups);
+struct nogvl_scan_arg {
+  const RE2 *pattern;
+  const re2_literal *literal;
+  re2_scanner *scanner;
+  bool matched;
+};
 
-    for (int i = 0; i < c->number_of_capturing_groups; ++i) {
-      if (matches[i].data() == nullptr) {
-        rb_ary_push(result, Qnil);
-      } else {
-        rb_ary_push(result, encoded_str_new(matches[i].data(),
-              matches[i].size(),
-              p->pattern->options().encoding()));
-      }
-    }
+static void *nogvl_scan(void *ptr) {
+  auto *arg = static_cast<nogvl_scan_arg *>(ptr);
+  re2_scanner *c = arg->scanner;
 
-    /* Check whether we've exhausted the input yet. */
-    c->eof = new_input_size == 0;
+  arg->matched = re2_scan_step(arg->pattern, arg->literal, c->input,
+      c->args, c->number_of_capturing_groups, &c->eof);
 
-    /* If the match didn't advance the input, we need to do this ourselves,
-     * advancing by a whole character to avoid splitting multi-byte characters.
-     *
-     * The lookup table approach is taken from RE2's own Python extension: the
-     * high 4 bits of a UTF-8 lead byte determine the character's byte length.
-     *
-     * See https://github.com/google/re2/blob/972a15cedd008d846f1a39b2e88ce48d7f166cbd/python/_re2.cc#L46-L48
-     */
-    if (!input_advanced && new_input_size > 0) {
-      size_t char_size = 1;
+  return nullptr;
+}
 
-      if (p->pattern->options().encoding() == RE2::Options::EncodingUTF8) {
-        char_size = "\1\1\1\1\1\1\1\1\1\1\1\1\2\2\3\4"
-            [((*c->input)[0] & 0xFF) >> 4];
+struct nogvl_scan_all_arg {
+  const RE2 *pattern;
+  const re2_literal *literal;
+  re2_scanner *scanner;
+  std::vector<re2::StringPiece> *matches;
+  bool failed;
+};
 
-        if (char_size > new_input_size) {
-          char_size = new_input_size;
-        }
+/* Scans the rest of the scanner's input in one go, appending the submatches
+ * of every match to a flat list.
+ */
+static void *nogvl_scan_all(void *ptr) {
+  auto *arg = static_cast<nogvl_scan_all_arg *>(ptr);
+  re2_scanner *c = arg->scanner;
+  int n = c->number_of_capturing_groups;
+
+  try {
+    while (!c->eof &&
+        re2_scan_step(arg->pattern, arg->literal, c->input, c->args, n,
+          &c->eof)) {
+      arg->matches->insert(arg->matches->end(), c->matches, c->matches + n);
+
+      /* Patterns without capturing groups still need an entry per match. */
+      if (n == 0) {
+        arg->matches->emplace_back();
       }
-
-      c->input->remove_prefix(char_size);
     }
-
-    return result;
-  } else {
-    return Qnil;
+  } catch (const std::bad_alloc &) {
+    arg->failed = true;
   }
+
+  return nullptr;
 }
 
-static re2::StringPiece *re2_matchdata_find_match(VALUE idx, const VALUE self) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
-  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+struct nogvl_scan_offsets_arg {
+  const RE2 *pattern;
+  re2::StringPiece text;
+  int n;
+  std::vector<re2::StringPiece> *matches;
+  bool failed;
+};
 
-  int id;
+/* Finds every match in the text in the same way as a scanner (searching the
+ * rest of the input after each match and advancing by a character after an
+ * empty match) but also records the overall match, appending `n` submatches
+ * for each to a flat list.
+ */
+static void *nogvl_scan_offsets(void *ptr) {
+  auto *arg = static_cast<nogvl_scan_offsets_arg *>(ptr);
+  re2::StringPiece input = arg->text;
+  int n = arg->n;
 
-  if (RB_INTEGER_TYPE_P(idx)) {
-    id = NUM2INT(idx);
-  } else if (SYMBOL_P(idx)) {
-    const auto& groups = p->pattern->NamedCapturingGroups();
-    auto search = groups.find(rb_id2name(SYM2ID(idx)));
+  try {
+    std::vector<re2::StringPiece> &matches = *arg->matches;
 
-    if (search != groups.end()) {
-      id = search->second;
-    } else {
-      return nullptr;
-    }
-  } else {
-    StringValue(idx);
+    for (;;) {
+      size_t offset = matches.size();
+      matches.resize(offset + n);
 
-    const auto& groups = p->pattern->NamedCapturingGroups();
-    auto search = groups.find(std::string(RSTRING_PTR(idx), RSTRING_LEN(idx)));
+#ifdef HAVE_ENDPOS_ARGUMENT
+      bool matched = arg->pattern->Match(
+          input, 0, input.size(), RE2::UNANCHORED, &matches[offset], n);
+#else
+      bool matched = arg->pattern->Match(
+          input, 0, RE2::UNANCHORED, &matches[offset], n);
+#endif
+      if (!matched) {
+        matches.resize(offset);
+        break;
+      }
 
-    if (search != groups.end()) {
-      id = search->second;
-    } else {
-      return nullptr;
-    }
-  }
+      const re2::StringPiece &match = matches[offset];
+      size_t consumed = match.data() + match.size() - input.data();
 
-  if (id >= 0 && id < m->number_of_matches) {
-    re2::StringPiece *match = &m->matches[id];
+      if (consumed == input.size()) {
+        break;
+      }
 
-    if (match->data() != nullptr) {
-      return match;
+      input.remove_prefix(consumed > 0 ? consumed : re2_char_size(arg->pattern, input));
     }
+  } catch (const std::bad_alloc &) {
+    arg->failed = true;
   }
 
   return nullptr;
 }
 
-/*
- * Returns the number of elements in the {RE2::MatchData} (including the
- * overall match, submatches and any `nils`).
- *
- * @return [Integer] the number of elements
- * @example
- *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
- *   m.size   #=> 2
- *   m.length #=> 2
- */
-static VALUE re2_matchdata_size(const VALUE self) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
+struct nogvl_match_many_arg {
+  const RE2 *pattern;
+  re2_batch *batch;
+  RE2::Anchor anchor;
+  int n;
+  size_t threads;
+  re2_thread_pool::workers *workers;
+};
 
-  return INT2FIX(m->number_of_matches);
+static void re2_match_range(nogvl_match_many_arg *arg, size_t begin, size_t end) {
+  re2_batch *batch = arg->batch;
+  re2::StringPiece *matches = arg->n > 0 ? &batch->matches[begin * arg->n] : nullptr;
+
+  for (size_t i = begin; i < end; ++i) {
+    const re2::StringPiece &text = batch->pieces[i];
+#ifdef HAVE_ENDPOS_ARGUMENT
+    batch->matched[i] = arg->pattern->Match(
+        text, 0, text.size(), arg->anchor, matches, arg->n);
+#else
+    batch->matched[i] = arg->pattern->Match(
+        text, 0, arg->anchor, matches, arg->n);
+#endif
+    if (matches) {
+      matches += arg->n;
+    }
+  }
 }
 
-/*
- * Returns the offset of the start of the nth element of the {RE2::MatchData}.
- *
- * @param [Integer, String, Symbol] n the name or number of the submatch
- * @return [Integer, nil] the offset of the start of the match or `nil` if
- *   there is no such submatch
- * @example
- *   m = RE2::Regexp.new('ob (\d+)').partial_match("bob 123")
- *   m.begin(0) #=> 1
- *   m.begin(1) #=> 4
+/* Returns the number of chunks to split `count` items into for the given
+ * number of threads.
  */
-static VALUE re2_matchdata_begin(const VALUE self, VALUE n) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
+static size_t re2_chunks(size_t count, size_t threads) {
+  return std::max<size_t>(1, std::min(count, threads));
+}
 
-  re2::StringPiece *match = re2_matchdata_find_match(n, self);
-  if (match == nullptr) {
-    return Qnil;
-  } else {
-    long offset = match->data() - RSTRING_PTR(m->text);
+/* Splits `count` items into `chunks` contiguous ranges of (nearly) equal size
+ * and calls `fn` with the index and bounds of each, spreading the calls across
+ * the thread pool. Chunks are numbered in the order of their ranges.
+ */
+static void re2_parallel_for(
+    re2_thread_pool::workers *workers, size_t count, size_t chunks,
+    const std::function<void(size_t, size_t, size_t)> &fn) {
+  if (chunks <= 1) {
+    fn(0, 0, count);
 
-    return LONG2NUM(rb_str_sublen(m->text, offset));
+    return;
   }
+
+  re2_thread_pool::run(workers, chunks, [&](size_t chunk) {
+    fn(chunk, count * chunk / chunks, count * (chunk + 1) / chunks);
+  });
 }
 
-/*
- * Returns the offset of the character following the end of the nth element of
- * the {RE2::MatchData}.
- *
- * @param [Integer, String, Symbol] n the name or number of the match
- * @return [Integer, nil] the offset of the character following the end of the
- *   match or `nil` if there is no such match
- * @example
- *   m = RE2::Regexp.new('ob (\d+) b').partial_match("bob 123 bob")
- *   m.end(0) #=> 9
- *   m.end(1) #=> 7
- */
-static VALUE re2_matchdata_end(const VALUE self, VALUE n) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
+static void *nogvl_match_many(void *ptr) {
+  auto *arg = static_cast<nogvl_match_many_arg *>(ptr);
 
-  re2::StringPiece *match = re2_matchdata_find_match(n, self);
-  if (match == nullptr) {
-    return Qnil;
-  } else {
-    long offset = (match->data() - RSTRING_PTR(m->text)) + match->size();
+  size_t count = arg->batch->pieces.size();
 
-    return LONG2NUM(rb_str_sublen(m->text, offset));
+  re2_parallel_for(arg->workers, count, re2_chunks(count, arg->threads),
+      [arg](size_t, size_t begin, size_t end) {
+        re2_match_range(arg, begin, end);
+      });
+
+  return nullptr;
+}
+
+static void re2_match_many_without_gvl(
+    const RE2 *pattern, re2_batch *batch, RE2::Anchor anchor, int n,
+    size_t threads) {
+  nogvl_match_many_arg arg;
+  arg.pattern = pattern;
+  arg.batch = batch;
+  arg.anchor = anchor;
+  arg.n = n;
+  arg.threads = threads;
+  arg.workers = nullptr;
+
+  batch->matched.assign(batch->pieces.size(), 0);
+  if (n > 0) {
+    batch->matches.assign(batch->pieces.size() * n, re2::StringPiece());
+  }
+
+#ifdef _WIN32
+  arg.threads = 1;
+  nogvl_match_many(&arg);
+#else
+  std::shared_ptr<re2_thread_pool::workers> workers;
+  if (threads > 1) {
+    workers = thread_pool.acquire();
+    arg.workers = workers.get();
+
+    re2_release_gvl(nogvl_match_many, &arg);
+  } else {
+    re2_call_without_gvl(nogvl_match_many, &arg,
+        re2_batch_bytes(batch->pieces));
   }
+#endif
 }
 
-/*
- * Returns the portion of the original string before the match.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
- *
- * @return [String] the portion of the original string before the match
- * @example
- *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123 456")
- *   m.pre_match #=> "bob "
+struct nogvl_set_match_arg {
+  const re2_set *s;
+  re2::StringPiece text;
+  std::vector<int> *v;
+#ifdef HAVE_ERROR_INFO_ARGUMENT
+  RE2::Set::ErrorInfo *error_info;
+#endif
+  re2_stats *stats;
+  re2_batch *details;
+  bool matched;
+};
+
+/* Matches each pattern found by a set against the text again to find where
+ * it matched and its submatches, compiling any pattern that has not been
+ * needed before. For each match, `counts` holds the offset of its submatches
+ * in `matches` (or -1 if it did not match) and `compiled` any pattern that
+ * was compiled for it.
  */
-static VALUE re2_matchdata_pre_match(const VALUE self) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
-  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+static void re2_set_match_details(nogvl_set_match_arg *arg) {
+  const re2_set *s = arg->s;
+  re2_batch *batch = arg->details;
+  size_t count = arg->v->size();
+
+  try {
+    batch->counts.assign(count, -1);
+    batch->compiled.resize(count);
+
+    for (size_t i = 0; i < count; ++i) {
+      int index = (*arg->v)[i];
+      const RE2 *pattern;
+
+      /* Regexps are pinned by the set and never replaced once stored. */
+      VALUE regexp = s->regexps[index].load(std::memory_order_acquire);
+      if (regexp) {
+        pattern = static_cast<re2_pattern *>(RTYPEDDATA_DATA(regexp))->pattern;
+      } else {
+        batch->compiled[i].reset(new RE2((*s->sources)[index], *s->options));
+        pattern = batch->compiled[i].get();
+      }
 
-  re2::StringPiece *match = &m->matches[0];
-  if (match->data() == nullptr) {
-    return Qnil;
-  }
+      int n = 1 + pattern->NumberOfCapturingGroups();
+      size_t offset = batch->matches.size();
+      batch->matches.resize(offset + n);
 
-  long offset = match->data() - RSTRING_PTR(m->text);
+#ifdef HAVE_ENDPOS_ARGUMENT
+      bool matched = pattern->Match(arg->text, 0, arg->text.size(),
+          s->anchor, &batch->matches[offset], n);
+#else
+      bool matched = pattern->Match(arg->text, 0, s->anchor,
+          &batch->matches[offset], n);
+#endif
+      if (matched) {
+        batch->counts[i] = static_cast<int>(offset);
+      }
+    }
+  } catch (const std::bad_alloc &) {
+    batch->failed = true;
+  }
+}
 
-  return encoded_str_new(RSTRING_PTR(m->text), offset,
-      p->pattern->options().encoding());
+static void *nogvl_set_match(void *ptr) {
+  auto *arg = static_cast<nogvl_set_match_arg *>(ptr);
+  uint64_t start = arg->stats ? re2_now_ns() : 0;
+#ifdef HAVE_ERROR_INFO_ARGUMENT
+  if (arg->error_info) {
+    arg->matched = arg->s->set->Match(arg->text, arg->v, arg->error_info);
+  } else {
+    arg->matched = arg->s->set->Match(arg->text, arg->v);
+  }
+#else
+  arg->matched = arg->s->set->Match(arg->text, arg->v);
+#endif
+  if (arg->stats) {
+    arg->stats->record(arg->text.size(), arg->matched, re2_now_ns() - start);
+  }
+  if (arg->matched && arg->details) {
+    re2_set_match_details(arg);
+  }
+  return nullptr;
 }
 
-/*
- * Returns the portion of the original string after the match.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
- *
- * @return [String] the portion of the original string after the match
- * @example
- *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123 456")
- *   m.post_match #=> " 456"
+struct nogvl_set_match_many_arg {
+  const RE2::Set *set;
+  re2_batch *batch;
+  bool error_info;
+  re2_thread_pool::workers *workers;
+};
+
+/* Matches each text in the given range, appending the indexes of matching
+ * regexps to the chunk's flat list of indices (reusing a single vector for
+ * each match) and recording how many there were for each text.
  */
-static VALUE re2_matchdata_post_match(const VALUE self) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
-  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+static void re2_set_match_range(
+    nogvl_set_match_many_arg *arg, size_t chunk, size_t begin, size_t end) {
+  re2_batch *batch = arg->batch;
+  std::vector<int> &indices = batch->indices[chunk];
 
-  re2::StringPiece *match = &m->matches[0];
-  if (match->data() == nullptr) {
-    return Qnil;
+  try {
+    std::vector<int> v;
+
+    for (size_t i = begin; i < end; ++i) {
+#ifdef HAVE_ERROR_INFO_ARGUMENT
+      if (arg->error_info) {
+        RE2::Set::ErrorInfo e;
+        batch->matched[i] = arg->set->Match(batch->pieces[i], &v, &e);
+        batch->errors[i] = e.kind;
+      } else {
+        batch->matched[i] = arg->set->Match(batch->pieces[i], &v);
+      }
+#else
+      batch->matched[i] = arg->set->Match(batch->pieces[i], &v);
+#endif
+
+      if (batch->matched[i]) {
+        indices.insert(indices.end(), v.begin(), v.end());
+        batch->counts[i] = v.size();
+      }
+    }
+  } catch (const std::bad_alloc &) {
+    batch->failed = true;
   }
+}
 
-  long start = (match->data() - RSTRING_PTR(m->text)) + match->size();
-  long remaining = RSTRING_LEN(m->text) - start;
+static void *nogvl_set_match_many(void *ptr) {
+  auto *arg = static_cast<nogvl_set_match_many_arg *>(ptr);
 
-  return encoded_str_new(RSTRING_PTR(m->text) + start, remaining,
-      p->pattern->options().encoding());
+  re2_parallel_for(arg->workers, arg->batch->pieces.size(),
+      arg->batch->indices.size(),
+      [arg](size_t chunk, size_t begin, size_t end) {
+        re2_set_match_range(arg, chunk, begin, end);
+      });
+
+  return nullptr;
 }
 
-/*
- * Returns a two-element array containing the beginning and ending offsets of
- * the nth match.
- *
- * @param [Integer, String, Symbol] n the name or number of the match
- * @return [Array<Integer>, nil] a two-element array with the beginning and
- *   ending offsets of the match or `nil` if there is no such match
- * @example
- *   m = RE2::Regexp.new('ob (\d+)').partial_match("bob 123")
- *   m.offset(0) #=> [1, 7]
- *   m.offset(1) #=> [4, 7]
- */
-static VALUE re2_matchdata_offset(const VALUE self, VALUE n) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
+static void re2_set_match_many_without_gvl(
+    const RE2::Set *set, re2_batch *batch, bool error_info, size_t threads) {
+  nogvl_set_match_many_arg arg;
+  arg.set = set;
+  arg.batch = batch;
+  arg.error_info = error_info;
+  arg.workers = nullptr;
 
-  re2::StringPiece *match = re2_matchdata_find_match(n, self);
-  if (match == nullptr) {
-    return Qnil;
-  }
+#ifdef _WIN32
+  threads = 1;
+#endif
 
-  long start = match->data() - RSTRING_PTR(m->text);
-  long end_pos = start + match->size();
+  size_t count = batch->pieces.size();
+  batch->matched.assign(count, 0);
+  batch->counts.assign(count, 0);
+  batch->errors.assign(count, 0);
+  batch->indices.assign(re2_chunks(count, threads), std::vector<int>());
+  batch->failed = false;
 
-  VALUE array = rb_ary_new2(2);
-  rb_ary_push(array, LONG2NUM(rb_str_sublen(m->text, start)));
-  rb_ary_push(array, LONG2NUM(rb_str_sublen(m->text, end_pos)));
+#ifdef _WIN32
+  nogvl_set_match_many(&arg);
+#else
+  std::shared_ptr<re2_thread_pool::workers> workers;
+  if (threads > 1) {
+    workers = thread_pool.acquire();
+    arg.workers = workers.get();
 
-  return array;
+    re2_release_gvl(nogvl_set_match_many, &arg);
+  } else {
+    re2_call_without_gvl(nogvl_set_match_many, &arg,
+        re2_batch_bytes(batch->pieces));
+  }
+#endif
 }
 
-/*
- * Returns the length of the nth match in characters. This is equivalent to
- * `m[n].length` but without allocating a new string.
- *
- * @param [Integer, String, Symbol] n the name or number of the match
- * @return [Integer, nil] the length of the match or `nil` if there is no such
- *   match
- * @example
- *   m = RE2::Regexp.new('(?P<word>\w+) (?P<number>\d+)').partial_match("alice 123")
- *   m.match_length(0)       #=> 9
- *   m.match_length(1)       #=> 5
- *   m.match_length(:number) #=> 3
+struct nogvl_warm_arg {
+  const RE2 *pattern;
+  const RE2::Set *set;
+  re2_batch *batch;
+  size_t matches;
+  uint64_t nanoseconds[2];
+  bool out_of_memory;
+};
+
+/* Matches a batch of sample texts against either a regexp or a set twice,
+ * timing each pass: the first builds the DFA states the samples need and the
+ * second finds them already cached.
  */
-static VALUE re2_matchdata_match_length(const VALUE self, VALUE n) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
+static void *nogvl_warm(void *ptr) {
+  auto *arg = static_cast<nogvl_warm_arg *>(ptr);
+  re2_batch *batch = arg->batch;
 
-  re2::StringPiece *match = re2_matchdata_find_match(n, self);
-  if (match == nullptr) {
-    return Qnil;
+  try {
+    std::vector<int> v;
+    re2::StringPiece match;
+
+    for (int pass = 0; pass < 2; ++pass) {
+      uint64_t start = re2_now_ns();
+      size_t matches = 0;
+
+      for (const re2::StringPiece &text : batch->pieces) {
+        bool matched;
+
+        if (arg->set) {
+#ifdef HAVE_ERROR_INFO_ARGUMENT
+          RE2::Set::ErrorInfo e;
+          matched = arg->set->Match(text, &v, &e);
+          if (!matched && e.kind == RE2::Set::kOutOfMemory) {
+            arg->out_of_memory = true;
+          }
+#else
+          matched = arg->set->Match(text, &v);
+#endif
+        } else {
+          /* Asking for the overall match runs the reverse DFA used to find
+           * where a match starts as well as the forward one.
+           */
+#ifdef HAVE_ENDPOS_ARGUMENT
+          matched = arg->pattern->Match(text, 0, text.size(),
+              RE2::UNANCHORED, &match, 1);
+#else
+          matched = arg->pattern->Match(text, 0, RE2::UNANCHORED, &match, 1);
+#endif
+        }
+
+        if (matched) {
+          ++matches;
+        }
+      }
+
+      arg->nanoseconds[pass] = re2_now_ns() - start;
+      arg->matches = matches;
+    }
+  } catch (const std::bad_alloc &) {
+    batch->failed = true;
   }
 
-  long start = match->data() - RSTRING_PTR(m->text);
-  long end_pos = start + match->size();
-  long char_len = rb_str_sublen(m->text, end_pos) - rb_str_sublen(m->text, start);
+  return nullptr;
+}
 
-  return LONG2NUM(char_len);
+struct nogvl_compile_arg {
+  re2::StringPiece pattern;
+  const RE2::Options *options;
+  RE2 *compiled;
+  bool finished;
+};
+
+static void *nogvl_compile(void *ptr) {
+  auto *arg = static_cast<nogvl_compile_arg *>(ptr);
+  uint64_t start = re2_now_ns();
+  if (arg->options) {
+    arg->compiled = new(std::nothrow) RE2(arg->pattern, *arg->options);
+  } else {
+    arg->compiled = new(std::nothrow) RE2(arg->pattern);
+  }
+  re2_count(global_stats.compile_nanoseconds, re2_now_ns() - start);
+  if (arg->compiled && arg->compiled->ok()) {
+    re2_count(global_stats.regexps_compiled);
+  }
+  return nullptr;
 }
 
-/*
- * Returns the {RE2::Regexp} used in the match.
- *
- * @return [RE2::Regexp] the regular expression used in the match
- * @example
- *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
- *   m.regexp #=> #<RE2::Regexp /(\d+)/>
- */
-static VALUE re2_matchdata_regexp(const VALUE self) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
+static VALUE re2_compile_body(VALUE ptr) {
+  auto *arg = reinterpret_cast<nogvl_compile_arg *>(ptr);
+  re2_call_without_gvl(nogvl_compile, arg, arg->pattern.size());
+  arg->finished = true;
 
-  return m->regexp;
+  return Qnil;
 }
 
-/*
- * Returns the {RE2::Regexp} used in the {RE2::Scanner}.
- *
- * @return [RE2::Regexp] the regular expression used in the {RE2::Scanner}
- * @example
- *   c = RE2::Regexp.new('(\d+)').scan("bob 123")
- *   c.regexp #=> #<RE2::Regexp /(\d+)/>
+/* Frees the compiled pattern if the thread was interrupted (e.g. by
+ * Thread#raise when reacquiring the GVL) after compiling it, as nothing will
+ * take ownership of it.
  */
-static VALUE re2_scanner_regexp(const VALUE self) {
-  re2_scanner *c = unwrap_re2_scanner(self);
+static VALUE re2_compile_ensure(VALUE ptr) {
+  auto *arg = reinterpret_cast<nogvl_compile_arg *>(ptr);
+  if (!arg->finished) {
+    delete arg->compiled;
+    arg->compiled = nullptr;
+  }
 
-  return c->regexp;
+  return Qnil;
 }
 
-static VALUE re2_regexp_allocate(VALUE klass) {
-  re2_pattern *p;
+/* Compiles the pattern described by `arg` without holding the GVL, returning
+ * null if there was not enough memory.
+ */
+static RE2 *re2_compile_arg_without_gvl(nogvl_compile_arg *arg) {
+  arg->compiled = nullptr;
+  arg->finished = false;
 
-  return TypedData_Make_Struct(klass, re2_pattern, &re2_regexp_data_type, p);
+  rb_ensure(re2_compile_body, reinterpret_cast<VALUE>(arg),
+      re2_compile_ensure, reinterpret_cast<VALUE>(arg));
+
+  return arg->compiled;
 }
 
-/*
- * Returns the array of matches including the overall match, submatches and any
- * `nil`s.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
- *
- * @return [Array<String, nil>] the array of matches
- * @example
- *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
- *   m.to_a #=> ["123", "123"]
+/* Parses and compiles `pattern` (with the default options if `options` is
+ * null) without holding the GVL, returning null if there was not enough
+ * memory. The pattern must be frozen so it cannot change while compiling.
  */
-static VALUE re2_matchdata_to_a(const VALUE self) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
-  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+static RE2 *re2_compile_without_gvl(
+    VALUE pattern, const RE2::Options *options) {
+  nogvl_compile_arg arg;
+  arg.pattern = re2::StringPiece(RSTRING_PTR(pattern), RSTRING_LEN(pattern));
+  arg.options = options;
 
-  VALUE array = rb_ary_new2(m->number_of_matches);
-  for (int i = 0; i < m->number_of_matches; ++i) {
-    re2::StringPiece *match = &m->matches[i];
-
-    if (match->data() == nullptr) {
-      rb_ary_push(array, Qnil);
-    } else {
-      rb_ary_push(array, encoded_str_new(match->data(), match->size(),
-            p->pattern->options().encoding()));
-    }
-  }
+  RE2 *compiled = re2_compile_arg_without_gvl(&arg);
+  RB_GC_GUARD(pattern);
 
-  return array;
+  return compiled;
 }
 
-static VALUE re2_matchdata_nth_match(int nth, const VALUE self) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
-  re2_pattern *p = unwrap_re2_regexp(m->regexp);
-
-  if (nth < 0 || nth >= m->number_of_matches) {
-    return Qnil;
-  } else {
-    re2::StringPiece *match = &m->matches[nth];
+struct nogvl_set_add_arg {
+  re2_set *s;
+  re2_batch *batch;
+  bool out_of_memory;
+};
 
-    if (match->data() == nullptr) {
-      return Qnil;
-    } else {
-      return encoded_str_new(match->data(), match->size(),
-          p->pattern->options().encoding());
+/* Adds every pattern in the batch to the set, recording each pattern's index
+ * (or -1 if it was rejected) in the batch's counts along with any error.
+ *
+ * Accepted patterns are recorded in the set here rather than once the GVL is
+ * reacquired (which may raise if the thread is interrupted) so the set's
+ * sources always agree with the RE2::Set. The caller reserves room for them.
+ */
+static void *nogvl_set_add(void *ptr) {
+  auto *arg = static_cast<nogvl_set_add_arg *>(ptr);
+  re2_set *s = arg->s;
+  re2_batch *batch = arg->batch;
+
+  try {
+    for (size_t i = 0; i < batch->pieces.size(); ++i) {
+      std::string source(batch->pieces[i].data(), batch->pieces[i].size());
+
+      batch->counts[i] = s->set->Add(batch->pieces[i], &batch->messages[i]);
+      if (batch->counts[i] >= 0) {
+        s->sources->push_back(std::move(source));
+        s->patterns += 1;
+        s->pattern_bytes += batch->pieces[i].size();
+      }
     }
+  } catch (const std::bad_alloc &) {
+    arg->out_of_memory = true;
   }
-}
 
-static VALUE re2_matchdata_named_match(const std::string &name, const VALUE self) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
-  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+  return nullptr;
+}
 
-  const auto& groups = p->pattern->NamedCapturingGroups();
-  auto search = groups.find(name);
+struct nogvl_set_compile_arg {
+  re2_set *s;
+};
 
-  if (search != groups.end()) {
-    return re2_matchdata_nth_match(search->second, self);
-  } else {
-    return Qnil;
+/* Compiles the set, marking it compiled here for the same reason as
+ * nogvl_set_add.
+ */
+static void *nogvl_set_compile(void *ptr) {
+  auto *arg = static_cast<nogvl_set_compile_arg *>(ptr);
+  uint64_t start = re2_now_ns();
+  arg->s->compiled = arg->s->set->Compile();
+  re2_count(global_stats.compile_nanoseconds, re2_now_ns() - start);
+  if (arg->s->compiled) {
+    re2_count(global_stats.sets_compiled);
   }
+  return nullptr;
 }
 
-/*
- * Retrieve zero, one or more matches by index or name.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
- *
- * @overload [](index)
- *   Access a particular match by index.
- *
- *   @param [Integer] index the index of the match to fetch
- *   @return [String, nil] the specified match or `nil` if it isn't present
- *   @example
- *     m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
- *     m[0] #=> "123"
- *
- * @overload [](start, length)
- *   Access a range of matches by starting index and length.
- *
- *   @param [Integer] start the index from which to start
- *   @param [Integer] length the number of elements to fetch
- *   @return [Array<String, nil>] the specified matches
- *   @example
- *     m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
- *     m[0, 1] #=> ["123"]
- *
- * @overload [](range)
- *   Access a range of matches by index.
- *
- *   @param [Range] range the range of match indexes to fetch
- *   @return [Array<String, nil>] the specified matches
- *   @example
- *     m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
- *     m[0..1] #=> ["123", "123"]
- *
- * @overload [](name)
- *   Access a particular match by name.
- *
- *   @param [String, Symbol] name the name of the match to fetch
- *   @return [String, nil] the specific match or `nil` if it isn't present
- *   @example
- *     m = RE2::Regexp.new('(?P<number>\d+)').partial_match("bob 123")
- *     m["number"] #=> "123"
- *     m[:number]  #=> "123"
+/* Returns a key uniquely identifying a set of RE2 options, suitable for use as
+ * a prefix when caching compiled patterns.
  */
-static VALUE re2_matchdata_aref(int argc, VALUE *argv, const VALUE self) {
-  VALUE idx, rest;
-  rb_scan_args(argc, argv, "11", &idx, &rest);
-
-  if (TYPE(idx) == T_STRING) {
-    return re2_matchdata_named_match(
-        std::string(RSTRING_PTR(idx), RSTRING_LEN(idx)), self);
-  } else if (SYMBOL_P(idx)) {
-    return re2_matchdata_named_match(rb_id2name(SYM2ID(idx)), self);
-  } else if (!NIL_P(rest) || !RB_INTEGER_TYPE_P(idx) || NUM2INT(idx) < 0) {
-    return rb_ary_aref(argc, argv, re2_matchdata_to_a(self));
-  } else {
-    return re2_matchdata_nth_match(NUM2INT(idx), self);
-  }
+static std::string re2_options_key(const RE2::Options &options) {
+  uint32_t flags =
+    (options.encoding() == RE2::Options::EncodingUTF8 ? 1u : 0u) |
+    (options.posix_syntax() ? 1u << 1 : 0u) |
+    (options.longest_match() ? 1u << 2 : 0u) |
+    (options.log_errors() ? 1u << 3 : 0u) |
+    (options.literal() ? 1u << 4 : 0u) |
+    (options.never_nl() ? 1u << 5 : 0u) |
+    (options.dot_nl() ? 1u << 6 : 0u) |
+    (options.never_capture() ? 1u << 7 : 0u) |
+    (options.case_sensitive() ? 1u << 8 : 0u) |
+    (options.perl_classes() ? 1u << 9 : 0u) |
+    (options.word_boundary() ? 1u << 10 : 0u) |
+    (options.one_line() ? 1u << 11 : 0u);
+  int64_t max_mem = options.max_mem();
+
+  std::string key;
+  key.append(reinterpret_cast<const char *>(&flags), sizeof(flags));
+  key.append(reinterpret_cast<const char *>(&max_mem), sizeof(max_mem));
+
+  return key;
 }
 
-/*
- * Returns the entire matched string.
- *
- * @return [String] the entire matched string
- * @example
- *   m = RE2::Regexp.new('(?P<number>\d+)').partial_match("bob 123")
- *   m.to_s #=> "123"
+/* A pattern compiled by the pattern cache along with the literal it matches
+ * (if any), parsed once when it is compiled rather than on every use.
  */
-static VALUE re2_matchdata_to_s(const VALUE self) {
-  return re2_matchdata_nth_match(0, self);
-}
+struct re2_cached_pattern {
+  std::unique_ptr<RE2> pattern;
+  std::unique_ptr<re2_literal> literal;
+};
 
-/*
- * Returns a printable version of the match.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+/* A bounded, least recently used cache of patterns compiled on behalf of
+ * RE2.replace, RE2.global_replace and RE2.extract when they are given a
+ * String rather than an RE2::Regexp.
  *
- * @return [String] a printable version of the match
- * @example
- *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
- *   m.inspect #=> "#<RE2::MatchData \"123\" 1:\"123\">"
+ * Lookups happen without the GVL (and from any Ractor) so all access is
+ * guarded by a mutex. Entries are handed out as shared pointers so evicting
+ * a pattern cannot free it while another thread is still matching with it.
  */
-static VALUE re2_matchdata_inspect(const VALUE self) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
-  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+class re2_pattern_cache {
+  public:
+    re2_pattern_cache() : capacity_(128), hits_(0), misses_(0) {}
 
-  std::ostringstream output;
-  output << "#<RE2::MatchData";
+    /* Returns the compiled pattern, or null if there was not enough memory
+     * (as this is called without the GVL, allocation failures must not
+     * unwind through Ruby).
+     */
+    std::shared_ptr<const re2_cached_pattern> fetch(const re2::StringPiece &pattern,
+        const RE2::Options &options) {
+      try {
+        return fetch_or_compile(pattern, options);
+      } catch (const std::bad_alloc &) {
+        return nullptr;
+      }
+    }
 
-  for (int i = 0; i < m->number_of_matches; ++i) {
-    output << " ";
+    size_t capacity() {
+      std::lock_guard<std::mutex> lock(mutex_);
 
-    if (i > 0) {
-      output << i << ":";
+      return capacity_;
     }
 
-    VALUE match = re2_matchdata_nth_match(i, self);
+    void set_capacity(size_t capacity) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      capacity_ = capacity;
+      evict();
+    }
 
-    if (match == Qnil) {
-      output << "nil";
-    } else {
-      output << "\"";
-      output.write(RSTRING_PTR(match), RSTRING_LEN(match));
-      output << "\"";
+    void clear() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      index_.clear();
+      entries_.clear();
+      hits_ = 0;
+      misses_ = 0;
     }
-  }
 
-  output << ">";
+    void stats(size_t *size, size_t *capacity, uint64_t *hits,
+        uint64_t *misses) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      *size = index_.size();
+      *capacity = capacity_;
+      *hits = hits_;
+      *misses = misses_;
+    }
 
-  return encoded_str_new(output.str().data(), output.str().length(),
-      p->pattern->options().encoding());
-}
+  private:
+    typedef std::pair<std::string, std::shared_ptr<const re2_cached_pattern>>
+      entry_type;
 
-/*
- * Returns the array of submatches.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is
- * undefined).
- *
- * @return [Array<String, nil>] the array of submatches
- * @example
- *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
- *   m.captures    #=> ["123"]
- *   m.deconstruct #=> ["123"]
- *
- * @example pattern matching
- *   case RE2::Regexp.new('(\d+) (\d+)').partial_match("bob 123 456")
- *   in x, y
- *     puts "Matched #{x} #{y}"
- *   else
- *     puts "Unrecognised match"
- *   end
- */
-static VALUE re2_matchdata_deconstruct(const VALUE self) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
-  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+    std::shared_ptr<const re2_cached_pattern> fetch_or_compile(const re2::StringPiece &pattern,
+        const RE2::Options &options) {
+      std::string key = re2_options_key(options);
+      key.append(pattern.data(), pattern.size());
 
-  VALUE array = rb_ary_new2(m->number_of_matches - 1);
-  for (int i = 1; i < m->number_of_matches; ++i) {
-    re2::StringPiece *match = &m->matches[i];
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto search = index_.find(key);
 
-    if (match->data() == nullptr) {
-      rb_ary_push(array, Qnil);
-    } else {
-      rb_ary_push(array, encoded_str_new(match->data(), match->size(),
-            p->pattern->options().encoding()));
-    }
-  }
+        if (search != index_.end()) {
+          ++hits_;
+          entries_.splice(entries_.begin(), entries_, search->second);
 
-  return array;
-}
+          return search->second->second;
+        }
 
-/*
- * Returns a hash of capturing group names to submatches for pattern matching.
- *
- * As this is used by Ruby's pattern matching, it will return an empty hash if given
- * more keys than there are capturing groups. Given keys will populate the hash in
- * order but an invalid name will cause the hash to be immediately returned.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
- *
- * @return [Hash] a hash of capturing group names to submatches
- * @param [Array<Symbol>, nil] keys an array of `Symbol` capturing group names
- *   or `nil` to return all names
- * @example
- *   m = RE2::Regexp.new('(?P<numbers>\d+) (?P<letters>[a-zA-Z]+)').partial_match('123 abc')
- *   m.deconstruct_keys(nil)                #=> {numbers: "123", letters: "abc"}
- *   m.deconstruct_keys([:numbers])         #=> {numbers: "123"}
- *   m.deconstruct_keys([:fruit])           #=> {}
- *   m.deconstruct_keys([:letters, :fruit]) #=> {letters: "abc"}
- *
- * @example pattern matching
- *   case RE2::Regexp.new('(?P<numbers>\d+) (?P<letters>[a-zA-Z]+)').partial_match('123 abc')
- *   in numbers:, letters:
- *     puts "Numbers: #{numbers}, letters: #{letters}"
- *   else
- *     puts "Unrecognised match"
- *   end
- */
-static VALUE re2_matchdata_deconstruct_keys(const VALUE self, const VALUE keys) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
-  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+        ++misses_;
+      }
 
-  const auto& groups = p->pattern->NamedCapturingGroups();
-  VALUE capturing_groups = rb_hash_new();
+      /* Compile outside of the lock so a slow compilation does not stall
+       * every other thread using the cache.
+       */
+      uint64_t start = re2_now_ns();
+      auto entry = std::make_shared<re2_cached_pattern>();
+      entry->pattern.reset(new(std::nothrow) RE2(pattern, options));
+      re2_count(global_stats.compile_nanoseconds, re2_now_ns() - start);
+      if (entry->pattern == nullptr) {
+        return nullptr;
+      }
+      if (entry->pattern->ok()) {
+        re2_count(global_stats.regexps_compiled);
+      }
+      entry->literal.reset(re2_literal::parse(*entry->pattern));
 
-  if (NIL_P(keys)) {
-    for (const auto& group : groups) {
-      rb_hash_aset(capturing_groups,
-          ID2SYM(rb_intern2(group.first.data(), group.first.size())),
-          re2_matchdata_nth_match(group.second, self));
-    }
-  } else {
-    Check_Type(keys, T_ARRAY);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (capacity_ == 0) {
+        return entry;
+      }
 
-    if (p->pattern->NumberOfCapturingGroups() >= RARRAY_LEN(keys)) {
-      for (int i = 0; i < RARRAY_LEN(keys); ++i) {
-        VALUE key = rb_ary_entry(keys, i);
-        Check_Type(key, T_SYMBOL);
-        const char *name = rb_id2name(SYM2ID(key));
-        auto search = groups.find(name);
+      /* Another thread may have compiled the same pattern in the meantime. */
+      auto search = index_.find(key);
+      if (search != index_.end()) {
+        entries_.splice(entries_.begin(), entries_, search->second);
 
-        if (search != groups.end()) {
-          rb_hash_aset(capturing_groups, key, re2_matchdata_nth_match(search->second, self));
-        } else {
-          break;
-        }
+        return search->second->second;
       }
+
+      entries_.emplace_front(key, entry);
+      try {
+        index_.emplace(std::move(key), entries_.begin());
+      } catch (...) {
+        entries_.pop_front();
+        throw;
+      }
+      evict();
+
+      return entry;
     }
-  }
 
-  return capturing_groups;
-}
+    void evict() {
+      while (index_.size() > capacity_) {
+        index_.erase(entries_.back().first);
+        entries_.pop_back();
+      }
+    }
 
-/*
- * Returns a hash of capturing group names to matched strings.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
- *
- * @overload named_captures
- *   Returns a hash with string keys.
- *
- *   @return [Hash] a hash of capturing group names to matching strings
- *   @example
- *     m = RE2::Regexp.new('(?P<numbers>\d+) (?P<letters>[a-zA-Z]+)').partial_match('123 abc')
- *     m.named_captures #=> {"numbers" => "123", "letters" => "abc"}
- *
- * @overload named_captures(symbolize_names:)
- *   Returns a hash with string or symbol keys.
+    std::mutex mutex_;
+    std::list<entry_type> entries_;
+    std::unordered_map<std::string, std::list<entry_type>::iterator> index_;
+    size_t capacity_;
+    uint64_t hits_;
+    uint64_t misses_;
+};
+
+static re2_pattern_cache pattern_cache;
+
+/* A process-wide registry of frozen RE2::Regexp objects interned by pattern
+ * and options for RE2::Regexp.cached.
  *
- *   @param [Boolean] symbolize_names whether to return group names as symbols
- *   @return [Hash] a hash of capturing group names to matching strings
- *   @example
- *     m = RE2::Regexp.new('(?P<numbers>\d+) (?P<letters>[a-zA-Z]+)').partial_match('123 abc')
- *     m.named_captures
- *     #=> {"numbers" => "123", "letters" => "abc"}
- *     m.named_captures(symbolize_names: true) #=> {numbers: "123", letters: "abc"}
+ * Each entry is weighted by its program size and the least recently used
+ * entries are evicted once the total weight exceeds the registry's capacity.
+ * As the registry may be used from any Ractor, all access is guarded by a
+ * mutex which must never be held while allocating Ruby objects (so that a
+ * garbage collection cannot start while it is held).
  */
-static VALUE re2_matchdata_named_captures(int argc, VALUE *argv, const VALUE self) {
-  VALUE opts;
-  rb_scan_args(argc, argv, "0:", &opts);
+class re2_regexp_registry {
+  public:
+    re2_regexp_registry()
+      : capacity_(1000000), cost_(0), hits_(0), misses_(0), evictions_(0) {}
 
-  bool symbolize = false;
-  if (!NIL_P(opts)) {
-    VALUE sym = rb_hash_aref(opts, ID2SYM(id_symbolize_names));
-    symbolize = RTEST(sym);
-  }
+    VALUE lookup(const std::string &key) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto search = index_.find(key);
 
-  re2_matchdata *m = unwrap_re2_matchdata(self);
-  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+      if (search == index_.end()) {
+        ++misses_;
 
-  const auto& groups = p->pattern->NamedCapturingGroups();
-  VALUE result = rb_hash_new();
+        return Qundef;
+      }
 
-  for (const auto& group : groups) {
-    VALUE key;
-    if (symbolize) {
-      key = ID2SYM(rb_intern2(group.first.data(), group.first.size()));
-    } else {
-      key = encoded_str_new(group.first.data(), group.first.size(),
-              p->pattern->options().encoding());
+      ++hits_;
+      entries_.splice(entries_.begin(), entries_, search->second);
+
+      return search->second->regexp;
     }
-    rb_hash_aset(result, key, re2_matchdata_nth_match(group.second, self));
-  }
 
-  return result;
-}
+    VALUE insert(const std::string &key, VALUE regexp, size_t cost) {
+      std::lock_guard<std::mutex> lock(mutex_);
 
-/*
- * Returns an array of names of named capturing groups. Names are returned in
- * alphabetical order rather than definition order, as RE2 stores named groups
- * internally in a sorted map.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
- *
- * @return [Array<String>] an array of names of named capturing groups
- * @example
- *   m = RE2::Regexp.new('(?P<numbers>\d+) (?P<letters>[a-zA-Z]+)').partial_match('123 abc')
- *   m.names #=> ["letters", "numbers"]
- */
-static VALUE re2_matchdata_names(const VALUE self) {
-  re2_matchdata *m = unwrap_re2_matchdata(self);
+      /* Another thread may have interned the same pattern in the meantime. */
+      auto search = index_.find(key);
+      if (search != index_.end()) {
+        entries_.splice(entries_.begin(), entries_, search->second);
 
-  return re2_regexp_names(m->regexp);
-}
+        return search->second->regexp;
+      }
 
-/*
- * Returns an array of match values at the given indices or names.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
- *
- * @param [Integer, String, Symbol] indexes the indices or names of
- *   the matches to fetch
- * @return [Array<String, nil>] the values at the given indices or names
- * @example
- *   m = RE2::Regexp.new('(?P<a>\d+) (?P<b>\d+)').partial_match("123 456")
- *   m.values_at(1, 2)   #=> ["123", "456"]
- *   m.values_at(:a, :b) #=> ["123", "456"]
- *   m.values_at(1, :b)  #=> ["123", "456"]
- */
-static VALUE re2_matchdata_values_at(int argc, VALUE *argv, const VALUE self) {
-  unwrap_re2_matchdata(self);
+      entries_.push_front(entry{key, regexp, cost});
+      index_.emplace(key, entries_.begin());
+      cost_ += cost;
+      evict();
 
-  VALUE result = rb_ary_new2(argc);
+      return regexp;
+    }
 
-  for (int i = 0; i < argc; ++i) {
-    VALUE idx = argv[i];
+    size_t capacity() {
+      std::lock_guard<std::mutex> lock(mutex_);
 
-    if (TYPE(idx) == T_STRING) {
-      rb_ary_push(result, re2_matchdata_named_match(
-            std::string(RSTRING_PTR(idx), RSTRING_LEN(idx)), self));
-    } else if (SYMBOL_P(idx)) {
-      rb_ary_push(result, re2_matchdata_named_match(
-            rb_id2name(SYM2ID(idx)), self));
-    } else {
-      rb_ary_push(result, re2_matchdata_nth_match(NUM2INT(idx), self));
+      return capacity_;
     }
-  }
 
-  return result;
-}
+    void set_capacity(size_t capacity) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      capacity_ = capacity;
+      evict();
+    }
 
-static VALUE re2_matchdata_initialize_copy(VALUE self, VALUE other) {
-  if (self == other) return self;
+    void clear() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      index_.clear();
+      entries_.clear();
+      cost_ = 0;
+      hits_ = 0;
+      misses_ = 0;
+      evictions_ = 0;
+    }
 
-  re2_matchdata *self_m;
-  re2_matchdata *other_m = unwrap_re2_matchdata(other);
+    void stats(size_t *size, size_t *cost, size_t *capacity, uint64_t *hits,
+        uint64_t *misses, uint64_t *evictions) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      *size = index_.size();
+      *cost = cost_;
+      *capacity = capacity_;
+      *hits = hits_;
+      *misses = misses_;
+      *evictions = evictions_;
+    }
 
-  TypedData_Get_Struct(self, re2_matchdata, &re2_matchdata_data_type, self_m);
+    void mark() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto& e : entries_) {
+        rb_gc_mark(e.regexp);
+      }
+    }
 
-  if (self_m->matches) {
-    delete[] self_m->matches;
-    self_m->matches = nullptr;
-  }
+  private:
+    struct entry {
+      std::string key;
+      VALUE regexp;
+      size_t cost;
+    };
+
+    void evict() {
+      while (cost_ > capacity_ && !entries_.empty()) {
+        cost_ -= entries_.back().cost;
+        index_.erase(entries_.back().key);
+        entries_.pop_back();
+        ++evictions_;
+      }
+    }
 
-  self_m->number_of_matches = other_m->number_of_matches;
-  RB_OBJ_WRITE(self, &self_m->regexp, other_m->regexp);
-  RB_OBJ_WRITE(self, &self_m->text, other_m->text);
+    std::mutex mutex_;
+    std::list<entry> entries_;
+    std::unordered_map<std::string, std::list<entry>::iterator> index_;
+    size_t capacity_;
+    size_t cost_;
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t evictions_;
+};
 
-  if (other_m->matches) {
-    self_m->matches = new(std::nothrow) re2::StringPiece[other_m->number_of_matches];
-    if (self_m->matches == nullptr) {
-      rb_raise(rb_eNoMemError,
-               "not enough memory to allocate StringPiece for matches");
-    }
-    for (int i = 0; i < other_m->number_of_matches; ++i) {
-      self_m->matches[i] = other_m->matches[i];
-    }
-  } else {
-    self_m->matches = nullptr;
-  }
+static re2_regexp_registry regexp_registry;
 
-  return self;
-}
+struct nogvl_replace_arg {
+  std::string *str;
+  const RE2 *pattern;
+  const re2_literal *literal;
+  re2::StringPiece string_pattern;
+  re2::StringPiece rewrite;
+  bool compiled;
+};
 
-/*
- * Shorthand to compile a new {RE2::Regexp}.
- *
- * @see RE2::Regexp#initialize
- */
-static VALUE re2_re2(int argc, VALUE *argv, VALUE) {
-  return rb_class_new_instance(argc, argv, re2_cRegexp);
+static void *nogvl_replace(void *ptr) {
+  auto *arg = static_cast<nogvl_replace_arg *>(ptr);
+  if (arg->pattern) {
+    RE2::Replace(arg->str, *arg->pattern, arg->rewrite);
+  } else {
+    std::shared_ptr<const re2_cached_pattern> cached = pattern_cache.fetch(
+        arg->string_pattern, RE2::Options());
+    arg->compiled = cached != nullptr;
+    if (cached) {
+      RE2::Replace(arg->str, *cached->pattern, arg->rewrite);
+    }
+  }
+  return nullptr;
 }
 
-/*
- * Returns a new {RE2::Regexp} object with a compiled version of
- * `pattern` stored inside.
- *
- * @overload initialize(pattern)
- *   Returns a new {RE2::Regexp} object with a compiled version of
- *   `pattern` stored inside with the default options.
- *
- *   @param [String] pattern the pattern to compile
- *   @return [RE2::Regexp] a {RE2::Regexp} with the specified pattern
- *   @raise [TypeError] if the given pattern can't be coerced to a `String`
- *   @raise [NoMemoryError] if memory could not be allocated for the compiled
- *     pattern
- *
- * @overload initialize(pattern, options)
- *   Returns a new {RE2::Regexp} object with a compiled version of
- *   `pattern` stored inside with the specified options.
- *
- *   @param [String] pattern the pattern to compile
- *   @param [Hash] options the options with which to compile the pattern
- *   @option options [Boolean] :utf8 (true) text and pattern are UTF-8; otherwise Latin-1
- *   @option options [Boolean] :posix_syntax (false) restrict regexps to POSIX egrep syntax
- *   @option options [Boolean] :longest_match (false) search for longest match, not first match
- *   @option options [Boolean] :log_errors (true) log syntax and execution errors to ERROR
- *   @option options [Integer] :max_mem approx. max memory footprint of RE2
- *   @option options [Boolean] :literal (false) interpret string as literal, not regexp
- *   @option options [Boolean] :never_nl (false) never match `\n`, even if it is in regexp
- *   @option options [Boolean] :case_sensitive (true) match is case-sensitive (regexp can override with `(?i)` unless in `posix_syntax` mode)
- *   @option options [Boolean] :perl_classes (false) allow Perl's `\d` `\s` `\w` `\D` `\S` `\W` when in `posix_syntax` mode
- *   @option options [Boolean] :word_boundary (false) allow `\b` `\B` (word boundary and not) when in `posix_syntax` mode
- *   @option options [Boolean] :one_line (false) `^` and `$` only match beginning and end of text when in `posix_syntax` mode
- *   @return [RE2::Regexp] a {RE2::Regexp} with the specified pattern and options
- *   @raise [TypeError] if the given pattern can't be coerced to a `String`
- *   @raise [NoMemoryError] if memory could not be allocated for the compiled pattern
+/* Replaces every match of the pattern in `str` in the same way as
+ * RE2::GlobalReplace, searching for the literal directly if given (and the
+ * rewrite does not refer to any submatches). Returns the number of
+ * replacements made.
  */
-static VALUE re2_regexp_initialize(int argc, VALUE *argv, VALUE self) {
-  VALUE pattern, options;
-  re2_pattern *p;
+static int re2_global_replace_string(std::string *str, const RE2 &pattern,
+    const re2_literal *literal, const re2::StringPiece &rewrite) {
+  if (literal == nullptr || pattern.MaxSubmatch(rewrite) > 0) {
+    return RE2::GlobalReplace(str, pattern, rewrite);
+  }
 
-  rb_scan_args(argc, argv, "11", &pattern, &options);
+  re2::StringPiece text(*str);
+  re2::StringPiece match;
+  std::string out;
+  size_t pos = 0;
+  int count = 0;
+
+  while (literal->match(text, pos, text.size(), RE2::UNANCHORED, &match)) {
+    out.append(text.data() + pos, match.data() - text.data() - pos);
+    pattern.Rewrite(&out, rewrite, &match, 1);
+    pos = match.data() + match.size() - text.data();
+    ++count;
+  }
 
-  /* Ensure pattern is a string. */
-  StringValue(pattern);
+  if (count == 0) {
+    return 0;
+  }
 
-  TypedData_Get_Struct(self, re2_pattern, &re2_regexp_data_type, p);
+  out.append(text.data() + pos, text.size() - pos);
+  str->swap(out);
 
-  rb_check_frozen(self);
+  return count;
+}
 
-  if (p->pattern) {
-    delete p->pattern;
-    p->pattern = nullptr;
+static void *nogvl_global_replace(void *ptr) {
+  auto *arg = static_cast<nogvl_replace_arg *>(ptr);
+  if (arg->pattern) {
+    re2_global_replace_string(arg->str, *arg->pattern, arg->literal,
+        arg->rewrite);
+  } else {
+    std::shared_ptr<const re2_cached_pattern> cached = pattern_cache.fetch(
+        arg->string_pattern, RE2::Options());
+    arg->compiled = cached != nullptr;
+    if (cached) {
+      re2_global_replace_string(arg->str, *cached->pattern,
+          cached->literal.get(), arg->rewrite);
+    }
   }
+  return nullptr;
+}
 
-  if (RTEST(options)) {
-    RE2::Options re2_options;
-    parse_re2_options(&re2_options, options);
+struct nogvl_extract_arg {
+  re2::StringPiece text;
+  const RE2 *pattern;
+  re2::StringPiece string_pattern;
+  re2::StringPiece rewrite;
+  std::string *out;
+  bool extracted;
+  bool compiled;
+};
 
-    p->pattern = new(std::nothrow) RE2(
-        re2::StringPiece(RSTRING_PTR(pattern), RSTRING_LEN(pattern)), re2_options);
+static void *nogvl_extract(void *ptr) {
+  auto *arg = static_cast<nogvl_extract_arg *>(ptr);
+  if (arg->pattern) {
+    arg->extracted = RE2::Extract(arg->text, *arg->pattern,
+        arg->rewrite, arg->out);
   } else {
-    p->pattern = new(std::nothrow) RE2(
-        re2::StringPiece(RSTRING_PTR(pattern), RSTRING_LEN(pattern)));
+    std::shared_ptr<const re2_cached_pattern> cached = pattern_cache.fetch(
+        arg->string_pattern, RE2::Options());
+    arg->compiled = cached != nullptr;
+    if (cached) {
+      arg->extracted = RE2::Extract(arg->text, *cached->pattern,
+          arg->rewrite, arg->out);
+    }
   }
+  return nullptr;
+}
 
-  if (p->pattern == nullptr) {
-    rb_raise(rb_eNoMemError, "not enough memory to allocate RE2 object");
+VALUE re2_mRE2, re2_cRegexp, re2_cMatchData, re2_cScanner, re2_cSet,
+      re2_eSetMatchError, re2_eSetUnsupportedError, re2_eRegexpUnsupportedError,
+      re2_cFilteredSet, re2_eFilteredSetMatchError, re2_cReplacer,
+      re2_eFilteredSetUnsupportedError;
+
+/* Symbols used in RE2 options. */
+static ID id_utf8, id_posix_syntax, id_longest_match, id_log_errors,
+          id_max_mem, id_literal, id_never_nl, id_case_sensitive,
+          id_perl_classes, id_word_boundary, id_one_line, id_unanchored,
+          id_anchor, id_anchor_start, id_anchor_both, id_exception,
+          id_submatches, id_startpos, id_endpos, id_symbolize_names,
+          id_size, id_capacity, id_hits, id_misses, id_cost, id_evictions,
+          id_output, id_match_data, id_offsets, id_threads, id_arrays,
+          id_flat, id_strings, id_indices, id_pack, id_into, id_auto, id_program_size,
+          id_pattern_bytes, id_estimated_bytes, id_patterns, id_compiled,
+          id_calls, id_bytes, id_nanoseconds, id_histogram,
+          id_regexps_compiled, id_sets_compiled, id_compile_nanoseconds,
+          id_nogvl_nanoseconds, id_set_match_errors, id_out_of_memory,
+          id_inconsistent, id_not_compiled, id_matchdata_allocations,
+          id_scanner_allocations, id_match, id_match_p, id_scan, id_replace,
+          id_global_replace, id_extract, id_set_match, id_min_atom_len,
+          id_read, id_chunk_size, id_max_match_length, id_lines, id_lazy,
+          id_samples, id_matches, id_cold_nanoseconds, id_warm_nanoseconds;
+
+inline VALUE encoded_str_new(const char *str, long length, RE2::Options::Encoding encoding) {
+  if (encoding == RE2::Options::EncodingUTF8) {
+    return rb_utf8_str_new(str, length);
   }
 
-  rb_obj_freeze(self);
+  VALUE string = rb_str_new(str, length);
+  rb_enc_associate_index(string, rb_enc_find_index("ISO-8859-1"));
 
-  return self;
+  return string;
 }
 
-static VALUE re2_regexp_initialize_copy(VALUE self, VALUE other) {
-  re2_pattern *self_p;
-  re2_pattern *other_p = unwrap_re2_regexp(other);
+static void parse_re2_options(RE2::Options* re2_options, const VALUE options) {
+  if (TYPE(options) != T_HASH) {
+    rb_raise(rb_eArgError, "options should be a hash");
+  }
 
-  TypedData_Get_Struct(self, re2_pattern, &re2_regexp_data_type, self_p);
+  VALUE utf8 = rb_hash_aref(options, ID2SYM(id_utf8));
+  if (!NIL_P(utf8)) {
+    re2_options->set_encoding(RTEST(utf8) ? RE2::Options::EncodingUTF8 : RE2::Options::EncodingLatin1);
+  }
 
-  rb_check_frozen(self);
+  VALUE posix_syntax = rb_hash_aref(options, ID2SYM(id_posix_syntax));
+  if (!NIL_P(posix_syntax)) {
+    re2_options->set_posix_syntax(RTEST(posix_syntax));
+  }
 
-  if (self_p->pattern) {
-    delete self_p->pattern;
-    self_p->pattern = nullptr;
+  VALUE longest_match = rb_hash_aref(options, ID2SYM(id_longest_match));
+  if (!NIL_P(longest_match)) {
+    re2_options->set_longest_match(RTEST(longest_match));
   }
 
-  self_p->pattern = new(std::nothrow) RE2(other_p->pattern->pattern(),
-                                          other_p->pattern->options());
-  if (self_p->pattern == nullptr) {
-    rb_raise(rb_eNoMemError, "not enough memory to allocate RE2 object");
+  VALUE log_errors = rb_hash_aref(options, ID2SYM(id_log_errors));
+  if (!NIL_P(log_errors)) {
+    re2_options->set_log_errors(RTEST(log_errors));
   }
 
-  rb_obj_freeze(self);
+  VALUE max_mem = rb_hash_aref(options, ID2SYM(id_max_mem));
+  if (!NIL_P(max_mem)) {
+    re2_options->set_max_mem(NUM2INT(max_mem));
+  }
 
-  return self;
-}
+  VALUE literal = rb_hash_aref(options, ID2SYM(id_literal));
+  if (!NIL_P(literal)) {
+    re2_options->set_literal(RTEST(literal));
+  }
 
-/*
- * Returns a printable version of the regular expression.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is
- * undefined).
- *
- * @return [String] a printable version of the regular expression
- * @example
- *   re2 = RE2::Regexp.new("woo?")
- *   re2.inspect #=> "#<RE2::Regexp /woo?/>"
- */
-static VALUE re2_regexp_inspect(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+  VALUE never_nl = rb_hash_aref(options, ID2SYM(id_never_nl));
+  if (!NIL_P(never_nl)) {
+    re2_options->set_never_nl(RTEST(never_nl));
+  }
 
-  std::ostringstream output;
+  VALUE case_sensitive = rb_hash_aref(options, ID2SYM(id_case_sensitive));
+  if (!NIL_P(case_sensitive)) {
+    re2_options->set_case_sensitive(RTEST(case_sensitive));
+  }
 
-  output << "#<RE2::Regexp /" << p->pattern->pattern() << "/>";
+  VALUE perl_classes = rb_hash_aref(options, ID2SYM(id_perl_classes));
+  if (!NIL_P(perl_classes)) {
+    re2_options->set_perl_classes(RTEST(perl_classes));
+  }
 
-  return encoded_str_new(output.str().data(), output.str().length(),
-      p->pattern->options().encoding());
+  VALUE word_boundary = rb_hash_aref(options, ID2SYM(id_word_boundary));
+  if (!NIL_P(word_boundary)) {
+    re2_options->set_word_boundary(RTEST(word_boundary));
+  }
+
+  VALUE one_line = rb_hash_aref(options, ID2SYM(id_one_line));
+  if (!NIL_P(one_line)) {
+    re2_options->set_one_line(RTEST(one_line));
+  }
 }
 
-/*
- * Returns a string version of the regular expression.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
- *
- * @return [String] a string version of the regular expression
- * @example
- *   re2 = RE2::Regexp.new("woo?")
- *   re2.to_s #=> "woo?"
- */
-static VALUE re2_regexp_to_s(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+static RE2::Anchor parse_re2_anchor(const VALUE anchor_option) {
+  Check_Type(anchor_option, T_SYMBOL);
 
-  return encoded_str_new(p->pattern->pattern().data(),
-      p->pattern->pattern().size(),
-      p->pattern->options().encoding());
+  ID id_anchor_option = SYM2ID(anchor_option);
+  if (id_anchor_option == id_unanchored) {
+    return RE2::UNANCHORED;
+  } else if (id_anchor_option == id_anchor_start) {
+    return RE2::ANCHOR_START;
+  } else if (id_anchor_option == id_anchor_both) {
+    return RE2::ANCHOR_BOTH;
+  }
+
+  rb_raise(rb_eArgError, "anchor should be one of: :unanchored, :anchor_start, :anchor_both");
 }
 
-/*
- * Returns whether or not the regular expression was compiled successfully.
- *
- * @return [Boolean] whether or not compilation was successful
- * @example
- *   re2 = RE2::Regexp.new("woo?")
- *   re2.ok? #=> true
- */
-static VALUE re2_regexp_ok(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+static void re2_matchdata_mark(void *ptr) {
+  re2_matchdata *m = static_cast<re2_matchdata *>(ptr);
+  rb_gc_mark_movable(m->regexp);
 
-  return BOOL2RUBY(p->pattern->ok());
+  /* Text must not be movable because StringPiece matches hold pointers into
+   * its underlying buffer; moving the string would invalidate them.
+   */
+  rb_gc_mark(m->text);
 }
 
-/*
- * Returns whether or not the regular expression was compiled with the `utf8`
- * option set to `true`.
- *
- * @return [Boolean] the `utf8` option
- * @example
- *   re2 = RE2::Regexp.new("woo?", utf8: true)
- *   re2.utf8? #=> true
- */
-static VALUE re2_regexp_utf8(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+static void re2_matchdata_compact(void *ptr) {
+  re2_matchdata *m = static_cast<re2_matchdata *>(ptr);
+  m->regexp = rb_gc_location(m->regexp);
+}
 
-  return BOOL2RUBY(p->pattern->options().encoding() == RE2::Options::EncodingUTF8);
+static void re2_matchdata_free(void *ptr) {
+  re2_matchdata *m = static_cast<re2_matchdata *>(ptr);
+  if (m->matches) {
+    delete[] m->matches;
+  }
+  xfree(m);
 }
 
-/*
- * Returns whether or not the regular expression was compiled with the
- * `posix_syntax` option set to `true`.
- *
- * @return [Boolean] the `posix_syntax` option
- * @example
- *   re2 = RE2::Regexp.new("woo?", posix_syntax: true)
- *   re2.posix_syntax? #=> true
- */
-static VALUE re2_regexp_posix_syntax(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+static size_t re2_matchdata_memsize(const void *ptr) {
+  const re2_matchdata *m = static_cast<const re2_matchdata *>(ptr);
+  size_t size = sizeof(*m);
+  if (m->matches) {
+    size += sizeof(*m->matches) * m->capacity;
+  }
 
-  return BOOL2RUBY(p->pattern->options().posix_syntax());
+  return size;
 }
 
-/*
- * Returns whether or not the regular expression was compiled with the
- * `longest_match` option set to `true`.
- *
- * @return [Boolean] the `longest_match` option
- * @example
- *   re2 = RE2::Regexp.new("woo?", longest_match: true)
- *   re2.longest_match? #=> true
- */
-static VALUE re2_regexp_longest_match(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+static const rb_data_type_t re2_matchdata_data_type = {
+  "RE2::MatchData",
+  {
+    re2_matchdata_mark,
+    re2_matchdata_free,
+    re2_matchdata_memsize,
+    re2_matchdata_compact
+  },
+  0,
+  0,
+  // IMPORTANT: WB_PROTECTED objects must only use the RB_OBJ_WRITE()
+  // macro to update VALUE references, as to trigger write barriers.
+  //
+  // Frozen match data is never written to again (matching `into:` it and
+  // #initialize_copy both check) so it can be shared between Ractors along
+  // with its frozen text and regexp.
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static void re2_scanner_mark(void *ptr) {
+  re2_scanner *s = static_cast<re2_scanner *>(ptr);
+  rb_gc_mark_movable(s->regexp);
 
-  return BOOL2RUBY(p->pattern->options().longest_match());
+  /* Text must not be movable because the StringPiece input holds a pointer
+   * into its underlying buffer; moving the string would invalidate it.
+   */
+  rb_gc_mark(s->text);
 }
 
-/*
- * Returns whether or not the regular expression was compiled with the
- * `log_errors` option set to `true`.
- *
- * @return [Boolean] the `log_errors` option
- * @example
- *   re2 = RE2::Regexp.new("woo?", log_errors: true)
- *   re2.log_errors? #=> true
- */
-static VALUE re2_regexp_log_errors(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+static void re2_scanner_compact(void *ptr) {
+  re2_scanner *s = static_cast<re2_scanner *>(ptr);
+  s->regexp = rb_gc_location(s->regexp);
+}
 
-  return BOOL2RUBY(p->pattern->options().log_errors());
+static void re2_scanner_free_buffers(re2_scanner *s) {
+  delete[] s->argv;
+  delete[] s->args;
+  delete[] s->matches;
+  s->argv = nullptr;
+  s->args = nullptr;
+  s->matches = nullptr;
 }
 
-/*
- * Returns the `max_mem` setting for the regular expression.
- *
- * @return [Integer] the `max_mem` option
- * @example
- *   re2 = RE2::Regexp.new("woo?", max_mem: 1024)
- *   re2.max_mem #=> 1024
- */
-static VALUE re2_regexp_max_mem(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+static void re2_scanner_free(void *ptr) {
+  re2_scanner *s = static_cast<re2_scanner *>(ptr);
+  if (s->input) {
+    delete s->input;
+  }
+  re2_scanner_free_buffers(s);
+  delete[] s->groups;
+  xfree(s);
+}
+
+static size_t re2_scanner_memsize(const void *ptr) {
+  const re2_scanner *s = static_cast<const re2_scanner *>(ptr);
+  size_t size = sizeof(*s);
+  if (s->input) {
+    size += sizeof(*s->input);
+  }
+  if (s->matches) {
+    size += (sizeof(*s->argv) + sizeof(*s->args) + sizeof(*s->matches)) *
+      s->number_of_capturing_groups;
+  }
+  if (s->groups) {
+    size += sizeof(*s->groups) * s->number_of_groups;
+  }
 
-  return INT2FIX(p->pattern->options().max_mem());
+  return size;
 }
 
-/*
- * Returns whether or not the regular expression was compiled with the
- * `literal` option set to `true`.
- *
- * @return [Boolean] the `literal` option
- * @example
- *   re2 = RE2::Regexp.new("woo?", literal: true)
- *   re2.literal? #=> true
+static const rb_data_type_t re2_scanner_data_type = {
+  "RE2::Scanner",
+  {
+    re2_scanner_mark,
+    re2_scanner_free,
+    re2_scanner_memsize,
+    re2_scanner_compact
+  },
+  0,
+  0,
+  // IMPORTANT: WB_PROTECTED objects must only use the RB_OBJ_WRITE()
+  // macro to update VALUE references, as to trigger write barriers.
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+/* RE2 does not report how much memory a compiled program takes, only its
+ * number of instructions. Each instruction takes 8 bytes plus the bookkeeping
+ * RE2 keeps alongside it (e.g. the lists used to flatten the program), and
+ * each program has a fixed overhead such as its 256-byte byte map.
  */
-static VALUE re2_regexp_literal(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+static const size_t re2_bytes_per_instruction = 16;
+static const size_t re2_bytes_per_program = 1024;
+
+/* Estimates the memory held by a compiled pattern: the RE2 object, copies of
+ * the pattern and its forward program. The reverse program and DFA caches are
+ * only built on demand (the latter bounded by max_mem) so are not included.
+ */
+static size_t re2_pattern_memsize(const RE2 *pattern) {
+  size_t size = sizeof(*pattern) + 2 * pattern->pattern().size();
+  if (pattern->ok()) {
+    size += re2_bytes_per_program +
+      re2_bytes_per_instruction * pattern->ProgramSize();
+  }
 
-  return BOOL2RUBY(p->pattern->options().literal());
+  return size;
 }
 
-/*
- * Returns whether or not the regular expression was compiled with the
- * `never_nl` option set to `true`.
- *
- * @return [Boolean] the `never_nl` option
- * @example
- *   re2 = RE2::Regexp.new("woo?", never_nl: true)
- *   re2.never_nl? #=> true
+/* Replaces the compiled pattern of a regexp (which must be called with the
+ * GVL held), telling the GC about the memory held outside of Ruby's heap.
  */
-static VALUE re2_regexp_never_nl(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+static void re2_regexp_set_pattern(re2_pattern *p, RE2 *pattern) {
+  if (p->pattern) {
+    global_stats.program_size.fetch_sub(
+        std::max(p->pattern->ProgramSize(), 0), std::memory_order_relaxed);
+    delete p->pattern;
+    rb_gc_adjust_memory_usage(-static_cast<ssize_t>(p->memsize));
+
+    /* Any named groups belonged to the old pattern. */
+    p->groups.store(0, std::memory_order_release);
+    delete p->literal;
+  }
 
-  return BOOL2RUBY(p->pattern->options().never_nl());
+  p->pattern = pattern;
+  p->literal = re2_literal::parse(*pattern);
+  p->memsize = re2_pattern_memsize(pattern);
+  rb_gc_adjust_memory_usage(static_cast<ssize_t>(p->memsize));
+  global_stats.program_size.fetch_add(
+      std::max(pattern->ProgramSize(), 0), std::memory_order_relaxed);
 }
 
-/*
- * Returns whether or not the regular expression was compiled with the
- * `case_sensitive` option set to `true`.
- *
- * @return [Boolean] the `case_sensitive` option
- * @example
- *   re2 = RE2::Regexp.new("woo?", case_sensitive: true)
- *   re2.case_sensitive? #=> true
- */
-static VALUE re2_regexp_case_sensitive(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+static void re2_regexp_mark(void *ptr) {
+  re2_pattern *p = static_cast<re2_pattern *>(ptr);
 
-  return BOOL2RUBY(p->pattern->options().case_sensitive());
+  /* Pinned as it is published to other Ractors with a compare-and-swap. */
+  VALUE groups = p->groups.load(std::memory_order_acquire);
+  if (groups) {
+    rb_gc_mark(groups);
+  }
 }
 
-/*
- * Returns whether or not the regular expression was compiled with the
- * `case_sensitive` option set to `false`.
- *
- * @return [Boolean] the inverse of the `case_sensitive` option
- * @example
- *   re2 = RE2::Regexp.new("woo?", case_sensitive: true)
- *   re2.case_insensitive? #=> false
- *   re2.casefold?         #=> false
- */
-static VALUE re2_regexp_case_insensitive(const VALUE self) {
-  return BOOL2RUBY(re2_regexp_case_sensitive(self) != Qtrue);
+static void re2_regexp_free(void *ptr) {
+  re2_pattern *p = static_cast<re2_pattern *>(ptr);
+  if (p->pattern) {
+    global_stats.program_size.fetch_sub(
+        std::max(p->pattern->ProgramSize(), 0), std::memory_order_relaxed);
+    delete p->pattern;
+    rb_gc_adjust_memory_usage(-static_cast<ssize_t>(p->memsize));
+  }
+  delete p->stats.load(std::memory_order_relaxed);
+  delete p->source;
+  delete p->options;
+  delete p->literal;
+  xfree(p);
 }
 
-/*
- * Returns whether or not the regular expression was compiled with the
- * perl_classes option set to `true`.
- *
- * @return [Boolean] the `perl_classes` option
- * @example
- *   re2 = RE2::Regexp.new("woo?", perl_classes: true)
- *   re2.perl_classes? #=> true
+static size_t re2_regexp_memsize(const void *ptr) {
+  const re2_pattern *p = static_cast<const re2_pattern *>(ptr);
+  size_t size = sizeof(*p);
+  if (p->pattern) {
+    size += p->memsize;
+  }
+  if (p->source) {
+    size += sizeof(*p->source) + p->source->capacity() + sizeof(*p->options);
+  }
+  if (p->literal) {
+    size += p->literal->memsize();
+  }
+  if (p->stats.load(std::memory_order_relaxed)) {
+    size += sizeof(re2_stats);
+  }
+
+  return size;
+}
+
+static const rb_data_type_t re2_regexp_data_type = {
+  "RE2::Regexp",
+  {
+    re2_regexp_mark,
+    re2_regexp_free,
+    re2_regexp_memsize,
+  },
+  0,
+  0,
+  // IMPORTANT: WB_PROTECTED objects must only use the RB_OBJ_WRITE()
+  // macro to update VALUE references, as to trigger write barriers.
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static void re2_regexp_registry_mark(void *ptr) {
+  static_cast<re2_regexp_registry *>(ptr)->mark();
+}
+
+/* The registry is never freed and is not write barrier protected so that it
+ * is always marked in full.
  */
-static VALUE re2_regexp_perl_classes(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+static const rb_data_type_t re2_regexp_registry_data_type = {
+  "RE2::Regexp registry",
+  {
+    re2_regexp_registry_mark,
+    0,
+    0,
+  },
+  0,
+  0,
+  0
+};
+
+static void re2_batch_mark(void *ptr) {
+  re2_batch *b = static_cast<re2_batch *>(ptr);
+
+  /* Texts must not be movable because the StringPieces hold pointers into
+   * their underlying buffers; moving them would invalidate them.
+   */
+  for (VALUE text : b->texts) {
+    rb_gc_mark(text);
+  }
+}
 
-  return BOOL2RUBY(p->pattern->options().perl_classes());
+static void re2_batch_free(void *ptr) {
+  delete static_cast<re2_batch *>(ptr);
 }
 
-/*
- * Returns whether or not the regular expression was compiled with the
- * `word_boundary` option set to `true`.
- *
- * @return [Boolean] the `word_boundary` option
- * @example
- *   re2 = RE2::Regexp.new("woo?", word_boundary: true)
- *   re2.word_boundary? #=> true
- */
-static VALUE re2_regexp_word_boundary(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+static size_t re2_batch_memsize(const void *ptr) {
+  const re2_batch *b = static_cast<const re2_batch *>(ptr);
+
+  size_t size = sizeof(*b) +
+    b->texts.capacity() * sizeof(VALUE) +
+    (b->pieces.capacity() + b->matches.capacity()) * sizeof(re2::StringPiece) +
+    b->matched.capacity() +
+    b->indices.capacity() * sizeof(std::vector<int>) +
+    (b->counts.capacity() + b->errors.capacity()) * sizeof(int);
+
+  for (const std::vector<int> &indices : b->indices) {
+    size += indices.capacity() * sizeof(int);
+  }
+
+  return size;
+}
+
+static const rb_data_type_t re2_batch_data_type = {
+  "RE2 batch",
+  {
+    re2_batch_mark,
+    re2_batch_free,
+    re2_batch_memsize,
+  },
+  0,
+  0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* Returns a hidden object owning an empty batch, freeing it (and any results
+ * stored in it) once it is garbage collected.
+ */
+static VALUE re2_batch_alloc(re2_batch **batch) {
+  re2_batch *b = new(std::nothrow) re2_batch();
+  if (b == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate batch");
+  }
+
+  *batch = b;
+
+  return TypedData_Wrap_Struct(0, &re2_batch_data_type, b);
+}
+
+static void re2_file_matches_free(void *ptr) {
+  delete static_cast<re2_file_matches *>(ptr);
+}
+
+static size_t re2_file_matches_memsize(const void *ptr) {
+  const re2_file_matches *m = static_cast<const re2_file_matches *>(ptr);
+
+  size_t size = sizeof(*m) +
+    m->hits.capacity() * sizeof(std::vector<int64_t>) +
+    m->indices.capacity() * sizeof(std::vector<int>) +
+    m->lines.capacity() * sizeof(int64_t);
+
+  for (const std::vector<int64_t> &hits : m->hits) {
+    size += hits.capacity() * sizeof(int64_t);
+  }
+  for (const std::vector<int> &indices : m->indices) {
+    size += indices.capacity() * sizeof(int);
+  }
+
+  return size;
+}
+
+static const rb_data_type_t re2_file_matches_data_type = {
+  "RE2 file matches",
+  {
+    0,
+    re2_file_matches_free,
+    re2_file_matches_memsize,
+  },
+  0,
+  0,
+  RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* Returns a hidden object owning empty file matches, freeing them once it is
+ * garbage collected.
+ */
+static VALUE re2_file_matches_alloc(re2_file_matches **matches) {
+  re2_file_matches *m = new(std::nothrow) re2_file_matches();
+  if (m == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate file matches");
+  }
+
+  *matches = m;
+
+  return TypedData_Wrap_Struct(0, &re2_file_matches_data_type, m);
+}
+
+/* Coerces and freezes every element of the given array of strings, returning a
+ * hidden object that keeps them alive (and in place) for as long as it is
+ * referenced.
+ */
+static VALUE re2_batch_new(VALUE strings, re2_batch **batch) {
+  Check_Type(strings, T_ARRAY);
+
+  re2_batch *b;
+  VALUE wrapper = re2_batch_alloc(&b);
+
+  /* The vectors grow while the GVL is held so a failed allocation must be
+   * caught here rather than unwind through Ruby's frames.
+   */
+  bool out_of_memory = false;
+  try {
+    b->texts.reserve(RARRAY_LEN(strings));
+  } catch (const std::bad_alloc &) {
+    out_of_memory = true;
+  }
+
+  for (long i = 0; !out_of_memory && i < RARRAY_LEN(strings); ++i) {
+    VALUE text = rb_ary_entry(strings, i);
+    StringValue(text);
+    text = rb_str_new_frozen(text);
+
+    try {
+      b->texts.push_back(text);
+    } catch (const std::bad_alloc &) {
+      out_of_memory = true;
+    }
+  }
+
+  if (!out_of_memory) {
+    try {
+      b->pieces.reserve(b->texts.size());
+      for (VALUE text : b->texts) {
+        b->pieces.emplace_back(RSTRING_PTR(text), RSTRING_LEN(text));
+      }
+    } catch (const std::bad_alloc &) {
+      out_of_memory = true;
+    }
+  }
+
+  if (out_of_memory) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate batch");
+  }
+
+  *batch = b;
+
+  return wrapper;
+}
+
+/* Guards compiling regexps created with `lazy: true`, which may be used from
+ * several Ractors at once.
+ */
+static std::mutex re2_lazy_mutex;
+
+/* Compiles a regexp created with `lazy: true` on first use (without the
+ * GVL), keeping the first pattern compiled if several threads race to do so.
+ */
+static void re2_regexp_compile_lazily(re2_pattern *p) {
+  nogvl_compile_arg arg;
+  arg.pattern = re2::StringPiece(*p->source);
+  arg.options = p->options;
+
+  RE2 *compiled = re2_compile_arg_without_gvl(&arg);
+
+  if (compiled == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate RE2 object");
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(re2_lazy_mutex);
+    if (!p->compiled.load(std::memory_order_relaxed)) {
+      re2_regexp_set_pattern(p, compiled);
+      p->compiled.store(true, std::memory_order_release);
+      compiled = nullptr;
+    }
+  }
+
+  delete compiled;
+}
+
+static re2_pattern *unwrap_re2_regexp(VALUE self) {
+  re2_pattern *p;
+  TypedData_Get_Struct(self, re2_pattern, &re2_regexp_data_type, p);
+  if (p->source && !p->compiled.load(std::memory_order_acquire)) {
+    re2_regexp_compile_lazily(p);
+  }
+  if (!p->pattern) {
+    rb_raise(rb_eTypeError, "uninitialized RE2::Regexp");
+  }
+  return p;
+}
+
+/* Unwraps a regexp for methods that only need its pattern and options (see
+ * re2_pattern_source and re2_pattern_options), so regexps created with
+ * `lazy: true` can be hashed, compared and printed without compiling them.
+ */
+static re2_pattern *unwrap_re2_regexp_source(VALUE self) {
+  re2_pattern *p;
+  TypedData_Get_Struct(self, re2_pattern, &re2_regexp_data_type, p);
+  if (!p->pattern && !p->source) {
+    rb_raise(rb_eTypeError, "uninitialized RE2::Regexp");
+  }
+  return p;
+}
+
+/* Lazy regexps keep their pattern and options (which never change) after
+ * compiling so they can be read without racing a compile in another thread.
+ */
+static re2::StringPiece re2_pattern_source(const re2_pattern *p) {
+  if (p->source) {
+    return re2::StringPiece(*p->source);
+  }
+
+  return re2::StringPiece(p->pattern->pattern());
+}
+
+static const RE2::Options &re2_pattern_options(const re2_pattern *p) {
+  if (p->options) {
+    return *p->options;
+  }
+
+  return p->pattern->options();
+}
+
+/* Raises a ThreadError if the match data is being matched into by
+ * RE2::Regexp#match in another thread (without the GVL), as its submatches
+ * are only partially written.
+ */
+static void re2_matchdata_check_matching(const re2_matchdata *m) {
+  if (m->matching) {
+    rb_raise(rb_eThreadError, "RE2::MatchData is being matched into in another thread");
+  }
+}
+
+static re2_matchdata *unwrap_re2_matchdata(VALUE self) {
+  re2_matchdata *m;
+  TypedData_Get_Struct(self, re2_matchdata, &re2_matchdata_data_type, m);
+  if (!RTEST(m->regexp)) {
+    rb_raise(rb_eTypeError, "uninitialized RE2::MatchData");
+  }
+  re2_matchdata_check_matching(m);
+  return m;
+}
+
+static re2_scanner *unwrap_re2_scanner(VALUE self) {
+  re2_scanner *c;
+  TypedData_Get_Struct(self, re2_scanner, &re2_scanner_data_type, c);
+  if (!RTEST(c->regexp)) {
+    rb_raise(rb_eTypeError, "uninitialized RE2::Scanner");
+  }
+  return c;
+}
+
+/* Allocates the argument and submatch buffers reused by every step of a
+ * scanner so that scanning does not allocate for each match.
+ */
+static void re2_scanner_allocate_buffers(re2_scanner *c) {
+  re2_scanner_free_buffers(c);
+
+  int n = c->number_of_capturing_groups;
+  c->argv = new(std::nothrow) RE2::Arg[n];
+  c->args = new(std::nothrow) RE2::Arg*[n];
+  c->matches = new(std::nothrow) re2::StringPiece[n];
+  if (c->argv == nullptr || c->args == nullptr || c->matches == nullptr) {
+    re2_scanner_free_buffers(c);
+    rb_raise(rb_eNoMemError,
+             "not enough memory to allocate buffers for submatches");
+  }
+
+  for (int i = 0; i < n; ++i) {
+    c->argv[i] = &c->matches[i];
+    c->args[i] = &c->argv[i];
+  }
+}
+
+/* Raises a ThreadError if the scanner is part-way through a step in another
+ * thread (without the GVL), as its input and buffers cannot be shared.
+ */
+static void re2_scanner_check_scanning(const re2_scanner *c) {
+  if (c->scanning) {
+    rb_raise(rb_eThreadError, "RE2::Scanner is already scanning in another thread");
+  }
+}
+
+/* The entries of a regexp's named group table, see re2_regexp_groups. */
+enum re2_group_table {
+  re2_group_names,
+  re2_group_symbols,
+  re2_group_indices,
+  re2_group_indices_by_name,
+  re2_group_indices_by_symbol
+};
+
+/* Returns a frozen table of the regexp's named capturing groups in RE2's
+ * (sorted) order: arrays of their names as strings and symbols and of their
+ * indices, and hashes of indices keyed by name and by symbol. The table is
+ * built the first time it is needed rather than each time a group is looked
+ * up by name, and published with a compare-and-swap as the regexp may be
+ * shared between Ractors.
+ */
+static VALUE re2_regexp_groups(const VALUE regexp, re2_pattern *p) {
+  VALUE groups = p->groups.load(std::memory_order_acquire);
+  if (groups) {
+    return groups;
+  }
+
+  const auto& named_groups = p->pattern->NamedCapturingGroups();
+  long size = static_cast<long>(named_groups.size());
+  VALUE names = rb_ary_new2(size);
+  VALUE symbols = rb_ary_new2(size);
+  VALUE indices = rb_ary_new2(size);
+  VALUE by_name = rb_hash_new();
+  VALUE by_symbol = rb_hash_new();
+
+  for (const auto& group : named_groups) {
+    VALUE name = rb_str_freeze(encoded_str_new(group.first.data(),
+          group.first.size(), p->pattern->options().encoding()));
+    VALUE symbol = rb_str_intern(name);
+    VALUE index = INT2FIX(group.second);
+
+    rb_ary_push(names, name);
+    rb_ary_push(symbols, symbol);
+    rb_ary_push(indices, index);
+    rb_hash_aset(by_name, name, index);
+    rb_hash_aset(by_symbol, symbol, index);
+  }
+
+  VALUE candidate = rb_ary_new_from_args(5, names, symbols, indices, by_name,
+      by_symbol);
+  rb_ractor_make_shareable(candidate);
+
+  if (p->groups.compare_exchange_strong(groups, candidate,
+        std::memory_order_acq_rel)) {
+    RB_OBJ_WRITTEN(regexp, Qundef, candidate);
+
+    return candidate;
+  }
+
+  return groups;
+}
+
+/* Returns the index of the named capturing group with the given name (a
+ * string or symbol) or -1 if there is none.
+ */
+static int re2_regexp_group_index(const VALUE regexp, re2_pattern *p,
+    VALUE name) {
+  VALUE groups = re2_regexp_groups(regexp, p);
+  bool symbol = SYMBOL_P(name);
+  VALUE index = rb_hash_lookup2(RARRAY_AREF(groups,
+        symbol ? re2_group_indices_by_symbol : re2_group_indices_by_name),
+      name, Qundef);
+
+  if (index != Qundef) {
+    return FIX2INT(index);
+  }
+
+  /* The table only has names in the regexp's own encoding (and symbols
+   * interned from them) so fall back to comparing bytes, e.g. for a
+   * non-ASCII name given in another encoding.
+   */
+  if (RARRAY_LEN(RARRAY_AREF(groups, re2_group_names)) == 0) {
+    return -1;
+  }
+
+  const auto& named_groups = p->pattern->NamedCapturingGroups();
+  auto search = symbol ?
+    named_groups.find(rb_id2name(SYM2ID(name))) :
+    named_groups.find(std::string(RSTRING_PTR(name), RSTRING_LEN(name)));
+
+  return search != named_groups.end() ? search->second : -1;
+}
+
+/*
+ * Returns an array of names of all named capturing groups. Names are returned
+ * in alphabetical order rather than definition order, as RE2 stores named
+ * groups internally in a sorted map.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @return [Array<String>] an array of names of named capturing groups
+ * @example
+ *   RE2::Regexp.new('(?P<a>\d+) (?P<b>\w+)').names #=> ["a", "b"]
+ */
+static VALUE re2_regexp_names(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  /* Copy the names so that the shared table's frozen strings never leak. */
+  VALUE groups = re2_regexp_groups(self, p);
+  VALUE shared = RARRAY_AREF(groups, re2_group_names);
+  VALUE names = rb_ary_new_capa(RARRAY_LEN(shared));
+
+  for (long i = 0; i < RARRAY_LEN(shared); ++i) {
+    rb_ary_push(names, rb_str_dup(RARRAY_AREF(shared, i)));
+  }
+
+  return names;
+}
+
+static VALUE re2_matchdata_allocate(VALUE klass) {
+  re2_matchdata *m;
+  re2_count(global_stats.matchdata_allocations);
+
+  return TypedData_Make_Struct(klass, re2_matchdata, &re2_matchdata_data_type,
+      m);
+}
+
+static VALUE re2_scanner_allocate(VALUE klass) {
+  re2_scanner *c;
+  re2_count(global_stats.scanner_allocations);
+
+  return TypedData_Make_Struct(klass, re2_scanner, &re2_scanner_data_type, c);
+}
+
+/*
+ * Returns a frozen copy of the text supplied when matching.
+ *
+ * If the text was already a frozen string, returns the original.
+ *
+ * @return [String] a frozen string with the text supplied when matching
+ * @example
+ *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
+ *   m.string #=> "bob 123"
+ */
+static VALUE re2_matchdata_string(const VALUE self) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+
+  return m->text;
+}
+
+/*
+ * Returns a frozen copy of the text supplied when incrementally matching with
+ * {RE2::Regexp#scan}.
+ *
+ * If the text was already a frozen string, returns the original.
+ *
+ * @return [String] a frozen string with the text passed to {RE2::Regexp#scan}
+ * @example
+ *   c = RE2::Regexp.new('(\d+)').scan("foo")
+ *   c.string #=> "foo"
+ */
+static VALUE re2_scanner_string(const VALUE self) {
+  re2_scanner *c = unwrap_re2_scanner(self);
+
+  return c->text;
+}
+
+/*
+ * Returns whether the {RE2::Scanner} has consumed all input or not.
+ *
+ * @return [Boolean] whether the {RE2::Scanner} has consumed all input or not
+ * @example
+ *   c = RE2::Regexp.new('(\d+)').scan("foo")
+ *   c.eof? #=> true
+ */
+static VALUE re2_scanner_eof(const VALUE self) {
+  re2_scanner *c = unwrap_re2_scanner(self);
+
+  return BOOL2RUBY(c->eof);
+}
+
+/*
+ * Rewind the {RE2::Scanner} to the start of the string.
+ *
+ * @example
+ *   s = RE2::Regexp.new('(\d+)').scan("1 2 3")
+ *   e = s.to_enum
+ *   e.scan #=> ["1"]
+ *   e.scan #=> ["2"]
+ *   s.rewind
+ *   e.scan #=> ["1"]
+ */
+static VALUE re2_scanner_rewind(VALUE self) {
+  re2_scanner *c = unwrap_re2_scanner(self);
+  re2_scanner_check_scanning(c);
+
+  delete c->input;
+  c->input = new(std::nothrow) re2::StringPiece(
+      RSTRING_PTR(c->text), RSTRING_LEN(c->text));
+  if (c->input == nullptr) {
+    rb_raise(rb_eNoMemError,
+             "not enough memory to allocate StringPiece for input");
+  }
+
+  c->eof = false;
+
+  return self;
+}
+
+static VALUE re2_scanner_initialize_copy(VALUE self, VALUE other) {
+  if (self == other) return self;
+
+  re2_scanner *self_c;
+  re2_scanner *other_c = unwrap_re2_scanner(other);
+
+  TypedData_Get_Struct(self, re2_scanner, &re2_scanner_data_type, self_c);
+  re2_scanner_check_scanning(self_c);
+  re2_scanner_check_scanning(other_c);
+
+  if (self_c->input) {
+    delete self_c->input;
+    self_c->input = nullptr;
+  }
+
+  RB_OBJ_WRITE(self, &self_c->regexp, other_c->regexp);
+  RB_OBJ_WRITE(self, &self_c->text, other_c->text);
+  self_c->number_of_capturing_groups = other_c->number_of_capturing_groups;
+  self_c->eof = other_c->eof;
+
+  if (other_c->input) {
+    self_c->input = new(std::nothrow) re2::StringPiece(*other_c->input);
+    if (self_c->input == nullptr) {
+      rb_raise(rb_eNoMemError,
+               "not enough memory to allocate StringPiece for input");
+    }
+  } else {
+    self_c->input = nullptr;
+  }
+
+  delete[] self_c->groups;
+  self_c->groups = nullptr;
+  self_c->number_of_groups = other_c->number_of_groups;
+  self_c->offsets = other_c->offsets;
+
+  if (other_c->groups) {
+    self_c->groups = new(std::nothrow) int[other_c->number_of_groups];
+    if (self_c->groups == nullptr) {
+      rb_raise(rb_eNoMemError,
+               "not enough memory to allocate submatch selection");
+    }
+    std::copy_n(other_c->groups, other_c->number_of_groups, self_c->groups);
+  }
+
+  re2_scanner_allocate_buffers(self_c);
+
+  return self;
+}
+
+/* Returns the selected submatches of a single match, either as strings or as
+ * byte offsets into the scanner's text.
+ */
+static VALUE re2_scanner_result(
+    const re2_scanner *c, const re2::StringPiece *matches,
+    RE2::Options::Encoding encoding) {
+  int count = c->groups ? c->number_of_groups : c->number_of_capturing_groups;
+  VALUE result = rb_ary_new_capa(count);
+
+  for (int i = 0; i < count; ++i) {
+    int group = c->groups ? c->groups[i] : i;
+
+    if (group < 0 || matches[group].data() == nullptr) {
+      rb_ary_push(result, Qnil);
+    } else if (c->offsets) {
+      long begin = matches[group].data() - RSTRING_PTR(c->text);
+      rb_ary_push(result, rb_assoc_new(LONG2NUM(begin),
+            LONG2NUM(begin + matches[group].size())));
+    } else {
+      rb_ary_push(result, encoded_str_new(matches[group].data(),
+            matches[group].size(), encoding));
+    }
+  }
+
+  return result;
+}
+
+/* Finds the next match without the GVL, called by {RE2::Scanner#scan} via
+ * rb_ensure so that the scanner is released if the search is interrupted.
+ */
+static VALUE re2_scanner_scan_body(VALUE self) {
+  re2_scanner *c = unwrap_re2_scanner(self);
+
+  re2_pattern *p = unwrap_re2_regexp(c->regexp);
+
+  nogvl_scan_arg arg;
+  arg.pattern = p->pattern;
+  arg.literal = p->literal;
+  arg.scanner = c;
+  arg.matched = false;
+
+  re2_call_without_gvl(nogvl_scan, &arg, arg.scanner->input->size());
+
+  return BOOL2RUBY(arg.matched);
+}
+
+static VALUE re2_scanner_scan_ensure(VALUE self) {
+  re2_scanner *c;
+  TypedData_Get_Struct(self, re2_scanner, &re2_scanner_data_type, c);
+  c->scanning = false;
+
+  return Qnil;
+}
+
+/*
+ * Scan the given text incrementally for matches using
+ * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L447-L463
+ * `FindAndConsume`}, returning an array of submatches on each subsequent
+ * call. Returns `nil` if no matches are found or an empty array for every
+ * match if the pattern has no capturing groups.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * If the scanner was created with the `:submatches` or `:output` options of
+ * {RE2::Regexp#scan}, only the selected submatches are returned, either as
+ * strings or as `[begin, end]` byte offsets into the text.
+ *
+ * The GVL is released while searching for each match so other threads can
+ * run during a long scan but a single {RE2::Scanner} must not be advanced by
+ * more than one thread at a time.
+ *
+ * @return [Array<String>] if the pattern has capturing groups
+ * @return [Array<Array<Integer>>] if the scanner returns offsets
+ * @return [[]] if the pattern does not have capturing groups
+ * @return [nil] if no matches are found
+ * @raise [ThreadError] if the scanner is already scanning in another thread
+ * @example
+ *   s = RE2::Regexp.new('(\w+)').scan("Foo bar baz")
+ *   s.scan #=> ["Foo"]
+ *   s.scan #=> ["bar"]
+ */
+static VALUE re2_scanner_scan(VALUE self) {
+  re2_count_call(re2_entry_scan);
+
+  re2_scanner *c = unwrap_re2_scanner(self);
+  re2_pattern *p = unwrap_re2_regexp(c->regexp);
+
+  if (c->eof) {
+    return Qnil;
+  }
+
+  re2_scanner_check_scanning(c);
+  c->scanning = true;
+
+  VALUE matched = rb_ensure(re2_scanner_scan_body, self,
+      re2_scanner_scan_ensure, self);
+
+  if (!RTEST(matched)) {
+    return Qnil;
+  }
+
+  return re2_scanner_result(c, c->matches, p->pattern->options().encoding());
+}
+
+struct re2_scanner_to_a_arg {
+  VALUE self;
+  re2_batch *batch;
+};
+
+static VALUE re2_scanner_to_a_body(VALUE ptr) {
+  auto *to_a_arg = reinterpret_cast<re2_scanner_to_a_arg *>(ptr);
+  re2_scanner *c = unwrap_re2_scanner(to_a_arg->self);
+
+  re2_pattern *p = unwrap_re2_regexp(c->regexp);
+
+  nogvl_scan_all_arg arg;
+  arg.pattern = p->pattern;
+  arg.literal = p->literal;
+  arg.scanner = c;
+  arg.matches = &to_a_arg->batch->matches;
+  arg.failed = false;
+
+  re2_call_without_gvl(nogvl_scan_all, &arg, arg.scanner->input->size());
+
+  return BOOL2RUBY(!arg.failed);
+}
+
+/*
+ * Scans the rest of the text for matches in a single pass, returning an array
+ * of the submatches of every match. This is equivalent to (but much faster
+ * than) calling {RE2::Scanner#scan} until it returns `nil`, as the GVL is
+ * released only once for the whole scan and no Ruby objects are created until
+ * it has finished.
+ *
+ * Like {RE2::Scanner#scan}, this consumes the scanner's input: subsequent
+ * calls return an empty array until the scanner is rewound.
+ *
+ * @return [Array<Array<String, nil>>] the submatches of every remaining match
+ * @raise [NoMemoryError] if there was not enough memory to store the matches
+ * @raise [ThreadError] if the scanner is already scanning in another thread
+ * @example
+ *   s = RE2::Regexp.new('(\w+)').scan("Foo bar baz")
+ *   s.scan #=> ["Foo"]
+ *   s.to_a #=> [["bar"], ["baz"]]
+ *   s.to_a #=> []
+ */
+static VALUE re2_scanner_to_a(VALUE self) {
+  re2_count_call(re2_entry_scan);
+
+  re2_scanner *c = unwrap_re2_scanner(self);
+  re2_pattern *p = unwrap_re2_regexp(c->regexp);
+
+  if (c->eof) {
+    return rb_ary_new();
+  }
+
+  re2_scanner_check_scanning(c);
+
+  re2_batch *batch;
+  VALUE wrapper = re2_batch_alloc(&batch);
+
+  re2_scanner_to_a_arg arg;
+  arg.self = self;
+  arg.batch = batch;
+
+  c->scanning = true;
+  VALUE succeeded = rb_ensure(re2_scanner_to_a_body,
+      reinterpret_cast<VALUE>(&arg), re2_scanner_scan_ensure, self);
+
+  if (!RTEST(succeeded)) {
+    rb_raise(rb_eNoMemError, "not enough memory to store matches");
+  }
+
+  int n = c->number_of_capturing_groups;
+  size_t stride = n > 0 ? n : 1;
+  size_t count = batch->matches.size() / stride;
+  RE2::Options::Encoding encoding = p->pattern->options().encoding();
+  VALUE results = rb_ary_new_capa(count);
+
+  for (size_t i = 0; i < count; ++i) {
+    rb_ary_push(results,
+        re2_scanner_result(c, &batch->matches[i * stride], encoding));
+  }
+
+  RB_GC_GUARD(wrapper);
+
+  return results;
+}
+
+static re2::StringPiece *re2_matchdata_find_match(VALUE idx, const VALUE self) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+
+  int id;
+
+  if (RB_INTEGER_TYPE_P(idx)) {
+    id = NUM2INT(idx);
+  } else {
+    if (!SYMBOL_P(idx)) {
+      StringValue(idx);
+    }
+
+    id = re2_regexp_group_index(m->regexp, p, idx);
+    if (id < 0) {
+      return nullptr;
+    }
+  }
+
+  if (id >= 0 && id < m->number_of_matches) {
+    re2::StringPiece *match = &m->matches[id];
+
+    if (match->data() != nullptr) {
+      return match;
+    }
+  }
+
+  return nullptr;
+}
+
+/*
+ * Returns the number of elements in the {RE2::MatchData} (including the
+ * overall match, submatches and any `nils`).
+ *
+ * @return [Integer] the number of elements
+ * @example
+ *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
+ *   m.size   #=> 2
+ *   m.length #=> 2
+ */
+static VALUE re2_matchdata_size(const VALUE self) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+
+  return INT2FIX(m->number_of_matches);
+}
+
+/*
+ * Returns the offset of the start of the nth element of the {RE2::MatchData}.
+ *
+ * @param [Integer, String, Symbol] n the name or number of the submatch
+ * @return [Integer, nil] the offset of the start of the match or `nil` if
+ *   there is no such submatch
+ * @example
+ *   m = RE2::Regexp.new('ob (\d+)').partial_match("bob 123")
+ *   m.begin(0) #=> 1
+ *   m.begin(1) #=> 4
+ */
+static VALUE re2_matchdata_begin(const VALUE self, VALUE n) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+
+  re2::StringPiece *match = re2_matchdata_find_match(n, self);
+  if (match == nullptr) {
+    return Qnil;
+  } else {
+    long offset = match->data() - RSTRING_PTR(m->text);
+
+    return LONG2NUM(rb_str_sublen(m->text, offset));
+  }
+}
+
+/*
+ * Returns the offset of the character following the end of the nth element of
+ * the {RE2::MatchData}.
+ *
+ * @param [Integer, String, Symbol] n the name or number of the match
+ * @return [Integer, nil] the offset of the character following the end of the
+ *   match or `nil` if there is no such match
+ * @example
+ *   m = RE2::Regexp.new('ob (\d+) b').partial_match("bob 123 bob")
+ *   m.end(0) #=> 9
+ *   m.end(1) #=> 7
+ */
+static VALUE re2_matchdata_end(const VALUE self, VALUE n) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+
+  re2::StringPiece *match = re2_matchdata_find_match(n, self);
+  if (match == nullptr) {
+    return Qnil;
+  } else {
+    long offset = (match->data() - RSTRING_PTR(m->text)) + match->size();
+
+    return LONG2NUM(rb_str_sublen(m->text, offset));
+  }
+}
+
+/*
+ * Returns the portion of the original string before the match.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @return [String] the portion of the original string before the match
+ * @example
+ *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123 456")
+ *   m.pre_match #=> "bob "
+ */
+static VALUE re2_matchdata_pre_match(const VALUE self) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+
+  re2::StringPiece *match = &m->matches[0];
+  if (match->data() == nullptr) {
+    return Qnil;
+  }
+
+  long offset = match->data() - RSTRING_PTR(m->text);
+
+  return encoded_str_new(RSTRING_PTR(m->text), offset,
+      p->pattern->options().encoding());
+}
+
+/*
+ * Returns the portion of the original string after the match.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @return [String] the portion of the original string after the match
+ * @example
+ *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123 456")
+ *   m.post_match #=> " 456"
+ */
+static VALUE re2_matchdata_post_match(const VALUE self) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+
+  re2::StringPiece *match = &m->matches[0];
+  if (match->data() == nullptr) {
+    return Qnil;
+  }
+
+  long start = (match->data() - RSTRING_PTR(m->text)) + match->size();
+  long remaining = RSTRING_LEN(m->text) - start;
+
+  return encoded_str_new(RSTRING_PTR(m->text) + start, remaining,
+      p->pattern->options().encoding());
+}
+
+/*
+ * Returns a two-element array containing the beginning and ending offsets of
+ * the nth match.
+ *
+ * @param [Integer, String, Symbol] n the name or number of the match
+ * @return [Array<Integer>, nil] a two-element array with the beginning and
+ *   ending offsets of the match or `nil` if there is no such match
+ * @example
+ *   m = RE2::Regexp.new('ob (\d+)').partial_match("bob 123")
+ *   m.offset(0) #=> [1, 7]
+ *   m.offset(1) #=> [4, 7]
+ */
+static VALUE re2_matchdata_offset(const VALUE self, VALUE n) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+
+  re2::StringPiece *match = re2_matchdata_find_match(n, self);
+  if (match == nullptr) {
+    return Qnil;
+  }
+
+  long start = match->data() - RSTRING_PTR(m->text);
+  long end_pos = start + match->size();
+
+  VALUE array = rb_ary_new2(2);
+  rb_ary_push(array, LONG2NUM(rb_str_sublen(m->text, start)));
+  rb_ary_push(array, LONG2NUM(rb_str_sublen(m->text, end_pos)));
+
+  return array;
+}
+
+/*
+ * Returns the length of the nth match in characters. This is equivalent to
+ * `m[n].length` but without allocating a new string.
+ *
+ * @param [Integer, String, Symbol] n the name or number of the match
+ * @return [Integer, nil] the length of the match or `nil` if there is no such
+ *   match
+ * @example
+ *   m = RE2::Regexp.new('(?P<word>\w+) (?P<number>\d+)').partial_match("alice 123")
+ *   m.match_length(0)       #=> 9
+ *   m.match_length(1)       #=> 5
+ *   m.match_length(:number) #=> 3
+ */
+static VALUE re2_matchdata_match_length(const VALUE self, VALUE n) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+
+  re2::StringPiece *match = re2_matchdata_find_match(n, self);
+  if (match == nullptr) {
+    return Qnil;
+  }
+
+  long start = match->data() - RSTRING_PTR(m->text);
+  long end_pos = start + match->size();
+  long char_len = rb_str_sublen(m->text, end_pos) - rb_str_sublen(m->text, start);
+
+  return LONG2NUM(char_len);
+}
+
+/*
+ * Returns the {RE2::Regexp} used in the match.
+ *
+ * @return [RE2::Regexp] the regular expression used in the match
+ * @example
+ *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
+ *   m.regexp #=> #<RE2::Regexp /(\d+)/>
+ */
+static VALUE re2_matchdata_regexp(const VALUE self) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+
+  return m->regexp;
+}
+
+/*
+ * Returns the {RE2::Regexp} used in the {RE2::Scanner}.
+ *
+ * @return [RE2::Regexp] the regular expression used in the {RE2::Scanner}
+ * @example
+ *   c = RE2::Regexp.new('(\d+)').scan("bob 123")
+ *   c.regexp #=> #<RE2::Regexp /(\d+)/>
+ */
+static VALUE re2_scanner_regexp(const VALUE self) {
+  re2_scanner *c = unwrap_re2_scanner(self);
+
+  return c->regexp;
+}
+
+static VALUE re2_regexp_allocate(VALUE klass) {
+  re2_pattern *p;
+
+  return TypedData_Make_Struct(klass, re2_pattern, &re2_regexp_data_type, p);
+}
+
+/*
+ * Returns the array of matches including the overall match, submatches and any
+ * `nil`s.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @return [Array<String, nil>] the array of matches
+ * @example
+ *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
+ *   m.to_a #=> ["123", "123"]
+ */
+static VALUE re2_matchdata_to_a(const VALUE self) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+
+  VALUE array = rb_ary_new2(m->number_of_matches);
+  for (int i = 0; i < m->number_of_matches; ++i) {
+    re2::StringPiece *match = &m->matches[i];
+
+    if (match->data() == nullptr) {
+      rb_ary_push(array, Qnil);
+    } else {
+      rb_ary_push(array, encoded_str_new(match->data(), match->size(),
+            p->pattern->options().encoding()));
+    }
+  }
+
+  return array;
+}
+
+static VALUE re2_matchdata_nth_match(int nth, const VALUE self) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+
+  if (nth < 0 || nth >= m->number_of_matches) {
+    return Qnil;
+  } else {
+    re2::StringPiece *match = &m->matches[nth];
+
+    if (match->data() == nullptr) {
+      return Qnil;
+    } else {
+      return encoded_str_new(match->data(), match->size(),
+          p->pattern->options().encoding());
+    }
+  }
+}
+
+/* Returns the match for the group with the given name (a string or
+ * symbol), if any.
+ */
+static VALUE re2_matchdata_named_match(const VALUE name, const VALUE self) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+
+  int index = re2_regexp_group_index(m->regexp, p, name);
+
+  if (index >= 0) {
+    return re2_matchdata_nth_match(index, self);
+  } else {
+    return Qnil;
+  }
+}
+
+/*
+ * Retrieve zero, one or more matches by index or name.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @overload [](index)
+ *   Access a particular match by index.
+ *
+ *   @param [Integer] index the index of the match to fetch
+ *   @return [String, nil] the specified match or `nil` if it isn't present
+ *   @example
+ *     m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
+ *     m[0] #=> "123"
+ *
+ * @overload [](start, length)
+ *   Access a range of matches by starting index and length.
+ *
+ *   @param [Integer] start the index from which to start
+ *   @param [Integer] length the number of elements to fetch
+ *   @return [Array<String, nil>] the specified matches
+ *   @example
+ *     m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
+ *     m[0, 1] #=> ["123"]
+ *
+ * @overload [](range)
+ *   Access a range of matches by index.
+ *
+ *   @param [Range] range the range of match indexes to fetch
+ *   @return [Array<String, nil>] the specified matches
+ *   @example
+ *     m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
+ *     m[0..1] #=> ["123", "123"]
+ *
+ * @overload [](name)
+ *   Access a particular match by name.
+ *
+ *   @param [String, Symbol] name the name of the match to fetch
+ *   @return [String, nil] the specific match or `nil` if it isn't present
+ *   @example
+ *     m = RE2::Regexp.new('(?P<number>\d+)').partial_match("bob 123")
+ *     m["number"] #=> "123"
+ *     m[:number]  #=> "123"
+ */
+static VALUE re2_matchdata_aref(int argc, VALUE *argv, const VALUE self) {
+  VALUE idx, rest;
+  rb_scan_args(argc, argv, "11", &idx, &rest);
+
+  if (TYPE(idx) == T_STRING || SYMBOL_P(idx)) {
+    return re2_matchdata_named_match(idx, self);
+  } else if (!NIL_P(rest) || !RB_INTEGER_TYPE_P(idx) || NUM2INT(idx) < 0) {
+    return rb_ary_aref(argc, argv, re2_matchdata_to_a(self));
+  } else {
+    return re2_matchdata_nth_match(NUM2INT(idx), self);
+  }
+}
+
+/*
+ * Returns the entire matched string.
+ *
+ * @return [String] the entire matched string
+ * @example
+ *   m = RE2::Regexp.new('(?P<number>\d+)').partial_match("bob 123")
+ *   m.to_s #=> "123"
+ */
+static VALUE re2_matchdata_to_s(const VALUE self) {
+  return re2_matchdata_nth_match(0, self);
+}
+
+/*
+ * Returns a printable version of the match.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @return [String] a printable version of the match
+ * @example
+ *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
+ *   m.inspect #=> "#<RE2::MatchData \"123\" 1:\"123\">"
+ */
+static VALUE re2_matchdata_inspect(const VALUE self) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+
+  std::ostringstream output;
+  output << "#<RE2::MatchData";
+
+  for (int i = 0; i < m->number_of_matches; ++i) {
+    output << " ";
+
+    if (i > 0) {
+      output << i << ":";
+    }
+
+    VALUE match = re2_matchdata_nth_match(i, self);
+
+    if (match == Qnil) {
+      output << "nil";
+    } else {
+      output << "\"";
+      output.write(RSTRING_PTR(match), RSTRING_LEN(match));
+      output << "\"";
+    }
+  }
+
+  output << ">";
+
+  return encoded_str_new(output.str().data(), output.str().length(),
+      p->pattern->options().encoding());
+}
+
+/*
+ * Returns the array of submatches.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is
+ * undefined).
+ *
+ * @return [Array<String, nil>] the array of submatches
+ * @example
+ *   m = RE2::Regexp.new('(\d+)').partial_match("bob 123")
+ *   m.captures    #=> ["123"]
+ *   m.deconstruct #=> ["123"]
+ *
+ * @example pattern matching
+ *   case RE2::Regexp.new('(\d+) (\d+)').partial_match("bob 123 456")
+ *   in x, y
+ *     puts "Matched #{x} #{y}"
+ *   else
+ *     puts "Unrecognised match"
+ *   end
+ */
+static VALUE re2_matchdata_deconstruct(const VALUE self) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+
+  VALUE array = rb_ary_new2(m->number_of_matches - 1);
+  for (int i = 1; i < m->number_of_matches; ++i) {
+    re2::StringPiece *match = &m->matches[i];
+
+    if (match->data() == nullptr) {
+      rb_ary_push(array, Qnil);
+    } else {
+      rb_ary_push(array, encoded_str_new(match->data(), match->size(),
+            p->pattern->options().encoding()));
+    }
+  }
+
+  return array;
+}
+
+/*
+ * Returns a hash of capturing group names to submatches for pattern matching.
+ *
+ * As this is used by Ruby's pattern matching, it will return an empty hash if given
+ * more keys than there are capturing groups. Given keys will populate the hash in
+ * order but an invalid name will cause the hash to be immediately returned.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @return [Hash] a hash of capturing group names to submatches
+ * @param [Array<Symbol>, nil] keys an array of `Symbol` capturing group names
+ *   or `nil` to return all names
+ * @example
+ *   m = RE2::Regexp.new('(?P<numbers>\d+) (?P<letters>[a-zA-Z]+)').partial_match('123 abc')
+ *   m.deconstruct_keys(nil)                #=> {numbers: "123", letters: "abc"}
+ *   m.deconstruct_keys([:numbers])         #=> {numbers: "123"}
+ *   m.deconstruct_keys([:fruit])           #=> {}
+ *   m.deconstruct_keys([:letters, :fruit]) #=> {letters: "abc"}
+ *
+ * @example pattern matching
+ *   case RE2::Regexp.new('(?P<numbers>\d+) (?P<letters>[a-zA-Z]+)').partial_match('123 abc')
+ *   in numbers:, letters:
+ *     puts "Numbers: #{numbers}, letters: #{letters}"
+ *   else
+ *     puts "Unrecognised match"
+ *   end
+ */
+static VALUE re2_matchdata_deconstruct_keys(const VALUE self, const VALUE keys) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+
+  VALUE capturing_groups = rb_hash_new();
+
+  if (NIL_P(keys)) {
+    VALUE groups = re2_regexp_groups(m->regexp, p);
+    VALUE symbols = RARRAY_AREF(groups, re2_group_symbols);
+    VALUE indices = RARRAY_AREF(groups, re2_group_indices);
+
+    for (long i = 0; i < RARRAY_LEN(symbols); ++i) {
+      rb_hash_aset(capturing_groups, RARRAY_AREF(symbols, i),
+          re2_matchdata_nth_match(FIX2INT(RARRAY_AREF(indices, i)), self));
+    }
+  } else {
+    Check_Type(keys, T_ARRAY);
+
+    if (p->pattern->NumberOfCapturingGroups() >= RARRAY_LEN(keys)) {
+      for (int i = 0; i < RARRAY_LEN(keys); ++i) {
+        VALUE key = rb_ary_entry(keys, i);
+        Check_Type(key, T_SYMBOL);
+        int index = re2_regexp_group_index(m->regexp, p, key);
+
+        if (index >= 0) {
+          rb_hash_aset(capturing_groups, key, re2_matchdata_nth_match(index, self));
+        } else {
+          break;
+        }
+      }
+    }
+  }
+
+  return capturing_groups;
+}
+
+/*
+ * Returns a hash of capturing group names to matched strings.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @overload named_captures
+ *   Returns a hash with string keys.
+ *
+ *   @return [Hash] a hash of capturing group names to matching strings
+ *   @example
+ *     m = RE2::Regexp.new('(?P<numbers>\d+) (?P<letters>[a-zA-Z]+)').partial_match('123 abc')
+ *     m.named_captures #=> {"numbers" => "123", "letters" => "abc"}
+ *
+ * @overload named_captures(symbolize_names:)
+ *   Returns a hash with string or symbol keys.
+ *
+ *   @param [Boolean] symbolize_names whether to return group names as symbols
+ *   @return [Hash] a hash of capturing group names to matching strings
+ *   @example
+ *     m = RE2::Regexp.new('(?P<numbers>\d+) (?P<letters>[a-zA-Z]+)').partial_match('123 abc')
+ *     m.named_captures
+ *     #=> {"numbers" => "123", "letters" => "abc"}
+ *     m.named_captures(symbolize_names: true) #=> {numbers: "123", letters: "abc"}
+ */
+static VALUE re2_matchdata_named_captures(int argc, VALUE *argv, const VALUE self) {
+  VALUE opts;
+  rb_scan_args(argc, argv, "0:", &opts);
+
+  bool symbolize = false;
+  if (!NIL_P(opts)) {
+    VALUE sym = rb_hash_aref(opts, ID2SYM(id_symbolize_names));
+    symbolize = RTEST(sym);
+  }
+
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+  re2_pattern *p = unwrap_re2_regexp(m->regexp);
+
+  VALUE groups = re2_regexp_groups(m->regexp, p);
+  VALUE keys = RARRAY_AREF(groups,
+      symbolize ? re2_group_symbols : re2_group_names);
+  VALUE indices = RARRAY_AREF(groups, re2_group_indices);
+  VALUE result = rb_hash_new();
+
+  for (long i = 0; i < RARRAY_LEN(keys); ++i) {
+    rb_hash_aset(result, RARRAY_AREF(keys, i),
+        re2_matchdata_nth_match(FIX2INT(RARRAY_AREF(indices, i)), self));
+  }
+
+  return result;
+}
+
+/*
+ * Returns an array of names of named capturing groups. Names are returned in
+ * alphabetical order rather than definition order, as RE2 stores named groups
+ * internally in a sorted map.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @return [Array<String>] an array of names of named capturing groups
+ * @example
+ *   m = RE2::Regexp.new('(?P<numbers>\d+) (?P<letters>[a-zA-Z]+)').partial_match('123 abc')
+ *   m.names #=> ["letters", "numbers"]
+ */
+static VALUE re2_matchdata_names(const VALUE self) {
+  re2_matchdata *m = unwrap_re2_matchdata(self);
+
+  return re2_regexp_names(m->regexp);
+}
+
+/*
+ * Returns an array of match values at the given indices or names.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @param [Integer, String, Symbol] indexes the indices or names of
+ *   the matches to fetch
+ * @return [Array<String, nil>] the values at the given indices or names
+ * @example
+ *   m = RE2::Regexp.new('(?P<a>\d+) (?P<b>\d+)').partial_match("123 456")
+ *   m.values_at(1, 2)   #=> ["123", "456"]
+ *   m.values_at(:a, :b) #=> ["123", "456"]
+ *   m.values_at(1, :b)  #=> ["123", "456"]
+ */
+static VALUE re2_matchdata_values_at(int argc, VALUE *argv, const VALUE self) {
+  unwrap_re2_matchdata(self);
+
+  VALUE result = rb_ary_new2(argc);
+
+  for (int i = 0; i < argc; ++i) {
+    VALUE idx = argv[i];
+
+    if (TYPE(idx) == T_STRING || SYMBOL_P(idx)) {
+      rb_ary_push(result, re2_matchdata_named_match(idx, self));
+    } else {
+      rb_ary_push(result, re2_matchdata_nth_match(NUM2INT(idx), self));
+    }
+  }
+
+  return result;
+}
+
+static VALUE re2_matchdata_initialize_copy(VALUE self, VALUE other) {
+  if (self == other) return self;
+
+  re2_matchdata *self_m;
+  re2_matchdata *other_m = unwrap_re2_matchdata(other);
+
+  TypedData_Get_Struct(self, re2_matchdata, &re2_matchdata_data_type, self_m);
+  rb_check_frozen(self);
+  re2_matchdata_check_matching(self_m);
+
+  if (self_m->matches) {
+    delete[] self_m->matches;
+    self_m->matches = nullptr;
+    self_m->capacity = 0;
+  }
+
+  self_m->number_of_matches = other_m->number_of_matches;
+  RB_OBJ_WRITE(self, &self_m->regexp, other_m->regexp);
+  RB_OBJ_WRITE(self, &self_m->text, other_m->text);
+
+  if (other_m->matches) {
+    self_m->matches = new(std::nothrow) re2::StringPiece[other_m->number_of_matches];
+    if (self_m->matches == nullptr) {
+      rb_raise(rb_eNoMemError,
+               "not enough memory to allocate StringPiece for matches");
+    }
+    for (int i = 0; i < other_m->number_of_matches; ++i) {
+      self_m->matches[i] = other_m->matches[i];
+    }
+    self_m->capacity = other_m->number_of_matches;
+  } else {
+    self_m->matches = nullptr;
+  }
+
+  return self;
+}
+
+/*
+ * Shorthand to compile a new {RE2::Regexp}.
+ *
+ * @see RE2::Regexp#initialize
+ */
+static VALUE re2_re2(int argc, VALUE *argv, VALUE) {
+  return rb_class_new_instance(argc, argv, re2_cRegexp);
+}
+
+/*
+ * Returns a new {RE2::Regexp} object with a compiled version of
+ * `pattern` stored inside.
+ *
+ * @overload initialize(pattern)
+ *   Returns a new {RE2::Regexp} object with a compiled version of
+ *   `pattern` stored inside with the default options.
+ *
+ *   @param [String] pattern the pattern to compile
+ *   @return [RE2::Regexp] a {RE2::Regexp} with the specified pattern
+ *   @raise [TypeError] if the given pattern can't be coerced to a `String`
+ *   @raise [NoMemoryError] if memory could not be allocated for the compiled
+ *     pattern
+ *
+ * @overload initialize(pattern, options)
+ *   Returns a new {RE2::Regexp} object with a compiled version of
+ *   `pattern` stored inside with the specified options.
+ *
+ *   @param [String] pattern the pattern to compile
+ *   @param [Hash] options the options with which to compile the pattern
+ *   @option options [Boolean] :utf8 (true) text and pattern are UTF-8; otherwise Latin-1
+ *   @option options [Boolean] :posix_syntax (false) restrict regexps to POSIX egrep syntax
+ *   @option options [Boolean] :longest_match (false) search for longest match, not first match
+ *   @option options [Boolean] :log_errors (true) log syntax and execution errors to ERROR
+ *   @option options [Integer] :max_mem approx. max memory footprint of RE2
+ *   @option options [Boolean] :literal (false) interpret string as literal, not regexp
+ *   @option options [Boolean] :never_nl (false) never match `\n`, even if it is in regexp
+ *   @option options [Boolean] :case_sensitive (true) match is case-sensitive (regexp can override with `(?i)` unless in `posix_syntax` mode)
+ *   @option options [Boolean] :perl_classes (false) allow Perl's `\d` `\s` `\w` `\D` `\S` `\W` when in `posix_syntax` mode
+ *   @option options [Boolean] :word_boundary (false) allow `\b` `\B` (word boundary and not) when in `posix_syntax` mode
+ *   @option options [Boolean] :one_line (false) `^` and `$` only match beginning and end of text when in `posix_syntax` mode
+ *   @option options [Boolean] :lazy (false) defer compiling the pattern until the regexp is first used (including by {RE2::Regexp#ok?} and {RE2::Regexp#error}), e.g. to avoid compiling patterns loaded at boot that may never be used
+ *   @return [RE2::Regexp] a {RE2::Regexp} with the specified pattern and options
+ *   @raise [TypeError] if the given pattern can't be coerced to a `String`
+ *   @raise [NoMemoryError] if memory could not be allocated for the compiled pattern
+ *   @example
+ *     re = RE2::Regexp.new('(\w+)@example\.com', lazy: true)
+ *     re.match?("bob@example.com") # compiles the pattern
+ */
+static VALUE re2_regexp_initialize(int argc, VALUE *argv, VALUE self) {
+  VALUE pattern, options;
+  re2_pattern *p;
+
+  rb_scan_args(argc, argv, "11", &pattern, &options);
+
+  /* Ensure pattern is a string and cannot change while compiling. */
+  StringValue(pattern);
+  pattern = rb_str_new_frozen(pattern);
+
+  TypedData_Get_Struct(self, re2_pattern, &re2_regexp_data_type, p);
+
+  rb_check_frozen(self);
+
+  RE2::Options re2_options;
+  bool lazy = false;
+
+  if (RTEST(options)) {
+    parse_re2_options(&re2_options, options);
+
+    lazy = RTEST(rb_hash_aref(options, ID2SYM(id_lazy)));
+  }
+
+  if (lazy) {
+    /* Defer compiling until first use, keeping copies of the pattern and
+     * options until then.
+     */
+    RE2::Options *lazy_options = new(std::nothrow) RE2::Options(re2_options);
+    if (lazy_options == nullptr) {
+      rb_raise(rb_eNoMemError, "not enough memory to allocate RE2::Options object");
+    }
+
+    std::string *source = new(std::nothrow) std::string(
+        RSTRING_PTR(pattern), RSTRING_LEN(pattern));
+    if (source == nullptr) {
+      delete lazy_options;
+      rb_raise(rb_eNoMemError, "not enough memory to allocate pattern");
+    }
+
+    p->options = lazy_options;
+    p->source = source;
+    rb_obj_freeze(self);
+
+    return self;
+  }
+
+  RE2 *compiled;
+  if (RTEST(options)) {
+    compiled = re2_compile_without_gvl(pattern, &re2_options);
+  } else {
+    compiled = re2_compile_without_gvl(pattern, nullptr);
+  }
+
+  if (compiled == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate RE2 object");
+  }
+
+  /* Only replace the pattern once compiled (and with the GVL held) so other
+   * threads never see a partially constructed one, unless another thread
+   * finished initializing this regexp first.
+   */
+  if (OBJ_FROZEN(self)) {
+    delete compiled;
+    rb_check_frozen(self);
+  }
+
+  re2_regexp_set_pattern(p, compiled);
+
+  rb_obj_freeze(self);
+
+  return self;
+}
+
+static VALUE re2_regexp_initialize_copy(VALUE self, VALUE other) {
+  re2_pattern *self_p;
+  re2_pattern *other_p = unwrap_re2_regexp(other);
+
+  TypedData_Get_Struct(self, re2_pattern, &re2_regexp_data_type, self_p);
+
+  rb_check_frozen(self);
+
+  /* The other regexp is frozen so its pattern and options cannot change while
+   * compiling.
+   */
+  nogvl_compile_arg arg;
+  arg.pattern = other_p->pattern->pattern();
+  arg.options = &other_p->pattern->options();
+
+  RE2 *compiled = re2_compile_arg_without_gvl(&arg);
+  RB_GC_GUARD(other);
+
+  if (compiled == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate RE2 object");
+  }
+
+  if (OBJ_FROZEN(self)) {
+    delete compiled;
+    rb_check_frozen(self);
+  }
+
+  re2_regexp_set_pattern(self_p, compiled);
+
+  rb_obj_freeze(self);
+
+  return self;
+}
+
+/* Returns a key identifying a pattern by its options and source. */
+static std::string re2_regexp_key(const re2_pattern *p) {
+  std::string key = re2_options_key(re2_pattern_options(p));
+  re2::StringPiece source = re2_pattern_source(p);
+  key.append(source.data(), source.size());
+
+  return key;
+}
+
+/*
+ * Returns an interned, frozen {RE2::Regexp} for the given pattern and options
+ * from a process-wide registry, only compiling the pattern if it isn't already
+ * registered.
+ *
+ * The registry is bounded by the total {RE2::Regexp#program_size} of its
+ * entries (see {RE2::Regexp.cache_capacity}), evicting the least recently used
+ * regexps when full. Returned regexps are shareable between Ractors.
+ *
+ * @param [String] pattern the pattern to compile
+ * @param [Hash] options the options with which to compile the pattern (see
+ *   {RE2::Regexp#initialize})
+ * @return [RE2::Regexp] a compiled, frozen {RE2::Regexp}
+ * @raise [TypeError] if the given pattern can't be coerced to a `String`
+ * @raise [ArgumentError] if given non-hash options
+ * @raise [NoMemoryError] if memory could not be allocated for the compiled
+ *   pattern
+ * @example
+ *   re = RE2::Regexp.cached('(\d+)')
+ *   re.equal?(RE2::Regexp.cached('(\d+)')) #=> true
+ */
+static VALUE re2_regexp_cached(int argc, VALUE *argv, VALUE) {
+  VALUE pattern, options;
+  rb_scan_args(argc, argv, "11", &pattern, &options);
+
+  StringValue(pattern);
+  pattern = rb_str_new_frozen(pattern);
+
+  RE2::Options re2_options;
+  if (RTEST(options)) {
+    parse_re2_options(&re2_options, options);
+  }
+
+  std::string key = re2_options_key(re2_options);
+  key.append(RSTRING_PTR(pattern), RSTRING_LEN(pattern));
+
+  VALUE regexp = regexp_registry.lookup(key);
+  if (regexp != Qundef) {
+    return regexp;
+  }
+
+  VALUE args[2] = {pattern, options};
+  regexp = rb_class_new_instance(RTEST(options) ? 2 : 1, args, re2_cRegexp);
+  rb_ractor_make_shareable(regexp);
+
+  re2_pattern *p = unwrap_re2_regexp(regexp);
+  int program_size = p->pattern->ok() ? p->pattern->ProgramSize() : 0;
+  size_t cost = program_size > 0 ? static_cast<size_t>(program_size) : 1;
+
+  return regexp_registry.insert(key, regexp, cost);
+}
+
+/*
+ * Returns the capacity of the registry used by {RE2::Regexp.cached}, measured
+ * as the total {RE2::Regexp#program_size} of all registered regexps.
+ *
+ * @return [Integer] the capacity of the registry
+ * @example
+ *   RE2::Regexp.cache_capacity #=> 1000000
+ */
+static VALUE re2_regexp_cache_capacity(VALUE) {
+  return SIZET2NUM(regexp_registry.capacity());
+}
+
+/*
+ * Sets the capacity of the registry used by {RE2::Regexp.cached}, measured as
+ * the total {RE2::Regexp#program_size} of all registered regexps, evicting the
+ * least recently used regexps if necessary.
+ *
+ * @param [Integer] capacity the maximum total program size to keep
+ * @return [Integer] the new capacity
+ * @raise [ArgumentError] if given a negative capacity
+ * @example
+ *   RE2::Regexp.cache_capacity = 50_000
+ */
+static VALUE re2_regexp_cache_capacity_set(VALUE, VALUE capacity) {
+  ssize_t value = NUM2SSIZET(capacity);
+
+  if (value < 0) {
+    rb_raise(rb_eArgError, "capacity should be >= 0");
+  }
+
+  regexp_registry.set_capacity(static_cast<size_t>(value));
+
+  return capacity;
+}
+
+/*
+ * Returns statistics for the registry used by {RE2::Regexp.cached}.
+ *
+ * @return [Hash] the number of registered regexps (`:size`), their total
+ *   program size (`:cost`), the registry's `:capacity` and the number of
+ *   `:hits`, `:misses` and `:evictions`
+ * @example
+ *   RE2::Regexp.cached('(\d+)')
+ *   RE2::Regexp.cached('(\d+)')
+ *   RE2::Regexp.cache_stats
+ *   #=> {size: 1, cost: 9, capacity: 1000000, hits: 1, misses: 1, evictions: 0}
+ */
+static VALUE re2_regexp_cache_stats(VALUE) {
+  size_t size, cost, capacity;
+  uint64_t hits, misses, evictions;
+  regexp_registry.stats(&size, &cost, &capacity, &hits, &misses, &evictions);
+
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(id_size), SIZET2NUM(size));
+  rb_hash_aset(stats, ID2SYM(id_cost), SIZET2NUM(cost));
+  rb_hash_aset(stats, ID2SYM(id_capacity), SIZET2NUM(capacity));
+  rb_hash_aset(stats, ID2SYM(id_hits), ULL2NUM(hits));
+  rb_hash_aset(stats, ID2SYM(id_misses), ULL2NUM(misses));
+  rb_hash_aset(stats, ID2SYM(id_evictions), ULL2NUM(evictions));
+
+  return stats;
+}
+
+/*
+ * Removes all regexps from the registry used by {RE2::Regexp.cached} and
+ * resets its counters.
+ *
+ * @return [nil]
+ */
+static VALUE re2_regexp_clear_cache(VALUE) {
+  regexp_registry.clear();
+
+  return Qnil;
+}
+
+/*
+ * Returns a hash code based on the pattern and options of the regular
+ * expression so that equivalent regexps can be used as the same `Hash` key.
+ *
+ * @return [Integer] the hash code
+ * @example
+ *   RE2::Regexp.new('(\d+)').hash == RE2::Regexp.new('(\d+)').hash #=> true
+ */
+static VALUE re2_regexp_hash(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+  std::string key = re2_regexp_key(p);
+
+  return ST2FIX(rb_memhash(key.data(), key.size()));
+}
+
+/*
+ * Returns whether the given object is an {RE2::Regexp} with the same pattern
+ * and options.
+ *
+ * @param [Object] other the object to compare
+ * @return [Boolean] whether the regexps are equivalent
+ * @example
+ *   RE2::Regexp.new('(\d+)') == RE2::Regexp.new('(\d+)')                   #=> true
+ *   RE2::Regexp.new('(\d+)') == RE2::Regexp.new('(\d+)', utf8: false)      #=> false
+ *   RE2::Regexp.new('(\d+)').eql?(RE2::Regexp.new('(\d+)', utf8: true))    #=> true
+ */
+static VALUE re2_regexp_eql(const VALUE self, VALUE other) {
+  if (self == other) {
+    return Qtrue;
+  }
+
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+
+  if (!rb_obj_is_kind_of(other, re2_cRegexp)) {
+    return Qfalse;
+  }
+
+  re2_pattern *other_p;
+  TypedData_Get_Struct(other, re2_pattern, &re2_regexp_data_type, other_p);
+  if (!other_p->pattern && !other_p->source) {
+    return Qfalse;
+  }
+
+  return BOOL2RUBY(re2_regexp_key(p) == re2_regexp_key(other_p));
+}
+
+/*
+ * Returns a printable version of the regular expression.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is
+ * undefined).
+ *
+ * @return [String] a printable version of the regular expression
+ * @example
+ *   re2 = RE2::Regexp.new("woo?")
+ *   re2.inspect #=> "#<RE2::Regexp /woo?/>"
+ */
+static VALUE re2_regexp_inspect(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+
+  std::ostringstream output;
+
+  output << "#<RE2::Regexp /" << re2_pattern_source(p) << "/>";
+
+  return encoded_str_new(output.str().data(), output.str().length(),
+      re2_pattern_options(p).encoding());
+}
+
+/*
+ * Returns a string version of the regular expression.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @return [String] a string version of the regular expression
+ * @example
+ *   re2 = RE2::Regexp.new("woo?")
+ *   re2.to_s #=> "woo?"
+ */
+static VALUE re2_regexp_to_s(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+  re2::StringPiece source = re2_pattern_source(p);
+
+  return encoded_str_new(source.data(), source.size(),
+      re2_pattern_options(p).encoding());
+}
+
+/*
+ * Returns whether or not the regular expression was compiled successfully.
+ *
+ * @return [Boolean] whether or not compilation was successful
+ * @example
+ *   re2 = RE2::Regexp.new("woo?")
+ *   re2.ok? #=> true
+ */
+static VALUE re2_regexp_ok(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  return BOOL2RUBY(p->pattern->ok());
+}
+
+/*
+ * Returns whether or not the regular expression was compiled with the `utf8`
+ * option set to `true`.
+ *
+ * @return [Boolean] the `utf8` option
+ * @example
+ *   re2 = RE2::Regexp.new("woo?", utf8: true)
+ *   re2.utf8? #=> true
+ */
+static VALUE re2_regexp_utf8(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+
+  return BOOL2RUBY(re2_pattern_options(p).encoding() == RE2::Options::EncodingUTF8);
+}
+
+/*
+ * Returns whether or not the regular expression was compiled with the
+ * `posix_syntax` option set to `true`.
+ *
+ * @return [Boolean] the `posix_syntax` option
+ * @example
+ *   re2 = RE2::Regexp.new("woo?", posix_syntax: true)
+ *   re2.posix_syntax? #=> true
+ */
+static VALUE re2_regexp_posix_syntax(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+
+  return BOOL2RUBY(re2_pattern_options(p).posix_syntax());
+}
+
+/*
+ * Returns whether or not the regular expression was compiled with the
+ * `longest_match` option set to `true`.
+ *
+ * @return [Boolean] the `longest_match` option
+ * @example
+ *   re2 = RE2::Regexp.new("woo?", longest_match: true)
+ *   re2.longest_match? #=> true
+ */
+static VALUE re2_regexp_longest_match(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+
+  return BOOL2RUBY(re2_pattern_options(p).longest_match());
+}
+
+/*
+ * Returns whether or not the regular expression was compiled with the
+ * `log_errors` option set to `true`.
+ *
+ * @return [Boolean] the `log_errors` option
+ * @example
+ *   re2 = RE2::Regexp.new("woo?", log_errors: true)
+ *   re2.log_errors? #=> true
+ */
+static VALUE re2_regexp_log_errors(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+
+  return BOOL2RUBY(re2_pattern_options(p).log_errors());
+}
+
+/*
+ * Returns the `max_mem` setting for the regular expression.
+ *
+ * @return [Integer] the `max_mem` option
+ * @example
+ *   re2 = RE2::Regexp.new("woo?", max_mem: 1024)
+ *   re2.max_mem #=> 1024
+ */
+static VALUE re2_regexp_max_mem(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+
+  return INT2FIX(re2_pattern_options(p).max_mem());
+}
+
+/*
+ * Returns whether or not the regular expression was compiled with the
+ * `literal` option set to `true`.
+ *
+ * @return [Boolean] the `literal` option
+ * @example
+ *   re2 = RE2::Regexp.new("woo?", literal: true)
+ *   re2.literal? #=> true
+ */
+static VALUE re2_regexp_literal(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+
+  return BOOL2RUBY(re2_pattern_options(p).literal());
+}
+
+/*
+ * Returns whether or not the regular expression was compiled with the
+ * `never_nl` option set to `true`.
+ *
+ * @return [Boolean] the `never_nl` option
+ * @example
+ *   re2 = RE2::Regexp.new("woo?", never_nl: true)
+ *   re2.never_nl? #=> true
+ */
+static VALUE re2_regexp_never_nl(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+
+  return BOOL2RUBY(re2_pattern_options(p).never_nl());
+}
+
+/*
+ * Returns whether or not the regular expression was compiled with the
+ * `case_sensitive` option set to `true`.
+ *
+ * @return [Boolean] the `case_sensitive` option
+ * @example
+ *   re2 = RE2::Regexp.new("woo?", case_sensitive: true)
+ *   re2.case_sensitive? #=> true
+ */
+static VALUE re2_regexp_case_sensitive(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+
+  return BOOL2RUBY(re2_pattern_options(p).case_sensitive());
+}
+
+/*
+ * Returns whether or not the regular expression was compiled with the
+ * `case_sensitive` option set to `false`.
+ *
+ * @return [Boolean] the inverse of the `case_sensitive` option
+ * @example
+ *   re2 = RE2::Regexp.new("woo?", case_sensitive: true)
+ *   re2.case_insensitive? #=> false
+ *   re2.casefold?         #=> false
+ */
+static VALUE re2_regexp_case_insensitive(const VALUE self) {
+  return BOOL2RUBY(re2_regexp_case_sensitive(self) != Qtrue);
+}
+
+/*
+ * Returns whether or not the regular expression was compiled with the
+ * perl_classes option set to `true`.
+ *
+ * @return [Boolean] the `perl_classes` option
+ * @example
+ *   re2 = RE2::Regexp.new("woo?", perl_classes: true)
+ *   re2.perl_classes? #=> true
+ */
+static VALUE re2_regexp_perl_classes(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+
+  return BOOL2RUBY(re2_pattern_options(p).perl_classes());
+}
+
+/*
+ * Returns whether or not the regular expression was compiled with the
+ * `word_boundary` option set to `true`.
+ *
+ * @return [Boolean] the `word_boundary` option
+ * @example
+ *   re2 = RE2::Regexp.new("woo?", word_boundary: true)
+ *   re2.word_boundary? #=> true
+ */
+static VALUE re2_regexp_word_boundary(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+
+  return BOOL2RUBY(re2_pattern_options(p).word_boundary());
+}
+
+/*
+ * Returns whether or not the regular expression was compiled with the
+ * `one_line` option set to `true`.
+ *
+ * @return [Boolean] the `one_line` option
+ * @example
+ *   re2 = RE2::Regexp.new("woo?", one_line: true)
+ *   re2.one_line? #=> true
+ */
+static VALUE re2_regexp_one_line(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+
+  return BOOL2RUBY(re2_pattern_options(p).one_line());
+}
+
+/*
+ * If the {RE2::Regexp} could not be created properly, returns an error string
+ * otherwise returns `nil`.
+ *
+ * @return [String, nil] the error string or `nil`
+ */
+static VALUE re2_regexp_error(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  if (p->pattern->ok()) {
+    return Qnil;
+  } else {
+    return rb_str_new(p->pattern->error().data(), p->pattern->error().size());
+  }
+}
+
+/*
+ * If the {RE2::Regexp} could not be created properly, returns
+ * the offending portion of the regexp otherwise returns `nil`.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @return [String, nil] the offending portion of the regexp or `nil`
+ */
+static VALUE re2_regexp_error_arg(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  if (p->pattern->ok()) {
+    return Qnil;
+  } else {
+    return encoded_str_new(p->pattern->error_arg().data(),
+        p->pattern->error_arg().size(),
+        p->pattern->options().encoding());
+  }
+}
+
+/*
+ * Returns the program size, a very approximate measure
+ * of a regexp's "cost". Larger numbers are more expensive
+ * than smaller numbers.
+ *
+ * @return [Integer] the regexp "cost"
+ */
+static VALUE re2_regexp_program_size(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  return INT2FIX(p->pattern->ProgramSize());
+}
+
+/* Returns a snapshot of the given stats as a Hash. */
+static VALUE re2_stats_to_hash(const re2_stats *stats) {
+  VALUE histogram = rb_ary_new_capa(re2_stats::buckets);
+  for (int i = 0; i < re2_stats::buckets; ++i) {
+    rb_ary_push(histogram,
+        ULL2NUM(stats->histogram[i].load(std::memory_order_relaxed)));
+  }
+
+  VALUE hash = rb_hash_new();
+  rb_hash_aset(hash, ID2SYM(id_calls),
+      ULL2NUM(stats->calls.load(std::memory_order_relaxed)));
+  rb_hash_aset(hash, ID2SYM(id_bytes),
+      ULL2NUM(stats->bytes.load(std::memory_order_relaxed)));
+  rb_hash_aset(hash, ID2SYM(id_hits),
+      ULL2NUM(stats->hits.load(std::memory_order_relaxed)));
+  rb_hash_aset(hash, ID2SYM(id_misses),
+      ULL2NUM(stats->misses.load(std::memory_order_relaxed)));
+  rb_hash_aset(hash, ID2SYM(id_nanoseconds),
+      ULL2NUM(stats->nanoseconds.load(std::memory_order_relaxed)));
+  rb_hash_aset(hash, ID2SYM(id_histogram), histogram);
+
+  return hash;
+}
+
+/*
+ * Starts counting calls to {RE2::Regexp#match} (and the methods built on it
+ * such as {RE2::Regexp#match?} and {RE2::Regexp#===}) for this regexp, along
+ * with the bytes searched and how long matching took, to be read with
+ * {RE2::Regexp#stats}. Use {RE2.instrument=} to instrument every regexp.
+ *
+ * This does not modify the regexp so works on frozen and shared regexps.
+ *
+ * @return [RE2::Regexp] the regexp
+ * @raise [NoMemoryError] if there was not enough memory to store the counters
+ * @example
+ *   re = RE2::Regexp.new('w(o)(o)').instrument!
+ *   re.match?("woo")
+ *   re.stats[:calls] #=> 1
+ */
+static VALUE re2_regexp_instrument(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  if (re2_stats_fetch(&p->stats, true) == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate stats");
+  }
+
+  return self;
+}
+
+/*
+ * Returns whether matches against this regexp are being counted, either
+ * because of {RE2::Regexp#instrument!} or {RE2.instrument=}.
+ *
+ * @return [Boolean] whether the regexp is instrumented
+ */
+static VALUE re2_regexp_instrumented_p(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  return BOOL2RUBY(p->stats.load(std::memory_order_acquire) ||
+      instrument_all.load(std::memory_order_relaxed));
+}
+
+/*
+ * Returns the counters collected since the regexp was instrumented: the
+ * number of match `:calls`, `:bytes` searched, `:hits` and `:misses`, the
+ * total `:nanoseconds` spent matching (outside of the GVL) and a
+ * `:histogram` of call durations where the `i`th element counts calls that
+ * took between `2**i` and `2**(i + 1)` nanoseconds.
+ *
+ * @return [Hash, nil] the counters or `nil` if the regexp is not instrumented
+ * @example
+ *   re = RE2::Regexp.new('w(o)(o)').instrument!
+ *   re.match?("woo")
+ *   re.stats
+ *   #=> {:calls=>1, :bytes=>3, :hits=>1, :misses=>0, :nanoseconds=>541, :histogram=>[0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, ...]}
+ */
+static VALUE re2_regexp_stats(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp(self);
+  re2_stats *stats = p->stats.load(std::memory_order_acquire);
+
+  if (stats == nullptr) {
+    return Qnil;
+  }
+
+  return re2_stats_to_hash(stats);
+}
+
+/* Warms the given regexp or set with an array of sample texts, returning a
+ * hash describing the samples and how long matching them took.
+ */
+static VALUE re2_warm(const RE2 *pattern, const RE2::Set *set,
+    VALUE samples) {
+  re2_batch *batch;
+  VALUE wrapper = re2_batch_new(samples, &batch);
+  batch->failed = false;
+
+  nogvl_warm_arg arg;
+  arg.pattern = pattern;
+  arg.set = set;
+  arg.batch = batch;
+  arg.matches = 0;
+  arg.nanoseconds[0] = arg.nanoseconds[1] = 0;
+  arg.out_of_memory = false;
+
+  /* RE2 logs an error every time an invalid pattern is matched. */
+  size_t bytes = re2_batch_bytes(batch->pieces);
+  if (pattern == nullptr || pattern->ok()) {
+    re2_call_without_gvl(nogvl_warm, &arg, bytes);
+  }
+
+  if (batch->failed) {
+    rb_raise(rb_eNoMemError, "not enough memory to warm");
+  }
+
+  VALUE result = rb_hash_new();
+  rb_hash_aset(result, ID2SYM(id_samples), SIZET2NUM(batch->pieces.size()));
+  rb_hash_aset(result, ID2SYM(id_bytes), SIZET2NUM(bytes));
+  rb_hash_aset(result, ID2SYM(id_matches), SIZET2NUM(arg.matches));
+  rb_hash_aset(result, ID2SYM(id_cold_nanoseconds),
+      ULL2NUM(arg.nanoseconds[0]));
+  rb_hash_aset(result, ID2SYM(id_warm_nanoseconds),
+      ULL2NUM(arg.nanoseconds[1]));
+  if (set) {
+    rb_hash_aset(result, ID2SYM(id_out_of_memory),
+        BOOL2RUBY(arg.out_of_memory));
+  }
+  RB_GC_GUARD(wrapper);
+
+  return result;
+}
+
+/*
+ * Matches each of the given sample texts against the regexp ahead of time so
+ * that the DFA states they need are already built, e.g. in a preforking
+ * server's parent process before it forks. Child processes then share those
+ * states with the parent instead of each building (and writing to) their own
+ * copy on their first requests. A regexp created with `lazy: true` is also
+ * compiled. Samples are not matched against an invalid pattern.
+ *
+ * RE2 does not expose how many DFA states it builds so the samples are
+ * matched twice: comparing the `:cold_nanoseconds` taken by the first pass
+ * with the `:warm_nanoseconds` taken by the second shows how much work was
+ * saved. Samples are matched without the GVL and are not counted by
+ * {RE2::Regexp#stats}. DFA states are bounded by `max_mem` and RE2 may
+ * discard them if it runs out so representative samples are better than
+ * many.
+ *
+ * @param [Array<String>] samples the texts to match
+ * @return [Hash] the number of `:samples`, their total `:bytes`, how many
+ *   `:matches` there were and the `:cold_nanoseconds` and
+ *   `:warm_nanoseconds` each pass took
+ * @raise [TypeError] if the samples are not an array of strings
+ * @raise [NoMemoryError] if there was not enough memory to match the samples
+ * @example
+ *   re = RE2::Regexp.new('(\w+)@example\.com')
+ *   re.warm!(["alice@example.com", "no email here"])
+ *   #=> {:samples=>2, :bytes=>30, :matches=>1, :cold_nanoseconds=>10292, :warm_nanoseconds=>1042}
+ */
+static VALUE re2_regexp_warm(const VALUE self, VALUE samples) {
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  return re2_warm(p->pattern, nullptr, samples);
+}
+
+/*
+ * Returns an estimate of the memory held by the compiled pattern outside of
+ * Ruby's heap, as reported to the GC and by `ObjectSpace.memsize_of`.
+ *
+ * The estimate covers the pattern and its compiled program. RE2 also builds a
+ * reverse program and DFA caches on demand while matching: these are not
+ * included but are bounded by `max_mem`.
+ *
+ * @return [Hash] the `:program_size` (see {RE2::Regexp#program_size}),
+ *   `:pattern_bytes`, `:estimated_bytes` and `:max_mem`
+ * @example
+ *   RE2::Regexp.new('w(o)(o)').memory_stats
+ *   #=> {:program_size=>11, :pattern_bytes=>7, :estimated_bytes=>1430, :max_mem=>8388608}
+ */
+static VALUE re2_regexp_memory_stats(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(id_program_size),
+      INT2FIX(p->pattern->ProgramSize()));
+  rb_hash_aset(stats, ID2SYM(id_pattern_bytes),
+      SIZET2NUM(p->pattern->pattern().size()));
+  rb_hash_aset(stats, ID2SYM(id_estimated_bytes), SIZET2NUM(p->memsize));
+  rb_hash_aset(stats, ID2SYM(id_max_mem),
+      LL2NUM(p->pattern->options().max_mem()));
+
+  return stats;
+}
+
+/*
+ * Returns a hash of the options currently set for the {RE2::Regexp}.
+ *
+ * @return [Hash] the options
+ */
+static VALUE re2_regexp_options(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp_source(self);
+  VALUE options = rb_hash_new();
+
+  rb_hash_aset(options, ID2SYM(id_utf8),
+      BOOL2RUBY(re2_pattern_options(p).encoding() == RE2::Options::EncodingUTF8));
+
+  rb_hash_aset(options, ID2SYM(id_posix_syntax),
+      BOOL2RUBY(re2_pattern_options(p).posix_syntax()));
+
+  rb_hash_aset(options, ID2SYM(id_longest_match),
+      BOOL2RUBY(re2_pattern_options(p).longest_match()));
+
+  rb_hash_aset(options, ID2SYM(id_log_errors),
+      BOOL2RUBY(re2_pattern_options(p).log_errors()));
+
+  rb_hash_aset(options, ID2SYM(id_max_mem),
+      INT2FIX(re2_pattern_options(p).max_mem()));
+
+  rb_hash_aset(options, ID2SYM(id_literal),
+      BOOL2RUBY(re2_pattern_options(p).literal()));
+
+  rb_hash_aset(options, ID2SYM(id_never_nl),
+      BOOL2RUBY(re2_pattern_options(p).never_nl()));
+
+  rb_hash_aset(options, ID2SYM(id_case_sensitive),
+      BOOL2RUBY(re2_pattern_options(p).case_sensitive()));
+
+  rb_hash_aset(options, ID2SYM(id_perl_classes),
+      BOOL2RUBY(re2_pattern_options(p).perl_classes()));
+
+  rb_hash_aset(options, ID2SYM(id_word_boundary),
+      BOOL2RUBY(re2_pattern_options(p).word_boundary()));
+
+  rb_hash_aset(options, ID2SYM(id_one_line),
+      BOOL2RUBY(re2_pattern_options(p).one_line()));
+
+  /* This is a read-only hash after all... */
+  rb_obj_freeze(options);
+
+  return options;
+}
+
+/*
+ * Returns the number of capturing subpatterns, or -1 if the regexp
+ * wasn't valid on construction. The overall match (`$0`) does not
+ * count: if the regexp is `"(a)(b)"`, returns 2.
+ *
+ * @return [Integer] the number of capturing subpatterns
+ */
+static VALUE re2_regexp_number_of_capturing_groups(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  return INT2FIX(p->pattern->NumberOfCapturingGroups());
+}
+
+/*
+ * Returns a hash of names to capturing indices of groups.
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @return [Hash] a hash of names to capturing indices
+ */
+static VALUE re2_regexp_named_capturing_groups(const VALUE self) {
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  return rb_hash_dup(RARRAY_AREF(re2_regexp_groups(self, p),
+        re2_group_indices_by_name));
+}
+
+/* Parses the options shared by {RE2::Regexp#match} and
+ * {RE2::Regexp#match_offsets} (either a hash of options or a legacy number of
+ * submatches). Returns false if the pattern is invalid and no number of
+ * submatches was given, in which case there can be no match.
+ */
+static bool parse_re2_match_options(
+    const RE2 *pattern, VALUE *options_ptr, size_t *startpos, size_t *endpos,
+    RE2::Anchor *anchor, int *n_ptr) {
+  VALUE options = *options_ptr;
+  int n;
+
+  if (RTEST(options)) {
+    if (RB_INTEGER_TYPE_P(options)) {
+      n = NUM2INT(options);
+
+      if (n < 0) {
+        rb_raise(rb_eArgError, "number of matches should be >= 0");
+      }
+    } else {
+      if (TYPE(options) != T_HASH) {
+        options = rb_Hash(options);
+        *options_ptr = options;
+      }
+
+      VALUE endpos_option = rb_hash_aref(options, ID2SYM(id_endpos));
+      if (!NIL_P(endpos_option)) {
+#ifdef HAVE_ENDPOS_ARGUMENT
+        ssize_t endpos_value = NUM2SSIZET(endpos_option);
+
+        if (endpos_value < 0) {
+          rb_raise(rb_eArgError, "endpos should be >= 0");
+        }
+
+        *endpos = static_cast<size_t>(endpos_value);
+#else
+        rb_raise(re2_eRegexpUnsupportedError, "current version of RE2::Match() does not support endpos argument");
+#endif
+      }
+
+      VALUE anchor_option = rb_hash_aref(options, ID2SYM(id_anchor));
+      if (!NIL_P(anchor_option)) {
+        *anchor = parse_re2_anchor(anchor_option);
+      }
+
+      VALUE submatches_option = rb_hash_aref(options, ID2SYM(id_submatches));
+      if (!NIL_P(submatches_option)) {
+        n = NUM2INT(submatches_option);
+
+        if (n < 0) {
+          rb_raise(rb_eArgError, "number of matches should be >= 0");
+        }
+      } else {
+        if (!pattern->ok()) {
+          return false;
+        }
+
+        n = pattern->NumberOfCapturingGroups();
+      }
+
+      VALUE startpos_option = rb_hash_aref(options, ID2SYM(id_startpos));
+      if (!NIL_P(startpos_option)) {
+        ssize_t startpos_value = NUM2SSIZET(startpos_option);
+
+        if (startpos_value < 0) {
+          rb_raise(rb_eArgError, "startpos should be >= 0");
+        }
+
+        *startpos = static_cast<size_t>(startpos_value);
+      }
+    }
+  } else {
+    if (!pattern->ok()) {
+      return false;
+    }
+
+    n = pattern->NumberOfCapturingGroups();
+  }
+
+  if (*startpos > *endpos) {
+    rb_raise(rb_eArgError, "startpos should be <= endpos");
+  }
+
+#ifndef HAVE_ENDPOS_ARGUMENT
+  /* Old RE2's Match() takes int startpos. Reject values that would overflow. */
+  if (*startpos > INT_MAX) {
+    rb_raise(rb_eRangeError, "startpos should be <= %d", INT_MAX);
+  }
+#endif
+
+  *n_ptr = n;
+
+  return true;
+}
+
+struct re2_match_into_arg {
+  re2_pattern *p;
+  VALUE text;
+  size_t startpos;
+  size_t endpos;
+  RE2::Anchor anchor;
+  re2_matchdata *m;
+  int n;
+  bool matched;
+  bool finished;
+};
+
+static VALUE re2_regexp_match_into_body(VALUE ptr) {
+  auto *arg = reinterpret_cast<re2_match_into_arg *>(ptr);
+
+  arg->matched = re2_match_without_gvl(arg->p, arg->text, arg->startpos,
+      arg->endpos, arg->anchor, arg->m->matches, arg->n);
+  arg->finished = true;
+
+  return Qnil;
+}
+
+/* Releases the match data once matching into it has finished or been
+ * interrupted (e.g. by Thread#raise when reacquiring the GVL), in which case
+ * its submatches may point into a text it does not hold so are cleared.
+ */
+static VALUE re2_regexp_match_into_ensure(VALUE ptr) {
+  auto *arg = reinterpret_cast<re2_match_into_arg *>(ptr);
+  re2_matchdata *m = arg->m;
+
+  if (!arg->finished) {
+    for (int i = 0; i < arg->n; ++i) {
+      m->matches[i] = re2::StringPiece();
+    }
+  }
+
+  m->matching = false;
+
+  return Qnil;
+}
+
+/* Matches into the caller-owned `into` match data, reusing its buffer of
+ * StringPieces if it is large enough for the whole match and `n` submatches.
+ * The whole match is always recorded, even when `n` is 0.
+ */
+static VALUE re2_regexp_match_into(
+    const VALUE self, re2_pattern *p, VALUE text, size_t startpos,
+    size_t endpos, RE2::Anchor anchor, int n, VALUE into) {
+  re2_matchdata *m;
+  TypedData_Get_Struct(into, re2_matchdata, &re2_matchdata_data_type, m);
+  rb_check_frozen(into);
+  re2_matchdata_check_matching(m);
+
+  if (n == INT_MAX) {
+    rb_raise(rb_eRangeError, "number of matches should be < %d", INT_MAX);
+  }
+
+  /* Because match returns the whole match as well. */
+  n += 1;
+
+  if (m->capacity < n) {
+    re2::StringPiece *matches = new(std::nothrow) re2::StringPiece[n];
+    if (matches == nullptr) {
+      rb_raise(rb_eNoMemError,
+               "not enough memory to allocate StringPieces for matches");
+    }
+
+    delete[] m->matches;
+    m->matches = matches;
+    m->capacity = n;
+  }
+
+  re2_match_into_arg arg;
+  arg.p = p;
+  arg.text = text;
+  arg.startpos = startpos;
+  arg.endpos = endpos;
+  arg.anchor = anchor;
+  arg.m = m;
+  arg.n = n;
+  arg.matched = false;
+  arg.finished = false;
+
+  m->matching = true;
+  rb_ensure(re2_regexp_match_into_body, reinterpret_cast<VALUE>(&arg),
+      re2_regexp_match_into_ensure, reinterpret_cast<VALUE>(&arg));
+  RB_GC_GUARD(text);
+
+  if (arg.matched) {
+    RB_OBJ_WRITE(into, &m->regexp, self);
+    RB_OBJ_WRITE(into, &m->text, text);
+    m->number_of_matches = n;
+
+    return into;
+  } else {
+    /* Don't leave submatches pointing into a text that is no longer held. */
+    for (int i = 0; i < m->number_of_matches; ++i) {
+      m->matches[i] = re2::StringPiece();
+    }
+
+    return Qnil;
+  }
+}
+
+/*
+ * General matching: match the pattern against the given `text` using
+ * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L562-L588
+ * `Match`} and return a {RE2::MatchData} instance with the specified number of
+ * submatches (defaults to the total number of capturing groups) or a boolean
+ * (if no submatches are required).
+ *
+ * The number of submatches has a significant impact on performance: requesting
+ * one submatch is much faster than requesting more than one and requesting
+ * zero submatches is faster still.
+ *
+ * @overload match(text)
+ *   Returns a {RE2::MatchData} containing the matching pattern and all
+ *   submatches resulting from looking for the regexp in `text` if the pattern
+ *   contains capturing groups.
+ *
+ *   Returns either `true` or `false` indicating whether a successful match was
+ *   made if the pattern contains no capturing groups.
+ *
+ *   @param [String] text the text to search
+ *   @return [RE2::MatchData, nil] if the pattern contains capturing groups
+ *   @return [Boolean] if the pattern does not contain capturing groups
+ *   @raise [NoMemoryError] if there was not enough memory to allocate the submatches
+ *   @raise [TypeError] if given text that cannot be coerced to a `String`
+ *   @example Matching with capturing groups
+ *     r = RE2::Regexp.new('w(o)(o)')
+ *     r.match('woo') #=> #<RE2::MatchData "woo" 1:"o" 2:"o">
+ *   @example Matching without capturing groups
+ *     r = RE2::Regexp.new('woo')
+ *     r.match('woo') #=> true
+ *
+ * @overload match(text, options)
+ *   See `match(text)` but with customisable offsets for starting and ending
+ *   matches, optional anchoring to the start or both ends of the text and a
+ *   specific number of submatches to extract (padded with `nil`s if
+ *   necessary).
+ *
+ *   @param [String] text the text to search
+ *   @param [Hash] options the options with which to perform the match
+ *   @option options [Integer] :startpos (0) offset at which to start matching
+ *   @option options [Integer] :endpos offset at which to stop matching, defaults to the text length
+ *   @option options [Symbol] :anchor (:unanchored) one of :unanchored, :anchor_start, :anchor_both to anchor the match
+ *   @option options [Integer] :submatches how many submatches to extract (0 is
+ *     fastest), defaults to the number of capturing groups
+ *   @option options [RE2::MatchData] :into an existing match data to
+ *     overwrite with the result (and return) instead of allocating a new one,
+ *     reusing its submatch buffer where possible. The whole match is always
+ *     recorded even if not extracting any submatches.
+ *   @return [RE2::MatchData, nil] if extracting any submatches or given `into`
+ *   @return [Boolean] if not extracting any submatches
+ *   @raise [ArgumentError] if given a negative number of submatches, invalid
+ *     anchor or invalid startpos, endpos pair
+ *   @raise [NoMemoryError] if there was not enough memory to allocate the matches
+ *   @raise [TypeError] if given non-String text, non-numeric number of
+ *     submatches, non-symbol anchor, non-hash options or `into` that is not
+ *     an {RE2::MatchData}
+ *   @raise [FrozenError] if `into` is frozen
+ *   @raise [ThreadError] if `into` is being matched into in another thread
+ *   @raise [RE2::Regexp::UnsupportedError] if given an endpos argument on a
+ *     version of RE2 that does not support it
+ *   @example Matching with capturing groups
+ *     r = RE2::Regexp.new('w(o)(o)')
+ *     r.match('woo', submatches: 1) #=> #<RE2::MatchData "woo" 1:"o">
+ *     r.match('woo', submatches: 3) #=> #<RE2::MatchData "woo" 1:"o" 2:"o" 3:nil>
+ *     r.match('woot', anchor: :anchor_both, submatches: 0)
+ *     #=> false
+ *     r.match('woot', anchor: :anchor_start, submatches: 0)
+ *     #=> true
+ *   @example Matching without capturing groups
+ *     r = RE2::Regexp.new('wo+')
+ *     r.match('woot', anchor: :anchor_both)  #=> false
+ *     r.match('woot', anchor: :anchor_start) #=> true
+ *   @example Reusing match data
+ *     r = RE2::Regexp.new('w(o+)')
+ *     md = r.match('woo')
+ *     r.match('woooo', into: md) #=> #<RE2::MatchData "woooo" 1:"oooo">
+ *     md[1]                      #=> "oooo"
+ *
+ * @overload match(text, submatches)
+ *   @deprecated Legacy syntax for matching against `text` with a specific
+ *     number of submatches to extract. Use `match(text, submatches: n)` instead.
+ *
+ *   @param [String] text the text to search
+ *   @param [Integer] submatches the number of submatches to extract
+ *   @return [RE2::MatchData, nil] if extracting any submatches
+ *   @return [Boolean] if not extracting any submatches
+ *   @raise [NoMemoryError] if there was not enough memory to allocate the submatches
+ *   @raise [TypeError] if given non-numeric number of submatches
+ *   @example
+ *     r = RE2::Regexp.new('w(o)(o)')
+ *     r.match('woo', 0) #=> true
+ *     r.match('woo', 1) #=> #<RE2::MatchData "woo" 1:"o">
+ *     r.match('woo', 2) #=> #<RE2::MatchData "woo" 1:"o" 2:"o">
+ */
+static VALUE re2_regexp_match(int argc, VALUE *argv, const VALUE self) {
+  re2_count_call(re2_entry_match);
+
+  re2_pattern *p;
+  re2_matchdata *m;
+  VALUE text, options;
+
+  rb_scan_args(argc, argv, "11", &text, &options);
+
+  /* Coerce and freeze text to prevent mutation. */
+  StringValue(text);
+  text = rb_str_new_frozen(text);
+
+  p = unwrap_re2_regexp(self);
+
+  int n;
+  size_t startpos = 0;
+  size_t endpos = RSTRING_LEN(text);
+  RE2::Anchor anchor = RE2::UNANCHORED;
+
+  VALUE into = Qnil;
+  if (RTEST(options) && !RB_INTEGER_TYPE_P(options)) {
+    if (TYPE(options) != T_HASH) {
+      options = rb_Hash(options);
+    }
+
+    into = rb_hash_aref(options, ID2SYM(id_into));
+  }
+
+  if (!parse_re2_match_options(p->pattern, &options, &startpos, &endpos,
+        &anchor, &n)) {
+    return Qnil;
+  }
+
+  if (!NIL_P(into)) {
+    return re2_regexp_match_into(self, p, text, startpos, endpos, anchor, n,
+        into);
+  }
+
+  if (n == 0) {
+    bool matched = re2_match_without_gvl(
+        p, text, startpos, endpos, anchor, 0, 0);
+    RB_GC_GUARD(text);
+
+    return BOOL2RUBY(matched);
+  } else {
+    if (n == INT_MAX) {
+      rb_raise(rb_eRangeError, "number of matches should be < %d", INT_MAX);
+    }
+
+    /* Because match returns the whole match as well. */
+    n += 1;
+
+    re2::StringPiece *matches = new(std::nothrow) re2::StringPiece[n];
+    if (matches == nullptr) {
+      rb_raise(rb_eNoMemError,
+               "not enough memory to allocate StringPieces for matches");
+    }
+
+    bool matched = re2_match_without_gvl(
+        p, text, startpos, endpos, anchor, matches, n);
+    RB_GC_GUARD(text);
+
+    if (matched) {
+      VALUE matchdata = rb_class_new_instance(0, 0, re2_cMatchData);
+      TypedData_Get_Struct(matchdata, re2_matchdata, &re2_matchdata_data_type, m);
+
+      RB_OBJ_WRITE(matchdata, &m->regexp, self);
+      RB_OBJ_WRITE(matchdata, &m->text, text);
+      m->matches = matches;
+      m->number_of_matches = n;
+      m->capacity = n;
+
+      return matchdata;
+    } else {
+      delete[] matches;
+
+      return Qnil;
+    }
+  }
+}
+
+/* Returns the byte offsets of the given submatches relative to `text` either
+ * as a flat array of begin and end pairs (with `nil`s for submatches that did
+ * not participate in the match) or packed into a binary string of native
+ * 64-bit integers (with -1 for submatches that did not participate).
+ */
+static VALUE re2_offsets_new(
+    const char *text, const re2::StringPiece *matches, size_t count,
+    bool pack) {
+  if (pack) {
+    VALUE packed = rb_str_new(nullptr, count * sizeof(int64_t[2]));
+    char *buffer = RSTRING_PTR(packed);
+
+    for (size_t i = 0; i < count; ++i) {
+      int64_t offsets[2] = {-1, -1};
+
+      if (matches[i].data() != nullptr) {
+        offsets[0] = matches[i].data() - text;
+        offsets[1] = offsets[0] + matches[i].size();
+      }
+
+      /* The string's buffer is not necessarily aligned for int64_t. */
+      memcpy(buffer + i * sizeof(offsets), offsets, sizeof(offsets));
+    }
+
+    return packed;
+  }
+
+  VALUE offsets = rb_ary_new_capa(count * 2);
+
+  for (size_t i = 0; i < count; ++i) {
+    if (matches[i].data() == nullptr) {
+      rb_ary_push(offsets, Qnil);
+      rb_ary_push(offsets, Qnil);
+    } else {
+      long begin = matches[i].data() - text;
+      rb_ary_push(offsets, LONG2NUM(begin));
+      rb_ary_push(offsets, LONG2NUM(begin + matches[i].size()));
+    }
+  }
+
+  return offsets;
+}
+
+/* Returns whether the given options ask for offsets to be packed into a
+ * binary string.
+ */
+static bool parse_re2_pack(const VALUE options) {
+  return TYPE(options) == T_HASH &&
+    RTEST(rb_hash_aref(options, ID2SYM(id_pack)));
+}
+
+/*
+ * Matches the pattern against the given text like {RE2::Regexp#match} but
+ * returns only the byte offsets of the overall match and each submatch,
+ * avoiding the allocation of a {RE2::MatchData} and any strings.
+ *
+ * Offsets are returned as a flat array of begin and end pairs, i.e. `[begin0,
+ * end0, begin1, end1, ...]` where `begin0` and `end0` are the offsets of the
+ * overall match, with `nil`s for any submatch that did not participate in the
+ * match. Alternatively, they can be packed into a binary string of native
+ * 64-bit integers (with -1 for any submatch that did not participate in the
+ * match) which can be read with `unpack("q*")`.
+ *
+ * @param [String] text the text to search
+ * @param [Hash] options the options with which to perform the match
+ * @option options [Integer] :startpos (0) offset at which to start matching
+ * @option options [Integer] :endpos offset at which to stop matching, defaults to the text length
+ * @option options [Symbol] :anchor (:unanchored) one of :unanchored, :anchor_start, :anchor_both to anchor the match
+ * @option options [Integer] :submatches how many submatches to return offsets
+ *   for, defaults to the number of capturing groups
+ * @option options [Boolean] :pack (false) whether to pack the offsets into a
+ *   binary string
+ * @return [Array<Integer, nil>] the offsets of the match and its submatches
+ * @return [String] the offsets packed into a binary string if `pack: true`
+ * @return [nil] if the text does not match
+ * @raise [ArgumentError] if given a negative number of submatches, invalid
+ *   anchor or invalid startpos, endpos pair
+ * @raise [TypeError] if given non-String text, non-numeric number of
+ *   submatches, non-symbol anchor or non-hash options
+ * @raise [RE2::Regexp::UnsupportedError] if given an endpos argument on a
+ *   version of RE2 that does not support it
+ * @example
+ *   r = RE2::Regexp.new('(\w+)@(\w+)?')
+ *   r.match_offsets("to: bob@") #=> [4, 8, 4, 7, nil, nil]
+ *   r.match_offsets("to: bob@", pack: true).unpack("q*")
+ *   #=> [4, 8, 4, 7, -1, -1]
+ */
+static VALUE re2_regexp_match_offsets(int argc, VALUE *argv, const VALUE self) {
+  VALUE text, options;
+  rb_scan_args(argc, argv, "11", &text, &options);
+
+  StringValue(text);
+  text = rb_str_new_frozen(text);
+
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  int n;
+  size_t startpos = 0;
+  size_t endpos = RSTRING_LEN(text);
+  RE2::Anchor anchor = RE2::UNANCHORED;
+
+  if (!parse_re2_match_options(p->pattern, &options, &startpos, &endpos,
+        &anchor, &n)) {
+    return Qnil;
+  }
+
+  if (n == INT_MAX) {
+    rb_raise(rb_eRangeError, "number of matches should be < %d", INT_MAX);
+  }
+
+  bool pack = parse_re2_pack(options);
+
+  /* Because match returns the whole match as well. */
+  n += 1;
+
+  /* Avoid allocating for patterns with a reasonable number of groups. */
+  re2::StringPiece stack_matches[16];
+  re2::StringPiece *matches = stack_matches;
+  if (n > 16) {
+    matches = new(std::nothrow) re2::StringPiece[n];
+    if (matches == nullptr) {
+      rb_raise(rb_eNoMemError,
+               "not enough memory to allocate StringPieces for matches");
+    }
+  }
+
+  bool matched = re2_match_without_gvl(
+      p, text, startpos, endpos, anchor, matches, n);
+
+  VALUE offsets = Qnil;
+  if (matched) {
+    offsets = re2_offsets_new(RSTRING_PTR(text), matches, n, pack);
+  }
+
+  if (matches != stack_matches) {
+    delete[] matches;
+  }
+
+  RB_GC_GUARD(text);
+
+  return offsets;
+}
+
+/*
+ * Returns true if the pattern matches any substring of the given text using
+ * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L413-L427
+ * `PartialMatch`}.
+ *
+ * @param [String] text the text to search
+ * @return [Boolean] whether the match was successful
+ * @raise [TypeError] if text cannot be coerced to a `String`
+ */
+static VALUE re2_regexp_match_p(const VALUE self, VALUE text) {
+  re2_count_call(re2_entry_match_p);
+
+  StringValue(text);
+  text = rb_str_new_frozen(text);
+
+  re2_pattern *p = unwrap_re2_regexp(self);
+  bool matched = re2_match_without_gvl(
+      p, text, 0, RSTRING_LEN(text), RE2::UNANCHORED, 0, 0);
+  RB_GC_GUARD(text);
+
+  return BOOL2RUBY(matched);
+}
+
+/*
+ * Returns true if the pattern matches the given text using
+ * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L376-L411
+ * `FullMatch`}.
+ *
+ * @param [String] text the text to search
+ * @return [Boolean] whether the match was successful
+ * @raise [TypeError] if text cannot be coerced to a `String`
+ */
+static VALUE re2_regexp_full_match_p(const VALUE self, VALUE text) {
+  re2_count_call(re2_entry_match_p);
+
+  StringValue(text);
+  text = rb_str_new_frozen(text);
+
+  re2_pattern *p = unwrap_re2_regexp(self);
+  bool matched = re2_match_without_gvl(
+      p, text, 0, RSTRING_LEN(text), RE2::ANCHOR_BOTH, 0, 0);
+  RB_GC_GUARD(text);
+
+  return BOOL2RUBY(matched);
+}
+
+/*
+ * Returns an array of byte offset pairs for each of the first `n` submatches
+ * of the `i`th text in a batch or `nil` for any submatch that did not
+ * participate in the match.
+ */
+static VALUE re2_batch_offsets(const re2_batch *batch, size_t i, int n) {
+  const re2::StringPiece &text = batch->pieces[i];
+  const re2::StringPiece *matches = &batch->matches[i * n];
+  VALUE offsets = rb_ary_new_capa(n);
+
+  for (int j = 0; j < n; ++j) {
+    if (matches[j].data() == nullptr) {
+      rb_ary_push(offsets, Qnil);
+    } else {
+      long begin = matches[j].data() - text.data();
+      rb_ary_push(offsets, rb_assoc_new(LONG2NUM(begin),
+            LONG2NUM(begin + matches[j].size())));
+    }
+  }
+
+  return offsets;
+}
+
+/* Returns the number of threads requested by a `:threads` option or the
+ * given default if there is none.
+ */
+static size_t parse_re2_threads(const VALUE options, size_t threads) {
+  VALUE threads_option = rb_hash_aref(options, ID2SYM(id_threads));
+  if (NIL_P(threads_option)) {
+    return threads;
+  }
+
+  long threads_value = NUM2LONG(threads_option);
+  if (threads_value < 1) {
+    rb_raise(rb_eArgError, "number of threads should be >= 1");
+  }
+
+  return static_cast<size_t>(threads_value);
+}
+
+/* The shared implementation of {RE2::Regexp#match_many} and
+ * {RE2::Regexp#parallel_match}.
+ */
+static VALUE re2_regexp_match_batch(
+    int argc, VALUE *argv, const VALUE self, bool parallel) {
+  VALUE strings, options;
+  rb_scan_args(argc, argv, "11", &strings, &options);
+
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  RE2::Anchor anchor = RE2::UNANCHORED;
+  size_t threads = parallel ? thread_pool.size() : 1;
+  bool offsets = false;
+  int n = p->pattern->ok() ? p->pattern->NumberOfCapturingGroups() : 0;
+
+  if (RTEST(options)) {
+    if (TYPE(options) != T_HASH) {
+      options = rb_Hash(options);
+    }
+
+    VALUE anchor_option = rb_hash_aref(options, ID2SYM(id_anchor));
+    if (!NIL_P(anchor_option)) {
+      anchor = parse_re2_anchor(anchor_option);
+    }
+
+    VALUE submatches_option = rb_hash_aref(options, ID2SYM(id_submatches));
+    if (!NIL_P(submatches_option)) {
+      n = NUM2INT(submatches_option);
+
+      if (n < 0) {
+        rb_raise(rb_eArgError, "number of matches should be >= 0");
+      }
+    }
+
+    if (parallel) {
+      threads = parse_re2_threads(options, threads);
+    }
+
+    VALUE output_option = rb_hash_aref(options, ID2SYM(id_output));
+    if (!NIL_P(output_option)) {
+      Check_Type(output_option, T_SYMBOL);
+
+      ID id_output_option = SYM2ID(output_option);
+      if (id_output_option == id_offsets) {
+        offsets = true;
+      } else if (id_output_option != id_match_data) {
+        rb_raise(rb_eArgError, "output should be one of: :match_data, :offsets");
+      }
+    }
+  }
+
+  if (n == INT_MAX) {
+    rb_raise(rb_eRangeError, "number of matches should be < %d", INT_MAX);
+  }
+
+  re2_batch *batch;
+  VALUE wrapper = re2_batch_new(strings, &batch);
+  size_t count = batch->pieces.size();
+
+  /* Offsets always include the overall match. */
+  if (offsets || n > 0) {
+    n += 1;
+  }
+
+  re2_match_many_without_gvl(p->pattern, batch, anchor, n, threads);
+
+  VALUE results = rb_ary_new_capa(count);
+
+  for (size_t i = 0; i < count; ++i) {
+    if (!batch->matched[i]) {
+      rb_ary_push(results, n == 0 ? Qfalse : Qnil);
+    } else if (n == 0) {
+      rb_ary_push(results, Qtrue);
+    } else if (offsets) {
+      rb_ary_push(results, re2_batch_offsets(batch, i, n));
+    } else {
+      re2::StringPiece *matches = new(std::nothrow) re2::StringPiece[n];
+      if (matches == nullptr) {
+        rb_raise(rb_eNoMemError,
+                 "not enough memory to allocate StringPieces for matches");
+      }
+      std::copy_n(&batch->matches[i * n], n, matches);
+
+      re2_matchdata *m;
+      VALUE matchdata = rb_class_new_instance(0, 0, re2_cMatchData);
+      TypedData_Get_Struct(matchdata, re2_matchdata, &re2_matchdata_data_type, m);
+
+      RB_OBJ_WRITE(matchdata, &m->regexp, self);
+      RB_OBJ_WRITE(matchdata, &m->text, batch->texts[i]);
+      m->matches = matches;
+      m->number_of_matches = n;
+      m->capacity = n;
+
+      rb_ary_push(results, matchdata);
+    }
+  }
+
+  RB_GC_GUARD(wrapper);
+
+  return results;
+}
+
+/*
+ * Matches the regexp against every string in `strings` at once, releasing the
+ * GVL only once for the whole batch rather than once per string. This is
+ * much faster than calling {RE2::Regexp#match} in a loop when matching many
+ * short strings.
+ *
+ * As with {RE2::Regexp#match}, requesting fewer submatches is faster and
+ * requesting zero submatches is fastest.
+ *
+ * @param [Array<String>] strings the texts to search
+ * @param [Hash] options the options with which to perform the matches
+ * @option options [Symbol] :anchor (:unanchored) one of :unanchored, :anchor_start, :anchor_both to anchor the matches
+ * @option options [Integer] :submatches how many submatches to extract (0 is
+ *   fastest), defaults to the number of capturing groups
+ * @option options [Symbol] :output (:match_data) either :match_data to return
+ *   an {RE2::MatchData} for each match or :offsets to return an array of
+ *   `[begin, end]` byte offsets for the overall match and each submatch
+ * @return [Array<RE2::MatchData, nil>] the result of each match if
+ *   extracting any submatches with `output: :match_data`
+ * @return [Array<Array<Array<Integer>, nil>, nil>] the byte offsets of each
+ *   match if `output: :offsets`
+ * @return [Array<Boolean>] whether each string matched if not extracting any
+ *   submatches with `output: :match_data`
+ * @raise [ArgumentError] if given a negative number of submatches, invalid
+ *   anchor or invalid output
+ * @raise [TypeError] if given a non-array of strings or any element cannot be
+ *   coerced to a `String`
+ * @example
+ *   r = RE2::Regexp.new('w(o+)')
+ *   r.match_many(["woo", "bar", "wooo"])
+ *   #=> [#<RE2::MatchData "woo" 1:"oo">, nil, #<RE2::MatchData "wooo" 1:"ooo">]
+ *   r.match_many(["woo", "bar"], submatches: 0) #=> [true, false]
+ *   r.match_many(["a woo", "bar"], output: :offsets)
+ *   #=> [[[2, 5], [3, 5]], nil]
+ */
+static VALUE re2_regexp_match_many(int argc, VALUE *argv, const VALUE self) {
+  return re2_regexp_match_batch(argc, argv, self, false);
+}
+
+/*
+ * Matches the regexp against every string in `strings` like
+ * {RE2::Regexp#match_many} but splits the batch across a pool of native
+ * worker threads so that large batches can use more than one CPU core.
+ * Results are returned in the same order as `strings`.
+ *
+ * The pool is shared by all regexps and sets and can be configured with
+ * {RE2.thread_pool_size=} and {RE2.thread_pool_cpus=}. On Windows, the batch
+ * is always matched on the calling thread.
+ *
+ * @param [Array<String>] strings the texts to search
+ * @param [Hash] options the options with which to perform the matches
+ * @option options [Integer] :threads the number of threads to split the batch
+ *   across, defaults to {RE2.thread_pool_size}
+ * @option options [Symbol] :anchor (:unanchored) one of :unanchored, :anchor_start, :anchor_both to anchor the matches
+ * @option options [Integer] :submatches how many submatches to extract (0 is
+ *   fastest), defaults to the number of capturing groups
+ * @option options [Symbol] :output (:match_data) either :match_data to return
+ *   an {RE2::MatchData} for each match or :offsets to return an array of
+ *   `[begin, end]` byte offsets for the overall match and each submatch
+ * @return [Array<RE2::MatchData, Array, Boolean, nil>] the result of each
+ *   match as for {RE2::Regexp#match_many}
+ * @raise [ArgumentError] if given fewer than one thread, a negative number of
+ *   submatches, invalid anchor or invalid output
+ * @raise [TypeError] if given a non-array of strings or any element cannot be
+ *   coerced to a `String`
+ * @example
+ *   r = RE2::Regexp.new('w(o+)')
+ *   r.parallel_match(["woo", "bar", "wooo"], threads: 2, submatches: 0)
+ *   #=> [true, false, true]
+ */
+static VALUE re2_regexp_parallel_match(int argc, VALUE *argv, const VALUE self) {
+  return re2_regexp_match_batch(argc, argv, self, true);
+}
+
+/*
+ * Returns whether the regexp matches each string in `strings`, releasing the
+ * GVL only once for the whole batch rather than once per string.
+ *
+ * @param [Array<String>] strings the texts to search
+ * @param [Hash] options the options with which to perform the matches
+ * @option options [Symbol] :anchor (:unanchored) one of :unanchored, :anchor_start, :anchor_both to anchor the matches
+ * @return [Array<Boolean>] whether each string matched
+ * @raise [ArgumentError] if given an invalid anchor
+ * @raise [TypeError] if given a non-array of strings or any element cannot be
+ *   coerced to a `String`
+ * @example
+ *   r = RE2::Regexp.new('wo+')
+ *   r.match_many?(["woo", "bar", "wooo"]) #=> [true, false, true]
+ *   r.match_many?(["woo", "a woo"], anchor: :anchor_start) #=> [true, false]
+ */
+static VALUE re2_regexp_match_many_p(int argc, VALUE *argv, const VALUE self) {
+  VALUE strings, options;
+  rb_scan_args(argc, argv, "11", &strings, &options);
+
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  RE2::Anchor anchor = RE2::UNANCHORED;
+  if (RTEST(options)) {
+    if (TYPE(options) != T_HASH) {
+      options = rb_Hash(options);
+    }
+
+    VALUE anchor_option = rb_hash_aref(options, ID2SYM(id_anchor));
+    if (!NIL_P(anchor_option)) {
+      anchor = parse_re2_anchor(anchor_option);
+    }
+  }
+
+  re2_batch *batch;
+  VALUE wrapper = re2_batch_new(strings, &batch);
+  size_t count = batch->pieces.size();
+
+  re2_match_many_without_gvl(p->pattern, batch, anchor, 0, 1);
+
+  VALUE results = rb_ary_new_capa(count);
+  for (size_t i = 0; i < count; ++i) {
+    rb_ary_push(results, BOOL2RUBY(batch->matched[i]));
+  }
+
+  RB_GC_GUARD(wrapper);
+
+  return results;
+}
+
+/* Selects which capturing groups a scanner returns from a `:submatches`
+ * option: either the first `n` groups or a list of group names and numbers.
+ */
+static void parse_re2_scanner_submatches(
+    re2_scanner *c, const RE2 *pattern, VALUE submatches) {
+  int number_of_capturing_groups = c->number_of_capturing_groups;
+  int count;
+
+  if (RB_INTEGER_TYPE_P(submatches)) {
+    count = NUM2INT(submatches);
+
+    if (count < 0) {
+      rb_raise(rb_eArgError, "number of matches should be >= 0");
+    }
+  } else {
+    Check_Type(submatches, T_ARRAY);
+    count = RARRAY_LENINT(submatches);
+  }
+
+  c->groups = new(std::nothrow) int[count];
+  if (c->groups == nullptr) {
+    rb_raise(rb_eNoMemError,
+             "not enough memory to allocate submatch selection");
+  }
+  c->number_of_groups = count;
+
+  /* Only extract as many groups as the last one selected. */
+  int needed = 0;
+
+  for (int i = 0; i < count; ++i) {
+    int group;
+
+    if (RB_INTEGER_TYPE_P(submatches)) {
+      group = i + 1;
+
+      /* Pad with nil beyond the last capturing group, as with match. */
+      if (group > number_of_capturing_groups) {
+        c->groups[i] = -1;
+        continue;
+      }
+    } else {
+      VALUE selector = rb_ary_entry(submatches, i);
+
+      if (RB_INTEGER_TYPE_P(selector)) {
+        group = NUM2INT(selector);
+
+        if (group < 1 || group > number_of_capturing_groups) {
+          rb_raise(rb_eArgError, "no capturing group %d", group);
+        }
+      } else {
+        if (SYMBOL_P(selector)) {
+          selector = rb_sym2str(selector);
+        }
+        StringValue(selector);
+
+        const std::map<std::string, int>& groups =
+          pattern->NamedCapturingGroups();
+        auto it = groups.find(
+            std::string(RSTRING_PTR(selector), RSTRING_LEN(selector)));
+        if (it == groups.end()) {
+          rb_raise(rb_eArgError, "no capturing group named %s",
+              StringValueCStr(selector));
+        }
+
+        group = it->second;
+      }
+    }
+
+    c->groups[i] = group - 1;
+    needed = std::max(needed, group);
+  }
+
+  c->number_of_capturing_groups = needed;
+}
+
+/*
+ * Returns a {RE2::Scanner} for scanning the given text incrementally with
+ * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L447-L463
+ * `FindAndConsume`}.
+ *
+ * @overload scan(text)
+ *   Returns a scanner that returns every submatch of each match as a string.
+ *
+ *   @param [String] text the text to scan incrementally
+ *   @return [RE2::Scanner] an `Enumerable` {RE2::Scanner} object
+ *   @raise [TypeError] if `text` cannot be coerced to a `String`
+ *   @example
+ *     c = RE2::Regexp.new('(\w+)').scan("Foo bar baz")
+ *     #=> #<RE2::Scanner:0x0000000000000001>
+ *
+ * @overload scan(text, options)
+ *   Returns a scanner that only returns the selected submatches of each
+ *   match, optionally as byte offsets rather than strings.
+ *
+ *   Fewer submatches are faster to extract: only as many capturing groups as
+ *   the last one selected are extracted and returning offsets avoids
+ *   allocating a string for each submatch.
+ *
+ *   @param [String] text the text to scan incrementally
+ *   @param [Hash] options the options with which to scan
+ *   @option options [Integer, Array<Symbol, String, Integer>] :submatches
+ *     either the number of submatches to return (padded with `nil`s if
+ *     necessary) or the names and/or numbers of the capturing groups to
+ *     return, defaults to every capturing group
+ *   @option options [Symbol] :output (:strings) either :strings to return
+ *     each submatch as a string or :offsets to return `[begin, end]` byte
+ *     offsets into `text`
+ *   @return [RE2::Scanner] an `Enumerable` {RE2::Scanner} object
+ *   @raise [ArgumentError] if given a negative number of submatches, an
+ *     unknown capturing group name or number or an invalid output
+ *   @raise [TypeError] if `text` cannot be coerced to a `String` or given
+ *     invalid submatches
+ *   @example
+ *     r = RE2::Regexp.new('(?P<key>\w+)=(?P<value>\w+)')
+ *     r.scan("a=1 b=2", submatches: [:value]).to_a #=> [["1"], ["2"]]
+ *     r.scan("a=1 b=2", submatches: 1, output: :offsets).to_a
+ *     #=> [[[0, 1]], [[4, 5]]]
+ */
+static VALUE re2_regexp_scan(int argc, VALUE *argv, const VALUE self) {
+  VALUE text, options;
+  rb_scan_args(argc, argv, "11", &text, &options);
+
+  StringValue(text);
+  text = rb_str_new_frozen(text);
+
+  re2_pattern *p = unwrap_re2_regexp(self);
+  re2_scanner *c;
+  VALUE scanner = rb_class_new_instance(0, 0, re2_cScanner);
+  TypedData_Get_Struct(scanner, re2_scanner, &re2_scanner_data_type, c);
+
+  RB_OBJ_WRITE(scanner, &c->regexp, self);
+  RB_OBJ_WRITE(scanner, &c->text, text);
+  c->input = new(std::nothrow) re2::StringPiece(
+      RSTRING_PTR(c->text), RSTRING_LEN(c->text));
+  if (c->input == nullptr) {
+    rb_raise(rb_eNoMemError,
+             "not enough memory to allocate StringPiece for input");
+  }
+
+  if (p->pattern->ok()) {
+    c->number_of_capturing_groups = p->pattern->NumberOfCapturingGroups();
+  } else {
+    c->number_of_capturing_groups = 0;
+  }
+
+  if (RTEST(options)) {
+    if (TYPE(options) != T_HASH) {
+      options = rb_Hash(options);
+    }
+
+    VALUE submatches_option = rb_hash_aref(options, ID2SYM(id_submatches));
+    if (!NIL_P(submatches_option)) {
+      parse_re2_scanner_submatches(c, p->pattern, submatches_option);
+    }
+
+    VALUE output_option = rb_hash_aref(options, ID2SYM(id_output));
+    if (!NIL_P(output_option)) {
+      Check_Type(output_option, T_SYMBOL);
+
+      ID id_output_option = SYM2ID(output_option);
+      if (id_output_option == id_offsets) {
+        c->offsets = true;
+      } else if (id_output_option != id_strings) {
+        rb_raise(rb_eArgError, "output should be one of: :strings, :offsets");
+      }
+    }
+  }
+
+  c->eof = false;
+  c->scanning = false;
+  re2_scanner_allocate_buffers(c);
+
+  return scanner;
+}
+
+/*
+ * Returns the submatches of every match of the pattern in the given text,
+ * scanning the whole text in a single pass. This is equivalent to (but much
+ * faster than) `scan(text).to_a` with a Ruby loop as the GVL is released only
+ * once for the whole scan.
+ *
+ * Accepts the same options as {RE2::Regexp#scan} to select which submatches
+ * to return and whether to return them as strings or byte offsets.
+ *
+ * @param [String] text the text to scan
+ * @param [Hash] options the options with which to scan
+ * @return [Array<Array<String, nil>>] the submatches of every match
+ * @return [Array<Array<Array<Integer>, nil>>] the byte offsets of the
+ *   submatches of every match if `output: :offsets`
+ * @raise [ArgumentError] if given a negative number of submatches, an unknown
+ *   capturing group name or number or an invalid output
+ * @raise [NoMemoryError] if there was not enough memory to store the matches
+ * @raise [TypeError] if `text` cannot be coerced to a `String`
+ * @example
+ *   RE2::Regexp.new('(\w+)=(\d+)').scan_all("a=1 b=2")
+ *   #=> [["a", "1"], ["b", "2"]]
+ *   RE2::Regexp.new('(\w+)=(\d+)').scan_all("a=1 b=2", submatches: [2])
+ *   #=> [["1"], ["2"]]
+ */
+static VALUE re2_regexp_scan_all(int argc, VALUE *argv, const VALUE self) {
+  return re2_scanner_to_a(re2_regexp_scan(argc, argv, self));
+}
+
+/*
+ * Returns the byte offsets of every match of the pattern in the given text
+ * (and its submatches) in a single pass, finding matches in the same way as
+ * {RE2::Regexp#scan} but avoiding the allocation of any strings.
+ *
+ * Offsets are returned as one flat array of begin and end pairs for the
+ * overall match and each submatch of every match in turn, i.e. each match
+ * takes up `2 * (submatches + 1)` elements, with `nil`s for any submatch that
+ * did not participate in a match. Alternatively, they can be packed into a
+ * binary string of native 64-bit integers (with -1 for any submatch that did
+ * not participate in a match) which can be read with `unpack("q*")`.
+ *
+ * @param [String] text the text to scan
+ * @param [Hash] options the options with which to scan
+ * @option options [Integer] :submatches how many submatches to return offsets
+ *   for, defaults to the number of capturing groups
+ * @option options [Boolean] :pack (false) whether to pack the offsets into a
+ *   binary string
+ * @return [Array<Integer, nil>] the offsets of every match and its submatches
+ * @return [String] the offsets packed into a binary string if `pack: true`
+ * @raise [ArgumentError] if given a negative number of submatches
+ * @raise [NoMemoryError] if there was not enough memory to store the matches
+ * @raise [TypeError] if `text` cannot be coerced to a `String` or given
+ *   non-hash options
+ * @example
+ *   r = RE2::Regexp.new('(\w+)=(\d+)')
+ *   r.scan_offsets("a=1 bb=22") #=> [0, 3, 0, 1, 2, 3, 4, 9, 4, 6, 7, 9]
+ *   r.scan_offsets("a=1 bb=22", submatches: 0) #=> [0, 3, 4, 9]
+ */
+static VALUE re2_regexp_scan_offsets(int argc, VALUE *argv, const VALUE self) {
+  re2_count_call(re2_entry_scan);
+
+  VALUE text, options;
+  rb_scan_args(argc, argv, "11", &text, &options);
+
+  StringValue(text);
+  text = rb_str_new_frozen(text);
+
+  re2_pattern *p = unwrap_re2_regexp(self);
+
+  if (!p->pattern->ok()) {
+    return parse_re2_pack(options) ? rb_str_new(nullptr, 0) : rb_ary_new();
+  }
+
+  int n = p->pattern->NumberOfCapturingGroups();
+  bool pack = false;
+
+  if (RTEST(options)) {
+    Check_Type(options, T_HASH);
+
+    VALUE submatches_option = rb_hash_aref(options, ID2SYM(id_submatches));
+    if (!NIL_P(submatches_option)) {
+      n = NUM2INT(submatches_option);
+
+      if (n < 0) {
+        rb_raise(rb_eArgError, "number of matches should be >= 0");
+      }
+
+      if (n == INT_MAX) {
+        rb_raise(rb_eRangeError, "number of matches should be < %d", INT_MAX);
+      }
+    }
+
+    pack = parse_re2_pack(options);
+  }
+
+  re2_batch *batch;
+  VALUE wrapper = re2_batch_alloc(&batch);
+
+  nogvl_scan_offsets_arg arg;
+  arg.pattern = p->pattern;
+  arg.text = re2::StringPiece(RSTRING_PTR(text), RSTRING_LEN(text));
+  arg.n = n + 1;
+  arg.matches = &batch->matches;
+  arg.failed = false;
+
+  re2_call_without_gvl(nogvl_scan_offsets, &arg, arg.text.size());
+
+  if (arg.failed) {
+    rb_raise(rb_eNoMemError, "not enough memory to store matches");
+  }
+
+  VALUE offsets = re2_offsets_new(RSTRING_PTR(text), batch->matches.data(),
+      batch->matches.size(), pack);
+
+  RB_GC_GUARD(text);
+  RB_GC_GUARD(wrapper);
+
+  return offsets;
+}
+
+/* The number of bytes before the unscanned part of the buffer kept by
+ * {RE2::Regexp#scan_io} so that assertions such as `\b` still see the
+ * preceding character.
+ */
+static const long re2_scan_io_context = 4;
+
+struct nogvl_scan_io_arg {
+  const RE2 *pattern;
+  re2::StringPiece buffer;
+  size_t start;
+  size_t limit;
+  bool eof;
+  int n;
+  std::vector<re2::StringPiece> *matches;
+  size_t next;
+  bool failed;
+};
+
+/* Finds every match in a buffer of streamed input that starts before `limit`
+ * and ends before the end of the buffer (unless the input is exhausted, when
+ * every match is found), as matches closer to the end could be different
+ * once more input has been read. Sets `next` to where scanning should resume.
+ */
+static void *nogvl_scan_io(void *ptr) {
+  auto *arg = static_cast<nogvl_scan_io_arg *>(ptr);
+  const re2::StringPiece &buffer = arg->buffer;
+  size_t length = buffer.size();
+  size_t pos = arg->start;
+  int n = arg->n;
+
+  try {
+    std::vector<re2::StringPiece> &matches = *arg->matches;
+
+    while (arg->eof || pos < arg->limit) {
+      size_t offset = matches.size();
+      matches.resize(offset + n);
+
+#ifdef HAVE_ENDPOS_ARGUMENT
+      bool matched = arg->pattern->Match(
+          buffer, pos, length, RE2::UNANCHORED, &matches[offset], n);
+#else
+      bool matched = arg->pattern->Match(
+          buffer, pos, RE2::UNANCHORED, &matches[offset], n);
+#endif
+      if (!matched) {
+        matches.resize(offset);
+        pos = arg->eof ? length : std::max(pos, arg->limit);
+        break;
+      }
+
+      const re2::StringPiece &match = matches[offset];
+      size_t begin = match.data() - buffer.data();
+      size_t end = begin + match.size();
+
+      if (!arg->eof && (begin >= arg->limit || end >= length)) {
+        matches.resize(offset);
+        pos = begin;
+        break;
+      }
+
+      if (end == length) {
+        pos = length;
+        break;
+      }
+
+      if (end > pos) {
+        pos = end;
+      } else {
+        pos += re2_char_size(arg->pattern,
+            re2::StringPiece(buffer.data() + pos, length - pos));
+      }
+    }
+  } catch (const std::bad_alloc &) {
+    arg->failed = true;
+  }
+
+  arg->next = pos;
+
+  return nullptr;
+}
+
+/*
+ * Scans text read from `io` (any object responding to `read(length,
+ * buffer)` such as a `File` or `StringIO`) for matches of the pattern,
+ * yielding each in turn. Unlike {RE2::Regexp#scan}, the input is never held
+ * in memory all at once: it is read `chunk_size` bytes at a time into a
+ * buffer that is reused throughout, keeping only the unscanned end of the
+ * previous chunk so that matches spanning chunks are still found.
+ *
+ * Matches are found by searching the input as a whole, so `^` only matches
+ * at the start of the input (or of a line with `(?m)`). This differs from
+ * {RE2::Regexp#scan} and {RE2::Regexp#scan_offsets}, which search the rest of
+ * the text after each match as if it were new text, so `^` matches again
+ * wherever the previous match ended. Like `String#scan`, the whole match is
+ * yielded if the pattern has no capturing groups. To find matches spanning
+ * chunks, no match may be longer than
+ * `max_match_length` bytes: a match that is longer is only found correctly if
+ * it fits within the buffer when it is scanned, which may require buffering
+ * more input.
+ *
+ * @param [#read] io the input to scan
+ * @param [Hash] options the options with which to scan
+ * @option options [Integer] :chunk_size (65536) how many bytes to read at a
+ *   time
+ * @option options [Integer] :max_match_length (4096) the length in bytes of
+ *   the longest possible match
+ * @option options [Symbol] :output (:strings) either :strings to yield each
+ *   match as strings or :offsets to yield the `[begin, end]` byte offsets of
+ *   the whole match from the start of the input
+ * @yieldparam [String, Array<String, nil>, Array<Integer>] match the whole
+ *   match, its submatches or its offsets
+ * @return [RE2::Regexp] the regexp
+ * @return [Enumerator] if no block is given
+ * @raise [ArgumentError] if given a chunk size or maximum match length that is
+ *   not positive or an invalid output
+ * @raise [NoMemoryError] if there was not enough memory to store the matches
+ * @raise [TypeError] if `io` does not return `String`s
+ * @example
+ *   File.open("production.log") do |file|
+ *     RE2('status=(\d+)').scan_io(file) { |(status)| puts status }
+ *   end
+ *   RE2('\d+').scan_io(StringIO.new("1 22 333"), output: :offsets).to_a
+ *   #=> [[0, 1], [2, 4], [5, 8]]
+ */
+static VALUE re2_regexp_scan_io(int argc, VALUE *argv, const VALUE self) {
+  VALUE io, options;
+  rb_scan_args(argc, argv, "11", &io, &options);
+
+  RETURN_ENUMERATOR(self, argc, argv);
+
+  re2_count_call(re2_entry_scan);
+
+  re2_pattern *p = unwrap_re2_regexp(self);
+  long chunk_size = 65536;
+  long max_match_length = 4096;
+  bool offsets = false;
+
+  if (RTEST(options)) {
+    Check_Type(options, T_HASH);
+
+    VALUE chunk_size_option = rb_hash_aref(options, ID2SYM(id_chunk_size));
+    if (!NIL_P(chunk_size_option)) {
+      chunk_size = NUM2LONG(chunk_size_option);
+
+      if (chunk_size <= 0) {
+        rb_raise(rb_eArgError, "chunk size should be > 0");
+      }
+    }
+
+    VALUE max_match_length_option = rb_hash_aref(options,
+        ID2SYM(id_max_match_length));
+    if (!NIL_P(max_match_length_option)) {
+      max_match_length = NUM2LONG(max_match_length_option);
+
+      if (max_match_length <= 0) {
+        rb_raise(rb_eArgError, "max match length should be > 0");
+      }
+    }
+
+    VALUE output_option = rb_hash_aref(options, ID2SYM(id_output));
+    if (!NIL_P(output_option)) {
+      Check_Type(output_option, T_SYMBOL);
+
+      ID id_output_option = SYM2ID(output_option);
+      if (id_output_option == id_offsets) {
+        offsets = true;
+      } else if (id_output_option != id_strings) {
+        rb_raise(rb_eArgError, "output should be one of: :strings, :offsets");
+      }
+    }
+  }
+
+  if (!p->pattern->ok()) {
+    return self;
+  }
+
+  int groups = p->pattern->NumberOfCapturingGroups();
+  int n = offsets ? 1 : groups + 1;
+  RE2::Options::Encoding encoding = p->pattern->options().encoding();
+
+  /* The chunk is handed to io.read to fill while the buffer is hidden so that
+   * only this method can change it, including while scanning without the
+   * GVL.
+   */
+  VALUE chunk = rb_str_buf_new(chunk_size);
+  VALUE buffer = rb_str_buf_new(
+      chunk_size + max_match_length + re2_scan_io_context);
+  rb_obj_hide(buffer);
+
+  re2_batch *batch;
+  VALUE wrapper = re2_batch_alloc(&batch);
+
+  long start = 0;
+  long position = 0;
+  bool eof = false;
+
+  while (!eof) {
+    VALUE read = rb_funcall(io, id_read, 2, LONG2NUM(chunk_size), chunk);
+    if (NIL_P(read)) {
+      eof = true;
+    } else {
+      StringValue(read);
+      rb_str_buf_cat(buffer, RSTRING_PTR(read), RSTRING_LEN(read));
+    }
+
+    long length = RSTRING_LEN(buffer);
+    long limit = length - max_match_length;
+    if (!eof && limit <= start) {
+      continue;
+    }
+
+    batch->matches.clear();
+
+    nogvl_scan_io_arg arg;
+    arg.pattern = p->pattern;
+    arg.buffer = re2::StringPiece(RSTRING_PTR(buffer), length);
+    arg.start = start;
+    arg.limit = eof ? length : limit;
+    arg.eof = eof;
+    arg.n = n;
+    arg.matches = &batch->matches;
+    arg.next = start;
+    arg.failed = false;
+
+    re2_call_without_gvl(nogvl_scan_io, &arg, length - start);
+
+    if (arg.failed) {
+      rb_raise(rb_eNoMemError, "not enough memory to store matches");
+    }
+
+    const char *base = RSTRING_PTR(buffer);
+    for (size_t i = 0; i < batch->matches.size(); i += n) {
+      const re2::StringPiece *match = &batch->matches[i];
+
+      if (offsets) {
+        long begin = position + (match->data() - base);
+        rb_yield(rb_assoc_new(LONG2NUM(begin),
+              LONG2NUM(begin + static_cast<long>(match->size()))));
+      } else if (groups == 0) {
+        rb_yield(encoded_str_new(match->data(), match->size(), encoding));
+      } else {
+        VALUE submatches = rb_ary_new_capa(groups);
+        for (int j = 1; j < n; ++j) {
+          if (match[j].data() == nullptr) {
+            rb_ary_push(submatches, Qnil);
+          } else {
+            rb_ary_push(submatches,
+                encoded_str_new(match[j].data(), match[j].size(), encoding));
+          }
+        }
+        rb_yield(submatches);
+      }
+    }
+
+    /* Discard everything already scanned but a little context. */
+    long next = static_cast<long>(arg.next);
+    long discard = std::max(next - re2_scan_io_context, 0L);
+    if (discard > 0) {
+      char *data = RSTRING_PTR(buffer);
+      memmove(data, data + discard, length - discard);
+      rb_str_set_len(buffer, length - discard);
+      position += discard;
+    }
+    start = next - discard;
+  }
+
+  RB_GC_GUARD(chunk);
+  RB_GC_GUARD(buffer);
+  RB_GC_GUARD(wrapper);
+
+  return self;
+}
+
+/* The smallest partition of a file worth searching on a separate thread. */
+static const size_t re2_search_file_min_partition = 64 * 1024;
+
+/* How many bytes of a file each partition reads at a time. */
+static const size_t re2_search_file_block = 64 * 1024;
+
+/* A file open for searching, read with pread so that partitions can be read
+ * independently (or, where that is not supported, read in order by a single
+ * partition).
+ */
+struct re2_file {
+#ifdef HAVE_PARTITIONED_READS
+  int fd;
+#else
+  FILE *file;
+#endif
+
+  /* Reads up to `size` bytes from `offset`, returning how many were read (0
+   * at the end of the file) or -1 with `errno` set.
+   */
+  long read(char *buffer, size_t size, uint64_t offset) const {
+#ifdef HAVE_PARTITIONED_READS
+    for (;;) {
+      ssize_t bytes = pread(fd, buffer, size, static_cast<off_t>(offset));
+      if (bytes >= 0 || errno != EINTR) {
+        return static_cast<long>(bytes);
+      }
+    }
+#else
+    (void)offset;
+    size_t bytes = fread(buffer, 1, size, file);
+    if (bytes == 0 && ferror(file)) {
+      errno = errno ? errno : EIO;
+
+      return -1;
+    }
+
+    return static_cast<long>(bytes);
+#endif
+  }
+};
+
+struct nogvl_search_file_arg {
+  const char *path;
+  const RE2 *pattern;
+  const RE2::Set *set;
+  bool offsets;
+  re2_file_matches *results;
+  size_t threads;
+  re2_thread_pool::workers *workers;
+  int error;
+  std::atomic<int> read_error;
+  std::atomic<int> set_error;
+};
+
+/* Matches a single line (without its trailing newline) starting at `offset`
+ * in the file, recording its line number within the partition followed by
+ * either the offsets of the match (for a regexp) or the offset of the line
+ * and the number of matching patterns (for a set, with their indices appended
+ * to the partition's list of indices).
+ */
+static void re2_search_line(nogvl_search_file_arg *arg, size_t chunk,
+    const re2::StringPiece &text, uint64_t offset, int64_t line,
+    std::vector<int> *v) {
+  std::vector<int64_t> &hits = arg->results->hits[chunk];
+
+  if (arg->pattern) {
+    re2::StringPiece match;
+#ifdef HAVE_ENDPOS_ARGUMENT
+    bool matched = arg->pattern->Match(text, 0, text.size(),
+        RE2::UNANCHORED, &match, arg->offsets ? 1 : 0);
+#else
+    bool matched = arg->pattern->Match(text, 0, RE2::UNANCHORED, &match,
+        arg->offsets ? 1 : 0);
+#endif
+    if (matched) {
+      hits.push_back(line);
+      if (arg->offsets) {
+        int64_t begin = offset + (match.data() - text.data());
+        hits.push_back(begin);
+        hits.push_back(begin + match.size());
+      }
+    }
+  } else {
+    bool matched;
+#ifdef HAVE_ERROR_INFO_ARGUMENT
+    RE2::Set::ErrorInfo e;
+    matched = arg->set->Match(text, v, &e);
+    if (!matched && e.kind != RE2::Set::kNoError) {
+      arg->set_error.store(e.kind, std::memory_order_relaxed);
+    }
+#else
+    matched = arg->set->Match(text, v);
+#endif
+    if (matched) {
+      std::vector<int> &indices = arg->results->indices[chunk];
+      hits.push_back(line);
+      hits.push_back(offset);
+      hits.push_back(v->size());
+      indices.insert(indices.end(), v->begin(), v->end());
+    }
+  }
+}
+
+/* Searches every line of the file starting at or after `begin` and before
+ * `end`, reading a block at a time so that only the current line needs to be
+ * held in memory. Lines are read to their end even past `end` and a file that
+ * is truncated while it is searched simply ends sooner. Records the number of
+ * lines in the partition.
+ */
+static void re2_search_partition(nogvl_search_file_arg *arg, size_t chunk,
+    const re2_file &file, uint64_t begin, uint64_t end) {
+  int64_t line = 0;
+
+  try {
+    std::vector<int> v;
+    std::string buffer;
+    uint64_t base = begin;
+    size_t cursor = 0;
+    bool eof = false;
+
+    /* Reads the next block onto the end of the buffer, discarding everything
+     * before the cursor.
+     */
+    auto fill = [&]() {
+      buffer.erase(0, cursor);
+      base += cursor;
+      cursor = 0;
+
+      size_t size = buffer.size();
+      buffer.resize(size + re2_search_file_block);
+      long bytes = file.read(&buffer[size], re2_search_file_block,
+          base + size);
+      buffer.resize(size + std::max(bytes, 0L));
+
+      if (bytes <= 0) {
+        eof = true;
+        if (bytes < 0) {
+          arg->read_error.store(errno, std::memory_order_relaxed);
+        }
+      }
+    };
+
+    /* Skip the end of a line started by the previous partition. */
+    if (begin > 0) {
+      base = begin - 1;
+
+      for (;;) {
+        const void *newline = memchr(buffer.data() + cursor, '\n',
+            buffer.size() - cursor);
+        if (newline) {
+          cursor = static_cast<const char *>(newline) - buffer.data() + 1;
+          break;
+        }
+        cursor = buffer.size();
+        if (eof) {
+          break;
+        }
+        fill();
+      }
+    }
+
+    while (base + cursor < end) {
+      const void *newline = memchr(buffer.data() + cursor, '\n',
+          buffer.size() - cursor);
+
+      if (newline == nullptr) {
+        if (!eof) {
+          fill();
+          continue;
+        }
+        if (cursor == buffer.size()) {
+          break;
+        }
+        newline = buffer.data() + buffer.size();
+      }
+
+      size_t stop = static_cast<const char *>(newline) - buffer.data();
+      re2_search_line(arg, chunk,
+          re2::StringPiece(buffer.data() + cursor, stop - cursor),
+          base + cursor, line, &v);
+
+      line += 1;
+      cursor = std::min(stop + 1, buffer.size());
+      if (stop == buffer.size()) {
+        break;
+      }
+    }
+  } catch (const std::bad_alloc &) {
+    arg->results->failed = true;
+  }
+
+  arg->results->lines[chunk] = line;
+}
+
+/* Searches the lines of the file, `size` bytes long when it was opened, in
+ * partitions spread across the thread pool. The last partition searches to
+ * the end of the file, however long it is.
+ */
+static void re2_search_file_partitions(nogvl_search_file_arg *arg,
+    const re2_file &file, uint64_t size) {
+  re2_file_matches *results = arg->results;
+  size_t chunks = re2_chunks(size / re2_search_file_min_partition + 1,
+      arg->threads);
+
+  results->hits.assign(chunks, std::vector<int64_t>());
+  results->indices.assign(chunks, std::vector<int>());
+  results->lines.assign(chunks, 0);
+
+  re2_thread_pool::run(arg->workers, chunks, [&](size_t chunk) {
+    uint64_t begin = size * chunk / chunks;
+    uint64_t end = chunk + 1 == chunks ? UINT64_MAX
+      : size * (chunk + 1) / chunks;
+
+    re2_search_partition(arg, chunk, file, begin, end);
+  });
+
+  int read_error = arg->read_error.load(std::memory_order_relaxed);
+  if (read_error != 0) {
+    arg->error = read_error;
+  }
+}
+
+/* Opens the file at `path` and searches it, setting `error` to an `errno` if
+ * it could not be read. Only regular files are searched so that a pipe
+ * cannot block the search.
+ */
+static void *nogvl_search_file(void *ptr) {
+  auto *arg = static_cast<nogvl_search_file_arg *>(ptr);
+
+  try {
+#ifdef HAVE_PARTITIONED_READS
+    /* Opening a FIFO without O_NONBLOCK waits for a writer. */
+    int fd = open(arg->path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd < 0) {
+      arg->error = errno;
+
+      return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      arg->error = errno;
+      close(fd);
+
+      return nullptr;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+      arg->error = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+      close(fd);
+
+      return nullptr;
+    }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    re2_file file;
+    file.fd = fd;
+
+    try {
+      re2_search_file_partitions(arg, file, static_cast<uint64_t>(st.st_size));
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+
+    close(fd);
+#else
+    FILE *fp = fopen(arg->path, "rb");
+    if (fp == nullptr) {
+      arg->error = errno;
+
+      return nullptr;
+    }
+
+    /* Without pread, the file can only be read in order by one partition. */
+    re2_file file;
+    file.file = fp;
+    arg->threads = 1;
+
+    try {
+      re2_search_file_partitions(arg, file, 0);
+    } catch (...) {
+      fclose(fp);
+      throw;
+    }
+
+    fclose(fp);
+#endif
+  } catch (const std::bad_alloc &) {
+    arg->results->failed = true;
+  }
+
+  return nullptr;
+}
+
+/* Searches the file at the given path, raising if it could not be read or
+ * there was not enough memory to store the results.
+ */
+static void re2_search_file_without_gvl(VALUE path,
+    nogvl_search_file_arg *arg) {
+  arg->path = RSTRING_PTR(path);
+  arg->workers = nullptr;
+  arg->error = 0;
+  arg->read_error.store(0, std::memory_order_relaxed);
+  arg->set_error.store(0, std::memory_order_relaxed);
+  arg->results->failed = false;
+
+#ifdef _WIN32
+  arg->threads = 1;
+  nogvl_search_file(arg);
+#else
+  std::shared_ptr<re2_thread_pool::workers> workers;
+  if (arg->threads > 1) {
+    workers = thread_pool.acquire();
+    arg->workers = workers.get();
+  }
+
+  re2_release_gvl(nogvl_search_file, arg);
+#endif
+
+  RB_GC_GUARD(path);
+
+  if (arg->error != 0) {
+    rb_syserr_fail_str(arg->error, path);
+  }
+
+  if (arg->results->failed) {
+    rb_raise(rb_eNoMemError, "not enough memory to store matches");
+  }
+}
+
+/* Coerces the path given to search_file and parses its options. */
+static VALUE parse_re2_search_file(int argc, VALUE *argv, size_t *threads,
+    bool *offsets) {
+  VALUE path, options;
+  rb_scan_args(argc, argv, "11", &path, &options);
+
+  FilePathValue(path);
+  path = rb_str_new_frozen(rb_str_encode_ospath(path));
+  StringValueCStr(path);
+
+  *threads = thread_pool.size();
+  *offsets = false;
+
+  if (RTEST(options)) {
+    Check_Type(options, T_HASH);
+
+    *threads = parse_re2_threads(options, *threads);
+
+    VALUE output_option = rb_hash_aref(options, ID2SYM(id_output));
+    if (!NIL_P(output_option)) {
+      Check_Type(output_option, T_SYMBOL);
+
+      ID id_output_option = SYM2ID(output_option);
+      if (id_output_option == id_offsets) {
+        *offsets = true;
+      } else if (id_output_option != id_lines) {
+        rb_raise(rb_eArgError, "output should be one of: :lines, :offsets");
+      }
+    }
+  }
+
+  return path;
+}
+
+/*
+ * Searches every line of the file at `path` for the pattern, returning the
+ * line numbers (starting from 1) of matching lines or the byte offsets of the
+ * first match on each, in file order.
+ *
+ * The file is read a block at a time rather than into a `String` and split
+ * into partitions at line boundaries which are read and searched in parallel
+ * on the thread pool (see {RE2.thread_pool_size=}) without the GVL (where
+ * supported). A file that is truncated while it is searched is only searched
+ * up to its new end. Each line is matched on its own without its trailing newline so `^`
+ * and `$` match at the start and end of every line.
+ *
+ * @param [String, Pathname] path the path of the file to search
+ * @param [Hash] options the options with which to search
+ * @option options [Integer] :threads (RE2.thread_pool_size) how many threads
+ *   to search with
+ * @option options [Symbol] :output (:lines) either :lines to return line
+ *   numbers or :offsets to return the `[begin, end]` byte offsets of the
+ *   first match on each matching line from the start of the file
+ * @return [Array<Integer>] the numbers of the matching lines
+ * @return [Array<Array(Integer, Integer)>] the offsets of the first match on
+ *   each matching line if `output: :offsets`
+ * @raise [ArgumentError] if given fewer than 1 thread or an invalid output
+ * @raise [NoMemoryError] if there was not enough memory to store the matches
+ * @raise [SystemCallError] if the file could not be read or is not a regular
+ *   file
+ * @example
+ *   RE2('ERROR|FATAL').search_file("production.log") #=> [12, 407]
+ *   RE2('ERROR').search_file("production.log", output: :offsets)
+ *   #=> [[1032, 1037]]
+ */
+static VALUE re2_regexp_search_file(int argc, VALUE *argv, const VALUE self) {
+  size_t threads;
+  bool offsets;
+  VALUE path = parse_re2_search_file(argc, argv, &threads, &offsets);
+
+  re2_pattern *p = unwrap_re2_regexp(self);
+  if (!p->pattern->ok()) {
+    return rb_ary_new();
+  }
+
+  re2_file_matches *results;
+  VALUE wrapper = re2_file_matches_alloc(&results);
+
+  nogvl_search_file_arg arg;
+  arg.pattern = p->pattern;
+  arg.set = nullptr;
+  arg.offsets = offsets;
+  arg.results = results;
+  arg.threads = threads;
+
+  re2_search_file_without_gvl(path, &arg);
+
+  VALUE result = rb_ary_new();
+  int64_t line = 1;
+
+  for (size_t chunk = 0; chunk < results->hits.size(); ++chunk) {
+    const std::vector<int64_t> &hits = results->hits[chunk];
+    size_t width = offsets ? 3 : 1;
+
+    for (size_t i = 0; i < hits.size(); i += width) {
+      if (offsets) {
+        rb_ary_push(result,
+            rb_assoc_new(LL2NUM(hits[i + 1]), LL2NUM(hits[i + 2])));
+      } else {
+        rb_ary_push(result, LL2NUM(line + hits[i]));
+      }
+    }
+
+    line += results->lines[chunk];
+  }
+
+  RB_GC_GUARD(wrapper);
+
+  return result;
+}
+
+/*
+ * Returns whether the underlying RE2 version supports passing an `endpos`
+ * argument to
+ * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L562-L588
+ * Match}. If not, {RE2::Regexp#match} will raise an error if attempting to
+ * pass an `endpos`.
+ *
+ * @return [Boolean] whether the underlying
+ *   {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L562-L588
+ *   Match} has an endpos argument
+ */
+static VALUE re2_regexp_match_has_endpos_argument_p(VALUE) {
+#ifdef HAVE_ENDPOS_ARGUMENT
+  return Qtrue;
+#else
+  return Qfalse;
+#endif
+}
+
+/*
+ * Returns a copy of `str` with the first occurrence `pattern` replaced with
+ * `rewrite` using
+ * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L465-L480
+ * `Replace`}.
+ *
+ * Patterns given as a `String` are compiled once and kept in a bounded cache
+ * shared by {RE2.replace}, {RE2.global_replace} and {RE2.extract} (see
+ * {RE2.pattern_cache_capacity}).
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @param [String] str the string to modify
+ * @param [String, RE2::Regexp] pattern a regexp matching text to be replaced
+ * @param [String] rewrite the string to replace with
+ * @return [String] the resulting string
+ * @raise [TypeError] if the given rewrite or pattern (if not provided as a
+ *   {RE2::Regexp}) cannot be coerced to `String`s
+ * @example
+ *   RE2.replace("hello there", "hello", "howdy") #=> "howdy there"
+ *   re2 = RE2::Regexp.new("hel+o")
+ *   RE2.replace("hello there", re2, "yo")        #=> "yo there"
+ */
+static VALUE re2_replace(VALUE, VALUE str, VALUE pattern,
+    VALUE rewrite) {
+  re2_count_call(re2_entry_replace);
+
+  re2_pattern *p = nullptr;
+
+  /* Coerce and freeze all arguments before any C++ allocations so that any
+   * Ruby exceptions (via longjmp) cannot bypass C++ destructors and leak
+   * memory, and later coercions cannot mutate earlier strings.
+   */
+  StringValue(str);
+  str = rb_str_new_frozen(str);
+  if (rb_obj_is_kind_of(pattern, re2_cRegexp)) {
+    p = unwrap_re2_regexp(pattern);
+  } else {
+    StringValue(pattern);
+    pattern = rb_str_new_frozen(pattern);
+  }
+  StringValue(rewrite);
+  rewrite = rb_str_new_frozen(rewrite);
+
+  VALUE result = Qnil;
+  bool compiled;
+
+  {
+    /* Take a copy of str so it can be modified in-place by RE2::Replace. */
+    std::string str_as_string(RSTRING_PTR(str), RSTRING_LEN(str));
+
+    nogvl_replace_arg arg;
+    arg.str = &str_as_string;
+    if (p) {
+      arg.pattern = p->pattern;
+      arg.literal = p->literal;
+    } else {
+      arg.pattern = nullptr;
+      arg.literal = nullptr;
+      arg.string_pattern = re2::StringPiece(
+          RSTRING_PTR(pattern), RSTRING_LEN(pattern));
+    }
+    arg.rewrite = re2::StringPiece(
+        RSTRING_PTR(rewrite), RSTRING_LEN(rewrite));
+    arg.compiled = true;
+
+    re2_call_without_gvl(nogvl_replace, &arg, arg.str->size());
+
+    RB_GC_GUARD(rewrite);
+    RB_GC_GUARD(pattern);
+
+    compiled = arg.compiled;
+    if (compiled) {
+      result = encoded_str_new(str_as_string.data(), str_as_string.size(),
+          p ? p->pattern->options().encoding()
+            : RE2::Options::EncodingUTF8);
+    }
+  }
+
+  /* Raise outside of the block so that str_as_string's destructor runs. */
+  if (!compiled) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate RE2 object");
+  }
+
+  return result;
+}
+
+/*
+ * Return a copy of `str` with `pattern` replaced by `rewrite` using
+ * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L482-L497
+ * `GlobalReplace`}.
+ *
+ * Patterns given as a `String` are compiled once and kept in a bounded cache
+ * shared by {RE2.replace}, {RE2.global_replace} and {RE2.extract} (see
+ * {RE2.pattern_cache_capacity}).
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @param [String] str the string to modify
+ * @param [String, RE2::Regexp] pattern a regexp matching text to be replaced
+ * @param [String] rewrite the string to replace with
+ * @raise [TypeError] if the given rewrite or pattern (if not provided as a
+ *   {RE2::Regexp}) cannot be coerced to `String`s
+ * @return [String] the resulting string
+ * @example
+ *   re2 = RE2::Regexp.new("oo?")
+ *   RE2.global_replace("whoops-doops", re2, "e") #=> "wheps-deps"
+ *   RE2.global_replace("hello there", "e", "i")  #=> "hillo thiri"
+ */
+static VALUE re2_global_replace(VALUE, VALUE str, VALUE pattern,
+                               VALUE rewrite) {
+  re2_count_call(re2_entry_global_replace);
+
+  re2_pattern *p = nullptr;
+
+  /* Coerce and freeze all arguments before any C++ allocations so that any
+   * Ruby exceptions (via longjmp) cannot bypass C++ destructors and leak
+   * memory, and later coercions cannot mutate earlier strings.
+   */
+  StringValue(str);
+  str = rb_str_new_frozen(str);
+  if (rb_obj_is_kind_of(pattern, re2_cRegexp)) {
+    p = unwrap_re2_regexp(pattern);
+  } else {
+    StringValue(pattern);
+    pattern = rb_str_new_frozen(pattern);
+  }
+  StringValue(rewrite);
+  rewrite = rb_str_new_frozen(rewrite);
+
+  VALUE result = Qnil;
+  bool compiled;
+
+  {
+    /* Take a copy of str so it can be modified in-place by
+     * RE2::GlobalReplace.
+     */
+    std::string str_as_string(RSTRING_PTR(str), RSTRING_LEN(str));
+
+    nogvl_replace_arg arg;
+    arg.str = &str_as_string;
+    if (p) {
+      arg.pattern = p->pattern;
+      arg.literal = p->literal;
+    } else {
+      arg.pattern = nullptr;
+      arg.literal = nullptr;
+      arg.string_pattern = re2::StringPiece(
+          RSTRING_PTR(pattern), RSTRING_LEN(pattern));
+    }
+    arg.rewrite = re2::StringPiece(
+        RSTRING_PTR(rewrite), RSTRING_LEN(rewrite));
+    arg.compiled = true;
+
+    re2_call_without_gvl(nogvl_global_replace, &arg, arg.str->size());
+
+    RB_GC_GUARD(rewrite);
+    RB_GC_GUARD(pattern);
+
+    compiled = arg.compiled;
+    if (compiled) {
+      result = encoded_str_new(str_as_string.data(), str_as_string.size(),
+          p ? p->pattern->options().encoding()
+            : RE2::Options::EncodingUTF8);
+    }
+  }
+
+  /* Raise outside of the block so that str_as_string's destructor runs. */
+  if (!compiled) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate RE2 object");
+  }
+
+  return result;
+}
+
+/*
+ * If `pattern` matches `text`, returns a copy of `rewrite` with substitutions
+ * using
+ * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L499-L510
+ * `Extract`}. Non-matching portions of `text` are ignored.
+ *
+ * Patterns given as a `String` are compiled once and kept in a bounded cache
+ * shared by {RE2.replace}, {RE2.global_replace} and {RE2.extract} (see
+ * {RE2.pattern_cache_capacity}).
+ *
+ * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
+ * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
+ * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ *
+ * @param [String] text the string from which to extract
+ * @param [String, RE2::Regexp] pattern a regexp matching the text
+ * @param [String] rewrite the rewrite string with `\1`-style substitutions
+ * @return [String, nil] the extracted string on a successful match or nil if
+ *   there is no match
+ * @raise [TypeError] if the given rewrite or pattern (if not provided as a
+ *   {RE2::Regexp}) cannot be coerced to `String`s
+ * @example
+ *   RE2.extract("alice@example.com", '(\w+)@(\w+)', '\2-\1')
+ *   #=> "example-alice"
+ *   RE2.extract("no match", '(\d+)', '\1') #=> nil
+ */
+static VALUE re2_extract(VALUE, VALUE text, VALUE pattern,
+    VALUE rewrite) {
+  re2_count_call(re2_entry_extract);
+
+  re2_pattern *p = nullptr;
+
+  /* Coerce and freeze all arguments before any C++ allocations so that any
+   * Ruby exceptions (via longjmp) cannot bypass C++ destructors and leak
+   * memory, and later coercions cannot mutate earlier strings.
+   */
+  StringValue(text);
+  text = rb_str_new_frozen(text);
+  if (rb_obj_is_kind_of(pattern, re2_cRegexp)) {
+    p = unwrap_re2_regexp(pattern);
+  } else {
+    StringValue(pattern);
+    pattern = rb_str_new_frozen(pattern);
+  }
+  StringValue(rewrite);
+  rewrite = rb_str_new_frozen(rewrite);
+
+  VALUE result = Qnil;
+  bool compiled;
+
+  {
+    std::string out;
+
+    nogvl_extract_arg arg;
+    arg.text = re2::StringPiece(RSTRING_PTR(text), RSTRING_LEN(text));
+    if (p) {
+      arg.pattern = p->pattern;
+    } else {
+      arg.pattern = nullptr;
+      arg.string_pattern = re2::StringPiece(
+          RSTRING_PTR(pattern), RSTRING_LEN(pattern));
+    }
+    arg.rewrite = re2::StringPiece(
+        RSTRING_PTR(rewrite), RSTRING_LEN(rewrite));
+    arg.out = &out;
+    arg.extracted = false;
+    arg.compiled = true;
+
+    re2_call_without_gvl(nogvl_extract, &arg, arg.text.size());
+
+    RB_GC_GUARD(text);
+    RB_GC_GUARD(rewrite);
+    RB_GC_GUARD(pattern);
+
+    compiled = arg.compiled;
+    if (arg.extracted) {
+      result = encoded_str_new(out.data(), out.size(),
+          p ? p->pattern->options().encoding()
+            : RE2::Options::EncodingUTF8);
+    }
+  }
+
+  /* Raise outside of the block so that out's destructor runs. */
+  if (!compiled) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate RE2 object");
+  }
+
+  return result;
+}
+
+/*
+ * Returns a version of `str` with all potentially meaningful regexp characters
+ * escaped using
+ * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L512-L518
+ * `QuoteMeta`}. The returned string, used as a regular expression, will
+ * exactly match the original string.
+ *
+ * @param [String] unquoted the unquoted string
+ * @raise [TypeError] if the given unquoted string cannot be coerced to a `String`
+ * @return [String] the escaped string
+ * @example
+ *   RE2.escape("1.5-2.0?")         #=> "1\\.5\\-2\\.0\\?"
+ *   RE2.quote("1.5-2.0?")          #=> "1\\.5\\-2\\.0\\?"
+ *   RE2::Regexp.escape("1.5-2.0?") #=> "1\\.5\\-2\\.0\\?"
+ *   RE2::Regexp.quote("1.5-2.0?")  #=> "1\\.5\\-2\\.0\\?"
+ */
+static VALUE re2_escape(VALUE, VALUE unquoted) {
+  StringValue(unquoted);
+
+  std::string quoted_string = RE2::QuoteMeta(
+      re2::StringPiece(RSTRING_PTR(unquoted), RSTRING_LEN(unquoted)));
+
+  return rb_str_new(quoted_string.data(), quoted_string.size());
+}
+
+/*
+ * Returns the maximum number of compiled patterns kept by the cache used when
+ * {RE2.replace}, {RE2.global_replace} and {RE2.extract} are given a pattern as
+ * a `String` rather than an {RE2::Regexp}.
+ *
+ * @return [Integer] the capacity of the pattern cache
+ * @example
+ *   RE2.pattern_cache_capacity #=> 128
+ */
+static VALUE re2_pattern_cache_capacity(VALUE) {
+  return SIZET2NUM(pattern_cache.capacity());
+}
+
+/*
+ * Sets the maximum number of compiled patterns kept by the cache used when
+ * {RE2.replace}, {RE2.global_replace} and {RE2.extract} are given a pattern as
+ * a `String`, evicting the least recently used patterns if necessary. A
+ * capacity of 0 disables caching.
+ *
+ * @param [Integer] capacity the maximum number of patterns to cache
+ * @return [Integer] the new capacity
+ * @raise [ArgumentError] if given a negative capacity
+ * @example
+ *   RE2.pattern_cache_capacity = 1024
+ */
+static VALUE re2_pattern_cache_capacity_set(VALUE, VALUE capacity) {
+  ssize_t value = NUM2SSIZET(capacity);
+
+  if (value < 0) {
+    rb_raise(rb_eArgError, "capacity should be >= 0");
+  }
+
+  pattern_cache.set_capacity(static_cast<size_t>(value));
+
+  return capacity;
+}
+
+/*
+ * Returns statistics for the cache of compiled patterns used when
+ * {RE2.replace}, {RE2.global_replace} and {RE2.extract} are given a pattern as
+ * a `String`.
+ *
+ * @return [Hash] the number of cached patterns (`:size`), the cache's
+ *   `:capacity` and the number of cache `:hits` and `:misses`
+ * @example
+ *   RE2.global_replace("secret=abc", 'secret=\S+', "secret=[FILTERED]")
+ *   RE2.global_replace("secret=def", 'secret=\S+', "secret=[FILTERED]")
+ *   RE2.pattern_cache_stats #=> {size: 1, capacity: 128, hits: 1, misses: 1}
+ */
+static VALUE re2_pattern_cache_stats(VALUE) {
+  size_t size, capacity;
+  uint64_t hits, misses;
+  pattern_cache.stats(&size, &capacity, &hits, &misses);
+
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(id_size), SIZET2NUM(size));
+  rb_hash_aset(stats, ID2SYM(id_capacity), SIZET2NUM(capacity));
+  rb_hash_aset(stats, ID2SYM(id_hits), ULL2NUM(hits));
+  rb_hash_aset(stats, ID2SYM(id_misses), ULL2NUM(misses));
+
+  return stats;
+}
+
+/*
+ * Removes all compiled patterns from the cache used when {RE2.replace},
+ * {RE2.global_replace} and {RE2.extract} are given a pattern as a `String`
+ * and resets its hit and miss counters.
+ *
+ * @return [nil]
+ * @example
+ *   RE2.clear_pattern_cache
+ *   RE2.pattern_cache_stats #=> {size: 0, capacity: 128, hits: 0, misses: 0}
+ */
+static VALUE re2_clear_pattern_cache(VALUE) {
+  pattern_cache.clear();
+
+  return Qnil;
+}
+
+/*
+ * Returns the number of native worker threads in the pool used by
+ * {RE2::Regexp#parallel_match} and {RE2::Set#parallel_match}, defaulting to
+ * the number of CPU cores.
+ *
+ * @return [Integer] the number of worker threads
+ * @example
+ *   RE2.thread_pool_size #=> 8
+ */
+static VALUE re2_thread_pool_size(VALUE) {
+  return SIZET2NUM(thread_pool.size());
+}
+
+/*
+ * Sets the number of native worker threads in the pool used by
+ * {RE2::Regexp#parallel_match} and {RE2::Set#parallel_match}. Any running
+ * workers are stopped once they finish their current work and new ones are
+ * started when next needed.
+ *
+ * @param [Integer] size the number of worker threads
+ * @return [Integer] the new size
+ * @raise [ArgumentError] if given a size less than 1
+ * @example
+ *   RE2.thread_pool_size = 4
+ */
+static VALUE re2_thread_pool_size_set(VALUE, VALUE size) {
+  long value = NUM2LONG(size);
+
+  if (value < 1) {
+    rb_raise(rb_eArgError, "size should be >= 1");
+  }
+
+  thread_pool.set_size(static_cast<size_t>(value));
+
+  return size;
+}
+
+/*
+ * Returns the CPUs that worker threads in the pool are pinned to or `nil` if
+ * they may run on any CPU.
+ *
+ * @return [Array<Integer>, nil] the CPUs worker threads are pinned to
+ * @example
+ *   RE2.thread_pool_cpus #=> nil
+ */
+static VALUE re2_thread_pool_cpus(VALUE) {
+  std::vector<int> cpus = thread_pool.cpus();
+  if (cpus.empty()) {
+    return Qnil;
+  }
+
+  VALUE result = rb_ary_new_capa(cpus.size());
+  for (int cpu : cpus) {
+    rb_ary_push(result, INT2FIX(cpu));
+  }
+
+  return result;
+}
+
+/*
+ * Pins the worker threads in the pool to the given CPUs, assigning them to
+ * each worker in turn, or allows them to run on any CPU if given `nil`. Any
+ * running workers are stopped once they finish their current work and new
+ * ones are started when next needed.
+ *
+ * Pinning is only supported on platforms with `pthread_setaffinity_np` (e.g.
+ * Linux) and is otherwise ignored.
+ *
+ * @param [Array<Integer>, nil] cpus the CPUs to pin worker threads to
+ * @return [Array<Integer>, nil] the given CPUs
+ * @raise [ArgumentError] if given a negative CPU
+ * @raise [TypeError] if given anything other than an array of integers or `nil`
+ * @example
+ *   RE2.thread_pool_cpus = [0, 1, 2, 3]
+ */
+static VALUE re2_thread_pool_cpus_set(VALUE, VALUE cpus) {
+  std::vector<int> values;
+
+  if (!NIL_P(cpus)) {
+    Check_Type(cpus, T_ARRAY);
+
+    for (long i = 0; i < RARRAY_LEN(cpus); ++i) {
+      int cpu = NUM2INT(rb_ary_entry(cpus, i));
+      if (cpu < 0) {
+        rb_raise(rb_eArgError, "CPU should be >= 0");
+      }
+
+      values.push_back(cpu);
+    }
+  }
+
+  thread_pool.set_cpus(values);
+
+  return cpus;
+}
+
+#ifndef _WIN32
+static void *nogvl_noop(void *) {
+  return nullptr;
+}
+#endif
+
+/* Measures how many bytes RE2 can match in the time it takes to release and
+ * reacquire the GVL on this machine, i.e. the input size above which
+ * releasing the GVL pays for itself.
+ */
+static size_t re2_measure_gvl_release_threshold() {
+#ifdef _WIN32
+  return 0;
+#else
+  using clock = std::chrono::steady_clock;
+  const int rounds = 1000;
+
+  clock::time_point start = clock::now();
+  for (int i = 0; i < rounds; ++i) {
+    rb_thread_call_without_gvl(nogvl_noop, nullptr, NULL, NULL);
+  }
+  double handoff = std::chrono::duration<double, std::nano>(
+      clock::now() - start).count() / rounds;
+
+  /* A pattern without a literal prefix so RE2 cannot skip through the text
+   * with memchr and must step its DFA over every byte.
+   */
+  RE2 pattern("[bc]d");
+  std::string text(4096, 'a');
+  re2::StringPiece input(text);
+
+  /* Build the DFA states before timing. */
+  RE2::PartialMatch(input, pattern);
+
+  start = clock::now();
+  for (int i = 0; i < rounds / 10; ++i) {
+    RE2::PartialMatch(input, pattern);
+  }
+  double per_byte = std::chrono::duration<double, std::nano>(
+      clock::now() - start).count() / (rounds / 10) / text.size();
+
+  if (!(per_byte > 0)) {
+    return 0;
+  }
+
+  double threshold = handoff / per_byte;
+  if (threshold > 1024 * 1024) {
+    threshold = 1024 * 1024;
+  }
+
+  return static_cast<size_t>(threshold);
+#endif
+}
+
+/*
+ * Returns the size in bytes below which inputs are matched, replaced, and
+ * extracted without releasing the GVL. 0 (the default) always releases it.
+ *
+ * @return [Integer] the threshold in bytes
+ * @example
+ *   RE2.gvl_release_threshold #=> 0
+ */
+static VALUE re2_gvl_release_threshold(VALUE) {
+  return SIZET2NUM(gvl_release_threshold.load(std::memory_order_relaxed));
+}
+
+/*
+ * Sets the size in bytes below which inputs are matched, replaced, and
+ * extracted without releasing the GVL. Releasing the GVL lets other threads
+ * run while matching but costs more than matching a short string, so short
+ * inputs (e.g. HTTP headers) are faster to process while holding it.
+ *
+ * Pass `:auto` to measure the crossover on this machine with
+ * {RE2.calibrate_gvl_release_threshold} and use that. Batches split across
+ * the thread pool (e.g. {RE2::Regexp#parallel_match}) always release the GVL
+ * and the GVL is never released on Windows.
+ *
+ * @param [Integer, Symbol] threshold the threshold in bytes or `:auto`
+ * @return [Integer, Symbol] the given threshold
+ * @raise [ArgumentError] if given a negative threshold or a symbol other than
+ *   `:auto`
+ * @raise [TypeError] if given a non-numeric threshold
+ * @example
+ *   RE2.gvl_release_threshold = 1024
+ *   RE2.gvl_release_threshold = :auto
+ *   RE2.gvl_release_threshold #=> 312
+ */
+static VALUE re2_gvl_release_threshold_set(VALUE, VALUE threshold) {
+  size_t value;
+
+  if (SYMBOL_P(threshold)) {
+    if (SYM2ID(threshold) != id_auto) {
+      rb_raise(rb_eArgError, "threshold should be an Integer or :auto");
+    }
+
+    value = re2_measure_gvl_release_threshold();
+  } else {
+    ssize_t bytes = NUM2SSIZET(threshold);
+    if (bytes < 0) {
+      rb_raise(rb_eArgError, "threshold should be >= 0");
+    }
+
+    value = static_cast<size_t>(bytes);
+  }
+
+  gvl_release_threshold.store(value, std::memory_order_relaxed);
+
+  return threshold;
+}
+
+/*
+ * Measures the input size in bytes above which releasing the GVL is cheaper
+ * than matching on this machine, without changing
+ * {RE2.gvl_release_threshold}. This blocks for around a millisecond.
+ *
+ * Note the measurement is of an uncontended GVL: if many threads are
+ * competing for it, handing it off costs more and a higher threshold may be
+ * better.
+ *
+ * @return [Integer] the measured threshold in bytes
+ * @example
+ *   RE2.calibrate_gvl_release_threshold #=> 312
+ */
+static VALUE re2_calibrate_gvl_release_threshold(VALUE) {
+  return SIZET2NUM(re2_measure_gvl_release_threshold());
+}
+
+/* Estimates the memory held by a set. RE2::Set reports neither its parsed
+ * patterns nor its program size so assume a fixed overhead per pattern and
+ * that each byte of pattern compiles to about one instruction.
+ */
+static size_t re2_set_estimate_memsize(const re2_set *s) {
+  size_t size = sizeof(*s->set) + 2 * s->pattern_bytes + 64 * s->patterns;
+  if (s->compiled) {
+    size += sizeof(VALUE) * s->patterns;
+    size += re2_bytes_per_program +
+      re2_bytes_per_instruction * s->pattern_bytes;
+  }
+
+  return size;
+}
+
+/* Recalculates the memory held by a set after adding patterns or compiling
+ * it (which must be called with the GVL held), telling the GC about the
+ * difference.
+ */
+static void re2_set_update_memsize(re2_set *s) {
+  size_t memsize = re2_set_estimate_memsize(s);
+  rb_gc_adjust_memory_usage(
+      static_cast<ssize_t>(memsize) - static_cast<ssize_t>(s->memsize));
+  s->memsize = memsize;
+}
+
+static VALUE re2_counter_new(const std::atomic<uint64_t> &counter) {
+  return ULL2NUM(counter.load(std::memory_order_relaxed));
+}
+
+/*
+ * Returns counters aggregated across every regexp and set in the process
+ * (and all Ractors) since it started:
+ *
+ * - `:regexps_compiled` and `:sets_compiled`: the number of patterns (including
+ *   those compiled for {RE2.replace} and friends when given a `String`) and
+ *   sets compiled successfully
+ * - `:compile_nanoseconds`: the total time spent compiling them, including
+ *   attempts that failed
+ * - `:program_size`: the total {RE2::Regexp#program_size} of all live regexps
+ * - `:calls`: the number of calls to each of {RE2::Regexp#match},
+ *   {RE2::Regexp#match?} (including its aliases and
+ *   {RE2::Regexp#full_match?}), {RE2::Scanner#scan} (each step, or each
+ *   whole scan with {RE2::Scanner#to_a}, {RE2::Regexp#scan_all} and
+ *   {RE2::Regexp#scan_offsets}), {RE2.replace},
+ *   {RE2.global_replace}, {RE2.extract} and {RE2::Set#match}
+ * - `:nogvl_nanoseconds`: the total time spent with the GVL released
+ * - `:set_match_errors`: the number of each kind of {RE2::Set::MatchError}
+ *   raised, e.g. `:out_of_memory` when the DFA exceeds `max_mem`
+ * - `:matchdata_allocations` and `:scanner_allocations`: the number of
+ *   {RE2::MatchData} and {RE2::Scanner} objects allocated
+ *
+ * These are always collected and are cheap to read so suit being exported
+ * to a metrics system periodically.
+ *
+ * @return [Hash] the counters
+ * @example
+ *   RE2.stats[:calls][:match?] #=> 1024
+ */
+static VALUE re2_process_stats(VALUE) {
+  VALUE calls = rb_hash_new();
+  rb_hash_aset(calls, ID2SYM(id_match),
+      re2_counter_new(global_stats.calls[re2_entry_match]));
+  rb_hash_aset(calls, ID2SYM(id_match_p),
+      re2_counter_new(global_stats.calls[re2_entry_match_p]));
+  rb_hash_aset(calls, ID2SYM(id_scan),
+      re2_counter_new(global_stats.calls[re2_entry_scan]));
+  rb_hash_aset(calls, ID2SYM(id_replace),
+      re2_counter_new(global_stats.calls[re2_entry_replace]));
+  rb_hash_aset(calls, ID2SYM(id_global_replace),
+      re2_counter_new(global_stats.calls[re2_entry_global_replace]));
+  rb_hash_aset(calls, ID2SYM(id_extract),
+      re2_counter_new(global_stats.calls[re2_entry_extract]));
+  rb_hash_aset(calls, ID2SYM(id_set_match),
+      re2_counter_new(global_stats.calls[re2_entry_set_match]));
+
+  VALUE set_match_errors = rb_hash_new();
+  rb_hash_aset(set_match_errors, ID2SYM(id_out_of_memory),
+      re2_counter_new(global_stats.set_out_of_memory));
+  rb_hash_aset(set_match_errors, ID2SYM(id_inconsistent),
+      re2_counter_new(global_stats.set_inconsistent));
+  rb_hash_aset(set_match_errors, ID2SYM(id_not_compiled),
+      re2_counter_new(global_stats.set_not_compiled));
+
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(id_regexps_compiled),
+      re2_counter_new(global_stats.regexps_compiled));
+  rb_hash_aset(stats, ID2SYM(id_sets_compiled),
+      re2_counter_new(global_stats.sets_compiled));
+  rb_hash_aset(stats, ID2SYM(id_compile_nanoseconds),
+      re2_counter_new(global_stats.compile_nanoseconds));
+  rb_hash_aset(stats, ID2SYM(id_program_size),
+      LL2NUM(global_stats.program_size.load(std::memory_order_relaxed)));
+  rb_hash_aset(stats, ID2SYM(id_calls), calls);
+  rb_hash_aset(stats, ID2SYM(id_nogvl_nanoseconds),
+      re2_counter_new(global_stats.nogvl_nanoseconds));
+  rb_hash_aset(stats, ID2SYM(id_set_match_errors), set_match_errors);
+  rb_hash_aset(stats, ID2SYM(id_matchdata_allocations),
+      re2_counter_new(global_stats.matchdata_allocations));
+  rb_hash_aset(stats, ID2SYM(id_scanner_allocations),
+      re2_counter_new(global_stats.scanner_allocations));
+
+  return stats;
+}
+
+/*
+ * Returns whether every {RE2::Regexp} and {RE2::Set} is instrumented.
+ *
+ * @return [Boolean] whether all regexps and sets are instrumented
+ * @see RE2.instrument=
+ */
+static VALUE re2_instrument_p(VALUE) {
+  return BOOL2RUBY(instrument_all.load(std::memory_order_relaxed));
+}
+
+/*
+ * Sets whether to count matches against every {RE2::Regexp} and {RE2::Set}
+ * as if calling {RE2::Regexp#instrument!} or {RE2::Set#instrument!} on each
+ * of them before they are next matched. Turning this off does not stop
+ * counting for objects that have already been instrumented.
+ *
+ * @param [Boolean] enabled whether to instrument all regexps and sets
+ * @return [Boolean] the given value
+ * @example
+ *   RE2.instrument = true
+ */
+static VALUE re2_instrument_set(VALUE, VALUE enabled) {
+  instrument_all.store(RTEST(enabled), std::memory_order_relaxed);
+
+  return enabled;
+}
+
+/* Regexps compiled for {RE2::Set#match} are pinned as their patterns are
+ * used without the GVL.
+ */
+static void re2_set_mark(void *ptr) {
+  re2_set *s = static_cast<re2_set *>(ptr);
+  if (s->regexps) {
+    for (size_t i = 0; i < s->patterns; ++i) {
+      VALUE regexp = s->regexps[i].load(std::memory_order_acquire);
+      if (regexp) {
+        rb_gc_mark(regexp);
+      }
+    }
+  }
+}
+
+static void re2_set_free(void *ptr) {
+  re2_set *s = static_cast<re2_set *>(ptr);
+  if (s->set) {
+    delete s->set;
+    rb_gc_adjust_memory_usage(-static_cast<ssize_t>(s->memsize));
+  }
+  delete s->options;
+  delete s->sources;
+  delete[] s->regexps;
+  delete s->stats.load(std::memory_order_relaxed);
+  xfree(s);
+}
+
+static size_t re2_set_memsize(const void *ptr) {
+  const re2_set *s = static_cast<const re2_set *>(ptr);
+  size_t size = sizeof(*s);
+  if (s->set) {
+    size += s->memsize;
+  }
+  if (s->stats.load(std::memory_order_relaxed)) {
+    size += sizeof(re2_stats);
+  }
+
+  return size;
+}
+
+static const rb_data_type_t re2_set_data_type = {
+  "RE2::Set",
+  {
+    re2_set_mark,
+    re2_set_free,
+    re2_set_memsize,
+  },
+  0,
+  0,
+  // IMPORTANT: WB_PROTECTED objects must only use the RB_OBJ_WRITE()
+  // macro to update VALUE references, as to trigger write barriers.
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_FROZEN_SHAREABLE
+};
+
+static re2_set *unwrap_re2_set(VALUE self) {
+  re2_set *s;
+  TypedData_Get_Struct(self, re2_set, &re2_set_data_type, s);
+  if (!s->set) {
+    rb_raise(rb_eTypeError, "uninitialized RE2::Set");
+  }
+  /* Patterns are added and compiled without the GVL so the set cannot be
+   * used by another thread until that has finished.
+   */
+  if (s->busy) {
+    rb_raise(rb_eThreadError, "RE2::Set is being modified in another thread");
+  }
+  return s;
+}
+
+static VALUE re2_set_allocate(VALUE klass) {
+  re2_set *s;
+  VALUE result = TypedData_Make_Struct(klass, re2_set, &re2_set_data_type, s);
+
+  return result;
+}
+
+static VALUE re2_set_initialize_copy(VALUE, VALUE) {
+  rb_raise(rb_eTypeError, "cannot copy RE2::Set");
+}
+
+/*
+ * Returns a new {RE2::Set} object, a collection of patterns that can be
+ * searched for simultaneously.
+ *
+ * @return [RE2::Set]
+ *
+ * @overload initialize
+ *   Returns a new {RE2::Set} object for unanchored patterns with the default
+ *   options.
+ *
+ *   @raise [NoMemoryError] if memory could not be allocated for the compiled pattern
+ *   @return [RE2::Set]
+ *
+ * @overload initialize(anchor)
+ *   Returns a new {RE2::Set} object for the specified anchor with the default
+ *   options.
+ *
+ *   @param [Symbol] anchor one of `:unanchored`, `:anchor_start`, `:anchor_both`
+ *   @raise [ArgumentError] if anchor is not `:unanchored`, `:anchor_start` or `:anchor_both`
+ *   @raise [NoMemoryError] if memory could not be allocated for the compiled pattern
+ *
+ * @overload initialize(anchor, options)
+ *   Returns a new {RE2::Set} object with the specified options.
+ *
+ *   @param [Symbol] anchor one of `:unanchored`, `:anchor_start`, `:anchor_both`
+ *   @param [Hash] options the options with which to compile the pattern
+ *   @option options [Boolean] :utf8 (true) text and pattern are UTF-8; otherwise Latin-1
+ *   @option options [Boolean] :posix_syntax (false) restrict regexps to POSIX egrep syntax
+ *   @option options [Boolean] :longest_match (false) search for longest match, not first match
+ *   @option options [Boolean] :log_errors (true) log syntax and execution errors to ERROR
+ *   @option options [Integer] :max_mem approx. max memory footprint of RE2
+ *   @option options [Boolean] :literal (false) interpret string as literal, not regexp
+ *   @option options [Boolean] :never_nl (false) never match `\n`, even if it is in regexp
+ *   @option options [Boolean] :case_sensitive (true) match is case-sensitive (regexp can override with `(?i)` unless in `posix_syntax` mode)
+ *   @option options [Boolean] :perl_classes (false) allow Perl's `\d` `\s` `\w` `\D` `\S` `\W` when in `posix_syntax` mode
+ *   @option options [Boolean] :word_boundary (false) allow `\b` `\B` (word boundary and not) when in `posix_syntax` mode
+ *   @option options [Boolean] :one_line (false) `^` and `$` only match beginning and end of text when in `posix_syntax` mode
+ *   @return [RE2::Set] a {RE2::Set} with the specified anchor and options
+ *   @raise [ArgumentError] if `anchor` is not one of the accepted choices
+ *   @raise [NoMemoryError] if memory could not be allocated for the compiled pattern
+ */
+static VALUE re2_set_initialize(int argc, VALUE *argv, VALUE self) {
+  VALUE anchor, options;
+  re2_set *s;
+
+  rb_scan_args(argc, argv, "02", &anchor, &options);
+  TypedData_Get_Struct(self, re2_set, &re2_set_data_type, s);
+
+  RE2::Anchor re2_anchor = RE2::UNANCHORED;
+
+  if (!NIL_P(anchor)) {
+    Check_Type(anchor, T_SYMBOL);
+    ID id_anchor_arg = SYM2ID(anchor);
+    if (id_anchor_arg == id_unanchored) {
+      re2_anchor = RE2::UNANCHORED;
+    } else if (id_anchor_arg == id_anchor_start) {
+      re2_anchor = RE2::ANCHOR_START;
+    } else if (id_anchor_arg == id_anchor_both) {
+      re2_anchor = RE2::ANCHOR_BOTH;
+    } else {
+      rb_raise(rb_eArgError, "anchor should be one of: :unanchored, :anchor_start, :anchor_both");
+    }
+  }
+
+  RE2::Options re2_options;
+
+  if (RTEST(options)) {
+    parse_re2_options(&re2_options, options);
+  }
+
+  rb_check_frozen(self);
+
+  /* Prevent re-initialisation: #match releases the GVL while holding a
+   * pointer to s->set, so replacing s->set from another thread would free
+   * the object out from under a concurrent match.
+   */
+  if (s->set) {
+    rb_raise(rb_eTypeError, "already initialized RE2::Set");
+  }
+
+  s->options = new(std::nothrow) RE2::Options(re2_options);
+  if (s->options == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate RE2::Options object");
+  }
+
+  s->sources = new(std::nothrow) std::vector<std::string>();
+  if (s->sources == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate patterns");
+  }
+
+  s->set = new(std::nothrow) RE2::Set(re2_options, re2_anchor);
+  if (s->set == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate RE2::Set object");
+  }
+
+  s->anchor = re2_anchor;
+
+  s->max_mem = re2_options.max_mem();
+  re2_set_update_memsize(s);
+
+  return self;
+}
+
+struct re2_set_call_arg {
+  VALUE self;
+  re2_set *s;
+  void *(*fn)(void *);
+  void *arg;
+  size_t bytes;
+};
+
+static VALUE re2_set_call_body(VALUE ptr) {
+  auto *arg = reinterpret_cast<re2_set_call_arg *>(ptr);
+  re2_call_without_gvl(arg->fn, arg->arg, arg->bytes);
+
+  return Qnil;
+}
+
+/* Releases the set once a call has finished or been interrupted (e.g. by
+ * Thread#raise when reacquiring the GVL), accounting for any patterns added
+ * and freezing it if it was compiled.
+ */
+static VALUE re2_set_call_ensure(VALUE ptr) {
+  auto *arg = reinterpret_cast<re2_set_call_arg *>(ptr);
+  re2_set *s = arg->s;
+
+  s->busy = false;
+  if (s->compiled) {
+    rb_obj_freeze(arg->self);
+  } else {
+    /* More patterns may still be added so they would not fit. */
+    delete[] s->regexps;
+    s->regexps = nullptr;
+  }
+  re2_set_update_memsize(s);
+
+  return Qnil;
+}
+
+/* Calls `fn` with `arg` as re2_call_without_gvl does, marking the set busy so
+ * no other thread can use it in the meantime.
+ */
+static void re2_set_call_without_gvl(VALUE self, re2_set *s,
+    void *(*fn)(void *), void *arg, size_t bytes) {
+  re2_set_call_arg call;
+  call.self = self;
+  call.s = s;
+  call.fn = fn;
+  call.arg = arg;
+  call.bytes = bytes;
+
+  s->busy = true;
+  rb_ensure(re2_set_call_body, reinterpret_cast<VALUE>(&call),
+      re2_set_call_ensure, reinterpret_cast<VALUE>(&call));
+}
+
+/* Reserves room for `count` more sources in the set before adding patterns
+ * to it without the GVL.
+ */
+static void re2_set_reserve_sources(re2_set *s, size_t count) {
+  bool out_of_memory = false;
+  try {
+    s->sources->reserve(s->sources->size() + count);
+  } catch (const std::bad_alloc &) {
+    out_of_memory = true;
+  }
+
+  if (out_of_memory) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate patterns");
+  }
+}
+
+/*
+ * Adds a pattern to the set. Returns the index that will identify the pattern
+ * in the output of {RE2::Set#match}. Cannot be called after {RE2::Set#compile}
+ * has been called.
+ *
+ * @param [String] pattern the regex pattern
+ * @return [Integer] the index of the pattern in the set
+ * @raise [ArgumentError] if called after compile or the pattern is rejected
+ * @example
+ *   set = RE2::Set.new
+ *   set.add("abc") #=> 0
+ *   set.add("def") #=> 1
+ */
+static VALUE re2_set_add(VALUE self, VALUE pattern) {
+  re2_batch *batch;
+  VALUE wrapper = re2_batch_new(rb_ary_new_from_args(1, pattern), &batch);
+  batch->counts.assign(1, -1);
+  batch->messages.assign(1, std::string());
+
+  re2_set *s = unwrap_re2_set(self);
+  rb_check_frozen(self);
+  re2_set_reserve_sources(s, 1);
+
+  nogvl_set_add_arg arg;
+  arg.s = s;
+  arg.batch = batch;
+  arg.out_of_memory = false;
+
+  re2_set_call_without_gvl(self, s, nogvl_set_add, &arg,
+      batch->pieces[0].size());
+  RB_GC_GUARD(wrapper);
+
+  if (arg.out_of_memory) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate patterns");
+  }
+
+  int index = batch->counts[0];
+  if (index < 0) {
+    rb_raise(rb_eArgError,
+             "str rejected by RE2::Set->Add(): %s", batch->messages[0].c_str());
+  }
+
+  return INT2FIX(index);
+}
+
+/*
+ * Adds many patterns to the set at once without holding the GVL, returning
+ * the index of each pattern (as in {RE2::Set#add}) or the reason it was
+ * rejected. Unlike {RE2::Set#add}, a rejected pattern does not raise an error
+ * or prevent the other patterns from being added. Cannot be called after
+ * {RE2::Set#compile} has been called.
+ *
+ * @param [Array<String>] patterns the regex patterns
+ * @return [Array<Array(Integer, nil), Array(nil, String)>] an `[index, nil]`
+ *   pair for each added pattern and a `[nil, error]` pair for each rejected
+ *   one, in the order given
+ * @raise [FrozenError] if called after compile
+ * @raise [ThreadError] if the set is being modified in another thread
+ * @raise [TypeError] if not given an array of strings
+ * @example
+ *   set = RE2::Set.new
+ *   set.add_all(["abc", "(def", "ghi"])
+ *   #=> [[0, nil], [nil, "missing ): (def"], [1, nil]]
+ */
+static VALUE re2_set_add_all(VALUE self, VALUE patterns) {
+  re2_batch *batch;
+  VALUE wrapper = re2_batch_new(patterns, &batch);
+  size_t count = batch->pieces.size();
+  batch->counts.assign(count, -1);
+  batch->messages.assign(count, std::string());
+
+  re2_set *s = unwrap_re2_set(self);
+  rb_check_frozen(self);
+  re2_set_reserve_sources(s, count);
+
+  nogvl_set_add_arg arg;
+  arg.s = s;
+  arg.batch = batch;
+  arg.out_of_memory = false;
+
+  re2_set_call_without_gvl(self, s, nogvl_set_add, &arg,
+      re2_batch_bytes(batch->pieces));
+
+  if (arg.out_of_memory) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate patterns");
+  }
+
+  VALUE result = rb_ary_new_capa(count);
+  for (size_t i = 0; i < count; ++i) {
+    int index = batch->counts[i];
+
+    if (index < 0) {
+      const std::string &message = batch->messages[i];
+      rb_ary_push(result,
+          rb_assoc_new(Qnil, rb_str_new(message.data(), message.size())));
+    } else {
+      rb_ary_push(result, rb_assoc_new(INT2FIX(index), Qnil));
+    }
+  }
+
+  RB_GC_GUARD(wrapper);
+
+  return result;
+}
+
+/*
+ * Compiles a {RE2::Set} so it can be used to match against. Must be called
+ * after {RE2::Set#add} and before {RE2::Set#match}.
+ *
+ * @return [Boolean] whether compilation was a success
+ * @example
+ *   set = RE2::Set.new
+ *   set.add("abc")
+ *   set.compile #=> true
+ */
+static VALUE re2_set_compile(VALUE self) {
+  re2_set *s = unwrap_re2_set(self);
+  rb_check_frozen(self);
+
+  /* Filled in lazily by #match with `output: :match_data`. Allocated up front
+   * so the set is usable as soon as it is marked compiled.
+   */
+  s->regexps = new(std::nothrow) std::atomic<VALUE>[s->patterns]();
+  if (s->regexps == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate regexps");
+  }
+
+  nogvl_set_compile_arg arg;
+  arg.s = s;
+
+  /* Compiling a set costs far more than matching so always release the
+   * GVL.
+   */
+  re2_set_call_without_gvl(self, s, nogvl_set_compile, &arg, SIZE_MAX);
+
+  return BOOL2RUBY(s->compiled);
+}
+
+/*
+ * Starts counting calls to {RE2::Set#match} for this set, along with the
+ * bytes searched and how long matching took, to be read with
+ * {RE2::Set#stats}. Use {RE2.instrument=} to instrument every set.
+ *
+ * @return [RE2::Set] the set
+ * @raise [NoMemoryError] if there was not enough memory to store the counters
+ * @example
+ *   set = RE2::Set.new.instrument!
+ */
+static VALUE re2_set_instrument(VALUE self) {
+  re2_set *s = unwrap_re2_set(self);
+
+  if (re2_stats_fetch(&s->stats, true) == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate stats");
+  }
+
+  return self;
+}
+
+/*
+ * Returns whether matches against this set are being counted, either
+ * because of {RE2::Set#instrument!} or {RE2.instrument=}.
+ *
+ * @return [Boolean] whether the set is instrumented
+ */
+static VALUE re2_set_instrumented_p(VALUE self) {
+  re2_set *s = unwrap_re2_set(self);
+
+  return BOOL2RUBY(s->stats.load(std::memory_order_acquire) ||
+      instrument_all.load(std::memory_order_relaxed));
+}
+
+/*
+ * Returns the counters collected since the set was instrumented, as described
+ * in {RE2::Regexp#stats}.
+ *
+ * @return [Hash, nil] the counters or `nil` if the set is not instrumented
+ */
+static VALUE re2_set_stats(VALUE self) {
+  re2_set *s = unwrap_re2_set(self);
+  re2_stats *stats = s->stats.load(std::memory_order_acquire);
+
+  if (stats == nullptr) {
+    return Qnil;
+  }
+
+  return re2_stats_to_hash(stats);
+}
+
+/*
+ * Matches each of the given sample texts against the compiled set ahead of
+ * time so that the DFA states they need are already built, as described in
+ * {RE2::Regexp#warm!}.
+ *
+ * @param [Array<String>] samples the texts to match
+ * @return [Hash] the number of `:samples`, their total `:bytes`, how many
+ *   `:matches` there were, the `:cold_nanoseconds` and `:warm_nanoseconds`
+ *   each pass took and whether the DFA ran `:out_of_memory` (in which case
+ *   a larger `max_mem` is needed for the states to be kept)
+ * @raise [RE2::Set::MatchError] if the set has not been compiled
+ * @raise [TypeError] if the samples are not an array of strings
+ * @raise [NoMemoryError] if there was not enough memory to match the samples
+ * @example
+ *   set = RE2::Set.new
+ *   set.add("abc")
+ *   set.compile
+ *   set.warm!(["abcdef", "xyz"])
+ *   #=> {:samples=>2, :bytes=>9, :matches=>1, :cold_nanoseconds=>8125, :warm_nanoseconds=>791, :out_of_memory=>false}
+ */
+static VALUE re2_set_warm(VALUE self, VALUE samples) {
+  re2_set *s = unwrap_re2_set(self);
+
+  if (!s->compiled) {
+    rb_raise(re2_eSetMatchError, "#warm! must not be called before #compile");
+  }
+
+  return re2_warm(nullptr, s->set, samples);
+}
+
+/*
+ * Returns an estimate of the memory held by the set outside of Ruby's heap,
+ * as reported to the GC and by `ObjectSpace.memsize_of`.
+ *
+ * RE2 does not report the size of a set's compiled program so this is
+ * estimated from the patterns added so far. DFA caches built while matching
+ * are not included but are bounded by `max_mem`.
+ *
+ * @return [Hash] the number of `:patterns` added, their `:pattern_bytes`,
+ *   whether the set is `:compiled`, the `:estimated_bytes` and `:max_mem`
+ * @example
+ *   set = RE2::Set.new
+ *   set.add("abc")
+ *   set.compile
+ *   set.memory_stats
+ *   #=> {:patterns=>1, :pattern_bytes=>3, :compiled=>true, :estimated_bytes=>1211, :max_mem=>8388608}
+ */
+static VALUE re2_set_memory_stats(VALUE self) {
+  re2_set *s = unwrap_re2_set(self);
+
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(id_patterns), SIZET2NUM(s->patterns));
+  rb_hash_aset(stats, ID2SYM(id_pattern_bytes), SIZET2NUM(s->pattern_bytes));
+  rb_hash_aset(stats, ID2SYM(id_compiled), BOOL2RUBY(s->compiled));
+  rb_hash_aset(stats, ID2SYM(id_estimated_bytes), SIZET2NUM(s->memsize));
+  rb_hash_aset(stats, ID2SYM(id_max_mem), LL2NUM(s->max_mem));
+
+  return stats;
+}
+
+/*
+ * Returns the size of the {RE2::Set}.
+ *
+ * @return [Integer] the number of patterns in the set
+ * @example
+ *   set = RE2::Set.new
+ *   set.add("abc")
+ *   set.size #=> 1
+ */
+static VALUE re2_set_size(VALUE self) {
+#ifdef HAVE_SET_SIZE
+  re2_set *s = unwrap_re2_set(self);
+
+  return INT2FIX(s->set->Size());
+#else
+  rb_raise(re2_eSetUnsupportedError, "current version of RE2::Set does not have Size method");
+#endif
+}
+
+/*
+ * Returns whether the underlying RE2 version outputs error information from
+ * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/set.h#L62-L65
+ * `RE2::Set::Match`}. If not, {RE2::Set#match} will raise an error if attempting to set
+ * its `:exception` option to `true`.
+ *
+ * @return [Boolean] whether the underlying RE2 outputs error information from {RE2::Set} matches
+ */
+static VALUE re2_set_match_raises_errors_p(VALUE) {
+#ifdef HAVE_ERROR_INFO_ARGUMENT
+  return Qtrue;
+#else
+  return Qfalse;
+#endif
+}
+
+/*
+ * Returns whether the underlying RE2 version has a Set::Size method.
+ *
+ * @return [Boolean] whether the underlying RE2 has a Set::Size method
+ */
+static VALUE re2_set_size_p(VALUE) {
+#ifdef HAVE_SET_SIZE
+  return Qtrue;
+#else
+  return Qfalse;
+#endif
+}
+
+#ifdef HAVE_ERROR_INFO_ARGUMENT
+/* Raises an {RE2::Set::MatchError} describing the given
+ * `RE2::Set::ErrorKind`, if any.
+ */
+static void re2_set_check_match_error(int kind) {
+  switch (kind) {
+    case RE2::Set::kNoError:
+      break;
+    case RE2::Set::kNotCompiled:
+      re2_count(global_stats.set_not_compiled);
+      rb_raise(re2_eSetMatchError, "#match must not be called before #compile");
+    case RE2::Set::kOutOfMemory:
+      re2_count(global_stats.set_out_of_memory);
+      rb_raise(re2_eSetMatchError, "The DFA ran out of memory");
+    case RE2::Set::kInconsistent:
+      re2_count(global_stats.set_inconsistent);
+      rb_raise(re2_eSetMatchError, "RE2::Prog internal error");
+    default:  // Just in case a future version of libre2 adds new ErrorKinds
+      rb_raise(re2_eSetMatchError, "Unknown RE2::Set::ErrorKind: %d", kind);
+  }
+}
+#endif
+
+/* Returns the regexp for the pattern at the given index of a compiled set,
+ * storing the given compiled pattern as a new regexp unless another thread
+ * has done so first.
+ */
+static VALUE re2_set_regexp(VALUE self, re2_set *s, int index,
+    std::unique_ptr<RE2> &compiled) {
+  VALUE regexp = s->regexps[index].load(std::memory_order_acquire);
+  if (regexp) {
+    return regexp;
+  }
+
+  re2_pattern *p;
+  VALUE candidate = rb_obj_alloc(re2_cRegexp);
+  TypedData_Get_Struct(candidate, re2_pattern, &re2_regexp_data_type, p);
+  re2_regexp_set_pattern(p, compiled.release());
+
+  /* The set may be shared between Ractors so its regexps must be too. */
+  rb_ractor_make_shareable(candidate);
+
+  if (s->regexps[index].compare_exchange_strong(regexp, candidate,
+        std::memory_order_acq_rel)) {
+    RB_OBJ_WRITTEN(self, Qundef, candidate);
+
+    return candidate;
+  }
+
+  return regexp;
+}
+
+/* Returns an array of `[index, match_data]` pairs for the matches found by
+ * {re2_set_match_details}.
+ */
+static VALUE re2_set_match_data(VALUE self, re2_set *s, VALUE str,
+    const std::vector<int> &v, re2_batch *batch) {
+  if (batch->failed) {
+    rb_raise(rb_eNoMemError, "not enough memory to match RE2::Set");
+  }
+
+  VALUE result = rb_ary_new2(v.size());
+
+  for (size_t i = 0; i < v.size(); ++i) {
+    int offset = batch->counts[i];
+    if (offset < 0) {
+      continue;
+    }
+
+    VALUE regexp = re2_set_regexp(self, s, v[i], batch->compiled[i]);
+    int n = 1 + unwrap_re2_regexp(regexp)->pattern->NumberOfCapturingGroups();
+
+    re2::StringPiece *matches = new(std::nothrow) re2::StringPiece[n];
+    if (matches == nullptr) {
+      rb_raise(rb_eNoMemError,
+               "not enough memory to allocate StringPieces for matches");
+    }
+    std::copy_n(&batch->matches[offset], n, matches);
+
+    re2_matchdata *m;
+    VALUE matchdata = rb_class_new_instance(0, 0, re2_cMatchData);
+    TypedData_Get_Struct(matchdata, re2_matchdata, &re2_matchdata_data_type, m);
+
+    RB_OBJ_WRITE(matchdata, &m->regexp, regexp);
+    RB_OBJ_WRITE(matchdata, &m->text, str);
+    m->matches = matches;
+    m->number_of_matches = n;
+    m->capacity = n;
+
+    rb_ary_push(result, rb_assoc_new(INT2FIX(v[i]), matchdata));
+  }
+
+  return result;
+}
+
+/*
+ * Matches the given text against patterns in the set, returning an array of
+ * integer indices of the matching patterns if matched or an empty array if
+ * there are no matches.
+ *
+ * @return [Array<Integer>]
+ *
+ * @overload match(str)
+ *   Returns an array of integer indices of patterns matching the given string
+ *   (if any). Raises exceptions if there are any errors while matching.
+ *
+ *   @param [String] str the text to match against
+ *   @return [Array<Integer>] the indices of matching regexps
+ *   @raise [MatchError] if an error occurs while matching
+ *   @raise [UnsupportedError] if the underlying version of RE2 does not output error information
+ *   @example
+ *     set = RE2::Set.new
+ *     set.add("abc")
+ *     set.add("def")
+ *     set.compile
+ *     set.match("abcdef") #=> [0, 1]
+ *
+ * @overload match(str, options)
+ *   Returns an array of integer indices of patterns matching the given string
+ *   (if any). Raises exceptions if there are any errors while matching and the
+ *   `:exception` option is set to true.
+ *
+ *   With `output: :match_data`, also finds where each matching pattern
+ *   matched and its submatches without releasing the GVL again, returning an
+ *   `[index, match_data]` pair for each. Each pattern is compiled into its own
+ *   {RE2::Regexp} the first time it matches and kept by the set for later
+ *   matches (and as {RE2::MatchData#regexp}).
+ *
+ *   @param [String] str the text to match against
+ *   @param [Hash] options the options with which to match
+ *   @option options [Boolean] :exception (true) whether to raise exceptions with RE2's error information (not supported on ABI version 0 of RE2)
+ *   @option options [Symbol] :output (:indices) either :indices to return
+ *     the indices of matching patterns or :match_data to also return an
+ *     {RE2::MatchData} for each
+ *   @return [Array<Integer>] the indices of matching regexps
+ *   @return [Array<Array(Integer, RE2::MatchData)>] the index and match of
+ *     each matching regexp if `output: :match_data`
+ *   @raise [ArgumentError] if given an invalid `:output`
+ *   @raise [MatchError] if an error occurs while matching
+ *   @raise [UnsupportedError] if the underlying version of RE2 does not output error information
+ *   @example
+ *     set = RE2::Set.new
+ *     set.add("abc")
+ *     set.add("def")
+ *     set.compile
+ *     set.match("abcdef", exception: true) #=> [0, 1]
+ *   @example
+ *     set = RE2::Set.new
+ *     set.add("(\\w+)@example\\.com")
+ *     set.add("\\d+")
+ *     set.compile
+ *     set.match("bob@example.com", output: :match_data)
+ *     #=> [[0, #<RE2::MatchData "bob@example.com" 1:"bob">]]
+ */
+static VALUE re2_set_match(int argc, VALUE *argv, const VALUE self) {
+  re2_count_call(re2_entry_set_match);
+
+  VALUE str, options;
+  bool raise_exception = true;
+  bool match_data = false;
+  rb_scan_args(argc, argv, "11", &str, &options);
+
+  StringValue(str);
+  str = rb_str_new_frozen(str);
+
+  re2_set *s = unwrap_re2_set(self);
+
+  if (RTEST(options)) {
+    Check_Type(options, T_HASH);
+
+    VALUE exception_option = rb_hash_aref(options, ID2SYM(id_exception));
+    if (!NIL_P(exception_option)) {
+      raise_exception = RTEST(exception_option);
+    }
+
+    VALUE output_option = rb_hash_aref(options, ID2SYM(id_output));
+    if (!NIL_P(output_option)) {
+      Check_Type(output_option, T_SYMBOL);
+
+      ID id_output_option = SYM2ID(output_option);
+      if (id_output_option == id_match_data) {
+        match_data = true;
+      } else if (id_output_option != id_indices) {
+        rb_raise(rb_eArgError, "output should be one of: :indices, :match_data");
+      }
+    }
+  }
+
+  std::vector<int> v;
+
+  /* Keeps the results of matching each pattern found by the set (and any
+   * patterns compiled to do so) until they are returned.
+   */
+  re2_batch *details = nullptr;
+  VALUE wrapper = Qnil;
+  if (match_data && s->compiled) {
+    wrapper = re2_batch_alloc(&details);
+    details->failed = false;
+  }
+
+  if (raise_exception) {
+#ifdef HAVE_ERROR_INFO_ARGUMENT
+    RE2::Set::ErrorInfo e;
+    nogvl_set_match_arg arg;
+    arg.s = s;
+    arg.text = re2::StringPiece(RSTRING_PTR(str), RSTRING_LEN(str));
+    arg.v = &v;
+    arg.error_info = &e;
+    arg.stats = re2_stats_fetch(&s->stats, false);
+    arg.details = details;
+    arg.matched = false;
+
+    re2_call_without_gvl(nogvl_set_match, &arg, arg.text.size());
+    RB_GC_GUARD(str);
+
+    bool match_failed = !arg.matched;
+
+    if (match_failed) {
+      re2_set_check_match_error(e.kind);
+    } else if (details) {
+      VALUE result = re2_set_match_data(self, s, str, v, details);
+      RB_GC_GUARD(wrapper);
+
+      return result;
+    }
+
+    VALUE result = rb_ary_new2(v.size());
+    for (int index : v) {
+      rb_ary_push(result, INT2FIX(index));
+    }
+
+    return result;
+#else
+    rb_raise(re2_eSetUnsupportedError, "current version of RE2::Set::Match() does not output error information, :exception option can only be set to false");
+#endif
+  } else {
+    nogvl_set_match_arg arg;
+    arg.s = s;
+    arg.text = re2::StringPiece(RSTRING_PTR(str), RSTRING_LEN(str));
+    arg.v = &v;
+#ifdef HAVE_ERROR_INFO_ARGUMENT
+    arg.error_info = nullptr;
+#endif
+    arg.stats = re2_stats_fetch(&s->stats, false);
+    arg.details = details;
+    arg.matched = false;
+
+    re2_call_without_gvl(nogvl_set_match, &arg, arg.text.size());
+    RB_GC_GUARD(str);
+
+    if (!arg.matched) {
+      return rb_ary_new();
+    }
+
+    if (details) {
+      VALUE result = re2_set_match_data(self, s, str, v, details);
+      RB_GC_GUARD(wrapper);
+
+      return result;
+    }
+
+    VALUE result = rb_ary_new2(v.size());
+    for (int index : v) {
+      rb_ary_push(result, INT2FIX(index));
+    }
+
+    return result;
+  }
+}
+
+/* The shared implementation of {RE2::Set#match_many} and
+ * {RE2::Set#parallel_match}.
+ */
+static VALUE re2_set_match_batch(
+    int argc, VALUE *argv, const VALUE self, bool parallel) {
+  VALUE strings, options;
+  bool raise_exception = true;
+  bool flat = false;
+  rb_scan_args(argc, argv, "11", &strings, &options);
+
+  re2_set *s = unwrap_re2_set(self);
+  size_t threads = parallel ? thread_pool.size() : 1;
+
+  if (RTEST(options)) {
+    Check_Type(options, T_HASH);
+
+    VALUE exception_option = rb_hash_aref(options, ID2SYM(id_exception));
+    if (!NIL_P(exception_option)) {
+      raise_exception = RTEST(exception_option);
+    }
+
+    if (parallel) {
+      threads = parse_re2_threads(options, threads);
+    }
+
+    VALUE output_option = rb_hash_aref(options, ID2SYM(id_output));
+    if (!NIL_P(output_option)) {
+      Check_Type(output_option, T_SYMBOL);
+
+      ID id_output_option = SYM2ID(output_option);
+      if (id_output_option == id_flat) {
+        flat = true;
+      } else if (id_output_option != id_arrays) {
+        rb_raise(rb_eArgError, "output should be one of: :arrays, :flat");
+      }
+    }
+  }
+
+#ifndef HAVE_ERROR_INFO_ARGUMENT
+  if (raise_exception) {
+    rb_raise(re2_eSetUnsupportedError, "current version of RE2::Set::Match() does not output error information, :exception option can only be set to false");
+  }
+#endif
+
+  re2_batch *batch;
+  VALUE wrapper = re2_batch_new(strings, &batch);
+  size_t count = batch->pieces.size();
+
+  re2_set_match_many_without_gvl(s->set, batch, raise_exception, threads);
+
+  if (batch->failed) {
+    rb_raise(rb_eNoMemError, "not enough memory to store matches");
+  }
+
+#ifdef HAVE_ERROR_INFO_ARGUMENT
+  if (raise_exception) {
+    for (size_t i = 0; i < count; ++i) {
+      if (!batch->matched[i]) {
+        re2_set_check_match_error(batch->errors[i]);
+      }
+    }
+  }
+#endif
+
+  size_t total = 0;
+  for (const std::vector<int> &indices : batch->indices) {
+    total += indices.size();
+  }
 
-  return BOOL2RUBY(p->pattern->options().word_boundary());
-}
+  VALUE results;
 
-/*
- * Returns whether or not the regular expression was compiled with the
- * `one_line` option set to `true`.
- *
- * @return [Boolean] the `one_line` option
- * @example
- *   re2 = RE2::Regexp.new("woo?", one_line: true)
- *   re2.one_line? #=> true
- */
-static VALUE re2_regexp_one_line(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+  if (flat) {
+    VALUE offsets = rb_ary_new_capa(count + 1);
+    VALUE indices = rb_ary_new_capa(total);
+    size_t offset = 0;
 
-  return BOOL2RUBY(p->pattern->options().one_line());
-}
+    rb_ary_push(offsets, INT2FIX(0));
+    for (size_t i = 0; i < count; ++i) {
+      offset += batch->counts[i];
+      rb_ary_push(offsets, SIZET2NUM(offset));
+    }
 
-/*
- * If the {RE2::Regexp} could not be created properly, returns an error string
- * otherwise returns `nil`.
- *
- * @return [String, nil] the error string or `nil`
- */
-static VALUE re2_regexp_error(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+    for (const std::vector<int> &chunk : batch->indices) {
+      for (int index : chunk) {
+        rb_ary_push(indices, INT2FIX(index));
+      }
+    }
 
-  if (p->pattern->ok()) {
-    return Qnil;
+    results = rb_assoc_new(offsets, indices);
   } else {
-    return rb_str_new(p->pattern->error().data(), p->pattern->error().size());
+    results = rb_ary_new_capa(count);
+
+    /* Chunks cover consecutive texts so their indices are in text order. */
+    size_t chunk = 0, position = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+      VALUE result = rb_ary_new_capa(batch->counts[i]);
+
+      for (int j = 0; j < batch->counts[i]; ++j) {
+        while (position == batch->indices[chunk].size()) {
+          ++chunk;
+          position = 0;
+        }
+
+        rb_ary_push(result, INT2FIX(batch->indices[chunk][position++]));
+      }
+
+      rb_ary_push(results, result);
+    }
   }
+
+  RB_GC_GUARD(wrapper);
+
+  return results;
 }
 
 /*
- * If the {RE2::Regexp} could not be created properly, returns
- * the offending portion of the regexp otherwise returns `nil`.
+ * Matches the set against every string in `strings` at once, releasing the
+ * GVL only once for the whole batch rather than once per string. This is
+ * much faster than calling {RE2::Set#match} in a loop when classifying many
+ * short strings.
  *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ * Results can either be returned as an array of matching indexes for each
+ * string or, to avoid allocating an array per string, as a flat pair of
+ * arrays in "compressed sparse row" form: an array of `strings.size + 1`
+ * offsets and a single array of the indexes matched by every string such that
+ * the indexes matched by the `i`th string are `indices[offsets[i]...offsets[i + 1]]`.
  *
- * @return [String, nil] the offending portion of the regexp or `nil`
+ * @param [Array<String>] strings the texts to match against
+ * @param [Hash] options the options with which to match
+ * @option options [Boolean] :exception (true) whether to raise exceptions
+ *   with RE2's error information (not supported on ABI version 0 of RE2)
+ * @option options [Symbol] :output (:arrays) either :arrays to return the
+ *   indexes for each string or :flat to return offsets and indexes
+ * @return [Array<Array<Integer>>] the indexes of matching regexps for each
+ *   string if `output: :arrays`
+ * @return [Array(Array<Integer>, Array<Integer>)] the offsets and indexes of
+ *   matching regexps if `output: :flat`
+ * @raise [ArgumentError] if given an invalid output
+ * @raise [TypeError] if given a non-array of strings or any element cannot be
+ *   coerced to a `String`
+ * @raise [NoMemoryError] if there was not enough memory to store the matches
+ * @raise [RE2::Set::MatchError] if `:exception` is true and there was an
+ *   error matching
+ * @raise [RE2::Set::UnsupportedError] if `:exception` is true and the
+ *   underlying version of RE2 does not output error information
+ * @example
+ *   set = RE2::Set.new
+ *   set.add("abc")
+ *   set.add("def")
+ *   set.compile
+ *   set.match_many(["abcdef", "xyz", "def"])
+ *   #=> [[0, 1], [], [1]]
+ *   set.match_many(["abcdef", "xyz", "def"], output: :flat)
+ *   #=> [[0, 2, 2, 3], [0, 1, 1]]
  */
-static VALUE re2_regexp_error_arg(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
-
-  if (p->pattern->ok()) {
-    return Qnil;
-  } else {
-    return encoded_str_new(p->pattern->error_arg().data(),
-        p->pattern->error_arg().size(),
-        p->pattern->options().encoding());
-  }
+static VALUE re2_set_match_many(int argc, VALUE *argv, const VALUE self) {
+  return re2_set_match_batch(argc, argv, self, false);
 }
 
 /*
- * Returns the program size, a very approximate measure
- * of a regexp's "cost". Larger numbers are more expensive
- * than smaller numbers.
+ * Matches the set against every string in `strings`, splitting the batch
+ * across a pool of native worker threads so that large batches can use more
+ * than one CPU core. Results are returned in the same order as `strings`.
  *
- * @return [Integer] the regexp "cost"
+ * The pool is shared by all regexps and sets and can be configured with
+ * {RE2.thread_pool_size=} and {RE2.thread_pool_cpus=}. On Windows, the batch
+ * is always matched on the calling thread.
+ *
+ * @param [Array<String>] strings the texts to match against
+ * @param [Hash] options the options with which to match
+ * @option options [Integer] :threads the number of threads to split the batch
+ *   across, defaults to {RE2.thread_pool_size}
+ * @option options [Boolean] :exception (true) whether to raise exceptions
+ *   with RE2's error information (not supported on ABI version 0 of RE2)
+ * @option options [Symbol] :output (:arrays) either :arrays or :flat as for
+ *   {RE2::Set#match_many}
+ * @return [Array<Array<Integer>>] the indexes of matching regexps for each
+ *   string if `output: :arrays`
+ * @return [Array(Array<Integer>, Array<Integer>)] the offsets and indexes of
+ *   matching regexps if `output: :flat`
+ * @raise [ArgumentError] if given fewer than one thread or an invalid output
+ * @raise [TypeError] if given a non-array of strings or any element cannot be
+ *   coerced to a `String`
+ * @raise [RE2::Set::MatchError] if `:exception` is true and there was an
+ *   error matching
+ * @raise [RE2::Set::UnsupportedError] if `:exception` is true and the
+ *   underlying version of RE2 does not output error information
+ * @example
+ *   set = RE2::Set.new
+ *   set.add("abc")
+ *   set.add("def")
+ *   set.compile
+ *   set.parallel_match(["abcdef", "abc", "xyz"], threads: 2)
+ *   #=> [[0, 1], [0], []]
  */
-static VALUE re2_regexp_program_size(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
-
-  return INT2FIX(p->pattern->ProgramSize());
+static VALUE re2_set_parallel_match(int argc, VALUE *argv, const VALUE self) {
+  return re2_set_match_batch(argc, argv, self, true);
 }
 
 /*
- * Returns a hash of the options currently set for the {RE2::Regexp}.
+ * Searches every line of the file at `path` for the patterns in the set,
+ * returning the line number (starting from 1) of each line that matched any
+ * pattern along with the indices of the patterns that matched it, in file
+ * order.
  *
- * @return [Hash] the options
+ * The file is read a block at a time rather than into a `String` and split
+ * into partitions at line boundaries which are read and searched in parallel
+ * on the thread pool (see {RE2.thread_pool_size=}) without the GVL (where
+ * supported). A file that is truncated while it is searched is only searched
+ * up to its new end. Each line is matched on its own without its trailing newline.
+ *
+ * @param [String, Pathname] path the path of the file to search
+ * @param [Hash] options the options with which to search
+ * @option options [Integer] :threads (RE2.thread_pool_size) how many threads
+ *   to search with
+ * @option options [Symbol] :output (:lines) either :lines to identify
+ *   matching lines by number or :offsets to identify them by the byte offset
+ *   of their start in the file
+ * @return [Array<Array(Integer, Array<Integer>)>] the number (or offset) of
+ *   each matching line and the indices of the patterns that matched it
+ * @raise [ArgumentError] if given fewer than 1 thread or an invalid output
+ * @raise [MatchError] if called before compile or an error occurs while
+ *   matching
+ * @raise [NoMemoryError] if there was not enough memory to store the matches
+ * @raise [SystemCallError] if the file could not be read or is not a regular
+ *   file
+ * @example
+ *   set = RE2::Set.new
+ *   set.add("ERROR")
+ *   set.add("timeout")
+ *   set.compile
+ *   set.search_file("production.log") #=> [[12, [0]], [407, [0, 1]]]
  */
-static VALUE re2_regexp_options(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
-  VALUE options = rb_hash_new();
+static VALUE re2_set_search_file(int argc, VALUE *argv, const VALUE self) {
+  size_t threads;
+  bool offsets;
+  VALUE path = parse_re2_search_file(argc, argv, &threads, &offsets);
 
-  rb_hash_aset(options, ID2SYM(id_utf8),
-      BOOL2RUBY(p->pattern->options().encoding() == RE2::Options::EncodingUTF8));
+  re2_set *s = unwrap_re2_set(self);
+  if (!s->compiled) {
+    rb_raise(re2_eSetMatchError, "#match must not be called before #compile");
+  }
 
-  rb_hash_aset(options, ID2SYM(id_posix_syntax),
-      BOOL2RUBY(p->pattern->options().posix_syntax()));
+  re2_file_matches *results;
+  VALUE wrapper = re2_file_matches_alloc(&results);
 
-  rb_hash_aset(options, ID2SYM(id_longest_match),
-      BOOL2RUBY(p->pattern->options().longest_match()));
+  nogvl_search_file_arg arg;
+  arg.pattern = nullptr;
+  arg.set = s->set;
+  arg.offsets = offsets;
+  arg.results = results;
+  arg.threads = threads;
 
-  rb_hash_aset(options, ID2SYM(id_log_errors),
-      BOOL2RUBY(p->pattern->options().log_errors()));
+  re2_search_file_without_gvl(path, &arg);
 
-  rb_hash_aset(options, ID2SYM(id_max_mem),
-      INT2FIX(p->pattern->options().max_mem()));
+#ifdef HAVE_ERROR_INFO_ARGUMENT
+  re2_set_check_match_error(arg.set_error.load(std::memory_order_relaxed));
+#endif
 
-  rb_hash_aset(options, ID2SYM(id_literal),
-      BOOL2RUBY(p->pattern->options().literal()));
+  VALUE result = rb_ary_new();
+  int64_t line = 1;
 
-  rb_hash_aset(options, ID2SYM(id_never_nl),
-      BOOL2RUBY(p->pattern->options().never_nl()));
+  for (size_t chunk = 0; chunk < results->hits.size(); ++chunk) {
+    const std::vector<int64_t> &hits = results->hits[chunk];
+    const std::vector<int> &indices = results->indices[chunk];
+    size_t next = 0;
 
-  rb_hash_aset(options, ID2SYM(id_case_sensitive),
-      BOOL2RUBY(p->pattern->options().case_sensitive()));
+    for (size_t i = 0; i < hits.size(); i += 3) {
+      size_t count = static_cast<size_t>(hits[i + 2]);
+      VALUE matched = rb_ary_new_capa(count);
+      for (size_t j = 0; j < count; ++j) {
+        rb_ary_push(matched, INT2FIX(indices[next + j]));
+      }
+      next += count;
 
-  rb_hash_aset(options, ID2SYM(id_perl_classes),
-      BOOL2RUBY(p->pattern->options().perl_classes()));
+      rb_ary_push(result, rb_assoc_new(
+            offsets ? LL2NUM(hits[i + 1]) : LL2NUM(line + hits[i]), matched));
+    }
 
-  rb_hash_aset(options, ID2SYM(id_word_boundary),
-      BOOL2RUBY(p->pattern->options().word_boundary()));
+    line += results->lines[chunk];
+  }
 
-  rb_hash_aset(options, ID2SYM(id_one_line),
-      BOOL2RUBY(p->pattern->options().one_line()));
+  RB_GC_GUARD(wrapper);
 
-  /* This is a read-only hash after all... */
-  rb_obj_freeze(options);
+  return result;
+}
 
-  return options;
+static void re2_replacer_free(void *ptr) {
+  re2_replacer *r = static_cast<re2_replacer *>(ptr);
+  if (r->patterns) {
+    for (RE2 *pattern : *r->patterns) {
+      delete pattern;
+    }
+    rb_gc_adjust_memory_usage(-static_cast<ssize_t>(r->memsize));
+  }
+  delete r->patterns;
+  delete r->rewrites;
+  delete r->set;
+  xfree(r);
 }
 
-/*
- * Returns the number of capturing subpatterns, or -1 if the regexp
- * wasn't valid on construction. The overall match (`$0`) does not
- * count: if the regexp is `"(a)(b)"`, returns 2.
- *
- * @return [Integer] the number of capturing subpatterns
- */
-static VALUE re2_regexp_number_of_capturing_groups(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
+static size_t re2_replacer_memsize(const void *ptr) {
+  const re2_replacer *r = static_cast<const re2_replacer *>(ptr);
+  size_t size = sizeof(*r);
+  if (r->patterns) {
+    size += r->memsize;
+  }
 
-  return INT2FIX(p->pattern->NumberOfCapturingGroups());
+  return size;
 }
 
-/*
- * Returns a hash of names to capturing indices of groups.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
- *
- * @return [Hash] a hash of names to capturing indices
- */
-static VALUE re2_regexp_named_capturing_groups(const VALUE self) {
-  re2_pattern *p = unwrap_re2_regexp(self);
-  const auto& groups = p->pattern->NamedCapturingGroups();
-  VALUE capturing_groups = rb_hash_new();
+static const rb_data_type_t re2_replacer_data_type = {
+  "RE2::Replacer",
+  {
+    0,
+    re2_replacer_free,
+    re2_replacer_memsize,
+  },
+  0,
+  0,
+  // IMPORTANT: WB_PROTECTED objects must only use the RB_OBJ_WRITE()
+  // macro to update VALUE references, as to trigger write barriers.
+  RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_FROZEN_SHAREABLE
+};
 
-  for (const auto& group : groups) {
-    rb_hash_aset(capturing_groups,
-        encoded_str_new(group.first.data(), group.first.size(),
-          p->pattern->options().encoding()),
-        INT2FIX(group.second));
+static re2_replacer *unwrap_re2_replacer(VALUE self) {
+  re2_replacer *r;
+  TypedData_Get_Struct(self, re2_replacer, &re2_replacer_data_type, r);
+  if (!r->patterns) {
+    rb_raise(rb_eTypeError, "uninitialized RE2::Replacer");
   }
-
-  return capturing_groups;
+  return r;
 }
 
-/*
- * General matching: match the pattern against the given `text` using
- * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L562-L588
- * `Match`} and return a {RE2::MatchData} instance with the specified number of
- * submatches (defaults to the total number of capturing groups) or a boolean
- * (if no submatches are required).
- *
- * The number of submatches has a significant impact on performance: requesting
- * one submatch is much faster than requesting more than one and requesting
- * zero submatches is faster still.
- *
- * @overload match(text)
- *   Returns a {RE2::MatchData} containing the matching pattern and all
- *   submatches resulting from looking for the regexp in `text` if the pattern
- *   contains capturing groups.
- *
- *   Returns either `true` or `false` indicating whether a successful match was
- *   made if the pattern contains no capturing groups.
- *
- *   @param [String] text the text to search
- *   @return [RE2::MatchData, nil] if the pattern contains capturing groups
- *   @return [Boolean] if the pattern does not contain capturing groups
- *   @raise [NoMemoryError] if there was not enough memory to allocate the submatches
- *   @raise [TypeError] if given text that cannot be coerced to a `String`
- *   @example Matching with capturing groups
- *     r = RE2::Regexp.new('w(o)(o)')
- *     r.match('woo') #=> #<RE2::MatchData "woo" 1:"o" 2:"o">
- *   @example Matching without capturing groups
- *     r = RE2::Regexp.new('woo')
- *     r.match('woo') #=> true
- *
- * @overload match(text, options)
- *   See `match(text)` but with customisable offsets for starting and ending
- *   matches, optional anchoring to the start or both ends of the text and a
- *   specific number of submatches to extract (padded with `nil`s if
- *   necessary).
- *
- *   @param [String] text the text to search
- *   @param [Hash] options the options with which to perform the match
- *   @option options [Integer] :startpos (0) offset at which to start matching
- *   @option options [Integer] :endpos offset at which to stop matching, defaults to the text length
- *   @option options [Symbol] :anchor (:unanchored) one of :unanchored, :anchor_start, :anchor_both to anchor the match
- *   @option options [Integer] :submatches how many submatches to extract (0 is
- *     fastest), defaults to the number of capturing groups
- *   @return [RE2::MatchData, nil] if extracting any submatches
- *   @return [Boolean] if not extracting any submatches
- *   @raise [ArgumentError] if given a negative number of submatches, invalid
- *     anchor or invalid startpos, endpos pair
- *   @raise [NoMemoryError] if there was not enough memory to allocate the matches
- *   @raise [TypeError] if given non-String text, non-numeric number of
- *     submatches, non-symbol anchor or non-hash options
- *   @raise [RE2::Regexp::UnsupportedError] if given an endpos argument on a
- *     version of RE2 that does not support it
- *   @example Matching with capturing groups
- *     r = RE2::Regexp.new('w(o)(o)')
- *     r.match('woo', submatches: 1) #=> #<RE2::MatchData "woo" 1:"o">
- *     r.match('woo', submatches: 3) #=> #<RE2::MatchData "woo" 1:"o" 2:"o" 3:nil>
- *     r.match('woot', anchor: :anchor_both, submatches: 0)
- *     #=> false
- *     r.match('woot', anchor: :anchor_start, submatches: 0)
- *     #=> true
- *   @example Matching without capturing groups
- *     r = RE2::Regexp.new('wo+')
- *     r.match('woot', anchor: :anchor_both)  #=> false
- *     r.match('woot', anchor: :anchor_start) #=> true
- *
- * @overload match(text, submatches)
- *   @deprecated Legacy syntax for matching against `text` with a specific
- *     number of submatches to extract. Use `match(text, submatches: n)` instead.
- *
- *   @param [String] text the text to search
- *   @param [Integer] submatches the number of submatches to extract
- *   @return [RE2::MatchData, nil] if extracting any submatches
- *   @return [Boolean] if not extracting any submatches
- *   @raise [NoMemoryError] if there was not enough memory to allocate the submatches
- *   @raise [TypeError] if given non-numeric number of submatches
- *   @example
- *     r = RE2::Regexp.new('w(o)(o)')
- *     r.match('woo', 0) #=> true
- *     r.match('woo', 1) #=> #<RE2::MatchData "woo" 1:"o">
- *     r.match('woo', 2) #=> #<RE2::MatchData "woo" 1:"o" 2:"o">
- */
-static VALUE re2_regexp_match(int argc, VALUE *argv, const VALUE self) {
-  re2_pattern *p;
-  re2_matchdata *m;
-  VALUE text, options;
+static VALUE re2_replacer_allocate(VALUE klass) {
+  re2_replacer *r;
 
-  rb_scan_args(argc, argv, "11", &text, &options);
+  return TypedData_Make_Struct(klass, re2_replacer, &re2_replacer_data_type,
+      r);
+}
 
-  /* Coerce and freeze text to prevent mutation. */
-  StringValue(text);
-  text = rb_str_new_frozen(text);
+static VALUE re2_replacer_initialize_copy(VALUE, VALUE) {
+  rb_raise(rb_eTypeError, "cannot copy RE2::Replacer");
+}
 
-  p = unwrap_re2_regexp(self);
+struct nogvl_replacer_compile_arg {
+  const RE2::Options *options;
+  re2_batch *patterns;
+  re2_batch *rewrites;
+  RE2::Set *set;
+  long failed;
+  bool out_of_memory;
+  bool finished;
+};
 
-  int n;
-  size_t startpos = 0;
-  size_t endpos = RSTRING_LEN(text);
-  RE2::Anchor anchor = RE2::UNANCHORED;
+/* Compiles every pattern (into `patterns->compiled`), checks its rewrite and
+ * builds a set of all the patterns to find which could match a text. If the
+ * set cannot be compiled, every pattern is tried instead.
+ */
+static void *nogvl_replacer_compile(void *ptr) {
+  auto *arg = static_cast<nogvl_replacer_compile_arg *>(ptr);
+  re2_batch *patterns = arg->patterns;
+  size_t count = patterns->pieces.size();
 
-  if (RTEST(options)) {
-    if (RB_INTEGER_TYPE_P(options)) {
-      n = NUM2INT(options);
+  try {
+    patterns->compiled.resize(count);
+    patterns->messages.resize(count);
 
-      if (n < 0) {
-        rb_raise(rb_eArgError, "number of matches should be >= 0");
-      }
-    } else {
-      if (TYPE(options) != T_HASH) {
-        options = rb_Hash(options);
+    for (size_t i = 0; i < count; ++i) {
+      patterns->compiled[i].reset(new RE2(patterns->pieces[i], *arg->options));
+
+      const RE2 *pattern = patterns->compiled[i].get();
+      if (!pattern->ok()) {
+        patterns->messages[i] = pattern->error();
+        arg->failed = static_cast<long>(i);
+
+        return nullptr;
       }
 
-      VALUE endpos_option = rb_hash_aref(options, ID2SYM(id_endpos));
-      if (!NIL_P(endpos_option)) {
-#ifdef HAVE_ENDPOS_ARGUMENT
-        ssize_t endpos_value = NUM2SSIZET(endpos_option);
+      if (!pattern->CheckRewriteString(arg->rewrites->pieces[i],
+            &patterns->messages[i])) {
+        arg->failed = static_cast<long>(i);
 
-        if (endpos_value < 0) {
-          rb_raise(rb_eArgError, "endpos should be >= 0");
-        }
+        return nullptr;
+      }
+    }
 
-        endpos = static_cast<size_t>(endpos_value);
-#else
-        rb_raise(re2_eRegexpUnsupportedError, "current version of RE2::Match() does not support endpos argument");
-#endif
+    if (count > 0) {
+      std::unique_ptr<RE2::Set> set(
+          new RE2::Set(*arg->options, RE2::UNANCHORED));
+
+      for (const re2::StringPiece &piece : patterns->pieces) {
+        set->Add(piece, nullptr);
       }
 
-      VALUE anchor_option = rb_hash_aref(options, ID2SYM(id_anchor));
-      if (!NIL_P(anchor_option)) {
-        Check_Type(anchor_option, T_SYMBOL);
-
-        ID id_anchor_option = SYM2ID(anchor_option);
-        if (id_anchor_option == id_unanchored) {
-          anchor = RE2::UNANCHORED;
-        } else if (id_anchor_option == id_anchor_start) {
-          anchor = RE2::ANCHOR_START;
-        } else if (id_anchor_option == id_anchor_both) {
-          anchor = RE2::ANCHOR_BOTH;
-        } else {
-          rb_raise(rb_eArgError, "anchor should be one of: :unanchored, :anchor_start, :anchor_both");
-        }
+      if (set->Compile()) {
+        arg->set = set.release();
       }
+    }
+  } catch (const std::bad_alloc &) {
+    arg->out_of_memory = true;
+  }
 
-      VALUE submatches_option = rb_hash_aref(options, ID2SYM(id_submatches));
-      if (!NIL_P(submatches_option)) {
-        n = NUM2INT(submatches_option);
+  return nullptr;
+}
 
-        if (n < 0) {
-          rb_raise(rb_eArgError, "number of matches should be >= 0");
-        }
-      } else {
-        if (!p->pattern->ok()) {
-          return Qnil;
-        }
+static VALUE re2_replacer_compile_body(VALUE ptr) {
+  auto *arg = reinterpret_cast<nogvl_replacer_compile_arg *>(ptr);
+  re2_call_without_gvl(nogvl_replacer_compile, arg, SIZE_MAX);
+  arg->finished = true;
 
-        n = p->pattern->NumberOfCapturingGroups();
-      }
+  return Qnil;
+}
 
-      VALUE startpos_option = rb_hash_aref(options, ID2SYM(id_startpos));
-      if (!NIL_P(startpos_option)) {
-        ssize_t startpos_value = NUM2SSIZET(startpos_option);
+/* Frees the set if the thread was interrupted (e.g. by Thread#raise when
+ * reacquiring the GVL) after compiling it, as nothing will take ownership of
+ * it. The compiled patterns are owned by their batch.
+ */
+static VALUE re2_replacer_compile_ensure(VALUE ptr) {
+  auto *arg = reinterpret_cast<nogvl_replacer_compile_arg *>(ptr);
+  if (!arg->finished) {
+    delete arg->set;
+    arg->set = nullptr;
+  }
 
-        if (startpos_value < 0) {
-          rb_raise(rb_eArgError, "startpos should be >= 0");
-        }
+  return Qnil;
+}
 
-        startpos = static_cast<size_t>(startpos_value);
+struct nogvl_replacer_replace_arg {
+  const re2_replacer *r;
+  re2::StringPiece text;
+  std::string *out;
+  int count;
+  bool failed;
+};
+
+/* Replaces every match of any pattern in the text in a single pass, always
+ * taking the leftmost match and, where several patterns match at the same
+ * position, the one added first. As in `RE2::GlobalReplace`, a pattern may
+ * not match empty text at the end of its own previous match: it is searched
+ * for again from the next character instead, so that a later pattern can
+ * still match there.
+ */
+static void *nogvl_replacer_replace(void *ptr) {
+  auto *arg = static_cast<nogvl_replacer_replace_arg *>(ptr);
+  const re2_replacer *r = arg->r;
+  const re2::StringPiece &text = arg->text;
+  std::string *out = arg->out;
+
+  try {
+    /* Only patterns the set finds anywhere in the text can match. */
+    std::vector<int> candidates;
+    bool filtered = false;
+    if (r->set) {
+#ifdef HAVE_ERROR_INFO_ARGUMENT
+      RE2::Set::ErrorInfo e;
+      filtered = r->set->Match(text, &candidates, &e) ||
+        e.kind == RE2::Set::kNoError;
+#else
+      filtered = r->set->Match(text, &candidates);
+#endif
+    }
+    if (filtered) {
+      std::sort(candidates.begin(), candidates.end());
+    } else {
+      candidates.resize(r->patterns->size());
+      for (size_t i = 0; i < candidates.size(); ++i) {
+        candidates[i] = static_cast<int>(i);
       }
     }
-  } else {
-    if (!p->pattern->ok()) {
-      return Qnil;
+
+    /* The next match of each candidate, only searched for again once the
+     * output has passed where it starts, and where its last match ended.
+     */
+    std::vector<std::vector<re2::StringPiece>> found(candidates.size());
+    std::vector<const char *> lastends(candidates.size(), nullptr);
+    for (size_t j = 0; j < candidates.size(); ++j) {
+      found[j].resize(1 + RE2::MaxSubmatch((*r->rewrites)[candidates[j]]));
     }
 
-    n = p->pattern->NumberOfCapturingGroups();
-  }
+    const char *p = text.data();
+    const char *ep = p + text.size();
 
-  if (startpos > endpos) {
-    rb_raise(rb_eArgError, "startpos should be <= endpos");
-  }
+    out->reserve(text.size());
 
-#ifndef HAVE_ENDPOS_ARGUMENT
-  /* Old RE2's Match() takes int startpos. Reject values that would overflow. */
-  if (startpos > INT_MAX) {
-    rb_raise(rb_eRangeError, "startpos should be <= %d", INT_MAX);
-  }
-#endif
+    while (p <= ep) {
+      long best = -1;
 
-  if (n == 0) {
-    bool matched = re2_match_without_gvl(
-        p->pattern, text, startpos, endpos, anchor, 0, 0);
-    RB_GC_GUARD(text);
+      for (size_t j = 0; j < candidates.size(); ++j) {
+        if (candidates[j] < 0) {
+          continue;
+        }
 
-    return BOOL2RUBY(matched);
-  } else {
-    if (n == INT_MAX) {
-      rb_raise(rb_eRangeError, "number of matches should be < %d", INT_MAX);
-    }
+        const RE2 *pattern = (*r->patterns)[candidates[j]];
+        std::vector<re2::StringPiece> &match = found[j];
+        const char *start = p;
+
+        while (match[0].data() == nullptr || match[0].data() < start ||
+            (match[0].data() == lastends[j] && match[0].empty())) {
+          /* Disallow an empty match at the end of the pattern's last match
+           * by searching again from the next character.
+           */
+          if (match[0].data() != nullptr && match[0].data() >= start) {
+            if (start == ep) {
+              candidates[j] = -1;
+              break;
+            }
+            start += re2_char_size(pattern,
+                re2::StringPiece(start, ep - start));
+          }
 
-    /* Because match returns the whole match as well. */
-    n += 1;
+#ifdef HAVE_ENDPOS_ARGUMENT
+          bool matched = pattern->Match(text, start - text.data(),
+              text.size(), RE2::UNANCHORED, match.data(),
+              static_cast<int>(match.size()));
+#else
+          bool matched = pattern->Match(text, start - text.data(),
+              RE2::UNANCHORED, match.data(), static_cast<int>(match.size()));
+#endif
+          if (!matched) {
+            candidates[j] = -1;
+            break;
+          }
+        }
 
-    re2::StringPiece *matches = new(std::nothrow) re2::StringPiece[n];
-    if (matches == nullptr) {
-      rb_raise(rb_eNoMemError,
-               "not enough memory to allocate StringPieces for matches");
-    }
+        if (candidates[j] < 0) {
+          continue;
+        }
 
-    bool matched = re2_match_without_gvl(
-        p->pattern, text, startpos, endpos, anchor, matches, n);
-    RB_GC_GUARD(text);
+        if (best < 0 || match[0].data() < found[best][0].data()) {
+          best = static_cast<long>(j);
+        }
+      }
 
-    if (matched) {
-      VALUE matchdata = rb_class_new_instance(0, 0, re2_cMatchData);
-      TypedData_Get_Struct(matchdata, re2_matchdata, &re2_matchdata_data_type, m);
+      if (best < 0) {
+        break;
+      }
 
-      RB_OBJ_WRITE(matchdata, &m->regexp, self);
-      RB_OBJ_WRITE(matchdata, &m->text, text);
-      m->matches = matches;
-      m->number_of_matches = n;
+      const RE2 *pattern = (*r->patterns)[candidates[best]];
+      const re2::StringPiece &match = found[best][0];
 
-      return matchdata;
-    } else {
-      delete[] matches;
+      if (p < match.data()) {
+        out->append(p, match.data() - p);
+      }
 
-      return Qnil;
+      pattern->Rewrite(out, (*r->rewrites)[candidates[best]],
+          found[best].data(), static_cast<int>(found[best].size()));
+      p = match.data() + match.size();
+      lastends[best] = p;
+      arg->count += 1;
     }
+
+    if (p < ep) {
+      out->append(p, ep - p);
+    }
+  } catch (const std::bad_alloc &) {
+    arg->failed = true;
   }
+
+  return nullptr;
 }
 
 /*
- * Returns true if the pattern matches any substring of the given text using
- * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L413-L427
- * `PartialMatch`}.
+ * Returns a new {RE2::Replacer} which replaces every match of several
+ * patterns in a string in a single pass, as if calling
+ * {RE2.global_replace} with each pattern and rewrite in turn but without
+ * copying and rescanning the whole string for every pattern.
  *
- * @param [String] text the text to search
- * @return [Boolean] whether the match was successful
- * @raise [TypeError] if text cannot be coerced to a `String`
+ * At each position, the leftmost match of any pattern is replaced. If
+ * several patterns match at the same position, the one given first wins.
+ * Replaced text is never matched again so patterns cannot replace the output
+ * of earlier patterns.
+ *
+ * @param [Array<Array(String, String)>] rules pairs of patterns and rewrites
+ *   (which may use `\1` to `\9` to refer to submatches as in
+ *   {RE2.global_replace})
+ * @param [Hash] options the options with which to compile every pattern (see
+ *   {RE2::Regexp#initialize})
+ * @return [RE2::Replacer]
+ * @raise [ArgumentError] if a rule is not a pair, a pattern is invalid or a
+ *   rewrite refers to submatches its pattern does not have
+ * @raise [TypeError] if given patterns or rewrites that can't be coerced to
+ *   `String`s
+ * @raise [NoMemoryError] if memory could not be allocated for the patterns
+ * @example
+ *   replacer = RE2::Replacer.new([
+ *     ['\d{4}-\d{4}-\d{4}-\d{4}', "[CARD]"],
+ *     ['(\w+)@\w+\.com', '\1@[REDACTED]']
+ *   ])
  */
-static VALUE re2_regexp_match_p(const VALUE self, VALUE text) {
-  StringValue(text);
-  text = rb_str_new_frozen(text);
+static VALUE re2_replacer_initialize(int argc, VALUE *argv, VALUE self) {
+  VALUE rules, options;
+  re2_replacer *r;
 
-  re2_pattern *p = unwrap_re2_regexp(self);
-  bool matched = re2_match_without_gvl(
-      p->pattern, text, 0, RSTRING_LEN(text), RE2::UNANCHORED, 0, 0);
-  RB_GC_GUARD(text);
+  rb_scan_args(argc, argv, "11", &rules, &options);
+  Check_Type(rules, T_ARRAY);
 
-  return BOOL2RUBY(matched);
-}
+  VALUE patterns = rb_ary_new_capa(RARRAY_LEN(rules));
+  VALUE rewrites = rb_ary_new_capa(RARRAY_LEN(rules));
 
-/*
- * Returns true if the pattern matches the given text using
- * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L376-L411
- * `FullMatch`}.
- *
- * @param [String] text the text to search
- * @return [Boolean] whether the match was successful
- * @raise [TypeError] if text cannot be coerced to a `String`
- */
-static VALUE re2_regexp_full_match_p(const VALUE self, VALUE text) {
-  StringValue(text);
-  text = rb_str_new_frozen(text);
+  for (long i = 0; i < RARRAY_LEN(rules); ++i) {
+    VALUE rule = rb_ary_entry(rules, i);
+    Check_Type(rule, T_ARRAY);
 
-  re2_pattern *p = unwrap_re2_regexp(self);
-  bool matched = re2_match_without_gvl(
-      p->pattern, text, 0, RSTRING_LEN(text), RE2::ANCHOR_BOTH, 0, 0);
-  RB_GC_GUARD(text);
+    if (RARRAY_LEN(rule) != 2) {
+      rb_raise(rb_eArgError, "rules should be pairs of patterns and rewrites");
+    }
 
-  return BOOL2RUBY(matched);
-}
+    rb_ary_push(patterns, rb_ary_entry(rule, 0));
+    rb_ary_push(rewrites, rb_ary_entry(rule, 1));
+  }
 
-/*
- * Returns a {RE2::Scanner} for scanning the given text incrementally with
- * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L447-L463
- * `FindAndConsume`}.
- *
- * @param [text] text the text to scan incrementally
- * @return [RE2::Scanner] an `Enumerable` {RE2::Scanner} object
- * @raise [TypeError] if `text` cannot be coerced to a `String`
- * @example
- *   c = RE2::Regexp.new('(\w+)').scan("Foo bar baz")
- *   #=> #<RE2::Scanner:0x0000000000000001>
- */
-static VALUE re2_regexp_scan(const VALUE self, VALUE text) {
-  StringValue(text);
-  text = rb_str_new_frozen(text);
+  /* Coerce and freeze every pattern and rewrite before any C++ allocations. */
+  re2_batch *pattern_batch;
+  VALUE pattern_wrapper = re2_batch_new(patterns, &pattern_batch);
+  re2_batch *rewrite_batch;
+  VALUE rewrite_wrapper = re2_batch_new(rewrites, &rewrite_batch);
 
-  re2_pattern *p = unwrap_re2_regexp(self);
-  re2_scanner *c;
-  VALUE scanner = rb_class_new_instance(0, 0, re2_cScanner);
-  TypedData_Get_Struct(scanner, re2_scanner, &re2_scanner_data_type, c);
+  RE2::Options re2_options;
 
-  RB_OBJ_WRITE(scanner, &c->regexp, self);
-  RB_OBJ_WRITE(scanner, &c->text, text);
-  c->input = new(std::nothrow) re2::StringPiece(
-      RSTRING_PTR(c->text), RSTRING_LEN(c->text));
-  if (c->input == nullptr) {
-    rb_raise(rb_eNoMemError,
-             "not enough memory to allocate StringPiece for input");
+  if (RTEST(options)) {
+    parse_re2_options(&re2_options, options);
   }
 
-  if (p->pattern->ok()) {
-    c->number_of_capturing_groups = p->pattern->NumberOfCapturingGroups();
-  } else {
-    c->number_of_capturing_groups = 0;
+  TypedData_Get_Struct(self, re2_replacer, &re2_replacer_data_type, r);
+
+  rb_check_frozen(self);
+
+  if (r->patterns) {
+    rb_raise(rb_eTypeError, "already initialized RE2::Replacer");
   }
 
-  c->eof = false;
+  nogvl_replacer_compile_arg arg;
+  arg.options = &re2_options;
+  arg.patterns = pattern_batch;
+  arg.rewrites = rewrite_batch;
+  arg.set = nullptr;
+  arg.failed = -1;
+  arg.out_of_memory = false;
+  arg.finished = false;
 
-  return scanner;
-}
+  rb_ensure(re2_replacer_compile_body, reinterpret_cast<VALUE>(&arg),
+      re2_replacer_compile_ensure, reinterpret_cast<VALUE>(&arg));
 
-/*
- * Returns whether the underlying RE2 version supports passing an `endpos`
- * argument to
- * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L562-L588
- * Match}. If not, {RE2::Regexp#match} will raise an error if attempting to
- * pass an `endpos`.
- *
- * @return [Boolean] whether the underlying
- *   {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L562-L588
- *   Match} has an endpos argument
- */
-static VALUE re2_regexp_match_has_endpos_argument_p(VALUE) {
-#ifdef HAVE_ENDPOS_ARGUMENT
-  return Qtrue;
-#else
-  return Qfalse;
-#endif
-}
+  if (arg.out_of_memory) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate RE2::Replacer");
+  }
 
-/*
- * Returns a copy of `str` with the first occurrence `pattern` replaced with
- * `rewrite` using
- * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L465-L480
- * `Replace`}.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
- *
- * @param [String] str the string to modify
- * @param [String, RE2::Regexp] pattern a regexp matching text to be replaced
- * @param [String] rewrite the string to replace with
- * @return [String] the resulting string
- * @raise [TypeError] if the given rewrite or pattern (if not provided as a
- *   {RE2::Regexp}) cannot be coerced to `String`s
- * @example
- *   RE2.replace("hello there", "hello", "howdy") #=> "howdy there"
- *   re2 = RE2::Regexp.new("hel+o")
- *   RE2.replace("hello there", re2, "yo")        #=> "yo there"
- */
-static VALUE re2_replace(VALUE, VALUE str, VALUE pattern,
-    VALUE rewrite) {
-  re2_pattern *p = nullptr;
+  if (arg.failed >= 0) {
+    rb_raise(rb_eArgError, "rule %ld rejected by RE2::Replacer: %s",
+        arg.failed, pattern_batch->messages[arg.failed].c_str());
+  }
 
-  /* Coerce and freeze all arguments before any C++ allocations so that any
-   * Ruby exceptions (via longjmp) cannot bypass C++ destructors and leak
-   * memory, and later coercions cannot mutate earlier strings.
+  /* Only initialize once every pattern has compiled so that other threads
+   * never see a partially constructed replacer.
    */
-  StringValue(str);
-  str = rb_str_new_frozen(str);
-  if (rb_obj_is_kind_of(pattern, re2_cRegexp)) {
-    p = unwrap_re2_regexp(pattern);
-  } else {
-    StringValue(pattern);
-    pattern = rb_str_new_frozen(pattern);
+  if (OBJ_FROZEN(self)) {
+    delete arg.set;
+    rb_check_frozen(self);
   }
-  StringValue(rewrite);
-  rewrite = rb_str_new_frozen(rewrite);
 
-  /* Take a copy of str so it can be modified in-place by RE2::Replace. */
-  std::string str_as_string(RSTRING_PTR(str), RSTRING_LEN(str));
+  r->set = arg.set;
+  r->encoding = re2_options.encoding();
 
-  nogvl_replace_arg arg;
-  arg.str = &str_as_string;
-  if (p) {
-    arg.pattern = p->pattern;
-  } else {
-    arg.pattern = nullptr;
-    arg.string_pattern = re2::StringPiece(
-        RSTRING_PTR(pattern), RSTRING_LEN(pattern));
+  r->rewrites = new(std::nothrow) std::vector<std::string>();
+  if (r->rewrites == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate rewrites");
+  }
+  for (const re2::StringPiece &rewrite : rewrite_batch->pieces) {
+    r->rewrites->emplace_back(rewrite.data(), rewrite.size());
   }
-  arg.rewrite = re2::StringPiece(
-      RSTRING_PTR(rewrite), RSTRING_LEN(rewrite));
-
-#ifdef _WIN32
-  nogvl_replace(&arg);
-#else
-  rb_thread_call_without_gvl(nogvl_replace, &arg, NULL, NULL);
-#endif
 
-  RB_GC_GUARD(rewrite);
-  RB_GC_GUARD(pattern);
+  std::vector<RE2 *> *compiled = new(std::nothrow) std::vector<RE2 *>();
+  if (compiled == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate patterns");
+  }
 
-  if (p) {
-    return encoded_str_new(str_as_string.data(), str_as_string.size(),
-        p->pattern->options().encoding());
-  } else {
-    return encoded_str_new(str_as_string.data(), str_as_string.size(),
-        RE2::Options::EncodingUTF8);
+  size_t memsize = 0;
+  for (std::unique_ptr<RE2> &pattern : pattern_batch->compiled) {
+    memsize += re2_pattern_memsize(pattern.get());
+    compiled->push_back(pattern.release());
+  }
+  for (const std::string &rewrite : *r->rewrites) {
+    memsize += sizeof(rewrite) + rewrite.capacity();
   }
+  if (r->set) {
+    memsize += sizeof(*r->set) + re2_bytes_per_program;
+  }
+
+  r->patterns = compiled;
+  r->memsize = memsize;
+  rb_gc_adjust_memory_usage(static_cast<ssize_t>(memsize));
+
+  RB_GC_GUARD(pattern_wrapper);
+  RB_GC_GUARD(rewrite_wrapper);
+
+  rb_obj_freeze(self);
+
+  return self;
 }
 
 /*
- * Return a copy of `str` with `pattern` replaced by `rewrite` using
- * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L482-L497
- * `GlobalReplace`}.
- *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ * Returns a copy of `str` with every match of the replacer's patterns
+ * replaced by their rewrites in a single pass.
  *
  * @param [String] str the string to modify
- * @param [String, RE2::Regexp] pattern a regexp matching text to be replaced
- * @param [String] rewrite the string to replace with
- * @raise [TypeError] if the given rewrite or pattern (if not provided as a
- *   {RE2::Regexp}) cannot be coerced to `String`s
  * @return [String] the resulting string
+ * @raise [NoMemoryError] if there was not enough memory to build the result
+ * @raise [TypeError] if given text that can't be coerced to a `String`
  * @example
- *   re2 = RE2::Regexp.new("oo?")
- *   RE2.global_replace("whoops-doops", re2, "e") #=> "wheps-deps"
- *   RE2.global_replace("hello there", "e", "i")  #=> "hillo thiri"
+ *   replacer = RE2::Replacer.new([["cat", "dog"], ["dog", "cat"]])
+ *   replacer.replace("cat chases dog") #=> "dog chases cat"
  */
-static VALUE re2_global_replace(VALUE, VALUE str, VALUE pattern,
-                               VALUE rewrite) {
-  re2_pattern *p = nullptr;
+static VALUE re2_replacer_replace(VALUE self, VALUE str) {
+  re2_count_call(re2_entry_global_replace);
 
-  /* Coerce and freeze all arguments before any C++ allocations so that any
-   * Ruby exceptions (via longjmp) cannot bypass C++ destructors and leak
-   * memory, and later coercions cannot mutate earlier strings.
-   */
   StringValue(str);
   str = rb_str_new_frozen(str);
-  if (rb_obj_is_kind_of(pattern, re2_cRegexp)) {
-    p = unwrap_re2_regexp(pattern);
-  } else {
-    StringValue(pattern);
-    pattern = rb_str_new_frozen(pattern);
-  }
-  StringValue(rewrite);
-  rewrite = rb_str_new_frozen(rewrite);
 
-  /* Take a copy of str so it can be modified in-place by
-   * RE2::GlobalReplace.
-   */
-  std::string str_as_string(RSTRING_PTR(str), RSTRING_LEN(str));
+  re2_replacer *r = unwrap_re2_replacer(self);
 
-  nogvl_replace_arg arg;
-  arg.str = &str_as_string;
-  if (p) {
-    arg.pattern = p->pattern;
-  } else {
-    arg.pattern = nullptr;
-    arg.string_pattern = re2::StringPiece(
-        RSTRING_PTR(pattern), RSTRING_LEN(pattern));
-  }
-  arg.rewrite = re2::StringPiece(
-      RSTRING_PTR(rewrite), RSTRING_LEN(rewrite));
+  VALUE result = Qnil;
+  bool failed;
 
-#ifdef _WIN32
-  nogvl_global_replace(&arg);
-#else
-  rb_thread_call_without_gvl(nogvl_global_replace, &arg, NULL, NULL);
-#endif
+  {
+    std::string out;
 
-  RB_GC_GUARD(rewrite);
-  RB_GC_GUARD(pattern);
+    nogvl_replacer_replace_arg arg;
+    arg.r = r;
+    arg.text = re2::StringPiece(RSTRING_PTR(str), RSTRING_LEN(str));
+    arg.out = &out;
+    arg.count = 0;
+    arg.failed = false;
 
-  if (p) {
-    return encoded_str_new(str_as_string.data(), str_as_string.size(),
-        p->pattern->options().encoding());
-  } else {
-    return encoded_str_new(str_as_string.data(), str_as_string.size(),
-        RE2::Options::EncodingUTF8);
+    re2_call_without_gvl(nogvl_replacer_replace, &arg, arg.text.size());
+    RB_GC_GUARD(str);
+
+    failed = arg.failed;
+    if (!failed) {
+      result = encoded_str_new(out.data(), out.size(), r->encoding);
+    }
+  }
+
+  /* Raise outside of the block so that out's destructor runs. */
+  if (failed) {
+    rb_raise(rb_eNoMemError, "not enough memory to replace");
   }
+
+  return result;
 }
 
 /*
- * If `pattern` matches `text`, returns a copy of `rewrite` with substitutions
- * using
- * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L499-L510
- * `Extract`}. Non-matching portions of `text` are ignored.
+ * Returns the number of rules in the {RE2::Replacer}.
  *
- * Note RE2 only supports UTF-8 and ISO-8859-1 encoding so strings will be
- * returned in UTF-8 by default or ISO-8859-1 if the `:utf8` option for the
- * {RE2::Regexp} is set to `false` (any other encoding's behaviour is undefined).
+ * @return [Integer] the number of patterns
+ * @example
+ *   RE2::Replacer.new([["a", "b"], ["c", "d"]]).size #=> 2
+ */
+static VALUE re2_replacer_size(VALUE self) {
+  re2_replacer *r = unwrap_re2_replacer(self);
+
+  return ULONG2NUM(r->patterns->size());
+}
+
+/*
+ * Returns a copy of `str` with every match of several patterns replaced in a
+ * single pass. See {RE2::Replacer} for how overlapping matches are handled;
+ * build one directly to reuse the compiled patterns between strings.
  *
- * @param [String] text the string from which to extract
- * @param [String, RE2::Regexp] pattern a regexp matching the text
- * @param [String] rewrite the rewrite string with `\1`-style substitutions
- * @return [String, nil] the extracted string on a successful match or nil if
- *   there is no match
- * @raise [TypeError] if the given rewrite or pattern (if not provided as a
- *   {RE2::Regexp}) cannot be coerced to `String`s
+ * @param [String] str the string to modify
+ * @param [Array<Array(String, String)>] rules pairs of patterns and rewrites
+ * @param [Hash] options the options with which to compile every pattern
+ * @return [String] the resulting string
+ * @raise [ArgumentError] if a rule is not a pair, a pattern is invalid or a
+ *   rewrite refers to submatches its pattern does not have
+ * @raise [TypeError] if given arguments that can't be coerced to `String`s
  * @example
- *   RE2.extract("alice@example.com", '(\w+)@(\w+)', '\2-\1')
- *   #=> "example-alice"
- *   RE2.extract("no match", '(\d+)', '\1') #=> nil
+ *   RE2.global_replace_many("hello world", [["hello", "goodbye"], ["o", "0"]])
+ *   #=> "goodbye w0rld"
  */
-static VALUE re2_extract(VALUE, VALUE text, VALUE pattern,
-    VALUE rewrite) {
-  re2_pattern *p = nullptr;
+static VALUE re2_global_replace_many(int argc, VALUE *argv, VALUE) {
+  VALUE str, rules, options;
+  rb_scan_args(argc, argv, "21", &str, &rules, &options);
 
-  /* Coerce and freeze all arguments before any C++ allocations so that any
-   * Ruby exceptions (via longjmp) cannot bypass C++ destructors and leak
-   * memory, and later coercions cannot mutate earlier strings.
-   */
-  StringValue(text);
-  text = rb_str_new_frozen(text);
-  if (rb_obj_is_kind_of(pattern, re2_cRegexp)) {
-    p = unwrap_re2_regexp(pattern);
-  } else {
-    StringValue(pattern);
-    pattern = rb_str_new_frozen(pattern);
+  VALUE args[] = {rules, options};
+  VALUE replacer = rb_class_new_instance(NIL_P(options) ? 1 : 2, args,
+      re2_cReplacer);
+
+  return re2_replacer_replace(replacer, str);
+}
+
+/* A multi-literal matcher (an Aho-Corasick automaton) that finds which of the
+ * atoms extracted by `re2::FilteredRE2::Compile` occur in a text, so that only
+ * the regexps that could possibly match it are run.
+ *
+ * Atoms are lowercase so the automaton matches ASCII letters in either case.
+ * Atoms that are empty or contain non-ASCII bytes would need Unicode case
+ * folding to find so they are always reported as found instead: this can
+ * only cause extra regexps to be tried, never a match to be missed.
+ */
+class re2_atom_matcher {
+ public:
+  re2_atom_matcher(const std::vector<std::string> &atoms, bool utf8)
+      : classes_(1), utf8_(utf8) {
+    std::memset(byte_class_, 0, sizeof(byte_class_));
+
+    /* Give every byte used by an atom its own class (with uppercase ASCII
+     * letters sharing the class of their lowercase form) and every other
+     * byte class 0 to keep the transition table small.
+     */
+    for (const std::string &atom : atoms) {
+      if (!re2_atom_matcher::searchable(atom)) {
+        continue;
+      }
+
+      for (unsigned char c : atom) {
+        if (byte_class_[c] == 0) {
+          byte_class_[c] = classes_++;
+        }
+      }
+    }
+    for (int c = 'A'; c <= 'Z'; ++c) {
+      byte_class_[c] = byte_class_[c - 'A' + 'a'];
+    }
+
+    add_state();
+
+    for (size_t i = 0; i < atoms.size(); ++i) {
+      const std::string &atom = atoms[i];
+      if (!re2_atom_matcher::searchable(atom)) {
+        always_.push_back(static_cast<int>(i));
+        continue;
+      }
+
+      int32_t state = 0;
+      for (unsigned char c : atom) {
+        size_t transition = state * classes_ + byte_class_[c];
+        int32_t next = transitions_[transition];
+        if (next == -1) {
+          next = add_state();
+          transitions_[transition] = next;
+        }
+        state = next;
+      }
+
+      if (outputs_[state] == -1) {
+        outputs_[state] = static_cast<int32_t>(terminal_atoms_.size());
+        terminal_atoms_.emplace_back();
+      }
+      terminal_atoms_[outputs_[state]].push_back(static_cast<int>(i));
+    }
+
+    build();
   }
-  StringValue(rewrite);
-  rewrite = rb_str_new_frozen(rewrite);
 
-  std::string out;
+  /* Appends the indexes of every atom found in `text` to `found`. */
+  void match(const re2::StringPiece &text, std::vector<int> *found) const {
+    found->insert(found->end(), always_.begin(), always_.end());
+    if (terminal_atoms_.empty()) {
+      return;
+    }
 
-  nogvl_extract_arg arg;
-  arg.text = re2::StringPiece(RSTRING_PTR(text), RSTRING_LEN(text));
-  if (p) {
-    arg.pattern = p->pattern;
-  } else {
-    arg.pattern = nullptr;
-    arg.string_pattern = re2::StringPiece(
-        RSTRING_PTR(pattern), RSTRING_LEN(pattern));
+    std::vector<char> seen(terminal_atoms_.size(), 0);
+    const unsigned char *p =
+      reinterpret_cast<const unsigned char *>(text.data());
+    const unsigned char *end = p + text.size();
+    int32_t state = 0;
+
+    for (; p < end; ++p) {
+      unsigned char c = *p;
+
+      /* The only characters outside of ASCII that RE2 folds to ASCII
+       * (KELVIN SIGN to k and LATIN SMALL LETTER LONG S to s) so may be part
+       * of an ASCII atom.
+       */
+      if (utf8_ && c >= 0x80) {
+        if (c == 0xE2 && end - p >= 3 && p[1] == 0x84 && p[2] == 0xAA) {
+          c = 'k';
+          p += 2;
+        } else if (c == 0xC5 && end - p >= 2 && p[1] == 0xBF) {
+          c = 's';
+          p += 1;
+        }
+      }
+
+      state = transitions_[state * classes_ + byte_class_[c]];
+
+      /* Report the atoms ending here and at every shorter suffix, stopping
+       * at any already reported as their own suffixes will have been too.
+       */
+      int32_t output = outputs_[state] != -1 ? state : dictionary_[state];
+      while (output != -1 && !seen[outputs_[output]]) {
+        seen[outputs_[output]] = 1;
+        const std::vector<int> &atoms = terminal_atoms_[outputs_[output]];
+        found->insert(found->end(), atoms.begin(), atoms.end());
+        output = dictionary_[output];
+      }
+    }
   }
-  arg.rewrite = re2::StringPiece(
-      RSTRING_PTR(rewrite), RSTRING_LEN(rewrite));
-  arg.out = &out;
-  arg.extracted = false;
 
-#ifdef _WIN32
-  nogvl_extract(&arg);
-#else
-  rb_thread_call_without_gvl(nogvl_extract, &arg, NULL, NULL);
-#endif
+  size_t memsize() const {
+    size_t size = sizeof(*this) +
+      sizeof(int32_t) * (transitions_.capacity() + outputs_.capacity() +
+          dictionary_.capacity()) +
+      sizeof(int) * always_.capacity();
+    for (const std::vector<int> &atoms : terminal_atoms_) {
+      size += sizeof(atoms) + sizeof(int) * atoms.capacity();
+    }
 
-  RB_GC_GUARD(text);
-  RB_GC_GUARD(rewrite);
-  RB_GC_GUARD(pattern);
+    return size;
+  }
 
-  if (arg.extracted) {
-    return encoded_str_new(out.data(), out.size(),
-        p ? p->pattern->options().encoding()
-          : RE2::Options::EncodingUTF8);
-  } else {
-    return Qnil;
+ private:
+  static bool searchable(const std::string &atom) {
+    if (atom.empty()) {
+      return false;
+    }
+
+    for (unsigned char c : atom) {
+      if (c >= 0x80) {
+        return false;
+      }
+    }
+
+    return true;
   }
-}
 
-/*
- * Returns a version of `str` with all potentially meaningful regexp characters
- * escaped using
- * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/re2.h#L512-L518
- * `QuoteMeta`}. The returned string, used as a regular expression, will
- * exactly match the original string.
- *
- * @param [String] unquoted the unquoted string
- * @raise [TypeError] if the given unquoted string cannot be coerced to a `String`
- * @return [String] the escaped string
- * @example
- *   RE2.escape("1.5-2.0?")         #=> "1\\.5\\-2\\.0\\?"
- *   RE2.quote("1.5-2.0?")          #=> "1\\.5\\-2\\.0\\?"
- *   RE2::Regexp.escape("1.5-2.0?") #=> "1\\.5\\-2\\.0\\?"
- *   RE2::Regexp.quote("1.5-2.0?")  #=> "1\\.5\\-2\\.0\\?"
- */
-static VALUE re2_escape(VALUE, VALUE unquoted) {
-  StringValue(unquoted);
+  int32_t add_state() {
+    int32_t state = static_cast<int32_t>(outputs_.size());
+    transitions_.resize(transitions_.size() + classes_, -1);
+    outputs_.push_back(-1);
+    dictionary_.push_back(-1);
 
-  std::string quoted_string = RE2::QuoteMeta(
-      re2::StringPiece(RSTRING_PTR(unquoted), RSTRING_LEN(unquoted)));
+    return state;
+  }
 
-  return rb_str_new(quoted_string.data(), quoted_string.size());
-}
+  /* Turns the trie into a complete automaton by following failure links
+   * breadth first, so matching never needs to backtrack.
+   */
+  void build() {
+    std::vector<int32_t> failure(outputs_.size(), 0);
+    std::deque<int32_t> queue;
+
+    for (int c = 0; c < classes_; ++c) {
+      int32_t &next = transitions_[c];
+      if (next == -1) {
+        next = 0;
+      } else {
+        queue.push_back(next);
+      }
+    }
 
-static void re2_set_free(void *ptr) {
-  re2_set *s = static_cast<re2_set *>(ptr);
-  if (s->set) {
-    delete s->set;
+    while (!queue.empty()) {
+      int32_t state = queue.front();
+      queue.pop_front();
+
+      for (int c = 0; c < classes_; ++c) {
+        int32_t &next = transitions_[state * classes_ + c];
+        int32_t fallback = transitions_[failure[state] * classes_ + c];
+
+        if (next == -1) {
+          next = fallback;
+        } else {
+          failure[next] = fallback;
+          dictionary_[next] = outputs_[fallback] != -1 ?
+            fallback : dictionary_[fallback];
+          queue.push_back(next);
+        }
+      }
+    }
   }
+
+  int classes_;
+  bool utf8_;
+  uint8_t byte_class_[256];
+  std::vector<int32_t> transitions_;
+  std::vector<int32_t> outputs_;
+  std::vector<int32_t> dictionary_;
+  std::vector<std::vector<int>> terminal_atoms_;
+  std::vector<int> always_;
+};
+
+static void re2_filtered_set_free(void *ptr) {
+  re2_filtered_set *s = static_cast<re2_filtered_set *>(ptr);
+  if (s->filter) {
+    delete s->filter;
+    rb_gc_adjust_memory_usage(-static_cast<ssize_t>(s->memsize));
+  }
+  delete s->options;
+  delete s->atoms;
+  delete s->matcher;
   xfree(s);
 }
 
-static size_t re2_set_memsize(const void *ptr) {
-  const re2_set *s = static_cast<const re2_set *>(ptr);
+static size_t re2_filtered_set_memsize(const void *ptr) {
+  const re2_filtered_set *s = static_cast<const re2_filtered_set *>(ptr);
   size_t size = sizeof(*s);
-  if (s->set) {
-    size += sizeof(*s->set);
+  if (s->filter) {
+    size += s->memsize;
   }
 
   return size;
 }
 
-static const rb_data_type_t re2_set_data_type = {
-  "RE2::Set",
+static const rb_data_type_t re2_filtered_set_data_type = {
+  "RE2::FilteredSet",
   {
     0,
-    re2_set_free,
-    re2_set_memsize,
+    re2_filtered_set_free,
+    re2_filtered_set_memsize,
   },
   0,
   0,
@@ -2415,356 +9057,470 @@ static const rb_data_type_t re2_set_data_type = {
   RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED | RUBY_TYPED_FROZEN_SHAREABLE
 };
 
-static re2_set *unwrap_re2_set(VALUE self) {
-  re2_set *s;
-  TypedData_Get_Struct(self, re2_set, &re2_set_data_type, s);
-  if (!s->set) {
-    rb_raise(rb_eTypeError, "uninitialized RE2::Set");
+static re2_filtered_set *unwrap_re2_filtered_set(VALUE self) {
+  re2_filtered_set *s;
+  TypedData_Get_Struct(self, re2_filtered_set, &re2_filtered_set_data_type, s);
+  if (!s->filter) {
+    rb_raise(rb_eTypeError, "uninitialized RE2::FilteredSet");
+  }
+  /* Patterns are added and compiled without the GVL so the set cannot be
+   * used by another thread until that has finished.
+   */
+  if (s->busy) {
+    rb_raise(rb_eThreadError, "RE2::FilteredSet is being modified in another thread");
   }
   return s;
 }
 
-static VALUE re2_set_allocate(VALUE klass) {
-  re2_set *s;
-  VALUE result = TypedData_Make_Struct(klass, re2_set, &re2_set_data_type, s);
+/* Recalculates the memory held by a filtered set after adding a pattern or
+ * compiling it, telling the GC about the difference.
+ */
+static void re2_filtered_set_update_memsize(re2_filtered_set *s) {
+  size_t memsize = sizeof(*s->filter) + sizeof(*s->options);
+  for (int i = 0; i < s->filter->NumRegexps(); ++i) {
+    memsize += re2_pattern_memsize(&s->filter->GetRE2(i));
+  }
+  if (s->atoms) {
+    for (const std::string &atom : *s->atoms) {
+      memsize += sizeof(atom) + atom.capacity();
+    }
+  }
+  if (s->matcher) {
+    memsize += s->matcher->memsize();
+  }
 
-  return result;
+  rb_gc_adjust_memory_usage(
+      static_cast<ssize_t>(memsize) - static_cast<ssize_t>(s->memsize));
+  s->memsize = memsize;
 }
 
-static VALUE re2_set_initialize_copy(VALUE, VALUE) {
-  rb_raise(rb_eTypeError, "cannot copy RE2::Set");
+static VALUE re2_filtered_set_allocate(VALUE klass) {
+  re2_filtered_set *s;
+
+  return TypedData_Make_Struct(klass, re2_filtered_set,
+      &re2_filtered_set_data_type, s);
 }
 
-/*
- * Returns a new {RE2::Set} object, a collection of patterns that can be
- * searched for simultaneously.
- *
- * @return [RE2::Set]
- *
- * @overload initialize
- *   Returns a new {RE2::Set} object for unanchored patterns with the default
- *   options.
- *
- *   @raise [NoMemoryError] if memory could not be allocated for the compiled pattern
- *   @return [RE2::Set]
- *
- * @overload initialize(anchor)
- *   Returns a new {RE2::Set} object for the specified anchor with the default
- *   options.
- *
- *   @param [Symbol] anchor one of `:unanchored`, `:anchor_start`, `:anchor_both`
- *   @raise [ArgumentError] if anchor is not `:unanchored`, `:anchor_start` or `:anchor_both`
- *   @raise [NoMemoryError] if memory could not be allocated for the compiled pattern
- *
- * @overload initialize(anchor, options)
- *   Returns a new {RE2::Set} object with the specified options.
- *
- *   @param [Symbol] anchor one of `:unanchored`, `:anchor_start`, `:anchor_both`
- *   @param [Hash] options the options with which to compile the pattern
- *   @option options [Boolean] :utf8 (true) text and pattern are UTF-8; otherwise Latin-1
- *   @option options [Boolean] :posix_syntax (false) restrict regexps to POSIX egrep syntax
- *   @option options [Boolean] :longest_match (false) search for longest match, not first match
- *   @option options [Boolean] :log_errors (true) log syntax and execution errors to ERROR
- *   @option options [Integer] :max_mem approx. max memory footprint of RE2
- *   @option options [Boolean] :literal (false) interpret string as literal, not regexp
- *   @option options [Boolean] :never_nl (false) never match `\n`, even if it is in regexp
- *   @option options [Boolean] :case_sensitive (true) match is case-sensitive (regexp can override with `(?i)` unless in `posix_syntax` mode)
- *   @option options [Boolean] :perl_classes (false) allow Perl's `\d` `\s` `\w` `\D` `\S` `\W` when in `posix_syntax` mode
- *   @option options [Boolean] :word_boundary (false) allow `\b` `\B` (word boundary and not) when in `posix_syntax` mode
- *   @option options [Boolean] :one_line (false) `^` and `$` only match beginning and end of text when in `posix_syntax` mode
- *   @return [RE2::Set] a {RE2::Set} with the specified anchor and options
- *   @raise [ArgumentError] if `anchor` is not one of the accepted choices
- *   @raise [NoMemoryError] if memory could not be allocated for the compiled pattern
- */
-static VALUE re2_set_initialize(int argc, VALUE *argv, VALUE self) {
-  VALUE anchor, options;
-  re2_set *s;
+static VALUE re2_filtered_set_initialize_copy(VALUE, VALUE) {
+  rb_raise(rb_eTypeError, "cannot copy RE2::FilteredSet");
+}
+
+struct nogvl_filtered_set_add_arg {
+  re2::FilteredRE2 *filter;
+  const RE2::Options *options;
+  re2::StringPiece pattern;
+  int id;
+  std::string error;
+  bool failed;
+};
+
+static void *nogvl_filtered_set_add(void *ptr) {
+  auto *arg = static_cast<nogvl_filtered_set_add_arg *>(ptr);
+
+  try {
+    RE2::ErrorCode code = arg->filter->Add(arg->pattern, *arg->options,
+        &arg->id);
+    if (code != RE2::NoError) {
+      arg->id = -1;
+
+      /* FilteredRE2 only returns the error code so compile the pattern
+       * again for a message.
+       */
+      RE2::Options options(*arg->options);
+      options.set_log_errors(false);
+      RE2 pattern(arg->pattern, options);
+      arg->error = pattern.error();
+    }
+  } catch (const std::bad_alloc &) {
+    arg->failed = true;
+  }
 
-  rb_scan_args(argc, argv, "02", &anchor, &options);
-  TypedData_Get_Struct(self, re2_set, &re2_set_data_type, s);
+  return nullptr;
+}
 
-  RE2::Anchor re2_anchor = RE2::UNANCHORED;
+struct nogvl_filtered_set_compile_arg {
+  re2_filtered_set *s;
+  bool failed;
+};
 
-  if (!NIL_P(anchor)) {
-    Check_Type(anchor, T_SYMBOL);
-    ID id_anchor_arg = SYM2ID(anchor);
-    if (id_anchor_arg == id_unanchored) {
-      re2_anchor = RE2::UNANCHORED;
-    } else if (id_anchor_arg == id_anchor_start) {
-      re2_anchor = RE2::ANCHOR_START;
-    } else if (id_anchor_arg == id_anchor_both) {
-      re2_anchor = RE2::ANCHOR_BOTH;
-    } else {
-      rb_raise(rb_eArgError, "anchor should be one of: :unanchored, :anchor_start, :anchor_both");
+/* Compiles the set, marking it compiled here rather than once the GVL is
+ * reacquired (which may raise if the thread is interrupted) so that it is
+ * never left compiled but unusable.
+ */
+static void *nogvl_filtered_set_compile(void *ptr) {
+  auto *arg = static_cast<nogvl_filtered_set_compile_arg *>(ptr);
+  re2_filtered_set *s = arg->s;
+
+  try {
+    /* FilteredRE2 refuses to compile without any patterns. */
+    if (s->filter->NumRegexps() > 0) {
+      s->filter->Compile(s->atoms);
     }
+
+    s->matcher = new re2_atom_matcher(*s->atoms,
+        s->options->encoding() == RE2::Options::EncodingUTF8);
+    s->compiled = true;
+  } catch (const std::bad_alloc &) {
+    arg->failed = true;
+  }
+
+  return nullptr;
+}
+
+struct nogvl_filtered_set_match_arg {
+  const re2_filtered_set *s;
+  re2::StringPiece text;
+  std::vector<int> *matches;
+  bool failed;
+};
+
+static void *nogvl_filtered_set_match(void *ptr) {
+  auto *arg = static_cast<nogvl_filtered_set_match_arg *>(ptr);
+  const re2_filtered_set *s = arg->s;
+
+  if (s->filter->NumRegexps() == 0) {
+    return nullptr;
+  }
+
+  try {
+    std::vector<int> atoms;
+    s->matcher->match(arg->text, &atoms);
+    s->filter->AllMatches(arg->text, atoms, arg->matches);
+  } catch (const std::bad_alloc &) {
+    arg->failed = true;
   }
 
+  return nullptr;
+}
+
+/*
+ * Returns a new {RE2::FilteredSet}, a collection of patterns that can be
+ * searched for simultaneously like {RE2::Set} but scaling to many more
+ * patterns.
+ *
+ * Rather than compiling every pattern into one large automaton (which can
+ * exhaust `max_mem` and raise {RE2::Set::MatchError} with tens of thousands
+ * of patterns), each pattern is compiled separately and the literal strings
+ * ("atoms") that any match must contain are extracted from them. Matching
+ * first searches the text for every atom at once and then only runs the
+ * patterns whose atoms were all found.
+ *
+ * @param [Hash] options the options with which to compile each pattern (see
+ *   {RE2::Regexp#initialize})
+ * @option options [Integer] :min_atom_len (0) the length of the shortest atom
+ *   to extract: patterns only containing shorter literals will always be run
+ * @return [RE2::FilteredSet]
+ * @raise [ArgumentError] if given a negative `:min_atom_len`
+ * @raise [NoMemoryError] if memory could not be allocated for the set
+ * @raise [RE2::FilteredSet::UnsupportedError] if given a `:min_atom_len` on a
+ *   version of RE2 that does not support it
+ * @example
+ *   RE2::FilteredSet.new
+ *   RE2::FilteredSet.new(case_sensitive: false, min_atom_len: 3)
+ */
+static VALUE re2_filtered_set_initialize(int argc, VALUE *argv, VALUE self) {
+  VALUE options;
+  re2_filtered_set *s;
+
+  rb_scan_args(argc, argv, "01", &options);
+  TypedData_Get_Struct(self, re2_filtered_set, &re2_filtered_set_data_type,
+      s);
+
   RE2::Options re2_options;
+  int min_atom_len = 0;
 
   if (RTEST(options)) {
     parse_re2_options(&re2_options, options);
+
+    VALUE min_atom_len_option = rb_hash_aref(options, ID2SYM(id_min_atom_len));
+    if (!NIL_P(min_atom_len_option)) {
+#ifdef HAVE_FILTERED_RE2_MIN_ATOM_LEN
+      min_atom_len = NUM2INT(min_atom_len_option);
+
+      if (min_atom_len < 0) {
+        rb_raise(rb_eArgError, "min_atom_len should be >= 0");
+      }
+#else
+      rb_raise(re2_eFilteredSetUnsupportedError, "current version of RE2::FilteredRE2 does not support min_atom_len");
+#endif
+    }
   }
 
   rb_check_frozen(self);
 
   /* Prevent re-initialisation: #match releases the GVL while holding a
-   * pointer to s->set, so replacing s->set from another thread would free
-   * the object out from under a concurrent match.
+   * pointer to s->filter.
    */
-  if (s->set) {
-    rb_raise(rb_eTypeError, "already initialized RE2::Set");
+  if (s->filter) {
+    rb_raise(rb_eTypeError, "already initialized RE2::FilteredSet");
   }
 
-  s->set = new(std::nothrow) RE2::Set(re2_options, re2_anchor);
-  if (s->set == nullptr) {
-    rb_raise(rb_eNoMemError, "not enough memory to allocate RE2::Set object");
+  s->options = new(std::nothrow) RE2::Options(re2_options);
+  if (s->options == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate RE2::Options object");
+  }
+
+  s->atoms = new(std::nothrow) std::vector<std::string>();
+  if (s->atoms == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate atoms");
   }
 
+#ifdef HAVE_FILTERED_RE2_MIN_ATOM_LEN
+  s->filter = new(std::nothrow) re2::FilteredRE2(min_atom_len);
+#else
+  s->filter = new(std::nothrow) re2::FilteredRE2();
+#endif
+  if (s->filter == nullptr) {
+    rb_raise(rb_eNoMemError, "not enough memory to allocate RE2::FilteredRE2 object");
+  }
+
+  re2_filtered_set_update_memsize(s);
+
   return self;
 }
 
+struct re2_filtered_set_call_arg {
+  VALUE self;
+  re2_filtered_set *s;
+  void *(*fn)(void *);
+  void *arg;
+  size_t bytes;
+  std::string *error;
+  bool finished;
+};
+
+static VALUE re2_filtered_set_call_body(VALUE ptr) {
+  auto *arg = reinterpret_cast<re2_filtered_set_call_arg *>(ptr);
+  re2_call_without_gvl(arg->fn, arg->arg, arg->bytes);
+  arg->finished = true;
+
+  return Qnil;
+}
+
+/* Releases the set once a call has finished or been interrupted (e.g. by
+ * Thread#raise when reacquiring the GVL), accounting for any pattern added
+ * and freezing it if it was compiled. An interrupted call's error message is
+ * freed as its owner's destructor will not run.
+ */
+static VALUE re2_filtered_set_call_ensure(VALUE ptr) {
+  auto *arg = reinterpret_cast<re2_filtered_set_call_arg *>(ptr);
+  re2_filtered_set *s = arg->s;
+
+  s->busy = false;
+  if (!arg->finished && arg->error) {
+    std::string().swap(*arg->error);
+  }
+  re2_filtered_set_update_memsize(s);
+  if (s->compiled) {
+    rb_obj_freeze(arg->self);
+  }
+
+  return Qnil;
+}
+
+/* Calls `fn` with `arg` as re2_call_without_gvl does, marking the set busy so
+ * no other thread can use it in the meantime.
+ */
+static void re2_filtered_set_call_without_gvl(VALUE self, re2_filtered_set *s,
+    void *(*fn)(void *), void *arg, size_t bytes, std::string *error) {
+  re2_filtered_set_call_arg call;
+  call.self = self;
+  call.s = s;
+  call.fn = fn;
+  call.arg = arg;
+  call.bytes = bytes;
+  call.error = error;
+  call.finished = false;
+
+  s->busy = true;
+  rb_ensure(re2_filtered_set_call_body, reinterpret_cast<VALUE>(&call),
+      re2_filtered_set_call_ensure, reinterpret_cast<VALUE>(&call));
+}
+
 /*
  * Adds a pattern to the set. Returns the index that will identify the pattern
- * in the output of {RE2::Set#match}. Cannot be called after {RE2::Set#compile}
- * has been called.
+ * in the output of {RE2::FilteredSet#match}. Cannot be called after
+ * {RE2::FilteredSet#compile} has been called.
  *
  * @param [String] pattern the regex pattern
  * @return [Integer] the index of the pattern in the set
- * @raise [ArgumentError] if called after compile or the pattern is rejected
+ * @raise [ArgumentError] if the pattern is rejected
+ * @raise [FrozenError] if called after compile
+ * @raise [TypeError] if given a pattern that can't be coerced to a `String`
  * @example
- *   set = RE2::Set.new
+ *   set = RE2::FilteredSet.new
  *   set.add("abc") #=> 0
  *   set.add("def") #=> 1
  */
-static VALUE re2_set_add(VALUE self, VALUE pattern) {
+static VALUE re2_filtered_set_add(VALUE self, VALUE pattern) {
   StringValue(pattern);
+  pattern = rb_str_new_frozen(pattern);
 
-  re2_set *s = unwrap_re2_set(self);
+  re2_filtered_set *s = unwrap_re2_filtered_set(self);
   rb_check_frozen(self);
 
-  int index;
+  int id;
+  bool failed;
   VALUE msg;
 
   {
-    std::string err;
-    index = s->set->Add(
-        re2::StringPiece(RSTRING_PTR(pattern), RSTRING_LEN(pattern)), &err);
-    msg = rb_str_new(err.data(), err.size());
+    nogvl_filtered_set_add_arg arg;
+    arg.filter = s->filter;
+    arg.options = s->options;
+    arg.pattern = re2::StringPiece(RSTRING_PTR(pattern), RSTRING_LEN(pattern));
+    arg.id = -1;
+    arg.failed = false;
+
+    re2_filtered_set_call_without_gvl(self, s, nogvl_filtered_set_add, &arg,
+        arg.pattern.size(), &arg.error);
+    RB_GC_GUARD(pattern);
+
+    id = arg.id;
+    failed = arg.failed;
+    msg = rb_str_new(arg.error.data(), arg.error.size());
   }
 
-  if (index < 0) {
+  if (failed) {
+    rb_raise(rb_eNoMemError, "not enough memory to add pattern to RE2::FilteredSet");
+  }
+
+  if (id < 0) {
     rb_raise(rb_eArgError,
-             "str rejected by RE2::Set->Add(): %s", RSTRING_PTR(msg));
+             "str rejected by RE2::FilteredSet->Add(): %s", RSTRING_PTR(msg));
   }
 
-  return INT2FIX(index);
+  return INT2FIX(id);
 }
 
 /*
- * Compiles a {RE2::Set} so it can be used to match against. Must be called
- * after {RE2::Set#add} and before {RE2::Set#match}.
+ * Compiles a {RE2::FilteredSet} so it can be used to match against,
+ * extracting the atoms of every pattern and building a matcher to search for
+ * them all at once. Must be called after {RE2::FilteredSet#add} and before
+ * {RE2::FilteredSet#match}.
  *
  * @return [Boolean] whether compilation was a success
+ * @raise [NoMemoryError] if memory could not be allocated for the matcher
  * @example
- *   set = RE2::Set.new
+ *   set = RE2::FilteredSet.new
  *   set.add("abc")
  *   set.compile #=> true
  */
-static VALUE re2_set_compile(VALUE self) {
-  re2_set *s = unwrap_re2_set(self);
+static VALUE re2_filtered_set_compile(VALUE self) {
+  re2_filtered_set *s = unwrap_re2_filtered_set(self);
   rb_check_frozen(self);
 
-  bool compiled = s->set->Compile();
-
-  if (compiled) {
-    rb_obj_freeze(self);
-  }
-
-  return BOOL2RUBY(compiled);
-}
-
-/*
- * Returns the size of the {RE2::Set}.
- *
- * @return [Integer] the number of patterns in the set
- * @example
- *   set = RE2::Set.new
- *   set.add("abc")
- *   set.size #=> 1
- */
-static VALUE re2_set_size(VALUE self) {
-#ifdef HAVE_SET_SIZE
-  re2_set *s = unwrap_re2_set(self);
+  nogvl_filtered_set_compile_arg arg;
+  arg.s = s;
+  arg.failed = false;
 
-  return INT2FIX(s->set->Size());
-#else
-  rb_raise(re2_eSetUnsupportedError, "current version of RE2::Set does not have Size method");
-#endif
-}
+  /* Compiling costs far more than matching so always release the GVL. */
+  re2_filtered_set_call_without_gvl(self, s, nogvl_filtered_set_compile, &arg,
+      SIZE_MAX, nullptr);
 
-/*
- * Returns whether the underlying RE2 version outputs error information from
- * {https://github.com/google/re2/blob/bc0faab533e2b27b85b8ad312abf061e33ed6b5d/re2/set.h#L62-L65
- * `RE2::Set::Match`}. If not, {RE2::Set#match} will raise an error if attempting to set
- * its `:exception` option to `true`.
- *
- * @return [Boolean] whether the underlying RE2 outputs error information from {RE2::Set} matches
- */
-static VALUE re2_set_match_raises_errors_p(VALUE) {
-#ifdef HAVE_ERROR_INFO_ARGUMENT
-  return Qtrue;
-#else
-  return Qfalse;
-#endif
-}
+  if (arg.failed) {
+    rb_raise(rb_eNoMemError, "not enough memory to compile RE2::FilteredSet");
+  }
 
-/*
- * Returns whether the underlying RE2 version has a Set::Size method.
- *
- * @return [Boolean] whether the underlying RE2 has a Set::Size method
- */
-static VALUE re2_set_size_p(VALUE) {
-#ifdef HAVE_SET_SIZE
   return Qtrue;
-#else
-  return Qfalse;
-#endif
 }
 
 /*
  * Matches the given text against patterns in the set, returning an array of
- * integer indices of the matching patterns if matched or an empty array if
- * there are no matches.
- *
- * @return [Array<Integer>]
- *
- * @overload match(str)
- *   Returns an array of integer indices of patterns matching the given string
- *   (if any). Raises exceptions if there are any errors while matching.
- *
- *   @param [String] str the text to match against
- *   @return [Array<Integer>] the indices of matching regexps
- *   @raise [MatchError] if an error occurs while matching
- *   @raise [UnsupportedError] if the underlying version of RE2 does not output error information
- *   @example
- *     set = RE2::Set.new
- *     set.add("abc")
- *     set.add("def")
- *     set.compile
- *     set.match("abcdef") #=> [0, 1]
+ * integer indices of the matching patterns in the order they were added (or
+ * an empty array if there are no matches).
  *
- * @overload match(str, options)
- *   Returns an array of integer indices of patterns matching the given string
- *   (if any). Raises exceptions if there are any errors while matching and the
- *   `:exception` option is set to true.
- *
- *   @param [String] str the text to match against
- *   @param [Hash] options the options with which to match
- *   @option options [Boolean] :exception (true) whether to raise exceptions with RE2's error information (not supported on ABI version 0 of RE2)
- *   @return [Array<Integer>] the indices of matching regexps
- *   @raise [MatchError] if an error occurs while matching
- *   @raise [UnsupportedError] if the underlying version of RE2 does not output error information
- *   @example
- *     set = RE2::Set.new
- *     set.add("abc")
- *     set.add("def")
- *     set.compile
- *     set.match("abcdef", exception: true) #=> [0, 1]
+ * @param [String] str the text to match against
+ * @return [Array<Integer>] the indices of matching regexps
+ * @raise [RE2::FilteredSet::MatchError] if called before compile
+ * @raise [NoMemoryError] if there was not enough memory to match
+ * @raise [TypeError] if given text that can't be coerced to a `String`
+ * @example
+ *   set = RE2::FilteredSet.new
+ *   set.add("abc")
+ *   set.add("def")
+ *   set.compile
+ *   set.match("abcdef") #=> [0, 1]
  */
-static VALUE re2_set_match(int argc, VALUE *argv, const VALUE self) {
-  VALUE str, options;
-  bool raise_exception = true;
-  rb_scan_args(argc, argv, "11", &str, &options);
-
+static VALUE re2_filtered_set_match(VALUE self, VALUE str) {
   StringValue(str);
   str = rb_str_new_frozen(str);
 
-  re2_set *s = unwrap_re2_set(self);
-
-  if (RTEST(options)) {
-    Check_Type(options, T_HASH);
+  re2_filtered_set *s = unwrap_re2_filtered_set(self);
 
-    VALUE exception_option = rb_hash_aref(options, ID2SYM(id_exception));
-    if (!NIL_P(exception_option)) {
-      raise_exception = RTEST(exception_option);
-    }
+  if (!s->compiled) {
+    rb_raise(re2_eFilteredSetMatchError, "#match must not be called before #compile");
   }
 
-  std::vector<int> v;
+  std::vector<int> matches;
 
-  if (raise_exception) {
-#ifdef HAVE_ERROR_INFO_ARGUMENT
-    RE2::Set::ErrorInfo e;
-    nogvl_set_match_arg arg;
-    arg.set = s->set;
-    arg.text = re2::StringPiece(RSTRING_PTR(str), RSTRING_LEN(str));
-    arg.v = &v;
-    arg.error_info = &e;
-    arg.matched = false;
+  nogvl_filtered_set_match_arg arg;
+  arg.s = s;
+  arg.text = re2::StringPiece(RSTRING_PTR(str), RSTRING_LEN(str));
+  arg.matches = &matches;
+  arg.failed = false;
 
-#ifdef _WIN32
-    nogvl_set_match(&arg);
-#else
-    rb_thread_call_without_gvl(nogvl_set_match, &arg, NULL, NULL);
-#endif
-    RB_GC_GUARD(str);
+  re2_call_without_gvl(nogvl_filtered_set_match, &arg, arg.text.size());
+  RB_GC_GUARD(str);
 
-    bool match_failed = !arg.matched;
-    VALUE result = rb_ary_new2(v.size());
+  if (arg.failed) {
+    rb_raise(rb_eNoMemError, "not enough memory to match RE2::FilteredSet");
+  }
 
-    if (match_failed) {
-      switch (e.kind) {
-        case RE2::Set::kNoError:
-          break;
-        case RE2::Set::kNotCompiled:
-          rb_raise(re2_eSetMatchError, "#match must not be called before #compile");
-        case RE2::Set::kOutOfMemory:
-          rb_raise(re2_eSetMatchError, "The DFA ran out of memory");
-        case RE2::Set::kInconsistent:
-          rb_raise(re2_eSetMatchError, "RE2::Prog internal error");
-        default:  // Just in case a future version of libre2 adds new ErrorKinds
-          rb_raise(re2_eSetMatchError, "Unknown RE2::Set::ErrorKind: %d", e.kind);
-      }
-    } else {
-      for (int index : v) {
-        rb_ary_push(result, INT2FIX(index));
-      }
-    }
+  std::sort(matches.begin(), matches.end());
 
-    return result;
-#else
-    rb_raise(re2_eSetUnsupportedError, "current version of RE2::Set::Match() does not output error information, :exception option can only be set to false");
-#endif
-  } else {
-    nogvl_set_match_arg arg;
-    arg.set = s->set;
-    arg.text = re2::StringPiece(RSTRING_PTR(str), RSTRING_LEN(str));
-    arg.v = &v;
-#ifdef HAVE_ERROR_INFO_ARGUMENT
-    arg.error_info = nullptr;
-#endif
-    arg.matched = false;
+  VALUE result = rb_ary_new2(matches.size());
+  for (int index : matches) {
+    rb_ary_push(result, INT2FIX(index));
+  }
 
-#ifdef _WIN32
-    nogvl_set_match(&arg);
-#else
-    rb_thread_call_without_gvl(nogvl_set_match, &arg, NULL, NULL);
-#endif
-    RB_GC_GUARD(str);
+  return result;
+}
 
-    VALUE result = rb_ary_new2(v.size());
+/*
+ * Returns the number of patterns in the {RE2::FilteredSet}.
+ *
+ * @return [Integer] the number of patterns in the set
+ * @example
+ *   set = RE2::FilteredSet.new
+ *   set.add("abc")
+ *   set.size #=> 1
+ */
+static VALUE re2_filtered_set_size(VALUE self) {
+  re2_filtered_set *s = unwrap_re2_filtered_set(self);
 
-    if (arg.matched) {
-      for (int index : v) {
-        rb_ary_push(result, INT2FIX(index));
-      }
-    }
+  return INT2FIX(s->filter->NumRegexps());
+}
 
-    return result;
+/*
+ * Returns the lowercase atoms extracted from the patterns in the set when it
+ * was compiled: the literal strings searched for before running any
+ * pattern. Useful for tuning `:min_atom_len`.
+ *
+ * @return [Array<String>] the atoms (empty if not yet compiled)
+ * @example
+ *   set = RE2::FilteredSet.new
+ *   set.add("hello.*world")
+ *   set.compile
+ *   set.atoms #=> ["hello", "world"]
+ */
+static VALUE re2_filtered_set_atoms(VALUE self) {
+  re2_filtered_set *s = unwrap_re2_filtered_set(self);
+
+  VALUE result = rb_ary_new2(s->atoms->size());
+  for (const std::string &atom : *s->atoms) {
+    rb_ary_push(result, encoded_str_new(atom.data(), atom.size(),
+          s->options->encoding()));
   }
+
+  return result;
 }
 
 extern "C" void Init_re2(void) {
+#ifdef RE2_LITERAL_AVX2
+  __builtin_cpu_init();
+  re2_cpu_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
   rb_ext_ractor_safe(true);
 
   re2_mRE2 = rb_define_module("RE2");
@@ -2778,6 +9534,13 @@ extern "C" void Init_re2(void) {
       rb_const_get(rb_cObject, rb_intern("StandardError")));
   re2_eSetUnsupportedError = rb_define_class_under(re2_cSet, "UnsupportedError",
       rb_const_get(rb_cObject, rb_intern("StandardError")));
+  re2_cFilteredSet = rb_define_class_under(re2_mRE2, "FilteredSet",
+      rb_cObject);
+  re2_cReplacer = rb_define_class_under(re2_mRE2, "Replacer", rb_cObject);
+  re2_eFilteredSetMatchError = rb_define_class_under(re2_cFilteredSet,
+      "MatchError", rb_const_get(rb_cObject, rb_intern("StandardError")));
+  re2_eFilteredSetUnsupportedError = rb_define_class_under(re2_cFilteredSet,
+      "UnsupportedError", rb_const_get(rb_cObject, rb_intern("StandardError")));
 
   rb_define_alloc_func(re2_cRegexp,
       reinterpret_cast<VALUE (*)(VALUE)>(re2_regexp_allocate));
@@ -2837,6 +9600,8 @@ extern "C" void Init_re2(void) {
       RUBY_METHOD_FUNC(re2_scanner_eof), 0);
   rb_define_method(re2_cScanner, "regexp",
       RUBY_METHOD_FUNC(re2_scanner_regexp), 0);
+  rb_define_method(re2_cScanner, "to_a",
+      RUBY_METHOD_FUNC(re2_scanner_to_a), 0);
   rb_define_method(re2_cScanner, "scan",
       RUBY_METHOD_FUNC(re2_scanner_scan), 0);
   rb_define_method(re2_cScanner, "rewind",
@@ -2850,6 +9615,19 @@ extern "C" void Init_re2(void) {
       RUBY_METHOD_FUNC(re2_regexp_initialize), -1);
   rb_define_method(re2_cRegexp, "initialize_copy",
       RUBY_METHOD_FUNC(re2_regexp_initialize_copy), 1);
+  rb_define_singleton_method(re2_cRegexp, "cached",
+      RUBY_METHOD_FUNC(re2_regexp_cached), -1);
+  rb_define_singleton_method(re2_cRegexp, "cache_capacity",
+      RUBY_METHOD_FUNC(re2_regexp_cache_capacity), 0);
+  rb_define_singleton_method(re2_cRegexp, "cache_capacity=",
+      RUBY_METHOD_FUNC(re2_regexp_cache_capacity_set), 1);
+  rb_define_singleton_method(re2_cRegexp, "cache_stats",
+      RUBY_METHOD_FUNC(re2_regexp_cache_stats), 0);
+  rb_define_singleton_method(re2_cRegexp, "clear_cache",
+      RUBY_METHOD_FUNC(re2_regexp_clear_cache), 0);
+  rb_define_method(re2_cRegexp, "hash", RUBY_METHOD_FUNC(re2_regexp_hash), 0);
+  rb_define_method(re2_cRegexp, "eql?", RUBY_METHOD_FUNC(re2_regexp_eql), 1);
+  rb_define_method(re2_cRegexp, "==", RUBY_METHOD_FUNC(re2_regexp_eql), 1);
   rb_define_method(re2_cRegexp, "ok?", RUBY_METHOD_FUNC(re2_regexp_ok), 0);
   rb_define_method(re2_cRegexp, "error", RUBY_METHOD_FUNC(re2_regexp_error),
       0);
@@ -2857,6 +9635,16 @@ extern "C" void Init_re2(void) {
       RUBY_METHOD_FUNC(re2_regexp_error_arg), 0);
   rb_define_method(re2_cRegexp, "program_size",
       RUBY_METHOD_FUNC(re2_regexp_program_size), 0);
+  rb_define_method(re2_cRegexp, "warm!",
+      RUBY_METHOD_FUNC(re2_regexp_warm), 1);
+  rb_define_method(re2_cRegexp, "memory_stats",
+      RUBY_METHOD_FUNC(re2_regexp_memory_stats), 0);
+  rb_define_method(re2_cRegexp, "instrument!",
+      RUBY_METHOD_FUNC(re2_regexp_instrument), 0);
+  rb_define_method(re2_cRegexp, "instrumented?",
+      RUBY_METHOD_FUNC(re2_regexp_instrumented_p), 0);
+  rb_define_method(re2_cRegexp, "stats",
+      RUBY_METHOD_FUNC(re2_regexp_stats), 0);
   rb_define_method(re2_cRegexp, "options",
       RUBY_METHOD_FUNC(re2_regexp_options), 0);
   rb_define_method(re2_cRegexp, "number_of_capturing_groups",
@@ -2871,6 +9659,14 @@ extern "C" void Init_re2(void) {
       -1);
   rb_define_method(re2_cRegexp, "match?", RUBY_METHOD_FUNC(re2_regexp_match_p),
       1);
+  rb_define_method(re2_cRegexp, "match_offsets",
+      RUBY_METHOD_FUNC(re2_regexp_match_offsets), -1);
+  rb_define_method(re2_cRegexp, "match_many",
+      RUBY_METHOD_FUNC(re2_regexp_match_many), -1);
+  rb_define_method(re2_cRegexp, "match_many?",
+      RUBY_METHOD_FUNC(re2_regexp_match_many_p), -1);
+  rb_define_method(re2_cRegexp, "parallel_match",
+      RUBY_METHOD_FUNC(re2_regexp_parallel_match), -1);
   rb_define_method(re2_cRegexp, "partial_match?",
       RUBY_METHOD_FUNC(re2_regexp_match_p), 1);
   rb_define_method(re2_cRegexp, "=~", RUBY_METHOD_FUNC(re2_regexp_match_p), 1);
@@ -2878,7 +9674,15 @@ extern "C" void Init_re2(void) {
   rb_define_method(re2_cRegexp, "full_match?",
       RUBY_METHOD_FUNC(re2_regexp_full_match_p), 1);
   rb_define_method(re2_cRegexp, "scan",
-      RUBY_METHOD_FUNC(re2_regexp_scan), 1);
+      RUBY_METHOD_FUNC(re2_regexp_scan), -1);
+  rb_define_method(re2_cRegexp, "scan_all",
+      RUBY_METHOD_FUNC(re2_regexp_scan_all), -1);
+  rb_define_method(re2_cRegexp, "scan_offsets",
+      RUBY_METHOD_FUNC(re2_regexp_scan_offsets), -1);
+  rb_define_method(re2_cRegexp, "scan_io",
+      RUBY_METHOD_FUNC(re2_regexp_scan_io), -1);
+  rb_define_method(re2_cRegexp, "search_file",
+      RUBY_METHOD_FUNC(re2_regexp_search_file), -1);
   rb_define_method(re2_cRegexp, "to_s", RUBY_METHOD_FUNC(re2_regexp_to_s), 0);
   rb_define_method(re2_cRegexp, "to_str", RUBY_METHOD_FUNC(re2_regexp_to_s),
       0);
@@ -2924,11 +9728,58 @@ extern "C" void Init_re2(void) {
   rb_define_method(re2_cSet, "initialize_copy",
       RUBY_METHOD_FUNC(re2_set_initialize_copy), 1);
   rb_define_method(re2_cSet, "add", RUBY_METHOD_FUNC(re2_set_add), 1);
+  rb_define_method(re2_cSet, "add_all", RUBY_METHOD_FUNC(re2_set_add_all), 1);
   rb_define_method(re2_cSet, "compile", RUBY_METHOD_FUNC(re2_set_compile), 0);
   rb_define_method(re2_cSet, "match", RUBY_METHOD_FUNC(re2_set_match), -1);
+  rb_define_method(re2_cSet, "match_many",
+      RUBY_METHOD_FUNC(re2_set_match_many), -1);
+  rb_define_method(re2_cSet, "parallel_match",
+      RUBY_METHOD_FUNC(re2_set_parallel_match), -1);
+  rb_define_method(re2_cSet, "search_file",
+      RUBY_METHOD_FUNC(re2_set_search_file), -1);
   rb_define_method(re2_cSet, "size", RUBY_METHOD_FUNC(re2_set_size), 0);
+  rb_define_method(re2_cSet, "warm!", RUBY_METHOD_FUNC(re2_set_warm), 1);
+  rb_define_method(re2_cSet, "memory_stats",
+      RUBY_METHOD_FUNC(re2_set_memory_stats), 0);
+  rb_define_method(re2_cSet, "instrument!",
+      RUBY_METHOD_FUNC(re2_set_instrument), 0);
+  rb_define_method(re2_cSet, "instrumented?",
+      RUBY_METHOD_FUNC(re2_set_instrumented_p), 0);
+  rb_define_method(re2_cSet, "stats", RUBY_METHOD_FUNC(re2_set_stats), 0);
   rb_define_method(re2_cSet, "length", RUBY_METHOD_FUNC(re2_set_size), 0);
 
+  rb_define_alloc_func(re2_cReplacer,
+      reinterpret_cast<VALUE (*)(VALUE)>(re2_replacer_allocate));
+  rb_define_method(re2_cReplacer, "initialize",
+      RUBY_METHOD_FUNC(re2_replacer_initialize), -1);
+  rb_define_method(re2_cReplacer, "initialize_copy",
+      RUBY_METHOD_FUNC(re2_replacer_initialize_copy), 1);
+  rb_define_method(re2_cReplacer, "replace",
+      RUBY_METHOD_FUNC(re2_replacer_replace), 1);
+  rb_define_method(re2_cReplacer, "size",
+      RUBY_METHOD_FUNC(re2_replacer_size), 0);
+  rb_define_method(re2_cReplacer, "length",
+      RUBY_METHOD_FUNC(re2_replacer_size), 0);
+
+  rb_define_alloc_func(re2_cFilteredSet,
+      reinterpret_cast<VALUE (*)(VALUE)>(re2_filtered_set_allocate));
+  rb_define_method(re2_cFilteredSet, "initialize",
+      RUBY_METHOD_FUNC(re2_filtered_set_initialize), -1);
+  rb_define_method(re2_cFilteredSet, "initialize_copy",
+      RUBY_METHOD_FUNC(re2_filtered_set_initialize_copy), 1);
+  rb_define_method(re2_cFilteredSet, "add",
+      RUBY_METHOD_FUNC(re2_filtered_set_add), 1);
+  rb_define_method(re2_cFilteredSet, "compile",
+      RUBY_METHOD_FUNC(re2_filtered_set_compile), 0);
+  rb_define_method(re2_cFilteredSet, "match",
+      RUBY_METHOD_FUNC(re2_filtered_set_match), 1);
+  rb_define_method(re2_cFilteredSet, "atoms",
+      RUBY_METHOD_FUNC(re2_filtered_set_atoms), 0);
+  rb_define_method(re2_cFilteredSet, "size",
+      RUBY_METHOD_FUNC(re2_filtered_set_size), 0);
+  rb_define_method(re2_cFilteredSet, "length",
+      RUBY_METHOD_FUNC(re2_filtered_set_size), 0);
+
   rb_define_module_function(re2_mRE2, "replace",
       RUBY_METHOD_FUNC(re2_replace), 3);
   rb_define_module_function(re2_mRE2, "Replace",
@@ -2937,6 +9788,8 @@ extern "C" void Init_re2(void) {
       RUBY_METHOD_FUNC(re2_global_replace), 3);
   rb_define_module_function(re2_mRE2, "GlobalReplace",
       RUBY_METHOD_FUNC(re2_global_replace), 3);
+  rb_define_module_function(re2_mRE2, "global_replace_many",
+      RUBY_METHOD_FUNC(re2_global_replace_many), -1);
   rb_define_module_function(re2_mRE2, "extract",
       RUBY_METHOD_FUNC(re2_extract), 3);
   rb_define_module_function(re2_mRE2, "QuoteMeta",
@@ -2945,6 +9798,34 @@ extern "C" void Init_re2(void) {
       RUBY_METHOD_FUNC(re2_escape), 1);
   rb_define_module_function(re2_mRE2, "quote",
       RUBY_METHOD_FUNC(re2_escape), 1);
+  rb_define_module_function(re2_mRE2, "pattern_cache_capacity",
+      RUBY_METHOD_FUNC(re2_pattern_cache_capacity), 0);
+  rb_define_module_function(re2_mRE2, "pattern_cache_capacity=",
+      RUBY_METHOD_FUNC(re2_pattern_cache_capacity_set), 1);
+  rb_define_module_function(re2_mRE2, "pattern_cache_stats",
+      RUBY_METHOD_FUNC(re2_pattern_cache_stats), 0);
+  rb_define_module_function(re2_mRE2, "clear_pattern_cache",
+      RUBY_METHOD_FUNC(re2_clear_pattern_cache), 0);
+  rb_define_module_function(re2_mRE2, "thread_pool_size",
+      RUBY_METHOD_FUNC(re2_thread_pool_size), 0);
+  rb_define_module_function(re2_mRE2, "thread_pool_size=",
+      RUBY_METHOD_FUNC(re2_thread_pool_size_set), 1);
+  rb_define_module_function(re2_mRE2, "thread_pool_cpus",
+      RUBY_METHOD_FUNC(re2_thread_pool_cpus), 0);
+  rb_define_module_function(re2_mRE2, "thread_pool_cpus=",
+      RUBY_METHOD_FUNC(re2_thread_pool_cpus_set), 1);
+  rb_define_module_function(re2_mRE2, "gvl_release_threshold",
+      RUBY_METHOD_FUNC(re2_gvl_release_threshold), 0);
+  rb_define_module_function(re2_mRE2, "gvl_release_threshold=",
+      RUBY_METHOD_FUNC(re2_gvl_release_threshold_set), 1);
+  rb_define_module_function(re2_mRE2, "calibrate_gvl_release_threshold",
+      RUBY_METHOD_FUNC(re2_calibrate_gvl_release_threshold), 0);
+  rb_define_module_function(re2_mRE2, "stats",
+      RUBY_METHOD_FUNC(re2_process_stats), 0);
+  rb_define_module_function(re2_mRE2, "instrument?",
+      RUBY_METHOD_FUNC(re2_instrument_p), 0);
+  rb_define_module_function(re2_mRE2, "instrument=",
+      RUBY_METHOD_FUNC(re2_instrument_set), 1);
   rb_define_singleton_method(re2_cRegexp, "escape",
       RUBY_METHOD_FUNC(re2_escape), 1);
   rb_define_singleton_method(re2_cRegexp, "quote",
@@ -2977,4 +9858,60 @@ extern "C" void Init_re2(void) {
   id_startpos = rb_intern("startpos");
   id_endpos = rb_intern("endpos");
   id_symbolize_names = rb_intern("symbolize_names");
+  id_size = rb_intern("size");
+  id_capacity = rb_intern("capacity");
+  id_hits = rb_intern("hits");
+  id_misses = rb_intern("misses");
+  id_cost = rb_intern("cost");
+  id_evictions = rb_intern("evictions");
+  id_output = rb_intern("output");
+  id_match_data = rb_intern("match_data");
+  id_offsets = rb_intern("offsets");
+  id_threads = rb_intern("threads");
+  id_arrays = rb_intern("arrays");
+  id_flat = rb_intern("flat");
+  id_strings = rb_intern("strings");
+  id_indices = rb_intern("indices");
+  id_pack = rb_intern("pack");
+  id_into = rb_intern("into");
+  id_auto = rb_intern("auto");
+  id_program_size = rb_intern("program_size");
+  id_pattern_bytes = rb_intern("pattern_bytes");
+  id_estimated_bytes = rb_intern("estimated_bytes");
+  id_patterns = rb_intern("patterns");
+  id_compiled = rb_intern("compiled");
+  id_calls = rb_intern("calls");
+  id_bytes = rb_intern("bytes");
+  id_nanoseconds = rb_intern("nanoseconds");
+  id_histogram = rb_intern("histogram");
+  id_regexps_compiled = rb_intern("regexps_compiled");
+  id_sets_compiled = rb_intern("sets_compiled");
+  id_compile_nanoseconds = rb_intern("compile_nanoseconds");
+  id_nogvl_nanoseconds = rb_intern("nogvl_nanoseconds");
+  id_set_match_errors = rb_intern("set_match_errors");
+  id_out_of_memory = rb_intern("out_of_memory");
+  id_inconsistent = rb_intern("inconsistent");
+  id_not_compiled = rb_intern("not_compiled");
+  id_matchdata_allocations = rb_intern("matchdata_allocations");
+  id_scanner_allocations = rb_intern("scanner_allocations");
+  id_match = rb_intern("match");
+  id_match_p = rb_intern("match?");
+  id_scan = rb_intern("scan");
+  id_replace = rb_intern("replace");
+  id_global_replace = rb_intern("global_replace");
+  id_extract = rb_intern("extract");
+  id_set_match = rb_intern("set_match");
+  id_min_atom_len = rb_intern("min_atom_len");
+  id_read = rb_intern("read");
+  id_chunk_size = rb_intern("chunk_size");
+  id_max_match_length = rb_intern("max_match_length");
+  id_lines = rb_intern("lines");
+  id_lazy = rb_intern("lazy");
+  id_samples = rb_intern("samples");
+  id_matches = rb_intern("matches");
+  id_cold_nanoseconds = rb_intern("cold_nanoseconds");
+  id_warm_nanoseconds = rb_intern("warm_nanoseconds");
+
+  rb_gc_register_mark_object(TypedData_Wrap_Struct(0,
+        &re2_regexp_registry_data_type, &regexp_registry));
 }
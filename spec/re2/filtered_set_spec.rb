@@ -0,0 +1,253 @@
+# frozen_string_literal: true
+
+RSpec.describe RE2::FilteredSet do
+  describe "#initialize" do
+    it "returns an instance given no args" do
+      set = RE2::FilteredSet.new
+
+      expect(set).to be_a(RE2::FilteredSet)
+    end
+
+    it "returns an instance given options" do
+      set = RE2::FilteredSet.new(case_sensitive: false, min_atom_len: 3)
+
+      expect(set).to be_a(RE2::FilteredSet)
+    end
+
+    it "raises an error if given options that are not a hash" do
+      expect { RE2::FilteredSet.new(0) }.to raise_error(ArgumentError, "options should be a hash")
+    end
+
+    it "raises an error if given a negative min_atom_len" do
+      expect { RE2::FilteredSet.new(min_atom_len: -1) }.to raise_error(ArgumentError, "min_atom_len should be >= 0")
+    end
+
+    it "cannot be re-initialized" do
+      set = RE2::FilteredSet.new
+
+      expect { set.send(:initialize) }.to raise_error(TypeError, /already initialized RE2::FilteredSet/)
+    end
+
+    it "cannot be copied" do
+      set = RE2::FilteredSet.new
+
+      expect { set.dup }.to raise_error(TypeError, "cannot copy RE2::FilteredSet")
+    end
+  end
+
+  describe "#add" do
+    it "returns the index of each added pattern" do
+      set = RE2::FilteredSet.new
+
+      expect(set.add("abc")).to eq(0)
+      expect(set.add("def")).to eq(1)
+    end
+
+    it "rejects invalid patterns with the error from RE2" do
+      set = RE2::FilteredSet.new
+
+      expect { set.add("???") }.to raise_error(ArgumentError, "str rejected by RE2::FilteredSet->Add(): no argument for repetition operator: ??")
+    end
+
+    it "raises an error if called after compile" do
+      set = RE2::FilteredSet.new
+      set.add("abc")
+      set.compile
+
+      expect { set.add("def") }.to raise_error(FrozenError)
+    end
+
+    it "raises an error if given a pattern that can't be coerced to a String" do
+      set = RE2::FilteredSet.new
+
+      expect { set.add(0) }.to raise_error(TypeError)
+    end
+  end
+
+  describe "#compile" do
+    it "compiles the set without error" do
+      set = RE2::FilteredSet.new
+      set.add("abc")
+
+      expect(set.compile).to be_truthy
+    end
+
+    it "compiles an empty set" do
+      set = RE2::FilteredSet.new
+
+      expect(set.compile).to be_truthy
+    end
+
+    it "freezes the set" do
+      set = RE2::FilteredSet.new
+      set.add("abc")
+      set.compile
+
+      expect(set).to be_frozen
+    end
+
+    it "can still be used if compiling is interrupted" do
+      set = RE2::FilteredSet.new
+      5000.times { |i| set.add("prefix#{i}[a-z]+suffix#{i}") }
+
+      thread = Thread.new do
+        Thread.current.report_on_exception = false
+        set.compile
+      end
+      sleep 0.005
+      thread.raise(Interrupt)
+
+      expect { thread.join }.to raise_error(Interrupt)
+      set.compile unless set.frozen?
+      expect(set.match("prefix12abcsuffix12")).to eq([12])
+    end
+  end
+
+  describe "#match" do
+    it "matches against multiple patterns" do
+      set = RE2::FilteredSet.new
+      set.add("abc")
+      set.add("def")
+      set.add("ghi")
+      set.compile
+
+      expect(set.match("abcdefghi")).to eq([0, 1, 2])
+    end
+
+    it "returns an empty array if there is no match" do
+      set = RE2::FilteredSet.new
+      set.add("abc")
+      set.compile
+
+      expect(set.match("def")).to eq([])
+    end
+
+    it "only returns patterns that match in full, not just their atoms" do
+      set = RE2::FilteredSet.new
+      set.add("hello.*world")
+      set.add("hello[0-9]+")
+      set.compile
+
+      expect(set.match("world says hello")).to eq([])
+      expect(set.match("hello there world")).to eq([0])
+      expect(set.match("hello123 world")).to eq([0, 1])
+    end
+
+    it "runs patterns without atoms against every text" do
+      set = RE2::FilteredSet.new
+      set.add("a.b")
+      set.add("\\d+")
+      set.compile
+
+      expect(set.match("axb 42")).to eq([0, 1])
+      expect(set.match("nothing")).to eq([])
+    end
+
+    it "matches atoms that overlap or share a suffix" do
+      set = RE2::FilteredSet.new
+      set.add("abcd")
+      set.add("bcde")
+      set.add("cd")
+      set.compile
+
+      expect(set.match("xbcdex")).to eq([1, 2])
+      expect(set.match("abcde")).to eq([0, 1, 2])
+    end
+
+    it "honours case-insensitive patterns" do
+      set = RE2::FilteredSet.new(case_sensitive: false)
+      set.add("hello")
+      set.add("(?i)world")
+      set.compile
+
+      expect(set.match("HeLLo WORLD")).to eq([0, 1])
+    end
+
+    it "matches case-insensitively against non-ASCII text" do
+      set = RE2::FilteredSet.new
+      set.add("(?i)kelvin")
+      set.add("(?i)ünïcode")
+      set.compile
+
+      expect(set.match("Kelvin")).to eq([0])
+      expect(set.match("ÜNÏCODE")).to eq([1])
+    end
+
+    it "matches the long s case-insensitively as RE2 does" do
+      set = RE2::FilteredSet.new
+      set.add("(?i)sun")
+      set.compile
+
+      expect(set.match("ſun")).to eq([0])
+      expect(RE2::Regexp.new("(?i)sun").match?("ſun")).to be(true)
+    end
+
+    it "returns matches from a set of many patterns" do
+      set = RE2::FilteredSet.new(min_atom_len: 3)
+      1000.times { |i| set.add("needle#{i}\\b") }
+      set.compile
+
+      expect(set.match("a needle42 and a needle999 in a haystack")).to eq([42, 999])
+    end
+
+    it "returns an empty array for an empty set" do
+      set = RE2::FilteredSet.new
+      set.compile
+
+      expect(set.match("abc")).to eq([])
+    end
+
+    it "raises an error if called before compile" do
+      set = RE2::FilteredSet.new
+      set.add("abc")
+
+      expect { set.match("abc") }.to raise_error(RE2::FilteredSet::MatchError, "#match must not be called before #compile")
+    end
+
+    it "raises an error if given text that can't be coerced to a String" do
+      set = RE2::FilteredSet.new
+      set.add("abc")
+      set.compile
+
+      expect { set.match(0) }.to raise_error(TypeError)
+    end
+
+    it "can be shared between Ractors", :aggregate_failures do
+      skip "Ractors are not supported" unless defined?(Ractor) && Ractor.respond_to?(:make_shareable)
+
+      set = RE2::FilteredSet.new
+      set.add("abc")
+      set.compile
+
+      expect(Ractor.shareable?(set)).to be(true)
+    end
+  end
+
+  describe "#atoms" do
+    it "returns the atoms extracted from the patterns" do
+      set = RE2::FilteredSet.new
+      set.add("hello.*world")
+      set.compile
+
+      expect(set.atoms.sort).to eq(["hello", "world"])
+    end
+
+    it "returns an empty array before compilation" do
+      set = RE2::FilteredSet.new
+      set.add("hello")
+
+      expect(set.atoms).to eq([])
+    end
+  end
+
+  describe "#size" do
+    it "returns the number of patterns" do
+      set = RE2::FilteredSet.new
+      set.add("abc")
+      set.add("def")
+
+      expect(set.size).to eq(2)
+      expect(set.length).to eq(2)
+    end
+  end
+end
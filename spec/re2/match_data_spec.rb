@@ -66,6 +66,45 @@ RSpec.describe RE2::MatchData do
 
       expect(md.to_a).to eq(["123", "123"])
     end
+
+    it "raises an error if the match data is frozen" do
+      md = RE2::Regexp.new('(\d+)').match("123").freeze
+      other = RE2::Regexp.new('(\w+)').match("abc")
+
+      expect { md.send(:initialize_copy, other) }.to raise_error(FrozenError)
+    end
+  end
+
+  describe "Ractor shareability" do
+    it "is not shareable while unfrozen" do
+      skip "Ractors are not supported" unless defined?(Ractor) && Ractor.respond_to?(:make_shareable)
+
+      md = RE2::Regexp.new('(\d+)').match("123")
+
+      expect(Ractor.shareable?(md)).to be(false)
+    end
+
+    it "is shareable once frozen" do
+      skip "Ractors are not supported" unless defined?(Ractor) && Ractor.respond_to?(:make_shareable)
+
+      md = RE2::Regexp.new('(\d+)').match("bob 123").freeze
+
+      expect(Ractor.shareable?(md)).to be(true)
+    end
+
+    it "can be made shareable" do
+      skip "Ractors are not supported" unless defined?(Ractor) && Ractor.respond_to?(:make_shareable)
+
+      md = Ractor.make_shareable(RE2::Regexp.new('(\d+)').match("bob 123"))
+
+      expect(md[1]).to eq("123")
+    end
+
+    it "cannot be matched into once frozen" do
+      md = RE2::Regexp.new('(\d+)').match("123").freeze
+
+      expect { RE2::Regexp.new('(\w+)').match("abc", into: md) }.to raise_error(FrozenError)
+    end
   end
 
   describe "#to_a" do
@@ -186,6 +225,25 @@ RSpec.describe RE2::MatchData do
       expect(md[:missing]).to be_nil
     end
 
+    it "allows access by non-ASCII names given in another encoding", :aggregate_failures do
+      re = RE2::Regexp.new('(?P<café>\w+)', log_errors: false)
+      skip "Underlying RE2 does not support non-ASCII group names" unless re.ok?
+
+      md = re.match("bob")
+
+      expect(md["café"]).to eq("bob")
+      expect(md["café".b]).to eq("bob")
+      expect(md[:café]).to eq("bob")
+    end
+
+    it "allows access by name after GC compaction" do
+      md = RE2::Regexp.new('(?P<name>wo{2})').match('woohoo' * 5)
+      md[:name]
+      GC.compact
+
+      expect(md[:name]).to eq("woo")
+    end
+
     it "raises an error if given an inappropriate index" do
       md = RE2::Regexp.new('(\d+)').match("bob 123")
 
@@ -915,6 +973,34 @@ RSpec.describe RE2::MatchData do
       expect(md.deconstruct_keys(nil)).to eq(empty: "", word: "bob")
     end
 
+    it "returns non-ASCII names as symbols", :aggregate_failures do
+      re = RE2::Regexp.new('(?P<café>\w+)', log_errors: false)
+      skip "Underlying RE2 does not support non-ASCII group names" unless re.ok?
+
+      md = re.match("bob")
+
+      expect(md.deconstruct_keys(nil)).to eq(café: "bob")
+      expect(md.deconstruct_keys([:café])).to eq(café: "bob")
+    end
+
+    it "supports pattern matching in other Ractors" do
+      skip "Ractors are not supported" unless defined?(Ractor) && Ractor.respond_to?(:make_shareable)
+
+      re = RE2::Regexp.new('(?P<numbers>\d+) (?P<letters>[a-zA-Z]+)')
+      experimental = Warning[:experimental]
+      Warning[:experimental] = false
+      ractor = Ractor.new(re) do |shared|
+        case shared.match("123 abc")
+        in {numbers:, letters:}
+          [numbers, letters]
+        end
+      end
+
+      expect(ractor.take).to eq(["123", "abc"])
+    ensure
+      Warning[:experimental] = experimental unless experimental.nil?
+    end
+
     it "raises an error if given a non-array of keys" do
       md = RE2::Regexp.new('(?P<numbers>\d+) (?P<letters>[a-zA-Z]+)').match('123 abc')
 
@@ -28,6 +28,69 @@ RSpec.describe RE2::Regexp do
       expect { RE2::Regexp.new(nil) }.to raise_error(TypeError)
     end
 
+    it "does not compile the pattern until first use if lazy" do
+      pattern = "lazy#{rand(1 << 30)}(\\d+)"
+      compiled = RE2.stats[:regexps_compiled]
+      re = RE2::Regexp.new(pattern, lazy: true)
+
+      expect(RE2.stats[:regexps_compiled]).to eq(compiled)
+      expect(re.match(pattern.sub("(\\d+)", "42"))[1]).to eq("42")
+      expect(RE2.stats[:regexps_compiled]).to eq(compiled + 1)
+    end
+
+    it "reports errors of lazy patterns on demand" do
+      re = RE2::Regexp.new('???', lazy: true, log_errors: false)
+
+      expect(re).not_to be_ok
+      expect(re.error).to eq("no argument for repetition operator: ??")
+    end
+
+    it "returns frozen, shareable lazy regexps" do
+      re = RE2::Regexp.new('woo', lazy: true)
+
+      expect(re).to be_frozen
+      expect(Ractor.shareable?(re)).to be(true) if defined?(Ractor)
+    end
+
+    it "compiles lazy patterns with the given options" do
+      re = RE2::Regexp.new('woo', lazy: true, case_sensitive: false)
+
+      expect(re.match?("WOO")).to be(true)
+      expect(re).to eq(RE2::Regexp.new('woo', case_sensitive: false))
+    end
+
+    it "does not compile lazy patterns to hash, compare or print them" do
+      pattern = "lazy#{rand(1 << 30)}(\\d+)"
+      compiled = RE2.stats[:regexps_compiled]
+      re = RE2::Regexp.new(pattern, lazy: true, case_sensitive: false)
+      other = RE2::Regexp.new(pattern, lazy: true, case_sensitive: false)
+
+      expect({ re => 1 }[other]).to eq(1)
+      expect(re).to eq(other)
+      expect(re).not_to eq(RE2::Regexp.new(pattern, lazy: true))
+      expect(re.to_s).to eq(pattern)
+      expect(re.inspect).to eq("#<RE2::Regexp /#{pattern}/>")
+      expect(re).not_to be_case_sensitive
+      expect(re.options).to include(case_sensitive: false)
+      expect(RE2.stats[:regexps_compiled]).to eq(compiled)
+    end
+
+    it "hashes lazy patterns like compiled ones" do
+      lazy = RE2::Regexp.new('(\d+)', lazy: true)
+      compiled = RE2::Regexp.new('(\d+)')
+
+      expect(lazy.hash).to eq(compiled.hash)
+      expect(lazy.eql?(compiled)).to be(true)
+    end
+
+    it "compiles lazy patterns only once when used from several threads" do
+      re = RE2::Regexp.new('(a+)', lazy: true)
+
+      threads = 10.times.map { Thread.new { re.match("baaa")[1] } }
+
+      expect(threads.map(&:value)).to all(eq("aaa"))
+    end
+
     it "allows invalid patterns to be created" do
       re = RE2::Regexp.new('???', log_errors: false)
 
@@ -147,6 +210,136 @@ RSpec.describe RE2::Regexp do
     end
   end
 
+  describe ".cached" do
+    before { RE2::Regexp.clear_cache }
+    after { RE2::Regexp.cache_capacity = 1_000_000 }
+
+    it "returns a compiled, frozen regexp" do
+      re = RE2::Regexp.cached('(\d+)')
+
+      expect(re).to be_frozen
+    end
+
+    it "returns the same object for the same pattern and options" do
+      re = RE2::Regexp.cached('(\d+)', case_sensitive: false)
+
+      expect(RE2::Regexp.cached('(\d+)', case_sensitive: false)).to equal(re)
+    end
+
+    it "returns different objects for different options" do
+      re = RE2::Regexp.cached('(\d+)')
+
+      expect(RE2::Regexp.cached('(\d+)', case_sensitive: false)).not_to equal(re)
+    end
+
+    it "returns regexps with the given options" do
+      re = RE2::Regexp.cached('woo', case_sensitive: false)
+
+      expect(re).to be_case_insensitive
+    end
+
+    it "returns regexps that are shareable between Ractors" do
+      re = RE2::Regexp.cached('(\d+)')
+
+      expect(Ractor.shareable?(re)).to be(true)
+    end
+
+    it "counts hits and misses", :aggregate_failures do
+      RE2::Regexp.cached('(\d+)')
+      RE2::Regexp.cached('(\d+)')
+      RE2::Regexp.cached('(\w+)')
+
+      stats = RE2::Regexp.cache_stats
+
+      expect(stats).to include(size: 2, hits: 1, misses: 2, evictions: 0)
+      expect(stats[:cost]).to eq(RE2('(\d+)').program_size + RE2('(\w+)').program_size)
+    end
+
+    it "evicts the least recently used regexps by program size", :aggregate_failures do
+      RE2::Regexp.cache_capacity = RE2('a').program_size * 2
+
+      a = RE2::Regexp.cached('a')
+      RE2::Regexp.cached('b')
+      RE2::Regexp.cached('a')
+      RE2::Regexp.cached('c')
+
+      expect(RE2::Regexp.cache_stats).to include(size: 2, evictions: 1)
+      expect(RE2::Regexp.cached('a')).to equal(a)
+    end
+
+    it "accepts patterns that can be coerced to a String" do
+      re = RE2::Regexp.cached(StringLike.new('(\d+)'))
+
+      expect(re.to_s).to eq('(\d+)')
+    end
+
+    it "caches invalid patterns" do
+      re = RE2::Regexp.cached('???', log_errors: false)
+
+      expect(RE2::Regexp.cached('???', log_errors: false)).to equal(re)
+    end
+
+    it "raises an error if given a negative capacity" do
+      expect { RE2::Regexp.cache_capacity = -1 }.to raise_error(ArgumentError)
+    end
+
+    it "raises an error if given non-hash options" do
+      expect { RE2::Regexp.cached('woo', 0) }.to raise_error(ArgumentError)
+    end
+
+    it "can be run concurrently" do
+      threads = 10.times.map do
+        Thread.new { RE2::Regexp.cached('(\d+)') }
+      end
+
+      expect(threads.map(&:value).uniq.size).to eq(1)
+    end
+  end
+
+  describe "#==" do
+    it "is true for regexps with the same pattern and options" do
+      expect(RE2::Regexp.new('(\d+)')).to eq(RE2::Regexp.new('(\d+)'))
+    end
+
+    it "is false for regexps with different patterns" do
+      expect(RE2::Regexp.new('(\d+)')).not_to eq(RE2::Regexp.new('(\w+)'))
+    end
+
+    it "is false for regexps with different options" do
+      expect(RE2::Regexp.new('(\d+)')).not_to eq(RE2::Regexp.new('(\d+)', utf8: false))
+    end
+
+    it "is false for other objects" do
+      expect(RE2::Regexp.new('(\d+)')).not_to eq('(\d+)')
+    end
+
+    it "is false for uninitialized regexps" do
+      expect(RE2::Regexp.new('(\d+)') == described_class.allocate).to be(false)
+    end
+  end
+
+  describe "#eql?" do
+    it "allows equivalent regexps to be used as the same hash key" do
+      hash = { RE2::Regexp.new('(\d+)') => 1 }
+
+      expect(hash[RE2::Regexp.new('(\d+)')]).to eq(1)
+    end
+
+    it "is false for regexps with different options" do
+      expect(RE2::Regexp.new('(\d+)').eql?(RE2::Regexp.new('(\d+)', longest_match: true))).to be(false)
+    end
+  end
+
+  describe "#hash" do
+    it "is the same for regexps with the same pattern and options" do
+      expect(RE2::Regexp.new('(\d+)').hash).to eq(RE2::Regexp.new('(\d+)').hash)
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.hash }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
+    end
+  end
+
   describe "#options" do
     it "returns a hash of options" do
       options = RE2::Regexp.new('woo').options
@@ -234,6 +427,165 @@ RSpec.describe RE2::Regexp do
     end
   end
 
+  describe "#warm!" do
+    it "reports the samples matched", :aggregate_failures do
+      re = RE2::Regexp.new('(\w+)@example\.com')
+      result = re.warm!(["alice@example.com", "no email here"])
+
+      expect(result[:samples]).to eq(2)
+      expect(result[:bytes]).to eq(30)
+      expect(result[:matches]).to eq(1)
+      expect(result[:cold_nanoseconds]).to be_a(Integer)
+      expect(result[:warm_nanoseconds]).to be_a(Integer)
+    end
+
+    it "accepts no samples" do
+      result = RE2::Regexp.new('abc').warm!([])
+
+      expect(result[:samples]).to eq(0)
+    end
+
+    it "does not count the samples in the regexp's stats" do
+      re = RE2::Regexp.new('abc').instrument!
+      re.warm!(["abc"])
+
+      expect(re.stats[:calls]).to eq(0)
+    end
+
+    it "compiles a lazy regexp" do
+      re = RE2::Regexp.new('a(b)c', lazy: true)
+      re.warm!(["abc"])
+
+      expect(re.match?("abc")).to eq(true)
+    end
+
+    it "does not match samples against an invalid pattern" do
+      re = RE2::Regexp.new('???', log_errors: false)
+
+      result = re.warm!(["???"])
+
+      expect(result).to include(samples: 1, matches: 0, cold_nanoseconds: 0, warm_nanoseconds: 0)
+    end
+
+    it "raises an error if given something other than an array" do
+      expect { RE2::Regexp.new('abc').warm!("abc") }.to raise_error(TypeError)
+    end
+
+    it "raises an error if given samples other than strings" do
+      expect { RE2::Regexp.new('abc').warm!([1]) }.to raise_error(TypeError)
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.warm!([]) }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
+    end
+  end
+
+  describe "#memory_stats" do
+    it "returns the program size, pattern size, and maximum memory", :aggregate_failures do
+      re = RE2::Regexp.new('w(o)(o)', max_mem: 1024 * 1024)
+      stats = re.memory_stats
+
+      expect(stats[:program_size]).to eq(re.program_size)
+      expect(stats[:pattern_bytes]).to eq(7)
+      expect(stats[:max_mem]).to eq(1024 * 1024)
+    end
+
+    it "estimates more memory for larger programs" do
+      small = RE2::Regexp.new('a').memory_stats[:estimated_bytes]
+      large = RE2::Regexp.new('a{100}').memory_stats[:estimated_bytes]
+
+      expect(large).to be > small
+    end
+
+    it "reports the estimate to ObjectSpace" do
+      require "objspace"
+
+      re = RE2::Regexp.new('a{100}')
+
+      expect(ObjectSpace.memsize_of(re)).to be >= re.memory_stats[:estimated_bytes]
+    end
+
+    it "returns stats for an invalid pattern" do
+      stats = RE2::Regexp.new('???', log_errors: false).memory_stats
+
+      expect(stats[:program_size]).to eq(-1)
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.memory_stats }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
+    end
+  end
+
+  describe "#instrument!" do
+    it "returns the regexp" do
+      re = RE2::Regexp.new('woo')
+
+      expect(re.instrument!).to equal(re)
+    end
+
+    it "instruments frozen regexps" do
+      re = RE2::Regexp.new('woo')
+
+      expect(re.instrument!).to be_instrumented
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.instrument! }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
+    end
+  end
+
+  describe "#instrumented?" do
+    it "returns false by default" do
+      expect(RE2::Regexp.new('woo')).not_to be_instrumented
+    end
+  end
+
+  describe "#stats" do
+    it "returns nil if not instrumented" do
+      expect(RE2::Regexp.new('woo').stats).to be_nil
+    end
+
+    it "counts calls, bytes, hits, and misses", :aggregate_failures do
+      re = RE2::Regexp.new('w(o+)').instrument!
+      re.match?("woo")
+      re.match("bar")
+      re.match("a woo", startpos: 2)
+
+      stats = re.stats
+
+      expect(stats[:calls]).to eq(3)
+      expect(stats[:bytes]).to eq(9)
+      expect(stats[:hits]).to eq(2)
+      expect(stats[:misses]).to eq(1)
+    end
+
+    it "records every call in the latency histogram", :aggregate_failures do
+      re = RE2::Regexp.new('woo').instrument!
+      3.times { re.match?("woo") }
+
+      stats = re.stats
+
+      expect(stats[:histogram].sum).to eq(3)
+      expect(stats[:nanoseconds]).to be >= 0
+    end
+
+    it "does not count calls made before being instrumented" do
+      re = RE2::Regexp.new('woo')
+      re.match?("woo")
+      re.instrument!
+
+      expect(re.stats[:calls]).to eq(0)
+    end
+
+    it "counts calls from multiple threads" do
+      re = RE2::Regexp.new('woo').instrument!
+
+      10.times.map { Thread.new { 10.times { re.match?("woo") } } }.each(&:join)
+
+      expect(re.stats[:calls]).to eq(100)
+    end
+  end
+
   describe "#to_str" do
     it "returns the original pattern" do
       string = RE2::Regexp.new('w(o)(o)').to_str
@@ -803,6 +1155,89 @@ RSpec.describe RE2::Regexp do
 
       expect(threads.map(&:value)).to all(eq(["one", "two"]))
     end
+
+    it "returns the given match data when matching into it" do
+      re = RE2::Regexp.new('(\w+)')
+      md = re.match("one")
+
+      expect(re.match("two", into: md)).to equal(md)
+    end
+
+    it "overwrites the given match data with the new match" do
+      re = RE2::Regexp.new('(\w+) (\w+)')
+      md = RE2::Regexp.new('(\d+)').match("123")
+
+      re.match("one two", into: md)
+
+      expect(md.to_a).to eq(["one two", "one", "two"])
+      expect(md.regexp).to equal(re)
+      expect(md.string).to eq("one two")
+    end
+
+    it "only exposes the requested submatches when reusing a larger match data" do
+      re = RE2::Regexp.new('(\w+) (\w+)')
+      md = re.match("one two")
+
+      re.match("three four", submatches: 1, into: md)
+
+      expect(md.to_a).to eq(["three four", "three"])
+    end
+
+    it "records the whole match when matching into match data without submatches" do
+      re = RE2::Regexp.new('(\w+)')
+      md = re.match("one")
+
+      expect(re.match("two", submatches: 0, into: md)).to equal(md)
+      expect(md[0]).to eq("two")
+      expect(md.size).to eq(1)
+    end
+
+    it "can match into an allocated match data" do
+      re = RE2::Regexp.new('(\w+)')
+      md = RE2::MatchData.allocate
+
+      re.match("one", into: md)
+
+      expect(md[1]).to eq("one")
+    end
+
+    it "returns nil and clears submatches when failing to match into match data" do
+      re = RE2::Regexp.new('(\d+)')
+      md = re.match("123")
+
+      expect(re.match("abc", into: md)).to be_nil
+      expect(md[1]).to be_nil
+    end
+
+    it "releases match data if matching into it is interrupted" do
+      re = RE2::Regexp.new('(a+)$')
+      md = re.match("a")
+      text = "a" * 20_000_000
+
+      thread = Thread.new do
+        Thread.current.report_on_exception = false
+        re.match(text, into: md)
+      end
+      sleep 0.01
+      thread.raise(Interrupt)
+
+      expect { thread.join }.to raise_error(Interrupt)
+      expect { md[0] }.not_to raise_error
+      expect(re.match("aa", into: md)[1]).to eq("aa")
+    end
+
+    it "raises an error when matching into something other than match data" do
+      re = RE2::Regexp.new('(\w+)')
+
+      expect { re.match("one", into: "two") }.to raise_error(TypeError)
+    end
+
+    it "raises an error when matching into frozen match data" do
+      re = RE2::Regexp.new('(\w+)')
+      md = re.match("one").freeze
+
+      expect { re.match("two", into: md) }.to raise_error(FrozenError)
+    end
   end
 
   describe "#match?" do
@@ -840,92 +1275,403 @@ RSpec.describe RE2::Regexp do
     end
   end
 
-  describe "#partial_match?" do
-    it "returns only true or false even if there are capturing groups", :aggregate_failures do
-      re = RE2::Regexp.new('My name is (\S+) (\S+)')
+  describe "#match_offsets" do
+    it "returns a flat array of byte offsets for the match and each submatch" do
+      re = RE2::Regexp.new('(\w+)@(\w+)')
 
-      expect(re.partial_match?("My name is Alice Bloggs")).to eq(true)
-      expect(re.partial_match?("My age is 99")).to eq(false)
+      expect(re.match_offsets("to: bob@example")).to eq([4, 15, 4, 7, 8, 15])
     end
 
-    it "supports matching against text containing null bytes", :aggregate_failures do
-      re = RE2::Regexp.new("a\0b")
+    it "returns nil for submatches that did not participate in the match" do
+      re = RE2::Regexp.new('(\w+)@(\w+)?')
 
-      expect(re.partial_match?("a\0b")).to eq(true)
-      expect(re.partial_match?("ab")).to eq(false)
+      expect(re.match_offsets("to: bob@")).to eq([4, 8, 4, 7, nil, nil])
     end
 
-    it "returns false if the pattern is invalid" do
-      re = RE2::Regexp.new('???', log_errors: false)
+    it "returns byte rather than character offsets" do
+      re = RE2::Regexp.new('(b)')
 
-      expect(re.partial_match?("My name is Alice Bloggs")).to eq(false)
+      expect(re.match_offsets("£b")).to eq([2, 3, 2, 3])
     end
 
-    it "raises an exception if text cannot be coerced to a string" do
-      re = RE2::Regexp.new('My name is (\S+) (\S+)')
+    it "returns nil if the text does not match" do
+      re = RE2::Regexp.new('(\w+)@(\w+)')
 
-      expect { re.partial_match?(0) }.to raise_error(TypeError)
+      expect(re.match_offsets("nobody")).to be_nil
     end
 
-    it "raises an error when called on an uninitialized object" do
-      expect { described_class.allocate.partial_match?("test") }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
+    it "returns only the offsets of the overall match if given zero submatches" do
+      re = RE2::Regexp.new('(\w+)@(\w+)')
+
+      expect(re.match_offsets("to: bob@example", submatches: 0)).to eq([4, 15])
     end
 
-    it "can be run concurrently" do
+    it "supports the same options as match", :aggregate_failures do
       re = RE2::Regexp.new('(\d+)')
 
-      threads = 10.times.map do
-        Thread.new { re.partial_match?("alice 123") }
-      end
+      expect(re.match_offsets("1 22 333", startpos: 2)).to eq([2, 4, 2, 4])
+      expect(re.match_offsets("a 1", anchor: :anchor_start)).to be_nil
+    end
 
-      expect(threads.map(&:value)).to all(eq(true))
+    it "supports the legacy number of submatches" do
+      re = RE2::Regexp.new('(\w+)@(\w+)')
+
+      expect(re.match_offsets("to: bob@example", 1)).to eq([4, 15, 4, 7])
     end
-  end
 
-  describe "#=~" do
-    it "returns only true or false even if there are capturing groups", :aggregate_failures do
-      re = RE2::Regexp.new('My name is (\S+) (\S+)')
+    it "packs the offsets into a binary string of 64-bit integers with pack: true", :aggregate_failures do
+      re = RE2::Regexp.new('(\w+)@(\w+)?')
 
-      expect(re =~ "My name is Alice Bloggs").to eq(true)
-      expect(re =~ "My age is 99").to eq(false)
+      packed = re.match_offsets("to: bob@", pack: true)
+
+      expect(packed.encoding).to eq(Encoding::BINARY)
+      expect(packed.unpack("q*")).to eq([4, 8, 4, 7, -1, -1])
     end
 
-    it "supports matching against text containing null bytes", :aggregate_failures do
-      re = RE2::Regexp.new("a\0b")
+    it "supports patterns with many capturing groups" do
+      re = RE2::Regexp.new("#{"(" * 20}a#{")" * 20}")
 
-      expect(re =~ "a\0b").to eq(true)
-      expect(re =~ "ab").to eq(false)
+      expect(re.match_offsets("a")).to eq([0, 1] * 21)
     end
 
-    it "returns false if the pattern is invalid" do
+    it "returns nil if the pattern is invalid" do
       re = RE2::Regexp.new('???', log_errors: false)
 
-      expect(re =~ "My name is Alice Bloggs").to eq(false)
+      expect(re.match_offsets("foo")).to be_nil
     end
 
-    it "raises an exception if text cannot be coerced to a string" do
-      re = RE2::Regexp.new('My name is (\S+) (\S+)')
+    it "raises an error if given a negative number of submatches" do
+      re = RE2::Regexp.new('(\w+)')
 
-      expect { re =~ 0 }.to raise_error(TypeError)
+      expect { re.match_offsets("foo", submatches: -1) }.to raise_error(ArgumentError, "number of matches should be >= 0")
+    end
+
+    it "raises an error if text cannot be coerced to a string" do
+      re = RE2::Regexp.new('(\w+)')
+
+      expect { re.match_offsets(0) }.to raise_error(TypeError)
     end
 
     it "raises an error when called on an uninitialized object" do
-      expect { described_class.allocate =~ "test" }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
+      expect { described_class.allocate.match_offsets("foo") }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
     end
   end
 
-  describe "#===" do
-    it "returns only true or false even if there are capturing groups", :aggregate_failures do
-      re = RE2::Regexp.new('My name is (\S+) (\S+)')
+  describe "#match_many" do
+    it "returns MatchData for each matching string and nil otherwise", :aggregate_failures do
+      re = RE2::Regexp.new('w(o+)')
 
-      expect(re === "My name is Alice Bloggs").to eq(true)
-      expect(re === "My age is 99").to eq(false)
+      matches = re.match_many(["woo", "bar", "a wooo"])
+
+      expect(matches.size).to eq(3)
+      expect(matches[0].to_a).to eq(["woo", "oo"])
+      expect(matches[1]).to be_nil
+      expect(matches[2].to_a).to eq(["wooo", "ooo"])
     end
 
-    it "returns false if the pattern is invalid" do
-      re = RE2::Regexp.new('???', log_errors: false)
+    it "returns MatchData referring to the regexp and original strings", :aggregate_failures do
+      re = RE2::Regexp.new('w(o+)')
 
-      expect(re === "My name is Alice Bloggs").to eq(false)
+      md = re.match_many(["a woo"]).first
+
+      expect(md.regexp).to equal(re)
+      expect(md.string).to eq("a woo")
+      expect(md.string).to be_frozen
+      expect(md.pre_match).to eq("a ")
+    end
+
+    it "returns booleans if there are no capturing groups" do
+      re = RE2::Regexp.new('wo+')
+
+      expect(re.match_many(["woo", "bar"])).to eq([true, false])
+    end
+
+    it "returns booleans if given zero submatches" do
+      re = RE2::Regexp.new('w(o+)')
+
+      expect(re.match_many(["woo", "bar"], submatches: 0)).to eq([true, false])
+    end
+
+    it "extracts the given number of submatches" do
+      re = RE2::Regexp.new('w(o)(o)')
+
+      expect(re.match_many(["woo"], submatches: 1).first.to_a).to eq(["woo", "o"])
+    end
+
+    it "pads extra submatches with nil" do
+      re = RE2::Regexp.new('w(o)')
+
+      expect(re.match_many(["woo"], submatches: 2).first.to_a).to eq(["wo", "o", nil])
+    end
+
+    it "supports anchoring the matches", :aggregate_failures do
+      re = RE2::Regexp.new('wo+')
+
+      expect(re.match_many(["woo", "a woo", "woot"], anchor: :anchor_start)).to eq([true, false, true])
+      expect(re.match_many(["woo", "a woo", "woot"], anchor: :anchor_both)).to eq([true, false, false])
+    end
+
+    it "returns byte offsets for each match and submatch with output: :offsets" do
+      re = RE2::Regexp.new('w(o+)(x)?')
+
+      expect(re.match_many(["a woo", "bar", "£wo"], output: :offsets)).to eq([
+        [[2, 5], [3, 5], nil],
+        nil,
+        [[2, 4], [3, 4], nil]
+      ])
+    end
+
+    it "returns offsets of the overall match with output: :offsets and zero submatches" do
+      re = RE2::Regexp.new('w(o+)')
+
+      expect(re.match_many(["a woo"], output: :offsets, submatches: 0)).to eq([[[2, 5]]])
+    end
+
+    it "returns an empty array if given no strings" do
+      re = RE2::Regexp.new('w(o+)')
+
+      expect(re.match_many([])).to eq([])
+    end
+
+    it "returns false for every string if the pattern is invalid" do
+      re = RE2::Regexp.new('???', log_errors: false)
+
+      expect(re.match_many(["woo", "bar"])).to eq([false, false])
+    end
+
+    it "accepts strings that can be coerced to a String" do
+      re = RE2::Regexp.new('w(o+)')
+
+      expect(re.match_many([StringLike.new("woo")]).first.to_a).to eq(["woo", "oo"])
+    end
+
+    it "does not allow the strings to be mutated after matching" do
+      re = RE2::Regexp.new('w(o+)')
+      text = +"woo"
+      md = re.match_many([text]).first
+
+      text.replace("bar")
+
+      expect(md[1]).to eq("oo")
+    end
+
+    it "raises an error if not given an array" do
+      re = RE2::Regexp.new('w(o+)')
+
+      expect { re.match_many("woo") }.to raise_error(TypeError)
+    end
+
+    it "raises an error if any string cannot be coerced to a String" do
+      re = RE2::Regexp.new('w(o+)')
+
+      expect { re.match_many(["woo", 0]) }.to raise_error(TypeError)
+    end
+
+    it "raises an error if given a negative number of submatches" do
+      re = RE2::Regexp.new('w(o+)')
+
+      expect { re.match_many(["woo"], submatches: -1) }.to raise_error(ArgumentError, "number of matches should be >= 0")
+    end
+
+    it "raises an error if given an invalid anchor" do
+      re = RE2::Regexp.new('w(o+)')
+
+      expect { re.match_many(["woo"], anchor: :invalid) }.to raise_error(ArgumentError, /anchor should be one of/)
+    end
+
+    it "raises an error if given an invalid output" do
+      re = RE2::Regexp.new('w(o+)')
+
+      expect { re.match_many(["woo"], output: :invalid) }.to raise_error(ArgumentError, "output should be one of: :match_data, :offsets")
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.match_many(["woo"]) }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
+    end
+
+    it "can be run concurrently" do
+      re = RE2::Regexp.new('(\w+)\s(\w+)')
+
+      threads = 10.times.map do
+        Thread.new { re.match_many(["one two", "three"], submatches: 0) }
+      end
+
+      expect(threads.map(&:value)).to all(eq([true, false]))
+    end
+  end
+
+  describe "#match_many?" do
+    it "returns only true or false even if there are capturing groups" do
+      re = RE2::Regexp.new('My name is (\S+) (\S+)')
+
+      expect(re.match_many?(["My name is Alice Bloggs", "My age is 99"])).to eq([true, false])
+    end
+
+    it "supports anchoring the matches" do
+      re = RE2::Regexp.new('wo+')
+
+      expect(re.match_many?(["woo", "a woo", "woot"], anchor: :anchor_both)).to eq([true, false, false])
+    end
+
+    it "returns false for every string if the pattern is invalid" do
+      re = RE2::Regexp.new('???', log_errors: false)
+
+      expect(re.match_many?(["woo"])).to eq([false])
+    end
+
+    it "raises an error if any string cannot be coerced to a String" do
+      re = RE2::Regexp.new('wo+')
+
+      expect { re.match_many?([0]) }.to raise_error(TypeError)
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.match_many?(["woo"]) }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
+    end
+  end
+
+  describe "#parallel_match" do
+    it "returns the same results as #match_many in order", :aggregate_failures do
+      re = RE2::Regexp.new('(\w+)@(\w+)')
+      strings = Array.new(1_000) { |i| i.even? ? "user#{i}@example" : "user #{i}" }
+
+      expect(re.parallel_match(strings, threads: 4).map(&:to_a)).to eq(re.match_many(strings).map(&:to_a))
+      expect(re.parallel_match(strings, threads: 3, submatches: 0)).to eq(re.match_many(strings, submatches: 0))
+      expect(re.parallel_match(strings, threads: 7, output: :offsets)).to eq(re.match_many(strings, output: :offsets))
+    end
+
+    it "supports more threads than strings" do
+      re = RE2::Regexp.new('wo+')
+
+      expect(re.parallel_match(["woo", "bar"], threads: 16)).to eq([true, false])
+    end
+
+    it "supports anchoring the matches" do
+      re = RE2::Regexp.new('wo+')
+
+      expect(re.parallel_match(["woo", "a woo", "woot"], threads: 2, anchor: :anchor_both)).to eq([true, false, false])
+    end
+
+    it "returns an empty array if given no strings" do
+      re = RE2::Regexp.new('wo+')
+
+      expect(re.parallel_match([])).to eq([])
+    end
+
+    it "raises an error if given fewer than one thread" do
+      re = RE2::Regexp.new('wo+')
+
+      expect { re.parallel_match(["woo"], threads: 0) }.to raise_error(ArgumentError, "number of threads should be >= 1")
+    end
+
+    it "raises an error if any string cannot be coerced to a String" do
+      re = RE2::Regexp.new('wo+')
+
+      expect { re.parallel_match(["woo", 0]) }.to raise_error(TypeError)
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.parallel_match(["woo"]) }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
+    end
+
+    it "can be run concurrently" do
+      re = RE2::Regexp.new('(\w+)\s(\w+)')
+      strings = Array.new(100) { |i| i.even? ? "one two" : "three" }
+
+      threads = 10.times.map do
+        Thread.new { re.parallel_match(strings, threads: 4, submatches: 0) }
+      end
+
+      expect(threads.map(&:value)).to all(eq(Array.new(100) { |i| i.even? }))
+    end
+  end
+
+  describe "#partial_match?" do
+    it "returns only true or false even if there are capturing groups", :aggregate_failures do
+      re = RE2::Regexp.new('My name is (\S+) (\S+)')
+
+      expect(re.partial_match?("My name is Alice Bloggs")).to eq(true)
+      expect(re.partial_match?("My age is 99")).to eq(false)
+    end
+
+    it "supports matching against text containing null bytes", :aggregate_failures do
+      re = RE2::Regexp.new("a\0b")
+
+      expect(re.partial_match?("a\0b")).to eq(true)
+      expect(re.partial_match?("ab")).to eq(false)
+    end
+
+    it "returns false if the pattern is invalid" do
+      re = RE2::Regexp.new('???', log_errors: false)
+
+      expect(re.partial_match?("My name is Alice Bloggs")).to eq(false)
+    end
+
+    it "raises an exception if text cannot be coerced to a string" do
+      re = RE2::Regexp.new('My name is (\S+) (\S+)')
+
+      expect { re.partial_match?(0) }.to raise_error(TypeError)
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.partial_match?("test") }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
+    end
+
+    it "can be run concurrently" do
+      re = RE2::Regexp.new('(\d+)')
+
+      threads = 10.times.map do
+        Thread.new { re.partial_match?("alice 123") }
+      end
+
+      expect(threads.map(&:value)).to all(eq(true))
+    end
+  end
+
+  describe "#=~" do
+    it "returns only true or false even if there are capturing groups", :aggregate_failures do
+      re = RE2::Regexp.new('My name is (\S+) (\S+)')
+
+      expect(re =~ "My name is Alice Bloggs").to eq(true)
+      expect(re =~ "My age is 99").to eq(false)
+    end
+
+    it "supports matching against text containing null bytes", :aggregate_failures do
+      re = RE2::Regexp.new("a\0b")
+
+      expect(re =~ "a\0b").to eq(true)
+      expect(re =~ "ab").to eq(false)
+    end
+
+    it "returns false if the pattern is invalid" do
+      re = RE2::Regexp.new('???', log_errors: false)
+
+      expect(re =~ "My name is Alice Bloggs").to eq(false)
+    end
+
+    it "raises an exception if text cannot be coerced to a string" do
+      re = RE2::Regexp.new('My name is (\S+) (\S+)')
+
+      expect { re =~ 0 }.to raise_error(TypeError)
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate =~ "test" }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
+    end
+  end
+
+  describe "#===" do
+    it "returns only true or false even if there are capturing groups", :aggregate_failures do
+      re = RE2::Regexp.new('My name is (\S+) (\S+)')
+
+      expect(re === "My name is Alice Bloggs").to eq(true)
+      expect(re === "My age is 99").to eq(false)
+    end
+
+    it "returns false if the pattern is invalid" do
+      re = RE2::Regexp.new('???', log_errors: false)
+
+      expect(re === "My name is Alice Bloggs").to eq(false)
     end
 
     it "raises an exception if text cannot be coerced to a string" do
@@ -1048,6 +1794,13 @@ RSpec.describe RE2::Regexp do
       expect(RE2::Regexp.new('???', log_errors: false).named_capturing_groups).to be_empty
     end
 
+    it "returns a new hash each time" do
+      re = RE2::Regexp.new('(?P<bob>a)')
+      re.named_capturing_groups["rob"] = 2
+
+      expect(re.named_capturing_groups).to eq("bob" => 1)
+    end
+
     it "raises an error when called on an uninitialized object" do
       expect { described_class.allocate.named_capturing_groups }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
     end
@@ -1082,6 +1835,24 @@ RSpec.describe RE2::Regexp do
       expect(names.first.encoding).to eq(Encoding::ISO_8859_1)
     end
 
+    it "returns a new array each time" do
+      re = RE2::Regexp.new('(?P<bob>a)')
+      re.names << "rob"
+
+      expect(re.names).to eq(["bob"])
+    end
+
+    it "returns strings that can be mutated without changing later results" do
+      re = RE2::Regexp.new('(?P<bob>a)')
+      re.names.first << "by"
+
+      expect(re.names).to eq(["bob"])
+    end
+
+    it "returns names for a lazy regexp" do
+      expect(RE2::Regexp.new('(?P<bob>a)', lazy: true).names).to eq(["bob"])
+    end
+
     it "raises an error when called on an uninitialized object" do
       expect { described_class.allocate.names }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
     end
@@ -1125,11 +1896,410 @@ RSpec.describe RE2::Regexp do
       expect { r.scan(nil) }.to raise_error(TypeError)
     end
 
+    it "returns only the given number of submatches" do
+      r = RE2::Regexp.new('(\w)(\d)(\w)')
+
+      expect(r.scan("a1b c2d", submatches: 2).to_a).to eq([["a", "1"], ["c", "2"]])
+    end
+
+    it "returns no submatches if given zero submatches" do
+      r = RE2::Regexp.new('(\w)(\d)')
+
+      expect(r.scan("a1 c2", submatches: 0).to_a).to eq([[], []])
+    end
+
+    it "pads extra submatches with nil" do
+      r = RE2::Regexp.new('(\w)')
+
+      expect(r.scan("a b", submatches: 2).to_a).to eq([["a", nil], ["b", nil]])
+    end
+
+    it "returns only the named submatches in the given order" do
+      r = RE2::Regexp.new('(?P<key>\w+)=(?P<value>\w+)')
+
+      expect(r.scan("a=1 b=2", submatches: [:value, "key"]).to_a).to eq([["1", "a"], ["2", "b"]])
+    end
+
+    it "returns only the numbered submatches in the given order" do
+      r = RE2::Regexp.new('(\w)(\d)(\w)')
+
+      expect(r.scan("a1b c2d", submatches: [3, 1]).to_a).to eq([["b", "a"], ["d", "c"]])
+    end
+
+    it "returns byte offsets with output: :offsets" do
+      r = RE2::Regexp.new('(\w+)=(\d+)?')
+
+      expect(r.scan("£a=1 b=", output: :offsets).to_a).to eq([[[2, 3], [4, 5]], [[6, 7], nil]])
+    end
+
+    it "returns byte offsets of the selected submatches" do
+      r = RE2::Regexp.new('(?P<key>\w+)=(?P<value>\w+)')
+
+      expect(r.scan("a=1 bb=22", submatches: [:value], output: :offsets).to_a).to eq([[[2, 3]], [[7, 9]]])
+    end
+
+    it "returns byte offsets relative to the start of the text when scanning incrementally", :aggregate_failures do
+      scanner = RE2::Regexp.new('(\w+)').scan("foo bar", output: :offsets)
+
+      expect(scanner.scan).to eq([[0, 3]])
+      expect(scanner.scan).to eq([[4, 7]])
+    end
+
+    it "keeps the selection when the scanner is copied" do
+      scanner = RE2::Regexp.new('(\w)(\d)').scan("a1 b2", submatches: [2], output: :offsets)
+      scanner.scan
+
+      expect(scanner.dup.scan).to eq([[4, 5]])
+    end
+
+    it "raises an error if given a negative number of submatches" do
+      r = RE2::Regexp.new('(\w+)')
+
+      expect { r.scan("foo", submatches: -1) }.to raise_error(ArgumentError, "number of matches should be >= 0")
+    end
+
+    it "raises an error if given an unknown group name" do
+      r = RE2::Regexp.new('(?P<key>\w+)')
+
+      expect { r.scan("foo", submatches: [:missing]) }.to raise_error(ArgumentError, "no capturing group named missing")
+    end
+
+    it "raises an error if given an unknown group number" do
+      r = RE2::Regexp.new('(\w+)')
+
+      expect { r.scan("foo", submatches: [2]) }.to raise_error(ArgumentError, "no capturing group 2")
+    end
+
+    it "raises an error if given an invalid output" do
+      r = RE2::Regexp.new('(\w+)')
+
+      expect { r.scan("foo", output: :invalid) }.to raise_error(ArgumentError, "output should be one of: :strings, :offsets")
+    end
+
+    it "raises an error if given invalid submatches" do
+      r = RE2::Regexp.new('(\w+)')
+
+      expect { r.scan("foo", submatches: "1") }.to raise_error(TypeError)
+    end
+
     it "raises an error when called on an uninitialized object" do
       expect { described_class.allocate.scan("test") }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
     end
   end
 
+  describe "#scan_all" do
+    it "returns the submatches of every match" do
+      r = RE2::Regexp.new('(\w+)=(\d+)')
+
+      expect(r.scan_all("a=1 b=2 c")).to eq([["a", "1"], ["b", "2"]])
+    end
+
+    it "returns an empty array if there are no matches" do
+      r = RE2::Regexp.new('(\d+)')
+
+      expect(r.scan_all("foo")).to eq([])
+    end
+
+    it "returns the same matches as a scanner" do
+      r = RE2::Regexp.new('(\w)|(\d)?')
+      text = "ab 12 £"
+      scanner = r.scan(text)
+      matches = []
+      while (match = scanner.scan)
+        matches << match
+      end
+
+      expect(r.scan_all(text)).to eq(matches)
+    end
+
+    it "works even if the original input is mutated" do
+      r = RE2::Regexp.new('(\w+)')
+      text = +"foo bar"
+      matches = r.scan_all(text)
+      text.upcase!
+
+      expect(matches).to eq([["foo"], ["bar"]])
+    end
+
+    it "accepts input that can be coerced to a String" do
+      r = RE2::Regexp.new('(\w+)')
+
+      expect(r.scan_all(StringLike.new("foo bar"))).to eq([["foo"], ["bar"]])
+    end
+
+    it "returns only the selected submatches" do
+      r = RE2::Regexp.new('(?P<key>\w+)=(?P<value>\w+)')
+
+      expect(r.scan_all("a=1 b=2", submatches: [:value])).to eq([["1"], ["2"]])
+    end
+
+    it "returns byte offsets with output: :offsets" do
+      r = RE2::Regexp.new('(\w+)')
+
+      expect(r.scan_all("foo bar", output: :offsets)).to eq([[[0, 3]], [[4, 7]]])
+    end
+
+    it "raises a type error if given invalid input" do
+      r = RE2::Regexp.new('(\w+)')
+
+      expect { r.scan_all(nil) }.to raise_error(TypeError)
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.scan_all("test") }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
+    end
+
+    it "can be run concurrently" do
+      r = RE2::Regexp.new('(\w+)')
+
+      threads = 10.times.map do
+        Thread.new { r.scan_all("one two three") }
+      end
+
+      expect(threads.map(&:value)).to all(eq([["one"], ["two"], ["three"]]))
+    end
+  end
+
+  describe "#scan_offsets" do
+    it "returns a flat array of byte offsets for every match and its submatches" do
+      r = RE2::Regexp.new('(\w+)=(\d+)')
+
+      expect(r.scan_offsets("a=1 bb=22")).to eq([0, 3, 0, 1, 2, 3, 4, 9, 4, 6, 7, 9])
+    end
+
+    it "returns only the offsets of each overall match if given zero submatches" do
+      r = RE2::Regexp.new('(\w+)=(\d+)')
+
+      expect(r.scan_offsets("a=1 bb=22", submatches: 0)).to eq([0, 3, 4, 9])
+    end
+
+    it "returns nil for submatches that did not participate in a match" do
+      r = RE2::Regexp.new('(a)|(b)')
+
+      expect(r.scan_offsets("ab")).to eq([0, 1, 0, 1, nil, nil, 1, 2, nil, nil, 1, 2])
+    end
+
+    it "returns an empty array if there are no matches" do
+      r = RE2::Regexp.new('(\d+)')
+
+      expect(r.scan_offsets("foo")).to eq([])
+    end
+
+    it "finds the same matches as a scanner" do
+      r = RE2::Regexp.new('(\d*)')
+      text = "a12£€b"
+
+      substrings = r.scan_offsets(text, submatches: 0).each_slice(2).map { |b, e| text.byteslice(b...e) }
+
+      expect(substrings).to eq(r.scan(text).to_a.flatten)
+    end
+
+    it "packs the offsets into a binary string of 64-bit integers with pack: true" do
+      r = RE2::Regexp.new('(a)|(b)')
+
+      expect(r.scan_offsets("ab", pack: true).unpack("q*")).to eq([0, 1, 0, 1, -1, -1, 1, 2, -1, -1, 1, 2])
+    end
+
+    it "returns an empty array if the pattern is invalid" do
+      r = RE2::Regexp.new('???', log_errors: false)
+
+      expect(r.scan_offsets("foo")).to eq([])
+    end
+
+    it "raises an error if given a negative number of submatches" do
+      r = RE2::Regexp.new('(\w+)')
+
+      expect { r.scan_offsets("foo", submatches: -1) }.to raise_error(ArgumentError, "number of matches should be >= 0")
+    end
+
+    it "raises an error if given non-hash options" do
+      r = RE2::Regexp.new('(\w+)')
+
+      expect { r.scan_offsets("foo", 0) }.to raise_error(TypeError)
+    end
+
+    it "raises a type error if given invalid input" do
+      r = RE2::Regexp.new('(\w+)')
+
+      expect { r.scan_offsets(nil) }.to raise_error(TypeError)
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.scan_offsets("test") }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
+    end
+  end
+
+  describe "#scan_io" do
+    it "yields every match read from an IO" do
+      re = RE2::Regexp.new('\\d+')
+
+      expect(re.scan_io(StringIO.new("1 22 333")).to_a).to eq(["1", "22", "333"])
+    end
+
+    it "yields the submatches of patterns with capturing groups" do
+      re = RE2::Regexp.new('(\\w+)=(\\d+)?')
+
+      expect(re.scan_io(StringIO.new("a=1 b=")).to_a).to eq([["a", "1"], ["b", nil]])
+    end
+
+    it "yields byte offsets from the start of the input with output: :offsets" do
+      re = RE2::Regexp.new('\\d+')
+
+      expect(re.scan_io(StringIO.new("1 22 333"), output: :offsets).to_a).to eq([[0, 1], [2, 4], [5, 8]])
+    end
+
+    it "finds matches spanning chunks" do
+      re = RE2::Regexp.new('hello \\w+')
+      io = StringIO.new("say hello world and hello there")
+
+      expect(re.scan_io(io, chunk_size: 3, max_match_length: 16).to_a).to eq(["hello world", "hello there"])
+    end
+
+    it "finds the same matches as scanning the whole text at once" do
+      text = Array.new(2000) { |i| %w[foo bar_baz 123 4567 x][i % 5] }.join(" ")
+      re = RE2::Regexp.new('(\\w+)_(\\w+)|\\d+|\\bx\\b')
+      expected = re.scan_offsets(text, submatches: 0).each_slice(2).to_a
+
+      [1, 7, 64, 65_536].each do |chunk_size|
+        expect(re.scan_io(StringIO.new(text), chunk_size: chunk_size, max_match_length: 16, output: :offsets).to_a).to eq(expected)
+      end
+    end
+
+    it "handles empty matches like #scan" do
+      re = RE2::Regexp.new('b*')
+      expected = re.scan_offsets("abcbb", submatches: 0).each_slice(2).to_a
+
+      expect(re.scan_io(StringIO.new("abcbb"), chunk_size: 1, max_match_length: 2, output: :offsets).to_a).to eq(expected)
+    end
+
+    it "only matches anchors at the start and end of the input" do
+      re = RE2::Regexp.new('^a|a$')
+
+      expect(re.scan_io(StringIO.new("aaaa"), chunk_size: 1, max_match_length: 1, output: :offsets).to_a).to eq([[0, 1], [3, 4]])
+    end
+
+    it "does not match anchors where the previous match ended unlike #scan", :aggregate_failures do
+      re = RE2::Regexp.new('(?m)^a')
+
+      expect(re.scan_io(StringIO.new("aa\na"), output: :offsets).to_a).to eq([[0, 1], [3, 4]])
+      expect(re.scan_offsets("aa\na", submatches: 0).each_slice(2).to_a).to eq([[0, 1], [1, 2], [3, 4]])
+    end
+
+    it "returns the regexp when given a block" do
+      re = RE2::Regexp.new('a')
+
+      expect(re.scan_io(StringIO.new("a")) { |_| }).to equal(re)
+    end
+
+    it "returns strings in the regexp's encoding" do
+      re = RE2::Regexp.new('\\w+', utf8: false)
+
+      expect(re.scan_io(StringIO.new("abc")).first.encoding).to eq(Encoding::ISO_8859_1)
+    end
+
+    it "raises an error if given a chunk size that is not positive" do
+      re = RE2::Regexp.new('a')
+
+      expect { re.scan_io(StringIO.new("a"), chunk_size: 0).to_a }.to raise_error(ArgumentError, "chunk size should be > 0")
+    end
+
+    it "raises an error if given a maximum match length that is not positive" do
+      re = RE2::Regexp.new('a')
+
+      expect { re.scan_io(StringIO.new("a"), max_match_length: 0).to_a }.to raise_error(ArgumentError, "max match length should be > 0")
+    end
+
+    it "raises an error if given an invalid output" do
+      re = RE2::Regexp.new('a')
+
+      expect { re.scan_io(StringIO.new("a"), output: :foo).to_a }.to raise_error(ArgumentError, "output should be one of: :strings, :offsets")
+    end
+  end
+
+  describe "#search_file" do
+    it "returns the numbers of matching lines" do
+      with_file("foo\nbar\nfoobar\n") do |path|
+        expect(RE2::Regexp.new('foo').search_file(path)).to eq([1, 3])
+      end
+    end
+
+    it "matches anchors at the start and end of each line" do
+      with_file("a\n\nb\nab") do |path|
+        expect(RE2::Regexp.new('^$').search_file(path)).to eq([2])
+        expect(RE2::Regexp.new('^a|b$').search_file(path)).to eq([1, 3, 4])
+      end
+    end
+
+    it "returns the byte offsets of the first match on each line with output: :offsets" do
+      with_file("foo foo\nbar\nxfoo") do |path|
+        expect(RE2::Regexp.new('foo').search_file(path, output: :offsets)).to eq([[0, 3], [13, 16]])
+      end
+    end
+
+    it "returns the same lines in file order regardless of the number of threads" do
+      lines = Array.new(50_000) { |i| i % 7 == 0 ? "match #{i}" : "line #{i}" }
+
+      with_file(lines.join("\n")) do |path|
+        expected = lines.each_index.select { |i| i % 7 == 0 }.map { |i| i + 1 }
+
+        [1, 2, 3, 8].each do |threads|
+          expect(RE2::Regexp.new('^match').search_file(path, threads: threads)).to eq(expected)
+        end
+      end
+    end
+
+    it "returns an empty array for an empty file" do
+      with_file("") do |path|
+        expect(RE2::Regexp.new('').search_file(path)).to eq([])
+      end
+    end
+
+    it "accepts a Pathname" do
+      with_file("foo") do |path|
+        expect(RE2::Regexp.new('foo').search_file(Pathname(path))).to eq([1])
+      end
+    end
+
+    it "reads files that report no size" do
+      skip "/proc is not available" unless File.file?("/proc/self/status")
+
+      expect(RE2::Regexp.new('^Name:').search_file("/proc/self/status")).to eq([1])
+    end
+
+    it "raises an error without waiting for a writer if given a FIFO" do
+      skip "FIFOs are not supported" unless File.respond_to?(:mkfifo)
+
+      Dir.mktmpdir do |dir|
+        path = File.join(dir, "fifo")
+        File.mkfifo(path)
+
+        expect { RE2::Regexp.new('foo').search_file(path) }.to raise_error(Errno::EINVAL)
+      end
+    end
+
+    it "raises an error if given a directory" do
+      Dir.mktmpdir do |dir|
+        expect { RE2::Regexp.new('foo').search_file(dir) }.to raise_error(SystemCallError)
+      end
+    end
+
+    it "raises an error if the file cannot be read" do
+      expect { RE2::Regexp.new('foo').search_file("/nonexistent/re2") }.to raise_error(Errno::ENOENT)
+    end
+
+    it "raises an error if given fewer than 1 thread" do
+      with_file("foo") do |path|
+        expect { RE2::Regexp.new('foo').search_file(path, threads: 0) }.to raise_error(ArgumentError, "number of threads should be >= 1")
+      end
+    end
+
+    it "raises an error if given an invalid output" do
+      with_file("foo") do |path|
+        expect { RE2::Regexp.new('foo').search_file(path, output: :foo) }.to raise_error(ArgumentError, "output should be one of: :lines, :offsets")
+      end
+    end
+  end
+
   describe "#partial_match" do
     it "matches the pattern anywhere within the given text" do
       r = RE2::Regexp.new('f(o+)')
@@ -1248,4 +2418,69 @@ RSpec.describe RE2::Regexp do
       expect { described_class.allocate.full_match('test') }.to raise_error(TypeError, /uninitialized RE2::Regexp/)
     end
   end
+
+  describe "literal patterns" do
+    [
+      ["needle", "[n]eedle", {}],
+      ["(?i)needle", "(?i)[n]eedle", {}],
+      ["needle", "[n]eedle", { case_sensitive: false }],
+      ["^needle", "^[n]eedle", {}],
+      ["needle$", "[n]eedle$", {}],
+      ["^needle$", "^[n]eedle$", {}],
+      ["a.b", "[a][.]b", { literal: true }],
+      ["n\\.e\\x00", "[n]\\.e\\x00", {}],
+      ["needle$", "[n]eedle$", { posix_syntax: true }],
+      ["needle$", "[n]eedle$", { posix_syntax: true, one_line: true }],
+      ["needle", "[n]eedle", { latin1: true }]
+    ].each do |pattern, equivalent, options|
+      context "with #{pattern.inspect} and #{options.inspect}" do
+        let(:fast) { described_class.new(pattern, options) }
+        let(:slow) { described_class.new(equivalent, options.except(:literal)) }
+        let(:texts) do
+          [
+            "", "needle", "NeEdLe", "a needle in a haystack\nneedle",
+            "#{"x" * 100}needle#{"n" * 100}", "needle\n", "a.b a+b", "n.e\0 n.e",
+            "#{"hay needl " * 20}needle"
+          ]
+        end
+
+        it "matches the same way as the equivalent regular expression" do
+          texts.each do |text|
+            startpos = [2, text.bytesize].min
+
+            expect(fast.match?(text)).to eq(slow.match?(text))
+            expect(fast.full_match?(text)).to eq(slow.full_match?(text))
+            expect(fast.match(text, submatches: 1)&.to_a).to eq(slow.match(text, submatches: 1)&.to_a)
+            expect(fast.match(text, endpos: 20, submatches: 1)&.to_a).to eq(slow.match(text, endpos: 20, submatches: 1)&.to_a)
+            expect(fast.match(text, startpos: startpos, anchor: :anchor_start, submatches: 1)&.to_a).to eq(slow.match(text, startpos: startpos, anchor: :anchor_start, submatches: 1)&.to_a)
+          end
+        end
+
+        it "scans the same way as the equivalent regular expression" do
+          texts.each do |text|
+            expect(fast.scan(text).to_a).to eq(slow.scan(text).to_a)
+          end
+        end
+
+        it "replaces the same way as the equivalent regular expression" do
+          texts.each do |text|
+            expect(RE2.global_replace(text, fast, "<\\0>")).to eq(RE2.global_replace(text, slow, "<\\0>"))
+            expect(RE2.replace(text, fast, "-")).to eq(RE2.replace(text, slow, "-"))
+          end
+        end
+      end
+    end
+
+    it "matches empty patterns" do
+      re = described_class.new("")
+
+      expect(re.scan("ab").to_a).to eq([[], [], []])
+    end
+
+    it "does not treat patterns with metacharacters as literals" do
+      re = described_class.new("ne+dle")
+
+      expect(re.match?("neeedle")).to be(true)
+    end
+  end
 end
@@ -0,0 +1,135 @@
+# frozen_string_literal: true
+
+RSpec.describe RE2::Replacer do
+  describe "#initialize" do
+    it "returns a frozen instance given rules" do
+      replacer = RE2::Replacer.new([["a", "b"]])
+
+      expect(replacer).to be_frozen
+    end
+
+    it "raises an error if a rule is not a pair" do
+      expect { RE2::Replacer.new([["a", "b", "c"]]) }.to raise_error(ArgumentError, "rules should be pairs of patterns and rewrites")
+    end
+
+    it "raises an error if given an invalid pattern" do
+      expect { RE2::Replacer.new([["a", "b"], ["(c", "d"]], log_errors: false) }.to raise_error(ArgumentError, "rule 1 rejected by RE2::Replacer: missing ): (c")
+    end
+
+    it "raises an error if a rewrite refers to a missing submatch" do
+      expect { RE2::Replacer.new([["(a)", "\\2"]]) }.to raise_error(ArgumentError, "rule 0 rejected by RE2::Replacer: Rewrite schema requests 2 matches, but the regexp only has 1 parenthesized subexpressions.")
+    end
+
+    it "raises an error if given rules that are not an array" do
+      expect { RE2::Replacer.new("a") }.to raise_error(TypeError)
+    end
+
+    it "raises an error if given a pattern that can't be coerced to a String" do
+      expect { RE2::Replacer.new([[0, "a"]]) }.to raise_error(TypeError)
+    end
+
+    it "cannot be copied" do
+      replacer = RE2::Replacer.new([["a", "b"]])
+
+      expect { replacer.dup }.to raise_error(TypeError, "cannot copy RE2::Replacer")
+    end
+  end
+
+  describe "#replace" do
+    it "replaces matches of every pattern" do
+      replacer = RE2::Replacer.new([["cat", "dog"], ["dog", "cat"]])
+
+      expect(replacer.replace("cat chases dog")).to eq("dog chases cat")
+    end
+
+    it "never rescans replaced text" do
+      replacer = RE2::Replacer.new([["a", "b"], ["b", "c"]])
+
+      expect(replacer.replace("ab")).to eq("bc")
+    end
+
+    it "prefers the leftmost match" do
+      replacer = RE2::Replacer.new([["bc", "X"], ["ab", "Y"]])
+
+      expect(replacer.replace("abc")).to eq("Yc")
+    end
+
+    it "prefers the pattern given first when matches start at the same position" do
+      expect(RE2::Replacer.new([["a", "b"], ["aa", "c"]]).replace("aaa")).to eq("bbb")
+      expect(RE2::Replacer.new([["aa", "c"], ["a", "b"]]).replace("aaa")).to eq("cb")
+    end
+
+    it "supports submatches in rewrites" do
+      replacer = RE2::Replacer.new([["(\\w+)@(\\w+)\\.com", "\\2:\\1"], ["o", "0"]])
+
+      expect(replacer.replace("bob@example.com or 42")).to eq("example:bob 0r 42")
+    end
+
+    it "handles empty matches like RE2.global_replace", :aggregate_failures do
+      expect(RE2::Replacer.new([["", "-"]]).replace("abc")).to eq(RE2.global_replace("abc", "", "-"))
+      expect(RE2::Replacer.new([["b*", "-"]]).replace("abc")).to eq(RE2.global_replace("abc", "b*", "-"))
+      expect(RE2::Replacer.new([["", "-"]]).replace("ünï")).to eq(RE2.global_replace("ünï", "", "-"))
+    end
+
+    it "lets a later pattern match where an earlier one would match empty text at the end of its last match", :aggregate_failures do
+      rules = [["a*", "X"], ["b", "Y"]]
+      expected = rules.reduce("ab") { |memo, (pattern, rewrite)| RE2.global_replace(memo, pattern, rewrite) }
+
+      expect(RE2.global_replace_many("ab", rules)).to eq("XYX")
+      expect(RE2.global_replace_many("ab", rules)).to eq(expected)
+    end
+
+    it "gives the same result as applying each rule in turn when they do not overlap" do
+      rules = 50.times.map { |i| ["word#{i}\\b", "<#{i}>"] }
+      text = 100.times.map { |i| "word#{i % 60}" }.join(" ")
+      replacer = RE2::Replacer.new(rules)
+
+      expected = rules.reduce(text) { |memo, (pattern, rewrite)| RE2.global_replace(memo, pattern, rewrite) }
+
+      expect(replacer.replace(text)).to eq(expected)
+    end
+
+    it "returns the text unchanged if nothing matches" do
+      replacer = RE2::Replacer.new([["x", "y"]])
+
+      expect(replacer.replace("abc")).to eq("abc")
+    end
+
+    it "returns UTF-8 strings by default" do
+      replacer = RE2::Replacer.new([["a", "b"]])
+
+      expect(replacer.replace("abc").encoding).to eq(Encoding::UTF_8)
+    end
+
+    it "returns ISO-8859-1 strings if the utf8 option is false" do
+      replacer = RE2::Replacer.new([["a", "b"]], utf8: false)
+
+      expect(replacer.replace("abc").encoding).to eq(Encoding::ISO_8859_1)
+    end
+
+    it "raises an error if given text that can't be coerced to a String" do
+      replacer = RE2::Replacer.new([["a", "b"]])
+
+      expect { replacer.replace(0) }.to raise_error(TypeError)
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.replace("foo") }.to raise_error(TypeError, "uninitialized RE2::Replacer")
+    end
+
+    it "can be shared between Ractors" do
+      skip "Ractors are not supported" unless defined?(Ractor) && Ractor.respond_to?(:make_shareable)
+
+      expect(Ractor.shareable?(RE2::Replacer.new([["a", "b"]]))).to be(true)
+    end
+  end
+
+  describe "#size" do
+    it "returns the number of rules" do
+      replacer = RE2::Replacer.new([["a", "b"], ["c", "d"]])
+
+      expect(replacer.size).to eq(2)
+      expect(replacer.length).to eq(2)
+    end
+  end
+end
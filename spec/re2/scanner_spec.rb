@@ -330,9 +330,104 @@ RSpec.describe RE2::Scanner do
       expect(scanner.scan).to eq(["It"])
     end
 
+    it "returns new submatches for each match even though buffers are reused", :aggregate_failures do
+      scanner = RE2::Regexp.new('(\w)(\d)?').scan("a1 b c3")
+
+      first = scanner.scan
+      second = scanner.scan
+      third = scanner.scan
+
+      expect(first).to eq(["a", "1"])
+      expect(second).to eq(["b", nil])
+      expect(third).to eq(["c", "3"])
+    end
+
     it "raises an error when called on an uninitialized object" do
       expect { described_class.allocate.scan }.to raise_error(TypeError, /uninitialized RE2::Scanner/)
     end
+
+    it "can be run concurrently with separate scanners" do
+      r = RE2::Regexp.new('(\w+)')
+      text = "one two three " * 100
+
+      threads = 10.times.map do
+        Thread.new { r.scan(text).to_a.size }
+      end
+
+      expect(threads.map(&:value)).to all(eq(300))
+    end
+  end
+
+  describe "#to_a" do
+    it "returns the submatches of every match" do
+      scanner = RE2::Regexp.new('(\w+)=(\d+)?').scan("a=1 b= c=3")
+
+      expect(scanner.to_a).to eq([["a", "1"], ["b", nil], ["c", "3"]])
+    end
+
+    it "returns the remaining matches after scanning" do
+      scanner = RE2::Regexp.new('(\w+)').scan("foo bar baz")
+      scanner.scan
+
+      expect(scanner.to_a).to eq([["bar"], ["baz"]])
+    end
+
+    it "consumes the input", :aggregate_failures do
+      scanner = RE2::Regexp.new('(\w+)').scan("foo bar")
+      scanner.to_a
+
+      expect(scanner.scan).to be_nil
+      expect(scanner.to_a).to eq([])
+    end
+
+    it "returns the matches again after rewinding" do
+      scanner = RE2::Regexp.new('(\w+)').scan("foo bar")
+      scanner.to_a
+      scanner.rewind
+
+      expect(scanner.to_a).to eq([["foo"], ["bar"]])
+    end
+
+    it "returns an empty array for every match if there are no capturing groups" do
+      scanner = RE2::Regexp.new('\w+').scan("foo bar")
+
+      expect(scanner.to_a).to eq([[], []])
+    end
+
+    it "returns the same matches as scanning one at a time with zero-width matches" do
+      r = RE2::Regexp.new('(\d*)')
+      text = "a12£€𝄞b"
+      scanner = r.scan(text)
+      matches = []
+      while (match = scanner.scan)
+        matches << match
+      end
+
+      expect(r.scan(text).to_a).to eq(matches)
+    end
+
+    it "advances by single bytes with zero-width matches on Latin-1 input" do
+      r = RE2::Regexp.new('()', utf8: false)
+      scanner = r.scan("\xC3\xA9".b)
+
+      expect(scanner.to_a).to eq([[""], [""], [""]])
+    end
+
+    it "returns ISO-8859-1 matches if the pattern is not UTF-8" do
+      scanner = RE2::Regexp.new('(\w+)', utf8: false).scan("Foo bar")
+
+      expect(scanner.to_a.flatten.map(&:encoding)).to all(eq(Encoding::ISO_8859_1))
+    end
+
+    it "returns an empty array if the regexp is invalid" do
+      scanner = RE2::Regexp.new('???', log_errors: false).scan("foo")
+
+      expect(scanner.to_a).to eq([])
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.to_a }.to raise_error(TypeError, /uninitialized RE2::Scanner/)
+    end
   end
 
   it "is enumerable" do
@@ -116,6 +116,82 @@ RSpec.describe RE2::Set do
     end
   end
 
+  describe "#add_all" do
+    it "adds every pattern, returning their indexes" do
+      set = RE2::Set.new
+
+      expect(set.add_all(["abc", "def", "ghi"])).to eq([[0, nil], [1, nil], [2, nil]])
+    end
+
+    it "continues numbering from patterns already added" do
+      set = RE2::Set.new
+      set.add("abc")
+
+      expect(set.add_all(["def"])).to eq([[1, nil]])
+    end
+
+    it "returns errors for rejected patterns without adding them" do
+      set = RE2::Set.new(:unanchored, log_errors: false)
+
+      expect(set.add_all(["abc", "???", "def"])).to eq([[0, nil], [nil, "no argument for repetition operator: ??"], [1, nil]])
+    end
+
+    it "can match the added patterns once compiled" do
+      set = RE2::Set.new
+      set.add_all(["abc", "def"])
+      set.compile
+
+      expect(set.match("abcdef", exception: false)).to eq([0, 1])
+    end
+
+    it "returns an empty array if given no patterns" do
+      set = RE2::Set.new
+
+      expect(set.add_all([])).to eq([])
+    end
+
+    it "accepts patterns that can be coerced to Strings" do
+      set = RE2::Set.new
+
+      expect(set.add_all([StringLike.new("abc")])).to eq([[0, nil]])
+    end
+
+    it "can still be used if adding patterns is interrupted" do
+      set = RE2::Set.new
+      patterns = 20_000.times.map { |i| "p#{i}[a-z]+x" }
+
+      thread = Thread.new do
+        Thread.current.report_on_exception = false
+        set.add_all(patterns)
+      end
+      sleep 0.005
+      thread.raise(Interrupt)
+
+      expect { thread.join }.to raise_error(Interrupt)
+      index = set.add("zz")
+      set.compile
+      expect(set.match("zz")).to eq([index])
+    end
+
+    it "raises an error if not given an array" do
+      set = RE2::Set.new
+
+      expect { set.add_all("abc") }.to raise_error(TypeError)
+    end
+
+    it "raises a FrozenError if called after #compile" do
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+
+      expect { set.add_all(["def"]) }.to raise_error(FrozenError)
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.add_all(["foo"]) }.to raise_error(TypeError, /uninitialized RE2::Set/)
+    end
+  end
+
   describe "#compile" do
     it "compiles the set without error" do
       set = RE2::Set.new
@@ -134,6 +210,22 @@ RSpec.describe RE2::Set do
       expect(set).to be_frozen
     end
 
+    it "can still be used if compiling is interrupted" do
+      set = RE2::Set.new
+      set.add_all(3000.times.map { |i| "p#{i}[a-z]{2,8}\\d+x#{i}" })
+
+      thread = Thread.new do
+        Thread.current.report_on_exception = false
+        set.compile
+      end
+      sleep 0.005
+      thread.raise(Interrupt)
+
+      expect { thread.join }.to raise_error(Interrupt)
+      set.compile unless set.frozen?
+      expect(set.match("p12ab3x12")).to eq([12])
+    end
+
     it "is not frozen before compilation" do
       set = RE2::Set.new
       set.add("abc")
@@ -141,6 +233,46 @@ RSpec.describe RE2::Set do
       expect(set).to_not be_frozen
     end
 
+    it "is shareable between Ractors once compiled" do
+      skip "Ractors are not supported" unless defined?(Ractor) && Ractor.respond_to?(:make_shareable)
+
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+
+      expect(Ractor.shareable?(set)).to be(true)
+    end
+
+    it "can be used by several Ractors at once once compiled" do
+      skip "Ractors are not supported" unless defined?(Ractor) && Ractor.respond_to?(:make_shareable)
+
+      set = RE2::Set.new
+      set.add("abc")
+      set.add("(d)(e)f")
+      set.compile
+
+      experimental = Warning[:experimental]
+      Warning[:experimental] = false
+      ractors = Array.new(2) do
+        Ractor.new(set) do |shared|
+          [shared.match("abcdef"), shared.match("def", output: :match_data).map { |index, md| [index, md[1]] }]
+        end
+      end
+
+      expect(ractors.map(&:take)).to eq([[[0, 1], [[1, "d"]]]] * 2)
+    ensure
+      Warning[:experimental] = experimental unless experimental.nil?
+    end
+
+    it "is not shareable between Ractors before compilation" do
+      skip "Ractors are not supported" unless defined?(Ractor) && Ractor.respond_to?(:make_shareable)
+
+      set = RE2::Set.new
+      set.add("abc")
+
+      expect(Ractor.shareable?(set)).to be(false)
+    end
+
     it "cannot be re-initialized after compilation" do
       set = RE2::Set.new
       set.add("abc")
@@ -268,6 +400,359 @@ RSpec.describe RE2::Set do
 
       expect(threads.map(&:value)).to all(eq([0, 1, 2]))
     end
+
+    it "returns the match data of each matching pattern with output: :match_data", :aggregate_failures do
+      set = RE2::Set.new
+      set.add("(\\w+)@example\\.com")
+      set.add("\\d+")
+      set.add("(?P<word>xyz)")
+      set.compile
+
+      result = set.match("bob@example.com 42", exception: false, output: :match_data)
+
+      expect(result.map(&:first)).to eq([0, 1])
+      expect(result[0][1]).to be_a(RE2::MatchData)
+      expect(result[0][1][0]).to eq("bob@example.com")
+      expect(result[0][1][1]).to eq("bob")
+      expect(result[0][1].begin(0)).to eq(0)
+      expect(result[1][1][0]).to eq("42")
+      expect(result[1][1].begin(0)).to eq(16)
+    end
+
+    it "returns named submatches with output: :match_data" do
+      set = RE2::Set.new
+      set.add("(?P<word>xyz)")
+      set.compile
+
+      result = set.match("axyz", exception: false, output: :match_data)
+
+      expect(result[0][1][:word]).to eq("xyz")
+    end
+
+    it "reuses the same frozen regexp for each pattern with output: :match_data", :aggregate_failures do
+      set = RE2::Set.new(:unanchored, case_sensitive: false)
+      set.add("abc")
+      set.compile
+
+      first = set.match("ABC", exception: false, output: :match_data)[0][1].regexp
+      second = set.match("xabc", exception: false, output: :match_data)[0][1].regexp
+
+      expect(first).to be_a(RE2::Regexp)
+      expect(first.source).to eq("abc")
+      expect(first.case_sensitive?).to be(false)
+      expect(first).to be_frozen
+      expect(second).to equal(first)
+    end
+
+    it "honours the set's anchor with output: :match_data" do
+      set = RE2::Set.new(:anchor_start)
+      set.add("abc")
+      set.compile
+
+      expect(set.match("abcabc", exception: false, output: :match_data)[0][1].begin(0)).to eq(0)
+    end
+
+    it "returns an empty array if there is no match with output: :match_data" do
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+
+      expect(set.match("def", exception: false, output: :match_data)).to eq([])
+    end
+
+    it "raises an error if given an invalid output" do
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+
+      expect { set.match("abc", output: :foo) }.to raise_error(ArgumentError, "output should be one of: :indices, :match_data")
+    end
+
+    it "can return match data concurrently" do
+      set = RE2::Set.new
+      set.add("a(b)c")
+      set.compile
+
+      threads = 10.times.map do
+        Thread.new { set.match("abc", exception: false, output: :match_data)[0][1][1] }
+      end
+
+      expect(threads.map(&:value)).to all(eq("b"))
+    end
+  end
+
+  describe "#search_file" do
+    it "returns the numbers of matching lines with the indices of matching patterns" do
+      set = RE2::Set.new
+      set.add("foo")
+      set.add("bar")
+      set.compile
+
+      with_file("foo\nbaz\nfoobar\n") do |path|
+        result = set.search_file(path).map { |line, indices| [line, indices.sort] }
+
+        expect(result).to eq([[1, [0]], [3, [0, 1]]])
+      end
+    end
+
+    it "returns the byte offset of each matching line with output: :offsets" do
+      set = RE2::Set.new
+      set.add("bar")
+      set.compile
+
+      with_file("foo\nbar\nbar") do |path|
+        expect(set.search_file(path, output: :offsets)).to eq([[4, [0]], [8, [0]]])
+      end
+    end
+
+    it "returns the same lines in file order regardless of the number of threads" do
+      set = RE2::Set.new
+      set.add("^match")
+      set.compile
+      lines = Array.new(50_000) { |i| i % 7 == 0 ? "match #{i}" : "line #{i}" }
+
+      with_file(lines.join("\n")) do |path|
+        expected = lines.each_index.select { |i| i % 7 == 0 }.map { |i| [i + 1, [0]] }
+
+        [1, 3, 8].each do |threads|
+          expect(set.search_file(path, threads: threads)).to eq(expected)
+        end
+      end
+    end
+
+    it "raises an error if called before compile" do
+      set = RE2::Set.new
+      set.add("foo")
+
+      with_file("foo") do |path|
+        expect { set.search_file(path) }.to raise_error(RE2::Set::MatchError, "#match must not be called before #compile")
+      end
+    end
+
+    it "raises an error if the file cannot be read" do
+      set = RE2::Set.new
+      set.add("foo")
+      set.compile
+
+      expect { set.search_file("/nonexistent/re2") }.to raise_error(Errno::ENOENT)
+    end
+  end
+
+  describe "#match_many" do
+    it "returns the indexes of matching regexps for each string in order" do
+      set = RE2::Set.new
+      set.add("abc")
+      set.add("def")
+      set.compile
+
+      expect(set.match_many(["abcdef", "xyz", "def"], exception: false)).to eq([[0, 1], [], [1]])
+    end
+
+    it "returns the same results as #match" do
+      set = RE2::Set.new
+      set.add('\d{3}')
+      set.add("[aeiou]{2}")
+      set.compile
+      strings = Array.new(100) { |i| "item #{i} #{"ea" if i.even?}" }
+
+      expect(set.match_many(strings, exception: false)).to eq(strings.map { |s| set.match(s, exception: false) })
+    end
+
+    it "returns flat offsets and indexes with output: :flat" do
+      set = RE2::Set.new
+      set.add("abc")
+      set.add("def")
+      set.compile
+
+      expect(set.match_many(["abcdef", "xyz", "def"], output: :flat, exception: false)).to eq([[0, 2, 2, 3], [0, 1, 1]])
+    end
+
+    it "returns flat results matching #match_many's arrays" do
+      set = RE2::Set.new
+      set.add('\d{3}')
+      set.add("[aeiou]{2}")
+      set.compile
+      strings = Array.new(100) { |i| "item #{i} #{"ea" if i.even?}" }
+
+      offsets, indices = set.match_many(strings, output: :flat, exception: false)
+      arrays = strings.each_index.map { |i| indices[offsets[i]...offsets[i + 1]] }
+
+      expect(arrays).to eq(set.match_many(strings, exception: false))
+    end
+
+    it "returns an empty array if given no strings" do
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+
+      expect(set.match_many([], exception: false)).to eq([])
+    end
+
+    it "returns a single offset if given no strings with output: :flat" do
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+
+      expect(set.match_many([], output: :flat, exception: false)).to eq([[0], []])
+    end
+
+    it "returns an empty array for each string if there is no match when :exception is true" do
+      skip "Underlying RE2::Set::Match does not output error information" unless RE2::Set.match_raises_errors?
+
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+
+      expect(set.match_many(["def", "ghi"])).to eq([[], []])
+    end
+
+    it "raises an error if called before #compile by default" do
+      skip "Underlying RE2::Set::Match does not output error information" unless RE2::Set.match_raises_errors?
+
+      set = RE2::Set.new(:unanchored, log_errors: false)
+
+      silence_stderr do
+        expect { set.match_many([""]) }.to raise_error(RE2::Set::MatchError)
+      end
+    end
+
+    it "returns empty arrays if called before #compile when :exception is false" do
+      set = RE2::Set.new(:unanchored, log_errors: false)
+
+      silence_stderr do
+        expect(set.match_many(["", "abc"], exception: false)).to eq([[], []])
+      end
+    end
+
+    it "raises an error if :exception is true and RE2 does not support it" do
+      skip "Underlying RE2::Set::Match outputs error information" if RE2::Set.match_raises_errors?
+
+      set = RE2::Set.new(:unanchored, log_errors: false)
+
+      expect { set.match_many([""], exception: true) }.to raise_error(RE2::Set::UnsupportedError)
+    end
+
+    it "raises an error if given an invalid output" do
+      set = RE2::Set.new
+      set.compile
+
+      expect { set.match_many([""], output: :invalid, exception: false) }.to raise_error(ArgumentError, "output should be one of: :arrays, :flat")
+    end
+
+    it "raises an error if given non-hash options" do
+      set = RE2::Set.new
+
+      expect { set.match_many([""], 0) }.to raise_error(TypeError)
+    end
+
+    it "accepts strings that can be coerced to a String" do
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+
+      expect(set.match_many([StringLike.new("abcdef")], exception: false)).to eq([[0]])
+    end
+
+    it "raises an error if any string cannot be coerced to a String" do
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+
+      expect { set.match_many(["abc", 0], exception: false) }.to raise_error(TypeError)
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.match_many(["foo"]) }.to raise_error(TypeError, /uninitialized RE2::Set/)
+    end
+
+    it "can be run concurrently" do
+      set = RE2::Set.new
+      set.add("abc")
+      set.add("def")
+      set.compile
+
+      threads = 10.times.map do
+        Thread.new { set.match_many(["abcdef", "xyz"], exception: false) }
+      end
+
+      expect(threads.map(&:value)).to all(eq([[0, 1], []]))
+    end
+  end
+
+  describe "#parallel_match" do
+    it "returns the indexes of matching regexps for each string in order" do
+      set = RE2::Set.new
+      set.add("abc")
+      set.add("def")
+      set.compile
+
+      expect(set.parallel_match(["abcdef", "abc", "xyz", "def"], threads: 3, exception: false)).to eq([[0, 1], [0], [], [1]])
+    end
+
+    it "returns the same results as #match for large batches" do
+      set = RE2::Set.new
+      set.add('\d{3}')
+      set.add("[aeiou]{2}")
+      set.compile
+      strings = Array.new(1_000) { |i| "item #{i} #{"ea" if i.even?}" }
+
+      expect(set.parallel_match(strings, threads: 4, exception: false)).to eq(strings.map { |s| set.match(s, exception: false) })
+    end
+
+    it "returns the same flat results as #match_many with output: :flat" do
+      set = RE2::Set.new
+      set.add('\d{3}')
+      set.add("[aeiou]{2}")
+      set.compile
+      strings = Array.new(1_000) { |i| "item #{i} #{"ea" if i.even?}" }
+
+      expect(set.parallel_match(strings, threads: 3, output: :flat, exception: false)).to eq(set.match_many(strings, output: :flat, exception: false))
+    end
+
+    it "returns an empty array if given no strings" do
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+
+      expect(set.parallel_match([], exception: false)).to eq([])
+    end
+
+    it "raises an error if called before #compile by default" do
+      skip "Underlying RE2::Set::Match does not output error information" unless RE2::Set.match_raises_errors?
+
+      set = RE2::Set.new(:unanchored, log_errors: false)
+
+      silence_stderr do
+        expect { set.parallel_match([""]) }.to raise_error(RE2::Set::MatchError)
+      end
+    end
+
+    it "returns empty arrays if called before #compile when :exception is false" do
+      set = RE2::Set.new(:unanchored, log_errors: false)
+
+      silence_stderr do
+        expect(set.parallel_match(["", "abc"], exception: false)).to eq([[], []])
+      end
+    end
+
+    it "raises an error if given fewer than one thread" do
+      set = RE2::Set.new
+      set.compile
+
+      expect { set.parallel_match([""], threads: 0, exception: false) }.to raise_error(ArgumentError, "number of threads should be >= 1")
+    end
+
+    it "raises an error if any string cannot be coerced to a String" do
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+
+      expect { set.parallel_match(["abc", 0], exception: false) }.to raise_error(TypeError)
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.parallel_match(["foo"]) }.to raise_error(TypeError, /uninitialized RE2::Set/)
+    end
   end
 
   describe "#size" do
@@ -302,6 +787,124 @@ RSpec.describe RE2::Set do
     end
   end
 
+  describe "#warm!" do
+    it "reports the samples matched", :aggregate_failures do
+      set = RE2::Set.new
+      set.add("abc")
+      set.add("def")
+      set.compile
+
+      result = set.warm!(["abcdef", "xyz"])
+
+      expect(result[:samples]).to eq(2)
+      expect(result[:bytes]).to eq(9)
+      expect(result[:matches]).to eq(1)
+      expect(result[:cold_nanoseconds]).to be_a(Integer)
+      expect(result[:warm_nanoseconds]).to be_a(Integer)
+      expect(result[:out_of_memory]).to eq(false)
+    end
+
+    it "raises an error if the set has not been compiled" do
+      set = RE2::Set.new
+      set.add("abc")
+
+      expect { set.warm!(["abc"]) }.to raise_error(RE2::Set::MatchError, "#warm! must not be called before #compile")
+    end
+
+    it "raises an error if given something other than an array" do
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+
+      expect { set.warm!("abc") }.to raise_error(TypeError)
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.warm!([]) }.to raise_error(TypeError, /uninitialized RE2::Set/)
+    end
+  end
+
+  describe "#memory_stats" do
+    it "counts the patterns added to the set", :aggregate_failures do
+      set = RE2::Set.new(:unanchored, max_mem: 1024 * 1024)
+      set.add("abc")
+      set.add_all(["de", "f"])
+
+      stats = set.memory_stats
+
+      expect(stats[:patterns]).to eq(3)
+      expect(stats[:pattern_bytes]).to eq(6)
+      expect(stats[:compiled]).to eq(false)
+      expect(stats[:max_mem]).to eq(1024 * 1024)
+    end
+
+    it "does not count rejected patterns" do
+      set = RE2::Set.new(:unanchored, log_errors: false)
+      set.add_all(["abc", "???"])
+
+      expect(set.memory_stats[:patterns]).to eq(1)
+    end
+
+    it "estimates more memory once compiled", :aggregate_failures do
+      set = RE2::Set.new
+      set.add("abc")
+      before = set.memory_stats[:estimated_bytes]
+      set.compile
+
+      expect(set.memory_stats[:compiled]).to eq(true)
+      expect(set.memory_stats[:estimated_bytes]).to be > before
+    end
+
+    it "reports the estimate to ObjectSpace" do
+      require "objspace"
+
+      set = RE2::Set.new
+      set.add("abc")
+
+      expect(ObjectSpace.memsize_of(set)).to be >= set.memory_stats[:estimated_bytes]
+    end
+
+    it "raises an error when called on an uninitialized object" do
+      expect { described_class.allocate.memory_stats }.to raise_error(TypeError, /uninitialized RE2::Set/)
+    end
+  end
+
+  describe "#instrument!" do
+    it "returns the set" do
+      set = RE2::Set.new
+
+      expect(set.instrument!).to equal(set)
+    end
+
+    it "instruments the set" do
+      expect(RE2::Set.new.instrument!).to be_instrumented
+    end
+  end
+
+  describe "#stats" do
+    it "returns nil if not instrumented" do
+      expect(RE2::Set.new.stats).to be_nil
+    end
+
+    it "counts matches against the set", :aggregate_failures do
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+      set.instrument!
+
+      set.match("abcdef", exception: false)
+      set.match("def", exception: false)
+
+      stats = set.stats
+
+      expect(stats[:calls]).to eq(2)
+      expect(stats[:bytes]).to eq(9)
+      expect(stats[:hits]).to eq(1)
+      expect(stats[:misses]).to eq(1)
+      expect(stats[:histogram].sum).to eq(2)
+    end
+  end
+
   describe "#length" do
     it "is an alias for size" do
       skip "Underlying RE2::Set has no Size method" unless RE2::Set.size?
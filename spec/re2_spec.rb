@@ -241,6 +241,24 @@ RSpec.describe RE2 do
     end
   end
 
+  describe ".global_replace_many" do
+    it "replaces every match of several patterns in one pass" do
+      expect(RE2.global_replace_many("hello world", [["hello", "goodbye"], ["o", "0"]])).to eq("goodbye w0rld")
+    end
+
+    it "accepts options for every pattern" do
+      expect(RE2.global_replace_many("ABC", [["b", "x"]], case_sensitive: false)).to eq("AxC")
+    end
+
+    it "returns a copy of the string given no rules" do
+      expect(RE2.global_replace_many("abc", [])).to eq("abc")
+    end
+
+    it "raises an error if given an invalid rule" do
+      expect { RE2.global_replace_many("abc", [["a"]]) }.to raise_error(ArgumentError, "rules should be pairs of patterns and rewrites")
+    end
+  end
+
   describe ".extract" do
     it "extracts a rewrite of the first match" do
       expect(RE2.extract("alice@example.com", '(\w+)@(\w+)', '\2-\1')).to eq("example-alice")
@@ -343,6 +361,328 @@ RSpec.describe RE2 do
     end
   end
 
+  describe ".pattern_cache_stats" do
+    before { RE2.clear_pattern_cache }
+
+    it "counts a miss and then a hit when reusing a string pattern", :aggregate_failures do
+      RE2.global_replace("secret=abc", 'secret=\S+', "secret=[FILTERED]")
+      RE2.global_replace("secret=def", 'secret=\S+', "secret=[FILTERED]")
+
+      stats = RE2.pattern_cache_stats
+
+      expect(stats[:size]).to eq(1)
+      expect(stats[:hits]).to eq(1)
+      expect(stats[:misses]).to eq(1)
+    end
+
+    it "shares cached patterns between replace, global_replace and extract", :aggregate_failures do
+      expect(RE2.replace("woo", "(o)", "a")).to eq("wao")
+      expect(RE2.global_replace("woo", "(o)", "a")).to eq("waa")
+      expect(RE2.extract("woo", "(o)", '\1')).to eq("o")
+
+      expect(RE2.pattern_cache_stats).to include(size: 1, hits: 2, misses: 1)
+    end
+
+    it "does not cache patterns given as an RE2::Regexp" do
+      RE2.replace("woo", RE2::Regexp.new("o"), "a")
+
+      expect(RE2.pattern_cache_stats).to include(size: 0, hits: 0, misses: 0)
+    end
+  end
+
+  describe ".pattern_cache_capacity=" do
+    after { RE2.pattern_cache_capacity = 128 }
+
+    it "defaults to 128" do
+      expect(RE2.pattern_cache_capacity).to eq(128)
+    end
+
+    it "evicts the least recently used patterns", :aggregate_failures do
+      RE2.clear_pattern_cache
+      RE2.pattern_cache_capacity = 2
+
+      RE2.replace("abc", "a", "x")
+      RE2.replace("abc", "b", "x")
+      RE2.replace("abc", "a", "x")
+      RE2.replace("abc", "c", "x")
+      RE2.replace("abc", "a", "x")
+
+      expect(RE2.pattern_cache_stats).to include(size: 2, capacity: 2, hits: 2, misses: 3)
+
+      RE2.replace("abc", "b", "x")
+
+      expect(RE2.pattern_cache_stats).to include(misses: 4)
+    end
+
+    it "disables caching when set to 0", :aggregate_failures do
+      RE2.clear_pattern_cache
+      RE2.pattern_cache_capacity = 0
+
+      expect(RE2.replace("woo", "o", "a")).to eq("wao")
+      expect(RE2.replace("woo", "o", "a")).to eq("wao")
+      expect(RE2.pattern_cache_stats).to include(size: 0, hits: 0, misses: 2)
+    end
+
+    it "raises an error if given a negative capacity" do
+      expect { RE2.pattern_cache_capacity = -1 }.to raise_error(ArgumentError)
+    end
+  end
+
+  describe ".clear_pattern_cache" do
+    it "removes all cached patterns and resets the counters" do
+      RE2.replace("woo", "o", "a")
+      RE2.clear_pattern_cache
+
+      expect(RE2.pattern_cache_stats).to include(size: 0, hits: 0, misses: 0)
+    end
+  end
+
+  describe ".thread_pool_size" do
+    it "defaults to at least one thread" do
+      expect(RE2.thread_pool_size).to be >= 1
+    end
+  end
+
+  describe ".thread_pool_size=" do
+    around do |example|
+      size = RE2.thread_pool_size
+      example.run
+    ensure
+      RE2.thread_pool_size = size
+    end
+
+    it "sets the number of worker threads" do
+      RE2.thread_pool_size = 3
+
+      expect(RE2.thread_pool_size).to eq(3)
+    end
+
+    it "still matches in parallel after being resized" do
+      re = RE2::Regexp.new('wo+')
+      re.parallel_match(["woo"] * 10, threads: 4)
+
+      RE2.thread_pool_size = 2
+
+      expect(re.parallel_match(["woo", "bar"] * 10, threads: 4)).to eq([true, false] * 10)
+    end
+
+    it "raises an error if given a size less than 1" do
+      expect { RE2.thread_pool_size = 0 }.to raise_error(ArgumentError, "size should be >= 1")
+    end
+  end
+
+  describe ".thread_pool_cpus=" do
+    after { RE2.thread_pool_cpus = nil }
+
+    it "defaults to nil" do
+      expect(RE2.thread_pool_cpus).to be_nil
+    end
+
+    it "sets the CPUs to pin worker threads to", :aggregate_failures do
+      RE2.thread_pool_cpus = [0]
+
+      expect(RE2.thread_pool_cpus).to eq([0])
+      expect(RE2::Regexp.new('wo+').parallel_match(["woo", "bar"] * 10, threads: 4)).to eq([true, false] * 10)
+    end
+
+    it "can be reset with nil" do
+      RE2.thread_pool_cpus = [0]
+      RE2.thread_pool_cpus = nil
+
+      expect(RE2.thread_pool_cpus).to be_nil
+    end
+
+    it "raises an error if given a negative CPU" do
+      expect { RE2.thread_pool_cpus = [-1] }.to raise_error(ArgumentError, "CPU should be >= 0")
+    end
+
+    it "raises an error if not given an array" do
+      expect { RE2.thread_pool_cpus = 0 }.to raise_error(TypeError)
+    end
+  end
+
+  describe ".gvl_release_threshold" do
+    it "defaults to always releasing the GVL" do
+      expect(RE2.gvl_release_threshold).to eq(0)
+    end
+  end
+
+  describe ".gvl_release_threshold=" do
+    after { RE2.gvl_release_threshold = 0 }
+
+    it "sets the threshold in bytes" do
+      RE2.gvl_release_threshold = 1024
+
+      expect(RE2.gvl_release_threshold).to eq(1024)
+    end
+
+    it "still matches, replaces, and extracts below the threshold", :aggregate_failures do
+      RE2.gvl_release_threshold = 1024
+      re = RE2::Regexp.new('w(o+)')
+
+      expect(re.match("woo")[1]).to eq("oo")
+      expect(re.match?("bar")).to eq(false)
+      expect(re.match_many(["woo", "bar"], submatches: 0)).to eq([true, false])
+      expect(RE2.replace("woo", re, "x")).to eq("x")
+      expect(RE2.global_replace("woo woo", re, "x")).to eq("x x")
+      expect(RE2.extract("woo", re, '\1')).to eq("oo")
+      expect(re.scan("woo wooo").to_a).to eq([["oo"], ["ooo"]])
+    end
+
+    it "only counts the bytes between startpos and endpos when matching" do
+      RE2.gvl_release_threshold = 1024
+      re = RE2::Regexp.new('w(o+)')
+      text = "woo" * 100_000
+
+      before = RE2.stats[:nogvl_nanoseconds]
+      expect(re.match(text, startpos: 3, endpos: 9)[1]).to eq("oo")
+
+      expect(RE2.stats[:nogvl_nanoseconds]).to eq(before)
+    end
+
+    it "calibrates the threshold with :auto" do
+      RE2.gvl_release_threshold = :auto
+
+      expect(RE2.gvl_release_threshold).to be_a(Integer)
+    end
+
+    it "raises an error if given a negative threshold" do
+      expect { RE2.gvl_release_threshold = -1 }.to raise_error(ArgumentError, "threshold should be >= 0")
+    end
+
+    it "raises an error if given a symbol other than :auto" do
+      expect { RE2.gvl_release_threshold = :always }.to raise_error(ArgumentError, "threshold should be an Integer or :auto")
+    end
+
+    it "raises an error if given a non-numeric threshold" do
+      expect { RE2.gvl_release_threshold = "1024" }.to raise_error(TypeError)
+    end
+  end
+
+  describe ".stats" do
+    it "counts compiled regexps and sets", :aggregate_failures do
+      before = RE2.stats
+      RE2::Regexp.new('w(o+)')
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+      after = RE2.stats
+
+      expect(after[:regexps_compiled] - before[:regexps_compiled]).to eq(1)
+      expect(after[:sets_compiled] - before[:sets_compiled]).to eq(1)
+      expect(after[:compile_nanoseconds]).to be > before[:compile_nanoseconds]
+    end
+
+    it "does not count regexps that fail to compile" do
+      before = RE2.stats[:regexps_compiled]
+      RE2::Regexp.new('w(o+', log_errors: false)
+      RE2::Regexp.new('w(o+', log_errors: false, lazy: true).match?("woo")
+
+      expect(RE2.stats[:regexps_compiled]).to eq(before)
+    end
+
+    it "tracks the program size of live regexps" do
+      GC.disable
+      before = RE2.stats[:program_size]
+      re = RE2::Regexp.new('w(o+)')
+
+      expect(RE2.stats[:program_size] - before).to eq(re.program_size)
+    ensure
+      GC.enable
+    end
+
+    it "counts calls to each entry point", :aggregate_failures do
+      re = RE2::Regexp.new('w(o+)')
+      set = RE2::Set.new
+      set.add("abc")
+      set.compile
+
+      before = RE2.stats[:calls]
+      re.match("woo")
+      re.match?("woo")
+      re =~ "woo"
+      re.scan("woo woo").scan
+      RE2.replace("woo", re, "x")
+      RE2.global_replace("woo", re, "x")
+      RE2.extract("woo", re, '\1')
+      set.match("abc")
+      after = RE2.stats[:calls]
+
+      expect(after[:match] - before[:match]).to eq(1)
+      expect(after[:match?] - before[:match?]).to eq(2)
+      expect(after[:scan] - before[:scan]).to eq(1)
+      expect(after[:replace] - before[:replace]).to eq(1)
+      expect(after[:global_replace] - before[:global_replace]).to eq(1)
+      expect(after[:extract] - before[:extract]).to eq(1)
+      expect(after[:set_match] - before[:set_match]).to eq(1)
+    end
+
+    it "counts MatchData and Scanner allocations", :aggregate_failures do
+      re = RE2::Regexp.new('w(o+)')
+
+      before = RE2.stats
+      re.match("woo")
+      re.scan("woo")
+      after = RE2.stats
+
+      expect(after[:matchdata_allocations] - before[:matchdata_allocations]).to eq(1)
+      expect(after[:scanner_allocations] - before[:scanner_allocations]).to eq(1)
+    end
+
+    it "counts RE2::Set::MatchError kinds" do
+      skip "Underlying RE2::Set::Match does not output error information" unless RE2::Set.match_raises_errors?
+
+      set = RE2::Set.new
+      set.add("abc")
+      before = RE2.stats[:set_match_errors][:not_compiled]
+
+      expect { set.match("abc") }.to raise_error(RE2::Set::MatchError)
+      expect(RE2.stats[:set_match_errors][:not_compiled] - before).to eq(1)
+    end
+
+    it "records time spent without the GVL" do
+      before = RE2.stats[:nogvl_nanoseconds]
+      RE2::Regexp.new('w(o+)').match?("woo" * 1000)
+
+      expect(RE2.stats[:nogvl_nanoseconds]).to be > before
+    end
+  end
+
+  describe ".instrument=" do
+    after { RE2.instrument = false }
+
+    it "defaults to false" do
+      expect(RE2.instrument?).to eq(false)
+    end
+
+    it "instruments every regexp and set", :aggregate_failures do
+      RE2.instrument = true
+      re = RE2::Regexp.new('woo')
+      re.match?("woo")
+
+      expect(RE2.instrument?).to eq(true)
+      expect(re).to be_instrumented
+      expect(re.stats[:calls]).to eq(1)
+    end
+
+    it "keeps counting for regexps instrumented while enabled" do
+      RE2.instrument = true
+      re = RE2::Regexp.new('woo')
+      re.match?("woo")
+      RE2.instrument = false
+      re.match?("woo")
+
+      expect(re.stats[:calls]).to eq(2)
+    end
+  end
+
+  describe ".calibrate_gvl_release_threshold" do
+    it "returns a threshold in bytes without changing the current one", :aggregate_failures do
+      expect(RE2.calibrate_gvl_release_threshold).to be >= 0
+      expect(RE2.gvl_release_threshold).to eq(0)
+    end
+  end
+
   describe "#escape" do
     it "escapes a string so it can be used as a regular expression" do
       expect(RE2.escape("1.5-2.0?")).to eq('1\.5\-2\.0\?')
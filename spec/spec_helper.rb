@@ -1,6 +1,9 @@
 # frozen_string_literal: true
 
 require "re2"
+require "pathname"
+require "stringio"
+require "tempfile"
 
 # To test passing objects that can be coerced to a String.
 class StringLike
@@ -12,6 +15,18 @@ class StringLike
   end
 end
 
+# Yields the path of a temporary file holding the given contents.
+def with_file(contents)
+  file = Tempfile.new("re2")
+  file.binmode
+  file.write(contents)
+  file.flush
+
+  yield file.path
+ensure
+  file.close!
+end
+
 RSpec.configure do |config|
   config.expect_with :rspec do |expectations|
     expectations.include_chain_clauses_in_custom_matcher_descriptions = true